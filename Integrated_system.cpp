@@ -7,6 +7,7 @@
 #include <ctime>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <stdexcept>
 #include <cctype>
 #include <sstream>
@@ -15,18 +16,585 @@
 #include <condition_variable>
 #include <chrono>
 #include <random>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <string_view>
+#include <functional>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <cstdio>
+#include <cstddef>
+#include <shared_mutex>
+#include <deque>
+#include <set>
+#include <memory>
+#include <csignal>
+#include <memory_resource>
+#include <variant>
+#include <optional>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#define BOOKSTORE_POSIX 1
+#endif
+
+// Timers and counters (see Metrics); build with -DBOOKSTORE_METRICS=0 to
+// compile them out
+#ifndef BOOKSTORE_METRICS
+#define BOOKSTORE_METRICS 1
+#endif
 
 using namespace std;
 
 // Constants for file names
 const string USER_DATA_FILE = "user_data.txt";
 const string BOOK_DATA_FILE = "book_data.txt";
-const string ORDER_HISTORY_PREFIX = "order_history_";
+const string BOOK_SNAPSHOT_FILE = "book_data.bin";
+const string CATALOG_JOURNAL_FILE = "catalog_journal.log";
+const string ORDER_JOURNAL_FILE = "orders.log";
 const string REVIEWS_FILE = "reviews.txt";
-const string SESSION_DATA_FILE = "session_data.txt";
+const string RETURNS_FILE = "returns.log";
+const string SESSION_DATA_FILE = "session_data.bin";
+const string NOTIFICATION_OUTBOX_FILE = "email_outbox.txt";
+const string PROMOTIONS_FILE = "promotions.txt";
+const string PROMOTION_USAGE_FILE = "promotion_usage.txt";
+
+// Default TCP port for --server and --loadgen
+const int DEFAULT_SERVER_PORT = 5050;
+
+// Copies added to a server cart are held for this long before returning to stock
+const chrono::minutes CART_HOLD_TIMEOUT(15);
+
+// Sessions without a request for this long are logged out
+const chrono::minutes SESSION_IDLE_TIMEOUT(30);
+
+// Book listings in the terminal show this many rows before asking to go on
+const size_t LISTING_PAGE_SIZE = 50;
+
+// Timer and counter report, rewritten periodically and on request (SIGUSR1)
+const string STATS_FILE = "stats.txt";
+const chrono::seconds STATS_DUMP_INTERVAL(60);
+constexpr bool METRICS_ENABLED = BOOKSTORE_METRICS != 0;
+
+// Operations timed by ScopedTimer
+enum MetricTimer {
+    TIME_LOAD_CATALOG,
+    TIME_SEARCH,
+    TIME_ADD_TO_CART,
+    TIME_CHECKOUT,
+    TIME_SAVE_ORDER,
+    TIME_SAVE_BOOKS,
+    TIME_LOG_SYNC, // Waiting for a GroupCommitLog batch to reach the disk
+    TIMER_COUNT
+};
+
+// Events counted by Metrics::count
+enum MetricCounter {
+    COUNT_ORDERS,
+    COUNT_SEARCHES,
+    COUNT_SEARCH_INDEX_HITS,   // Searches answered from the trigram index instead of a scan
+    COUNT_READER_CACHE_HITS,   // Review reads on an already open segment
+    COUNT_READER_CACHE_MISSES,
+    COUNT_BYTES_WRITTEN,       // Log batches and base file rewrites
+    COUNT_FSYNCS,
+    COUNT_LOGINS,
+    COUNT_RETURNS,
+    COUNTER_COUNT
+};
+
+// Local broken-down time; unlike localtime() it shares no static buffer, so
+// the stats reporter thread and the menus can format times at once
+inline tm localTime(time_t when) {
+    tm parts = {};
+#if defined(BOOKSTORE_POSIX)
+    localtime_r(&when, &parts);
+#else
+    localtime_s(&parts, &when);
+#endif
+    return parts;
+}
+
+// Log-linear latency histogram in the style of HdrHistogram
+// Values (nanoseconds) below 64 get a bucket each; above that every power of
+// two is split into 32 buckets, so a bucket spans at most about 3% of its
+// values, up to 2^48 ns (about 3 days; longer values are clamped). One thread
+// records; any thread may read at any time, so the cells are atomics written
+// with plain load/store (no locked instructions).
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+    static constexpr int MAX_BITS = 48;
+    static constexpr uint64_t MAX_VALUE = (uint64_t(1) << MAX_BITS) - 1;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static size_t indexOf(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS) return static_cast<size_t>(value);
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS; // value >= 64, so never zero
+        return static_cast<size_t>(shift) * SUB_BUCKETS + static_cast<size_t>(value >> shift);
+    }
+
+    // Largest value that falls in bucket `index`
+    static uint64_t highestIn(size_t index) {
+        if (index < 2 * SUB_BUCKETS) return index;
+        int shift = static_cast<int>(index / SUB_BUCKETS) - 1;
+        uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    atomic<uint64_t> counts[BUCKETS];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> max;
+
+    static void bump(atomic<uint64_t>& cell, uint64_t amount) {
+        cell.store(cell.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    void record(uint64_t nanos) {
+        uint64_t value = min(nanos, MAX_VALUE);
+        bump(counts[indexOf(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > max.load(memory_order_relaxed)) max.store(value, memory_order_relaxed);
+    }
+};
+
+// Sum of LatencyHistograms read at one moment
+struct LatencySummary {
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    LatencySummary() : counts(LatencyHistogram::BUCKETS, 0) {}
+
+    void add(const LatencyHistogram& histogram) {
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            counts[i] += histogram.counts[i].load(memory_order_relaxed);
+        }
+        total += histogram.total.load(memory_order_relaxed);
+        sum += histogram.sum.load(memory_order_relaxed);
+        max = std::max(max, histogram.max.load(memory_order_relaxed));
+    }
+
+    // Value at or below which `fraction` of the samples fall (the top of
+    // the bucket holding it, capped at the largest sample)
+    uint64_t percentile(double fraction) const {
+        if (total == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * static_cast<double>(total))));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(LatencyHistogram::highestIn(i), max);
+        }
+        return max;
+    }
+
+    double mean() const { return total ? static_cast<double>(sum) / static_cast<double>(total) : 0.0; }
+};
+
+// One thread's timers and counters
+struct alignas(64) ThreadMetrics {
+    LatencyHistogram timers[TIMER_COUNT];
+    atomic<uint64_t> counters[COUNTER_COUNT];
+    atomic<bool> inUse;
+};
+
+// Process-wide timers and counters
+// Each thread records into its own ThreadMetrics block, claimed on its first
+// record and handed on to a later thread when it exits, so recording never
+// locks or shares a cache line with another thread; summarize() adds every
+// block up. Built with BOOKSTORE_METRICS=0, count() and record() are empty
+// and ScopedTimer never reads the clock.
+class Metrics {
+private:
+    struct Claim {
+        ThreadMetrics* block = nullptr;
+        ~Claim() {
+            if (block) block->inUse.store(false, memory_order_release);
+        }
+    };
+
+    static mutex& registryMutex() {
+        static mutex registryLock;
+        return registryLock;
+    }
+
+    // Blocks live until the process exits
+    static vector<ThreadMetrics*>& registry() {
+        static vector<ThreadMetrics*>* blocks = new vector<ThreadMetrics*>();
+        return *blocks;
+    }
+
+    static ThreadMetrics& local() {
+        thread_local Claim claim;
+        if (!claim.block) {
+            lock_guard<mutex> lock(registryMutex());
+            for (ThreadMetrics* block : registry()) {
+                bool idle = false;
+                if (block->inUse.compare_exchange_strong(idle, true)) {
+                    claim.block = block;
+                    break;
+                }
+            }
+            if (!claim.block) {
+                claim.block = new ThreadMetrics();
+                claim.block->inUse.store(true);
+                registry().push_back(claim.block);
+            }
+        }
+        return *claim.block;
+    }
+public:
+    struct Summary {
+        LatencySummary timers[TIMER_COUNT];
+        uint64_t counters[COUNTER_COUNT] = {};
+        size_t blocks = 0;
+    };
+
+    static void count(MetricCounter counter, uint64_t amount = 1) {
+        if constexpr (METRICS_ENABLED) {
+            LatencyHistogram::bump(local().counters[counter], amount);
+        }
+    }
+
+    static void record(MetricTimer timer, uint64_t nanos) {
+        if constexpr (METRICS_ENABLED) {
+            local().timers[timer].record(nanos);
+        }
+    }
+
+    static Summary summarize() {
+        Summary summary;
+        lock_guard<mutex> lock(registryMutex());
+        for (const ThreadMetrics* block : registry()) {
+            for (int t = 0; t < TIMER_COUNT; t++) {
+                summary.timers[t].add(block->timers[t]);
+            }
+            for (int c = 0; c < COUNTER_COUNT; c++) {
+                summary.counters[c] += block->counters[c].load(memory_order_relaxed);
+            }
+        }
+        summary.blocks = registry().size();
+        return summary;
+    }
+
+    static const char* timerName(int timer) {
+        static const char* const NAMES[TIMER_COUNT] = { "load catalog", "search", "add to cart", "checkout",
+                                                        "save order", "save books", "log sync" };
+        return NAMES[timer];
+    }
+
+    static const char* counterName(int counter) {
+        static const char* const NAMES[COUNTER_COUNT] = { "orders", "searches", "search index hits",
+                                                          "review reader cache hits", "review reader cache misses",
+                                                          "bytes written", "fsyncs", "logins", "returns" };
+        return NAMES[counter];
+    }
+
+    // "850 ns", "12.3 us", "4.56 ms", "1.23 s"
+    static string formatNanos(double nanos) {
+        ostringstream text;
+        text << fixed;
+        if (nanos < 1e3) text << setprecision(0) << nanos << " ns";
+        else if (nanos < 1e6) text << setprecision(1) << nanos / 1e3 << " us";
+        else if (nanos < 1e9) text << setprecision(2) << nanos / 1e6 << " ms";
+        else text << setprecision(2) << nanos / 1e9 << " s";
+        return text.str();
+    }
+
+    // Every timer and counter as text; the first line is a heading
+    static string report() {
+        if constexpr (!METRICS_ENABLED) {
+            return "Metrics are compiled out (BOOKSTORE_METRICS=0)\n";
+        }
+        Summary summary = summarize();
+        char stamp[32];
+        time_t now = time(nullptr);
+        tm local = localTime(now);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+        ostringstream text;
+        text << "Bookstore statistics at " << stamp << " (" << summary.blocks << " threads recording)\n";
+        text << left << setw(14) << "timer" << right << setw(10) << "count" << setw(11) << "mean" << setw(11) << "p50"
+             << setw(11) << "p90" << setw(11) << "p99" << setw(11) << "p99.9" << setw(11) << "max" << '\n';
+        for (int t = 0; t < TIMER_COUNT; t++) {
+            const LatencySummary& timer = summary.timers[t];
+            text << left << setw(14) << timerName(t) << right << setw(10) << timer.total
+                 << setw(11) << formatNanos(timer.mean()) << setw(11) << formatNanos(timer.percentile(0.5))
+                 << setw(11) << formatNanos(timer.percentile(0.9)) << setw(11) << formatNanos(timer.percentile(0.99))
+                 << setw(11) << formatNanos(timer.percentile(0.999)) << setw(11) << formatNanos(timer.max) << '\n';
+        }
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            text << left << setw(28) << counterName(c) << right << setw(14) << summary.counters[c] << '\n';
+        }
+        return text.str();
+    }
+};
+
+// Times the enclosing scope into one of the Metrics timers
+class ScopedTimer {
+private:
+    MetricTimer timer;
+    chrono::steady_clock::time_point started;
+public:
+    explicit ScopedTimer(MetricTimer t) : timer(t) {
+        if constexpr (METRICS_ENABLED) started = chrono::steady_clock::now();
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    ~ScopedTimer() {
+        if constexpr (METRICS_ENABLED) {
+            auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started);
+            Metrics::record(timer, static_cast<uint64_t>(elapsed.count()));
+        }
+    }
+};
+
+// Rewrites the stats file every interval from a background thread, sooner
+// when requestDump() is called or the `signalled` flag is raised (a signal
+// handler may only set a flag, so it is polled each second), and once more
+// when stopped
+class MetricsReporter {
+private:
+    string path;
+    chrono::seconds interval;
+    atomic<bool>* signalled;
+    thread worker;
+    mutex reporterMutex;
+    condition_variable wake;
+    bool stopping;
+    bool dumpRequested;
+public:
+    MetricsReporter() : interval(0), signalled(nullptr), stopping(false), dumpRequested(false) {}
+    MetricsReporter(const MetricsReporter&) = delete;
+    MetricsReporter& operator=(const MetricsReporter&) = delete;
+    ~MetricsReporter() { stop(); }
+
+    // Writes the report through a temporary file so readers never see half of it
+    static bool dump(const string& statsPath) {
+        string tempPath = statsPath + ".tmp";
+        {
+            ofstream out(tempPath, ios::trunc);
+            if (!out) return false;
+            out << Metrics::report();
+            if (!out) return false;
+        }
+        error_code error;
+        filesystem::rename(tempPath, statsPath, error);
+        return !error;
+    }
+
+    void start(const string& statsPath, chrono::seconds every, atomic<bool>* flag = nullptr) {
+        if constexpr (!METRICS_ENABLED) return;
+        stop();
+        path = statsPath;
+        interval = max(every, chrono::seconds(1));
+        signalled = flag;
+        stopping = false;
+        worker = thread([this] {
+            auto due = chrono::steady_clock::now() + interval;
+            unique_lock<mutex> lock(reporterMutex);
+            while (true) {
+                wake.wait_for(lock, chrono::seconds(1), [this] { return stopping || dumpRequested; });
+                bool raised = signalled && signalled->exchange(false);
+                if (!stopping && !dumpRequested && !raised && chrono::steady_clock::now() < due) continue;
+                bool last = stopping;
+                dumpRequested = false;
+                lock.unlock();
+                dump(path);
+                due = chrono::steady_clock::now() + interval;
+                lock.lock();
+                if (last) break;
+            }
+        });
+    }
+
+    // Wakes the reporter to write the file now
+    void requestDump() {
+        lock_guard<mutex> lock(reporterMutex);
+        dumpRequested = true;
+        wake.notify_one();
+    }
+
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            lock_guard<mutex> lock(reporterMutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+};
+
+
+// Amount of money in whole cents
+// Prices and totals are exact integers, so sums never drift and every
+// discount rounds exactly once, half away from zero, to the nearest cent.
+// Rates are given in basis points: 10000 = 100%.
+class Money {
+private:
+    int64_t cents;
+
+    constexpr explicit Money(int64_t c) : cents(c) {}
+public:
+    static constexpr int64_t BASIS = 10000;
+
+    constexpr Money() : cents(0) {}
+
+    static constexpr Money fromCents(int64_t c) { return Money(c); }
+    static Money fromDouble(double amount) { return Money(llround(amount * 100.0)); }
+
+    // numerator / denominator rounded half away from zero (denominator > 0)
+    static constexpr int64_t divideRounded(int64_t numerator, int64_t denominator) {
+        return numerator >= 0 ? (numerator + denominator / 2) / denominator
+                              : -((-numerator + denominator / 2) / denominator);
+    }
+
+    constexpr int64_t getCents() const { return cents; }
+    double toDouble() const { return cents / 100.0; }
+
+    // This amount times basisPoints / 10000, rounded to the cent
+    constexpr Money scaled(int64_t basisPoints) const { return Money(divideRounded(cents * basisPoints, BASIS)); }
+
+    // "12.34", "-0.05"
+    string toString() const {
+        int64_t whole = cents < 0 ? -cents : cents;
+        string fraction = to_string(whole % 100);
+        return (cents < 0 ? "-" : "") + to_string(whole / 100) + (fraction.size() < 2 ? ".0" : ".") + fraction;
+    }
+
+    Money operator+(Money other) const { return Money(cents + other.cents); }
+    Money operator-(Money other) const { return Money(cents - other.cents); }
+    Money operator*(int64_t quantity) const { return Money(cents * quantity); }
+    Money& operator+=(Money other) { cents += other.cents; return *this; }
+    Money& operator-=(Money other) { cents -= other.cents; return *this; }
+    bool operator==(Money other) const { return cents == other.cents; }
+    bool operator!=(Money other) const { return cents != other.cents; }
+    bool operator<(Money other) const { return cents < other.cents; }
+    bool operator>(Money other) const { return cents > other.cents; }
+    bool operator<=(Money other) const { return cents <= other.cents; }
+    bool operator>=(Money other) const { return cents >= other.cents; }
+};
+
+inline ostream& operator<<(ostream& out, Money amount) {
+    return out << amount.toString();
+}
+
+// Share of the price a Gold Member pays per star level (index 1-5), in basis points
+constexpr int64_t STAR_LEVEL_BASIS_POINTS[6] = { 10000, 9500, 9000, 8500, 8000, 7000 };
+
+// Buyer tiers as compile-time policies
+// Each policy holds its account ID range, its label and the share of the
+// price it pays for a tier parameter (star level for Gold, the negotiated rate
+// in basis points for Diamond). Code templated on a policy, or visiting an
+// AnyBuyer, is resolved at compile time: no vtable, no heap allocation, and
+// the discount inlines into the pricing loop. The Buyer classes below are the
+// interactive front end over the same policies.
+struct GoldTier {
+    static constexpr int TYPE = 1;
+    static constexpr int MIN_ID = 1, MAX_ID = 100;
+    static constexpr const char* LABEL = "Gold Member";
+
+    static constexpr int64_t shareBasisPoints(int64_t stars) {
+        return (stars >= 1 && stars <= 5) ? STAR_LEVEL_BASIS_POINTS[stars] : Money::BASIS;
+    }
+};
+
+struct DiamondTier {
+    static constexpr int TYPE = 2;
+    static constexpr int MIN_ID = 200, MAX_ID = 300;
+    static constexpr const char* LABEL = "Diamond Member";
+
+    static constexpr int64_t shareBasisPoints(int64_t basisPoints) {
+        return (basisPoints > 0 && basisPoints <= Money::BASIS) ? basisPoints : Money::BASIS;
+    }
+};
+
+struct OrdinaryTier {
+    static constexpr int TYPE = 3;
+    static constexpr int MIN_ID = 1000, MAX_ID = 2000;
+    static constexpr const char* LABEL = "Ordinary Member";
+
+    static constexpr int64_t shareBasisPoints(int64_t) { return Money::BASIS; } // No discount
+};
+
+// Pricing state of one buyer of a known tier; a plain value
+template <class Tier>
+class TieredBuyer {
+private:
+    int64_t parameter; // Stars or basis points, as the policy expects
+public:
+    using Policy = Tier;
+
+    constexpr explicit TieredBuyer(int64_t p = 0) : parameter(p) {}
+
+    constexpr int64_t getParameter() const { return parameter; }
+    constexpr int64_t shareBasisPoints() const { return Tier::shareBasisPoints(parameter); }
+    constexpr Money pay(Money subtotal) const { return subtotal.scaled(shareBasisPoints()); }
+};
+
+using AnyBuyer = variant<TieredBuyer<GoldTier>, TieredBuyer<DiamondTier>, TieredBuyer<OrdinaryTier>>;
+
+template <class Tier>
+constexpr bool inTier(int id) { return id >= Tier::MIN_ID && id <= Tier::MAX_ID; }
+
+// Buyer tier from the account ID: 1 = Gold, 2 = Diamond, 3 = Ordinary, 0 = invalid
+constexpr int buyerTypeForId(int id) {
+    return inTier<GoldTier>(id) ? GoldTier::TYPE
+         : inTier<DiamondTier>(id) ? DiamondTier::TYPE
+         : inTier<OrdinaryTier>(id) ? OrdinaryTier::TYPE
+         : 0;
+}
+
+// Empty for an ID outside every tier
+inline optional<AnyBuyer> makeTieredBuyer(int id, int64_t parameter) {
+    switch (buyerTypeForId(id)) {
+        case GoldTier::TYPE: return AnyBuyer(TieredBuyer<GoldTier>(parameter));
+        case DiamondTier::TYPE: return AnyBuyer(TieredBuyer<DiamondTier>(parameter));
+        case OrdinaryTier::TYPE: return AnyBuyer(TieredBuyer<OrdinaryTier>(parameter));
+        default: return nullopt;
+    }
+}
+
+inline int64_t tierShareBasisPoints(const AnyBuyer& buyer) {
+    return visit([](const auto& tiered) { return tiered.shareBasisPoints(); }, buyer);
+}
 
-// Global mutex for thread synchronization
-mutex mtx;
+inline Money payFor(const AnyBuyer& buyer, Money subtotal) {
+    return visit([subtotal](const auto& tiered) { return tiered.pay(subtotal); }, buyer);
+}
+
+// Amounts payable for n buyers of one tier, given their parameters and
+// subtotals in cents; the policy's discount is inlined into the loop
+template <class Tier>
+void payAll(const int64_t* parameters, const int64_t* subtotalCents, int64_t* payableCents, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        payableCents[i] = Money::divideRounded(subtotalCents[i] * Tier::shareBasisPoints(parameters[i]), Money::BASIS);
+    }
+}
+
+static_assert(GoldTier::shareBasisPoints(5) == 7000, "5 stars pay 70%");
+static_assert(TieredBuyer<DiamondTier>(6000).pay(Money::fromCents(1001)).getCents() == 601, "rounds half away from zero");
+static_assert(buyerTypeForId(250) == DiamondTier::TYPE && buyerTypeForId(150) == 0, "tier ID ranges");
 
 // Base class Buyer
 class Buyer {
@@ -34,9 +602,9 @@ protected:
     string name;
     int id;
     string address;
-    double purchaseAmount;
+    Money purchaseAmount;
 public:
-    Buyer() : purchaseAmount(0.0) {}
+    Buyer() : id(0) {}
 
     virtual void getBuyName() {
         cout << "Enter your name: ";
@@ -54,30 +622,49 @@ public:
         cin.ignore(); // Clear the input buffer
     }
 
-    virtual double getPay() {
+    virtual Money getPay() {
         return purchaseAmount;
     }
 
-    virtual void setPay(double amount) = 0; // Pure virtual function
+    const string& getBuyerName() const { return name; }
+    int getBuyerID() const { return id; }
+    const string& getBuyerAddress() const { return address; }
+
+    // For buyers whose details do not come from the console (server mode)
+    void setDetails(const string& buyerName, int buyerID, const string& buyerAddress) {
+        name = buyerName;
+        id = buyerID;
+        address = buyerAddress;
+    }
+
+    virtual void setPay(Money amount) = 0; // Pure virtual function
     virtual void display() = 0;             // Pure virtual function
 
+    // Share of the price this buyer pays after the tier discount, in basis points
+    virtual int64_t getTierBasisPoints() const { return Money::BASIS; }
+
+    // Final amount once promotions are priced in (the tier is already included)
+    void setPayable(Money amount) { purchaseAmount = amount; }
+
     virtual ~Buyer() {}
 };
 
 // Derived class Layfolk (Ordinary Member)
 class Layfolk : public Buyer {
 public:
-    void setPay(double amount) override {
-        purchaseAmount = amount; // No discount for ordinary members
+    int64_t getTierBasisPoints() const override { return OrdinaryTier::shareBasisPoints(0); }
+
+    void setPay(Money amount) override {
+        purchaseAmount = TieredBuyer<OrdinaryTier>().pay(amount); // No discount for ordinary members
     }
 
     void display() override {
         cout << "\n----- Order Details -----\n";
-        cout << "Buyer Type: Ordinary Member\n";
+        cout << "Buyer Type: " << OrdinaryTier::LABEL << "\n";
         cout << "Name: " << name << endl;
         cout << "Buyer ID: " << id << endl;
         cout << "Address: " << address << endl;
-        cout << "Total Amount Payable: $" << fixed << setprecision(2) << purchaseAmount << endl;
+        cout << "Total Amount Payable: $" << purchaseAmount << endl;
     }
 };
 
@@ -86,6 +673,8 @@ class Member : public Buyer {
 protected:
     int starLevel; // 1 to 5 stars
 public:
+    Member() : starLevel(1) {}
+
     void getStarLevel() {
         cout << "Enter your membership star level (1-5): ";
         cin >> starLevel;
@@ -96,47 +685,35 @@ public:
         cin.ignore(); // Clear the input buffer
     }
 
-    void setPay(double amount) override {
-        double discountRate;
-        switch (starLevel) {
-            case 5:
-                discountRate = 0.70;
-                break;
-            case 4:
-                discountRate = 0.80;
-                break;
-            case 3:
-                discountRate = 0.85;
-                break;
-            case 2:
-                discountRate = 0.90;
-                break;
-            case 1:
-                discountRate = 0.95;
-                break;
-            default:
-                discountRate = 1.0;
-        }
-        purchaseAmount = amount * discountRate;
+    void setStarLevel(int level) { starLevel = level; }
+    int getStars() const { return starLevel; }
+
+    int64_t getTierBasisPoints() const override { return GoldTier::shareBasisPoints(starLevel); }
+
+    void setPay(Money amount) override {
+        purchaseAmount = TieredBuyer<GoldTier>(starLevel).pay(amount);
     }
 
     void display() override {
         cout << "\n----- Order Details -----\n";
-        cout << "Buyer Type: Gold Member\n";
+        cout << "Buyer Type: " << GoldTier::LABEL << "\n";
         cout << "Name: " << name << endl;
         cout << "Buyer ID: " << id << endl;
         cout << "Star Level: " << starLevel << " Star\n";
         cout << "Address: " << address << endl;
-        cout << "Total Amount Payable after Discount: $" << fixed << setprecision(2) << purchaseAmount << endl;
+        cout << "Total Amount Payable after Discount: $" << purchaseAmount << endl;
     }
 };
 
 // Derived class HonoredGuest (Diamond Member)
 class HonoredGuest : public Buyer {
 protected:
-    double discountRate; // e.g., 0.60 means 40% off
+    int64_t discountBasisPoints; // Share paid, e.g. 6000 means 40% off
 public:
+    HonoredGuest() : discountBasisPoints(Money::BASIS) {}
+
     void getDiscountRate() {
+        double discountRate;
         cout << "Enter your special discount rate (e.g., enter 0.60 for 40% off): ";
         cin >> discountRate;
         while (discountRate <= 0 || discountRate > 1) {
@@ -144,875 +721,9245 @@ public:
             cin >> discountRate;
         }
         cin.ignore(); // Clear the input buffer
+        discountBasisPoints = llround(discountRate * Money::BASIS);
     }
 
-    void setPay(double amount) override {
-        purchaseAmount = amount * discountRate;
+    void setDiscountBasisPoints(int64_t basisPoints) { discountBasisPoints = basisPoints; }
+
+    int64_t getTierBasisPoints() const override { return DiamondTier::shareBasisPoints(discountBasisPoints); }
+
+    void setPay(Money amount) override {
+        purchaseAmount = TieredBuyer<DiamondTier>(discountBasisPoints).pay(amount);
     }
 
     void display() override {
         cout << "\n----- Order Details -----\n";
-        cout << "Buyer Type: Diamond Member\n";
+        cout << "Buyer Type: " << DiamondTier::LABEL << "\n";
         cout << "Name: " << name << endl;
         cout << "Buyer ID: " << id << endl;
         cout << "Address: " << address << endl;
-        cout << "Special Discount Rate: " << (1 - discountRate) * 100 << "% off\n";
-        cout << "Total Amount Payable after Discount: $" << fixed << setprecision(2) << purchaseAmount << endl;
+        cout << "Special Discount Rate: " << (Money::BASIS - discountBasisPoints) / 100.0 << "% off\n";
+        cout << "Total Amount Payable after Discount: $" << purchaseAmount << endl;
     }
 };
 
-// Class for Books
-class Book {
-private:
-    int bookID;
-    string title;
-    string author;
-    double price;
-    int stockQuantity;
-    double ratingSum;
-    int ratingCount;
-public:
-    Book(int id, string t, string a, double p, int sq)
-        : bookID(id), title(t), author(a), price(p), stockQuantity(sq), ratingSum(0.0), ratingCount(0) {}
+// Many carts laid out column-wise for PricingEngine
+// Lines of cart c are lineBegin[c] .. lineBegin[c + 1] - 1 of the line
+// columns; every per-cart column has one entry per cart.
+struct PricingBatch {
+    vector<int64_t> unitCents;
+    vector<int32_t> quantities;
+    vector<uint32_t> lineBegin;
+    vector<int64_t> tierBasisPoints;   // Share paid after the buyer's tier discount
+    vector<int64_t> couponBasisPoints; // Stacked percentage coupons, e.g. 1000 = 10% off
+    vector<int64_t> couponCents;       // Stacked fixed-amount coupons
+    vector<int64_t> lineCouponShare;   // Percentages off some lines: sum of line cents x basis points
 
-    int getBookID() const { return bookID; }
-    string getTitle() const { return title; }
-    string getAuthor() const { return author; }
-    double getPrice() const { return price; }
-    int getStockQuantity() const { return stockQuantity; }
-    double getAverageRating() const {
-        if (ratingCount == 0) return 0.0;
-        return ratingSum / ratingCount;
+    PricingBatch() : lineBegin(1, 0) {}
+
+    size_t size() const { return lineBegin.size() - 1; }
+
+    void reserve(size_t carts, size_t lines) {
+        unitCents.reserve(lines);
+        quantities.reserve(lines);
+        lineBegin.reserve(carts + 1);
+        tierBasisPoints.reserve(carts);
+        couponBasisPoints.reserve(carts);
+        couponCents.reserve(carts);
+        lineCouponShare.reserve(carts);
     }
 
-    void setStockQuantity(int quantity) {
-        stockQuantity = quantity;
+    // Starts a new cart; its lines and coupons are added next
+    void addCart(int64_t tier) {
+        lineBegin.push_back(lineBegin.back());
+        tierBasisPoints.push_back(tier);
+        couponBasisPoints.push_back(0);
+        couponCents.push_back(0);
+        lineCouponShare.push_back(0);
     }
 
-    void addRating(double rating) {
-        ratingSum += rating;
-        ratingCount++;
+    void addLine(Money unitPrice, int quantity) {
+        unitCents.push_back(unitPrice.getCents());
+        quantities.push_back(quantity);
+        lineBegin.back()++;
     }
 
-    void displayBook() const {
-        cout << left << setw(5) << bookID
-             << setw(25) << title
-             << setw(20) << author
-             << "$" << fixed << setprecision(2) << price
-             << setw(10) << " Stock: " << stockQuantity
-             << " Rating: " << fixed << setprecision(1) << getAverageRating() << "/5"
-             << endl;
+    // Percentage coupons add up rather than compound; fixed ones add up too
+    void addPercentCoupon(int64_t basisPoints) { couponBasisPoints.back() += basisPoints; }
+    void addFixedCoupon(Money amount) { couponCents.back() += amount.getCents(); }
+
+    // A percentage off only `lines` (the matching lines' subtotal); priced
+    // like a whole-cart percentage, so 10% off every line equals 10% off
+    void addLinePercentCoupon(Money lines, int64_t basisPoints) {
+        lineCouponShare.back() += lines.getCents() * min(basisPoints, Money::BASIS);
     }
 };
 
-// Class for User (for authentication)
-class User {
-private:
-    string username;
-    string password;
-    int id;
-    bool isLoggedIn;
-public:
-    User(string uname, string pwd, int uid) : username(uname), password(pwd), id(uid), isLoggedIn(false) {}
-
-    string getUsername() const { return username; }
-    string getPassword() const { return password; }
-    int getId() const { return id; }
-    void setLoggedIn(bool status) { isLoggedIn = status; }
-    bool getLoggedIn() const { return isLoggedIn; }
+// Prices of every cart in a PricingBatch, one entry per cart
+struct PricingResult {
+    vector<int64_t> subtotalCents; // Before any discount
+    vector<int64_t> discountCents; // Tier and coupons together
+    vector<int64_t> taxCents;
+    vector<int64_t> totalCents;    // Amount payable
 };
 
-// Class for Admin (inherits User)
-class Admin : public User {
+// Exact batch pricing
+// Subtotals up to about $900 million per cart are exact. For each cart: subtotal = sum of unit price x quantity; the tier share and
+// the stacked percentage coupons (capped at maxCouponBasisPoints) are applied
+// together with a single rounding; fixed coupons come off next, never below
+// zero; tax is then charged on what is left. Percentages off some lines (also
+// capped at maxCouponBasisPoints of the subtotal) come off the subtotal
+// inside that same rounding, so they meet the tier exactly as a whole-cart
+// percentage does. Each stage is one loop over plain integer columns, which
+// the compiler can vectorize; only carts with line percentages take a
+// 128-bit path.
+class PricingEngine {
+private:
+    int64_t taxBasisPoints;
+    int64_t maxCouponBasisPoints;
 public:
-    Admin(string uname, string pwd, int uid) : User(uname, pwd, uid) {}
+    PricingEngine(int64_t tax, int64_t maxCoupon = 5000) : taxBasisPoints(tax), maxCouponBasisPoints(maxCoupon) {}
 
-    // Administrative functions
-    void addBook(vector<Book>& books) {
-        int id, stock;
-        string title, author;
-        double price;
-        cout << "Enter new book ID: ";
-        cin >> id;
-        cin.ignore();
-        cout << "Enter book title: ";
-        getline(cin, title);
-        cout << "Enter author name: ";
-        getline(cin, author);
-        cout << "Enter price: ";
-        cin >> price;
-        cout << "Enter stock quantity: ";
-        cin >> stock;
-        cin.ignore();
-        books.push_back(Book(id, title, author, price, stock));
-        cout << "Book added successfully.\n";
-    }
+    void price(const PricingBatch& batch, PricingResult& result) const {
+        size_t carts = batch.size();
+        result.subtotalCents.resize(carts);
+        result.discountCents.resize(carts);
+        result.taxCents.resize(carts);
+        result.totalCents.resize(carts);
+        const int64_t* unit = batch.unitCents.data();
+        const int32_t* quantity = batch.quantities.data();
+        const uint32_t* begin = batch.lineBegin.data();
+        int64_t* subtotal = result.subtotalCents.data();
+        int64_t* discount = result.discountCents.data();
+        int64_t* tax = result.taxCents.data();
+        int64_t* total = result.totalCents.data();
 
-    void removeBook(vector<Book>& books) {
-        int id;
-        cout << "Enter the ID of the book to remove: ";
-        cin >> id;
-        cin.ignore();
-        auto it = find_if(books.begin(), books.end(), [id](const Book& b) {
-            return b.getBookID() == id;
-        });
-        if (it != books.end()) {
-            books.erase(it);
-            cout << "Book removed successfully.\n";
-        } else {
-            cout << "Book not found.\n";
+        for (size_t c = 0; c < carts; c++) {
+            int64_t sum = 0;
+            for (uint32_t line = begin[c]; line < begin[c + 1]; line++) {
+                sum += unit[line] * quantity[line];
+            }
+            subtotal[c] = sum;
         }
-    }
-
-    void updateBookStock(vector<Book>& books) {
-        int id, newStock;
-        cout << "Enter the ID of the book to update stock: ";
-        cin >> id;
-        cout << "Enter new stock quantity: ";
-        cin >> newStock;
-        cin.ignore();
-        auto it = find_if(books.begin(), books.end(), [id](Book& b) {
-            return b.getBookID() == id;
-        });
-        if (it != books.end()) {
-            it->setStockQuantity(newStock);
-            cout << "Stock updated successfully.\n";
-        } else {
-            cout << "Book not found.\n";
+        // All amounts are non-negative, so unsigned division (a multiply and
+        // shift for these constant divisors) rounds the same way
+        const uint64_t SHARE_SCALE = Money::BASIS * Money::BASIS;
+        const int64_t* tier = batch.tierBasisPoints.data();
+        const int64_t* couponShare = batch.couponBasisPoints.data();
+        const int64_t* couponCents = batch.couponCents.data();
+        const int64_t* lineShare = batch.lineCouponShare.data();
+        for (size_t c = 0; c < carts; c++) {
+            uint64_t coupon = static_cast<uint64_t>(min(couponShare[c], maxCouponBasisPoints));
+            uint64_t share = static_cast<uint64_t>(tier[c]) * (Money::BASIS - coupon);
+            int64_t net;
+            if (lineShare[c] == 0) {
+                net = static_cast<int64_t>((static_cast<uint64_t>(subtotal[c]) * share + SHARE_SCALE / 2) / SHARE_SCALE);
+            } else {
+                // (subtotal - lines x percent) x share, at basis-point scale
+                typedef unsigned __int128 Wide;
+                const Wide LINE_SCALE = static_cast<Wide>(SHARE_SCALE) * Money::BASIS;
+                uint64_t lineOff = static_cast<uint64_t>(min(lineShare[c], subtotal[c] * maxCouponBasisPoints));
+                Wide base = static_cast<Wide>(subtotal[c]) * Money::BASIS - lineOff;
+                net = static_cast<int64_t>((base * share + LINE_SCALE / 2) / LINE_SCALE);
+            }
+            net = max<int64_t>(net - couponCents[c], 0);
+            discount[c] = subtotal[c] - net;
+            tax[c] = static_cast<int64_t>((static_cast<uint64_t>(net) * taxBasisPoints + Money::BASIS / 2) / Money::BASIS);
+            total[c] = net + tax[c];
         }
     }
 };
 
-// Function prototypes
-void showWelcomeMessage();
-void displayBookList(const vector<Book>& books);
-void addBooksToCart(vector<pair<Book, int>>& cart, vector<Book>& books);
-double calculateTotal(const vector<pair<Book, int>>& cart);
-void saveOrderToFile(Buyer* buyer, const vector<pair<Book, int>>& cart);
-void viewCart(const vector<pair<Book, int>>& cart);
-void removeBookFromCart(vector<pair<Book, int>>& cart);
-void updateBookQuantity(vector<pair<Book, int>>& cart);
-void userRegistration(map<string, User>& users);
-User userLogin(map<string, User>& users);
-void viewOrderHistory(const User& user);
-void adminMenu(Admin& admin, vector<Book>& books);
-void applyCoupon(Buyer* buyer);
-void processPayment(Buyer* buyer);
-void saveUsersToFile(const map<string, User>& users);
-void loadUsersFromFile(map<string, User>& users);
-void saveBooksToFile(const vector<Book>& books);
-void loadBooksFromFile(vector<Book>& books);
-void searchBooks(const vector<Book>& books);
-void filterBooks(const vector<Book>& books);
-void rateBook(vector<Book>& books);
-void addToWishlist(vector<Book>& wishlist, const vector<Book>& books);
-void viewWishlist(const vector<Book>& wishlist);
-void sendEmailNotification(const User& user, const string& message);
-void handleGiftOption(vector<pair<Book, int>>& cart);
-void returnOrRefund(vector<Book>& books);
-void startUserSession(User& user);
-void saveSessionData(const User& user);
-void loadSessionData(map<string, User>& users);
-string encryptData(const string& data);
-string decryptData(const string& data);
+// Atomic access to values kept in plain arrays (the catalog's price, stock
+// and rating columns), which an array of std::atomic could not grow or erase
+// from. Does what std::atomic_ref does in C++20 with the GCC/Clang __atomic
+// builtins, so the file still builds as C++17. Loads and stores also take
+// doubles; the read-modify-write helpers need integers.
+template<class T>
+inline T atomicLoad(const T& cell) {
+    T value;
+    __atomic_load(&cell, &value, __ATOMIC_RELAXED);
+    return value;
+}
 
-// Exception classes
-class AuthenticationError : public exception {
+template<class T>
+inline void atomicStore(T& cell, T value) {
+    __atomic_store(&cell, &value, __ATOMIC_RELAXED);
+}
+
+// Returns the value before the addition
+template<class T, class U>
+inline T atomicFetchAdd(T& cell, U delta) {
+    return __atomic_fetch_add(&cell, static_cast<T>(delta), __ATOMIC_ACQ_REL);
+}
+
+// On failure `expected` is updated to the current value, as with
+// compare_exchange_weak
+template<class T>
+inline bool atomicCompareExchange(T& cell, T& expected, T desired) {
+    return __atomic_compare_exchange_n(&cell, &expected, desired, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+// Rating aggregate packed into one 64-bit word
+// The high 28 bits count the ratings and the low 36 bits hold their sum in
+// hundredths of a star. With sum and count in one word, add() updates both
+// with a single compare-and-swap: no lock, and readers never see a sum that
+// does not match its count. The sum is an exact integer, so it can be saved
+// and reloaded any number of times without drift.
+class RatingTally {
+private:
+    static const int SUM_BITS = 36;
+    static const uint64_t SUM_MASK = (uint64_t(1) << SUM_BITS) - 1;
+    static const uint64_t MAX_COUNT = (uint64_t(1) << (64 - SUM_BITS)) - 1;
 public:
-    const char* what() const noexcept override {
-        return "Authentication failed.";
+    static uint64_t pack(uint64_t sumHundredths, uint64_t count) {
+        return (count << SUM_BITS) | (sumHundredths & SUM_MASK);
+    }
+
+    // Returns false if the sum or count would no longer fit
+    static bool fromSumAndCount(double sum, long long count, uint64_t& tally) {
+        long long hundredths = llround(sum * 100.0);
+        if (count < 0 || hundredths < 0 || static_cast<uint64_t>(count) > MAX_COUNT
+            || static_cast<uint64_t>(hundredths) > SUM_MASK) {
+            return false;
+        }
+        tally = pack(static_cast<uint64_t>(hundredths), static_cast<uint64_t>(count));
+        return true;
+    }
+
+    static uint64_t sumHundredths(uint64_t tally) { return tally & SUM_MASK; }
+    static int count(uint64_t tally) { return static_cast<int>(tally >> SUM_BITS); }
+    static double sum(uint64_t tally) { return sumHundredths(tally) / 100.0; }
+
+    static double average(uint64_t tally) {
+        if (count(tally) == 0) return 0.0;
+        return sum(tally) / count(tally);
+    }
+
+    // Exact decimal form of the sum, e.g. "12.50"
+    static string formatSum(uint64_t tally) {
+        uint64_t hundredths = sumHundredths(tally);
+        string cents = to_string(hundredths % 100);
+        return to_string(hundredths / 100) + (cents.size() < 2 ? ".0" : ".") + cents;
+    }
+
+    // Reads a tally word that other threads may be updating
+    static uint64_t load(const uint64_t& tally) {
+        return atomicLoad(tally);
+    }
+
+    // Adds one rating to a tally word shared between threads, lock-free.
+    // Stores the new tally in `updated`; returns false if the tally is full.
+    static bool add(uint64_t& tally, double rating, uint64_t& updated) {
+        uint64_t step = pack(static_cast<uint64_t>(llround(rating * 100.0)), 1);
+        uint64_t current = atomicLoad(tally);
+        do {
+            if (static_cast<uint64_t>(count(current)) == MAX_COUNT
+                || sumHundredths(current) + sumHundredths(step) > SUM_MASK) {
+                return false;
+            }
+        } while (!atomicCompareExchange(tally, current, current + step));
+        updated = current + step;
+        return true;
     }
 };
 
-class BookNotFoundError : public exception {
+// Formats book listings into one reusable byte buffer
+// Numbers are written with to_chars and columns padded by appending spaces,
+// so a row costs a few appends instead of a chain of stream insertions. The
+// buffer goes to the stream in blocks of about flushBytes rather than with a
+// flush per row; without a stream, rows collect until take(). Rows match the
+// former setw/setprecision layout byte for byte (setw pads but never cuts).
+class ListingRenderer {
 public:
-    const char* what() const noexcept override {
-        return "Book not found.";
+    static constexpr size_t FLUSH_BYTES = 64 * 1024;
+private:
+    ostream* out;
+    string buffer;
+    size_t flushBytes;
+
+    void padded(string_view text, size_t width) {
+        buffer.append(text.data(), text.size());
+        if (text.size() < width) buffer.append(width - text.size(), ' ');
     }
-};
 
-class OutOfStockError : public exception {
+    void integer(long long value) {
+        char digits[24];
+        buffer.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+    }
+
+    // Same digits as printf("%.*f"). Small non-negative values not near a
+    // rounding tie are scaled to an integer (the scaling error is far below
+    // the 1e-6 margin); ties, such as 3.25 to one place, go through to_chars
+    // for its round-half-to-even.
+    void decimal(double value, int precision) {
+        static constexpr double SCALE[] = { 1.0, 10.0, 100.0, 1000.0 };
+        if (precision >= 0 && precision <= 3 && value >= 0.0 && value < 1e6) {
+            double scaled = value * SCALE[precision];
+            double whole = floor(scaled);
+            double fraction = scaled - whole;
+            if (fabs(fraction - 0.5) > 1e-6) {
+                char digits[24];
+                long long units = static_cast<long long>(whole) + (fraction > 0.5 ? 1 : 0);
+                char* end = to_chars(digits, digits + sizeof(digits), units).ptr;
+                size_t length = static_cast<size_t>(end - digits);
+                size_t fractionDigits = static_cast<size_t>(precision);
+                if (length <= fractionDigits) { // 0.05 -> "5" needs leading zeros
+                    buffer += '0';
+                    if (fractionDigits > 0) buffer += '.';
+                    buffer.append(fractionDigits - length, '0');
+                    buffer.append(digits, length);
+                } else {
+                    buffer.append(digits, length - fractionDigits);
+                    if (fractionDigits > 0) {
+                        buffer += '.';
+                        buffer.append(end - fractionDigits, fractionDigits);
+                    }
+                }
+                return;
+            }
+        }
+        char digits[64];
+        to_chars_result result = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, precision);
+        if (result.ec == errc()) {
+            buffer.append(digits, result.ptr);
+        } else {
+            buffer += to_string(value); // Too large for the scratch array
+        }
+    }
+
+    void rowDone() {
+        if (out && buffer.size() >= flushBytes) flush();
+    }
 public:
-    const char* what() const noexcept override {
-        return "Requested quantity not available.";
+    explicit ListingRenderer(ostream& stream, size_t blockBytes = FLUSH_BYTES)
+        : out(&stream), flushBytes(blockBytes) {
+        buffer.reserve(blockBytes + 256);
     }
-};
 
-// Entry point of the program
-int main() {
-    srand(static_cast<unsigned int>(time(0))); // Seed for random numbers
+    ListingRenderer() : out(nullptr), flushBytes(0) {}
+    ListingRenderer(const ListingRenderer&) = delete;
+    ListingRenderer& operator=(const ListingRenderer&) = delete;
+    ~ListingRenderer() { flush(); }
 
-    // Load users and books from files
-    map<string, User> users;
-    loadUsersFromFile(users);
-    vector<Book> books;
-    loadBooksFromFile(books);
+    // Column headings of the terminal listing
+    void header() {
+        buffer += "ID   Title                    Author              Price Stock          Rating\n";
+        buffer += "---------------------------------------------------------------------------------\n";
+    }
 
-    // Ensure admin user exists
-    users["admin"] = User("admin", "admin123", 0); // Admin user
+    void text(string_view line) {
+        buffer.append(line.data(), line.size());
+        rowDone();
+    }
 
-    vector<pair<Book, int>> shoppingCart;
-    vector<Book> wishlist;
-    Buyer* buyer = nullptr;
+    // One terminal listing row
+    void row(int bookID, string_view title, string_view author, double price, int stockQuantity, double averageRating) {
+        char id[16];
+        padded(string_view(id, to_chars(id, id + sizeof(id), bookID).ptr - id), 5);
+        padded(title, 25);
+        padded(author, 20);
+        buffer += '$';
+        decimal(price, 2);
+        buffer += " Stock:   ";
+        integer(stockQuantity);
+        buffer += " Rating: ";
+        decimal(averageRating, 1);
+        buffer += "/5\n";
+        rowDone();
+    }
 
-    showWelcomeMessage();
+    // One server reply line: bookID|title|author|price|stock|rating
+    void record(int bookID, string_view title, string_view author, double price, int stockQuantity, double averageRating) {
+        integer(bookID);
+        buffer += '|';
+        buffer.append(title.data(), title.size());
+        buffer += '|';
+        buffer.append(author.data(), author.size());
+        buffer += '|';
+        decimal(price, 2);
+        buffer += '|';
+        integer(stockQuantity);
+        buffer += '|';
+        decimal(averageRating, 1);
+        buffer += '\n';
+        rowDone();
+    }
 
-    // User authentication
-    int choice;
-    cout << "1. Register\n2. Login\nChoose an option: ";
-    cin >> choice;
-    cin.ignore();
+    // Book and BookView both offer these getters
+    template<class BookLike>
+    void row(const BookLike& book) {
+        row(book.getBookID(), book.getTitle(), book.getAuthor(), book.getPrice(), book.getStockQuantity(),
+            book.getAverageRating());
+    }
 
-    User currentUser("", "", -1);
+    template<class BookLike>
+    void record(const BookLike& book) {
+        record(book.getBookID(), book.getTitle(), book.getAuthor(), book.getPrice(), book.getStockQuantity(),
+               book.getAverageRating());
+    }
 
-    try {
-        if (choice == 1) {
-            userRegistration(users);
-            saveUsersToFile(users);
-            currentUser = userLogin(users);
-        } else if (choice == 2) {
-            currentUser = userLogin(users);
-        } else {
-            cout << "Invalid choice. Exiting.\n";
-            return 0;
+    // Hands what is buffered to the stream (does not flush the stream itself)
+    void flush() {
+        if (out && !buffer.empty()) {
+            out->write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            buffer.clear();
         }
-    } catch (AuthenticationError& e) {
-        cout << e.what() << endl;
-        return 0;
     }
 
-    // Start user session
-    thread userSession(startUserSession, ref(currentUser));
-    userSession.detach();
+    // The collected text, for a renderer without a stream
+    string take() {
+        string collected;
+        collected.swap(buffer);
+        return collected;
+    }
+};
 
-    // Check if the user is an admin
-    if (currentUser.getUsername() == "admin") {
-        Admin admin(currentUser.getUsername(), currentUser.getPassword(), currentUser.getId());
-        adminMenu(admin, books);
-        saveBooksToFile(books);
-        return 0;
+// Position in a listing shown one page at a time
+struct ListingCursor {
+    size_t offset;
+    size_t pageSize;
+
+    explicit ListingCursor(size_t rowsPerPage = LISTING_PAGE_SIZE) : offset(0), pageSize(max<size_t>(1, rowsPerPage)) {}
+
+    bool atEnd(size_t total) const { return offset >= total; }
+
+    // Renders rows [offset, offset + pageSize) of `total` (rowAt(i) gives
+    // row i) and moves to the next page; only the page's rows are touched
+    template<class RowAt>
+    size_t renderPage(ListingRenderer& renderer, size_t total, RowAt rowAt) {
+        size_t end = min(total, offset + pageSize);
+        size_t rendered = 0;
+        for (; offset < end; offset++, rendered++) {
+            renderer.row(rowAt(offset));
+        }
+        return rendered;
     }
+};
 
-    // Proceed with shopping
-    int buyerType = 0;
-    int id = currentUser.getId();
+// Prints one row of the book listing; shared by Book and BookView
+inline void displayBookRow(int bookID, string_view title, string_view author, double price,
+                           int stockQuantity, double averageRating) {
+    ListingRenderer renderer(cout, 0);
+    renderer.row(bookID, title, author, price, stockQuantity, averageRating);
+}
 
-    // Determine buyer type based on ID
-    if (id >= 1 && id <= 100) {
-        buyerType = 1; // Gold Member
-    } else if (id >= 200 && id <= 300) {
-        buyerType = 2; // Diamond Member
-    } else if (id >= 1000 && id <= 2000) {
-        buyerType = 3; // Ordinary Member
-    } else {
-        cout << "Invalid buyer ID. Exiting the system.\n";
-        return 0;
+// Class for Books
+class Book {
+private:
+    int bookID;
+    string title;
+    string author;
+    double price;
+    int stockQuantity;
+    uint64_t ratingTally; // See RatingTally
+public:
+    Book(int id, string t, string a, double p, int sq)
+        : bookID(id), title(t), author(a), price(p), stockQuantity(sq), ratingTally(0) {}
+    Book(int id, string t, string a, double p, int sq, uint64_t rt)
+        : bookID(id), title(t), author(a), price(p), stockQuantity(sq), ratingTally(rt) {}
+
+    int getBookID() const { return bookID; }
+    const string& getTitle() const { return title; }
+    const string& getAuthor() const { return author; }
+    double getPrice() const { return price; }
+    int getStockQuantity() const { return stockQuantity; }
+    uint64_t getRatingTally() const { return RatingTally::load(ratingTally); }
+    double getRatingSum() const { return RatingTally::sum(getRatingTally()); }
+    int getRatingCount() const { return RatingTally::count(getRatingTally()); }
+    double getAverageRating() const { return RatingTally::average(getRatingTally()); }
+
+    void setStockQuantity(int quantity) {
+        stockQuantity = quantity;
     }
 
-    // Create appropriate buyer object
-    switch (buyerType) {
-        case 1:
-            buyer = new Member();
-            break;
-        case 2:
-            buyer = new HonoredGuest();
-            break;
-        case 3:
-            buyer = new Layfolk();
-            break;
-        default:
-            cout << "Error determining buyer type.\n";
-            return 0;
+    // Safe to call from several threads at once (lock-free)
+    bool addRating(double rating) {
+        uint64_t updated;
+        return RatingTally::add(ratingTally, rating, updated);
     }
 
-    buyer->getId();
-    buyer->getBuyName();
-    buyer->getAddress();
+    void displayBook() const {
+        displayBookRow(bookID, title, author, price, stockQuantity, getAverageRating());
+    }
+};
 
-    // Additional details based on buyer type
-    if (buyerType == 1) {
-        static_cast<Member*>(buyer)->getStarLevel();
-    } else if (buyerType == 2) {
-        static_cast<HonoredGuest*>(buyer)->getDiscountRate();
+// ASCII lowercase of a single byte (locale independent, safe for any char)
+inline char foldCase(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Case-insensitive substring kernels
+// All variants scan the original bytes in place and take a keyword that is
+// already lowercase and non-empty. The SIMD variants compare the first and
+// last keyword byte against a whole block of case-folded text positions and
+// only verify the positions where both match.
+inline bool matchesAtIgnoreCase(const char* text, const char* keyword, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (foldCase(text[i]) != keyword[i]) return false;
     }
+    return true;
+}
 
-    // Main menu loop
-    bool exitProgram = false;
-    while (!exitProgram) {
-        cout << "\n--- Main Menu ---\n";
-        cout << "1. Browse Books\n2. Search Books\n3. View Cart\n4. View Wishlist\n5. View Order History\n6. Checkout\n7. Logout\nChoose an option: ";
-        int mainChoice;
-        cin >> mainChoice;
-        cin.ignore();
+inline size_t findIgnoreCaseScalar(const char* text, size_t textLength,
+                                   const char* keyword, size_t length, size_t from = 0) {
+    if (length > textLength) return string::npos;
+    for (size_t pos = from; pos + length <= textLength; pos++) {
+        if (foldCase(text[pos]) == keyword[0] && matchesAtIgnoreCase(text + pos, keyword, length)) {
+            return pos;
+        }
+    }
+    return string::npos;
+}
 
-        switch (mainChoice) {
-            case 1:
-                displayBookList(books);
-                addBooksToCart(shoppingCart, books);
-                break;
-            case 2:
-                searchBooks(books);
-                break;
-            case 3:
-                viewCart(shoppingCart);
-                break;
-            case 4:
-                viewWishlist(wishlist);
-                break;
-            case 5:
-                viewOrderHistory(currentUser);
-                break;
-            case 6:
-                if (shoppingCart.empty()) {
-                    cout << "Your cart is empty.\n";
-                    break;
-                }
-                // Gift Option
-                handleGiftOption(shoppingCart);
-                // Apply coupon
-                applyCoupon(buyer);
-                // Calculate total amount
-                double totalAmount;
-                totalAmount = calculateTotal(shoppingCart);
-                buyer->setPay(totalAmount);
-                // Display order details
-                buyer->display();
-                // Process payment
-                processPayment(buyer);
-                // Save order to file
-                saveOrderToFile(buyer, shoppingCart);
-                // Update stock quantities
-                for (const auto& item : shoppingCart) {
-                    auto it = find_if(books.begin(), books.end(), [item](Book& b) {
-                        return b.getBookID() == item.first.getBookID();
-                    });
-                    if (it != books.end()) {
-                        int newStock = it->getStockQuantity() - item.second;
-                        it->setStockQuantity(newStock);
-                    }
-                }
-                // Save books to file
-                saveBooksToFile(books);
-                // Clear cart
-                shoppingCart.clear();
-                // Send email notification
-                sendEmailNotification(currentUser, "Your order has been placed successfully!");
-                break;
-            case 7:
-                exitProgram = true;
-                break;
-            default:
-                cout << "Invalid choice. Try again.\n";
-                break;
+#if defined(__SSE2__)
+inline __m128i foldCase16(__m128i bytes) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+    return _mm_add_epi8(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+inline size_t findIgnoreCaseSSE2(const char* text, size_t textLength, const char* keyword, size_t length) {
+    const __m128i first = _mm_set1_epi8(keyword[0]);
+    const __m128i last = _mm_set1_epi8(keyword[length - 1]);
+    size_t pos = 0;
+    for (; pos + length - 1 + 16 <= textLength; pos += 16) {
+        __m128i head = foldCase16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos)));
+        __m128i tail = foldCase16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos + length - 1)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+        while (mask != 0) {
+            unsigned offset = static_cast<unsigned>(__builtin_ctz(mask));
+            if (matchesAtIgnoreCase(text + pos + offset, keyword, length)) return pos + offset;
+            mask &= mask - 1;
         }
     }
+    return findIgnoreCaseScalar(text, textLength, keyword, length, pos);
+}
+#endif
 
-    // Clean up
-    delete buyer;
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BOOKSTORE_HAVE_AVX2 1
+__attribute__((target("avx2")))
+inline __m256i foldCase32(__m256i bytes) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), bytes));
+    return _mm256_add_epi8(bytes, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
 
-    cout << "\nThank you for visiting the Online Bookstore!\n";
+__attribute__((target("avx2")))
+inline size_t findIgnoreCaseAVX2(const char* text, size_t textLength, const char* keyword, size_t length) {
+    const __m256i first = _mm256_set1_epi8(keyword[0]);
+    const __m256i last = _mm256_set1_epi8(keyword[length - 1]);
+    size_t pos = 0;
+    for (; pos + length - 1 + 32 <= textLength; pos += 32) {
+        __m256i head = foldCase32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos)));
+        __m256i tail = foldCase32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + pos + length - 1)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last))));
+        while (mask != 0) {
+            unsigned offset = static_cast<unsigned>(__builtin_ctz(mask));
+            if (matchesAtIgnoreCase(text + pos + offset, keyword, length)) return pos + offset;
+            mask &= mask - 1;
+        }
+    }
+    return findIgnoreCaseScalar(text, textLength, keyword, length, pos);
+}
+#endif
 
-    return 0;
+typedef size_t (*FindIgnoreCaseFn)(const char*, size_t, const char*, size_t);
+
+// Picks the widest kernel the CPU supports, once per process
+inline FindIgnoreCaseFn selectFindIgnoreCase() {
+#if defined(BOOKSTORE_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findIgnoreCaseAVX2;
+#endif
+#if defined(__SSE2__)
+    return findIgnoreCaseSSE2;
+#else
+    return [](const char* text, size_t textLength, const char* keyword, size_t length) {
+        return findIgnoreCaseScalar(text, textLength, keyword, length);
+    };
+#endif
 }
 
-// Function Definitions
+// Case-insensitive substring search over the original bytes, without making
+// lowercase copies. The keyword must already be lowercase.
+inline size_t findIgnoreCase(const char* text, size_t textLength, const string& keyword) {
+    static const FindIgnoreCaseFn kernel = selectFindIgnoreCase();
+    if (keyword.empty()) return 0;
+    if (keyword.size() > textLength) return string::npos;
+    return kernel(text, textLength, keyword.data(), keyword.size());
+}
 
-void showWelcomeMessage() {
-    cout << "**********************************\n";
-    cout << "* Welcome to the Online Bookstore *\n";
-    cout << "**********************************\n\n";
+inline size_t findIgnoreCase(string_view text, const string& keyword) {
+    return findIgnoreCase(text.data(), text.size(), keyword);
 }
 
-void displayBookList(const vector<Book>& books) {
-    cout << "\nAvailable Books:\n";
-    cout << left << setw(5) << "ID"
-         << setw(25) << "Title"
-         << setw(20) << "Author"
-         << "Price" << setw(15) << " Stock"
-         << " Rating\n";
-    cout << "---------------------------------------------------------------------------------\n";
-    for (const auto& book : books) {
-        book.displayBook();
+// Inverted index for searchBooks
+// Titles and authors are indexed as lowercase character trigrams, so a keyword
+// of three or more characters only has to be checked against the books that
+// contain all of its trigrams. This keeps the substring semantics of the
+// original scan. Posting lists hold book IDs in ascending order.
+class SearchIndex {
+private:
+    unordered_map<uint32_t, vector<int>> postings;
+
+    static uint32_t trigramAt(string_view text, size_t pos) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(foldCase(text[pos]))) << 16)
+             | (static_cast<uint32_t>(static_cast<unsigned char>(foldCase(text[pos + 1]))) << 8)
+             | static_cast<uint32_t>(static_cast<unsigned char>(foldCase(text[pos + 2])));
     }
-}
 
-void addBooksToCart(vector<pair<Book, int>>& cart, vector<Book>& books) {
-    char choice = 'y';
-    while (tolower(choice) == 'y') {
-        int bookID = 0;
-        int quantity = 0;
-        cout << "Enter the ID of the book you want to add to your cart: ";
-        cin >> bookID;
-        cin.ignore(); // Clear the input buffer
+    static void collectTrigrams(string_view text, vector<uint32_t>& out) {
+        for (size_t pos = 0; pos + 3 <= text.size(); pos++) {
+            out.push_back(trigramAt(text, pos));
+        }
+    }
 
-        auto it = find_if(books.begin(), books.end(), [bookID](const Book& b) {
-            return b.getBookID() == bookID;
-        });
+    static vector<uint32_t> trigramsOf(string_view title, string_view author) {
+        vector<uint32_t> grams;
+        collectTrigrams(title, grams);
+        collectTrigrams(author, grams);
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+public:
+    static const size_t MIN_KEYWORD_LENGTH = 3;
 
-        if (it != books.end()) {
-            cout << "Enter quantity: ";
-            cin >> quantity;
-            cin.ignore();
-            if (quantity > it->getStockQuantity()) {
-                cout << "Only " << it->getStockQuantity() << " copies available.\n";
-                quantity = it->getStockQuantity();
+    void addBook(int id, string_view title, string_view author) {
+        for (uint32_t gram : trigramsOf(title, author)) {
+            vector<int>& list = postings[gram];
+            if (list.empty() || list.back() < id) {
+                list.push_back(id); // Common case: IDs arrive in ascending order
+            } else {
+                list.insert(lower_bound(list.begin(), list.end(), id), id);
             }
-            cart.push_back(make_pair(*it, quantity));
-            cout << "\"" << it->getTitle() << "\" has been added to your cart.\n";
-        } else {
-            cout << "Book with ID " << bookID << " not found.\n";
         }
-        cout << "Do you want to add another book to your cart? (y/n): ";
-        cin >> choice;
-        cin.ignore();
     }
-}
 
-double calculateTotal(const vector<pair<Book, int>>& cart) {
-    double total = 0.0;
-    cout << "\nBooks in your cart:\n";
-    for (const auto& item : cart) {
-        cout << "- " << item.first.getTitle() << " x" << item.second << " ($" << item.first.getPrice() << " each)\n";
-        total += item.first.getPrice() * item.second;
+    void removeBook(int id, string_view title, string_view author) {
+        for (uint32_t gram : trigramsOf(title, author)) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) continue;
+            vector<int>& list = it->second;
+            auto pos = lower_bound(list.begin(), list.end(), id);
+            if (pos != list.end() && *pos == id) {
+                list.erase(pos);
+            }
+            if (list.empty()) {
+                postings.erase(it);
+            }
+        }
+    }
+
+    void clear() { postings.clear(); }
+
+    // Returns the IDs (ascending) of books containing every trigram of the
+    // lowercase keyword. Callers still verify the actual substring match.
+    vector<int> candidates(const string& keyword) const {
+        vector<uint32_t> grams;
+        collectTrigrams(keyword, grams);
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+
+        vector<const vector<int>*> lists;
+        for (uint32_t gram : grams) {
+            auto it = postings.find(gram);
+            if (it == postings.end()) return {};
+            lists.push_back(&it->second);
+        }
+        if (lists.empty()) return {};
+        // Intersect starting from the rarest trigram
+        sort(lists.begin(), lists.end(), [](const vector<int>* a, const vector<int>* b) {
+            return a->size() < b->size();
+        });
+        vector<int> result = *lists[0];
+        for (size_t i = 1; i < lists.size() && !result.empty(); i++) {
+            const vector<int>& list = *lists[i];
+            auto keep = remove_if(result.begin(), result.end(), [&list](int id) {
+                return !binary_search(list.begin(), list.end(), id);
+            });
+            result.erase(keep, result.end());
+        }
+        return result;
+    }
+};
+
+// Criteria for filterBooks
+// A maxPrice of 0 means no upper bound; an empty author matches any author.
+struct BookFilter {
+    enum SortKey { SORT_NONE, SORT_RATING, SORT_PRICE_ASC, SORT_PRICE_DESC };
+
+    double minPrice;
+    double maxPrice;
+    double minRating;
+    bool inStockOnly;
+    string author; // Lowercase substring of the author name
+    SortKey sortKey;
+    size_t limit;  // 0 = all results
+
+    BookFilter()
+        : minPrice(0.0), maxPrice(0.0), minRating(0.0), inStockOnly(false),
+          sortKey(SORT_NONE), limit(0) {}
+};
+
+// Evaluates the numeric filter predicates over whole catalog columns and
+// appends the slots that pass to survivors, in slot order. The SSE2 path tests
+// the price and stock predicates two slots per step; the rating predicate only
+// looks at slots that passed them, using the same average as
+// Book::getAverageRating.
+inline void evaluateNumericPredicates(const double* prices, const int* stocks, const uint64_t* ratingTallies,
+                                      size_t count, const BookFilter& filter, vector<size_t>& survivors) {
+    double maxPrice = filter.maxPrice > 0.0 ? filter.maxPrice : numeric_limits<double>::infinity();
+    auto keep = [&](size_t slot) {
+        if (filter.minRating <= 0.0
+            || RatingTally::average(RatingTally::load(ratingTallies[slot])) >= filter.minRating) {
+            survivors.push_back(slot);
+        }
+    };
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128d lowPrice = _mm_set1_pd(filter.minPrice);
+    const __m128d highPrice = _mm_set1_pd(maxPrice);
+    const __m128i anyStock = _mm_set1_epi32(filter.inStockOnly ? 0 : -1);
+    for (; i + 2 <= count; i += 2) {
+        __m128d price = _mm_loadu_pd(prices + i);
+        __m128d pass = _mm_and_pd(_mm_cmpge_pd(price, lowPrice), _mm_cmple_pd(price, highPrice));
+        __m128i stockOk = _mm_or_si128(anyStock, _mm_cmpgt_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(stocks + i)), _mm_setzero_si128()));
+        pass = _mm_and_pd(pass, _mm_castsi128_pd(_mm_unpacklo_epi32(stockOk, stockOk)));
+        int bits = _mm_movemask_pd(pass);
+        if (bits & 1) keep(i);
+        if (bits & 2) keep(i + 1);
+    }
+#endif
+    for (; i < count; i++) {
+        if (prices[i] >= filter.minPrice && prices[i] <= maxPrice && (!filter.inStockOnly || stocks[i] > 0)) {
+            keep(i);
+        }
     }
-    cout << "Total amount before discount: $" << fixed << setprecision(2) << total << endl;
-    return total;
 }
 
-void saveOrderToFile(Buyer* buyer, const vector<pair<Book, int>>& cart) {
-    ofstream outFile("order_details.txt", ios::app);
-    if (!outFile) {
-        cout << "Error opening file to save order details.\n";
+class Catalog;
+
+// Lightweight read-only view of one catalog row
+// Offers the same getters as Book so callers can read catalog rows without
+// copying them; toBook() makes an owning copy (e.g. for carts).
+class BookView {
+private:
+    const Catalog* catalog;
+    size_t slot;
+public:
+    BookView(const Catalog* c, size_t s) : catalog(c), slot(s) {}
+
+    // False for the view returned when a lookup finds nothing
+    explicit operator bool() const { return catalog != nullptr; }
+
+    int getBookID() const;
+    string_view getTitle() const;
+    string_view getAuthor() const;
+    double getPrice() const;
+    Money getUnitPrice() const; // getPrice() to the nearest cent
+    int getStockQuantity() const;
+    int getOnHandQuantity() const;
+    uint64_t getRatingTally() const;
+    double getRatingSum() const;
+    int getRatingCount() const;
+    double getAverageRating() const;
+    Book toBook() const;
+    void displayBook() const;
+};
+
+// One catalog column: a flat array that either owns its elements or, after
+// a snapshot load, uses them in place in a private (copy-on-write) mapping of
+// the snapshot file. Elements can be read and written either way; the first
+// change in length copies a mapped column into owned memory.
+template<class T>
+class Column {
+private:
+    vector<T> owned;
+    T* first;     // owned.data() or the mapping
+    size_t count;
+    bool mapped;
+
+    void materialize() {
+        if (!mapped) return;
+        owned.assign(first, first + count);
+        mapped = false;
+    }
+
+    void sync() {
+        first = owned.data();
+        count = owned.size();
+    }
+public:
+    Column() : first(nullptr), count(0), mapped(false) {}
+    Column(const Column&) = delete;
+    Column& operator=(const Column&) = delete;
+
+    // The caller keeps the mapping alive for as long as the column uses it
+    void map(T* elements, size_t size) {
+        vector<T>().swap(owned);
+        first = elements;
+        count = size;
+        mapped = true;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T* data() { return first; }
+    const T* data() const { return first; }
+    T& operator[](size_t i) { return first[i]; }
+    const T& operator[](size_t i) const { return first[i]; }
+    const T* begin() const { return first; }
+    const T* end() const { return first + count; }
+
+    void reserve(size_t size) { materialize(); owned.reserve(size); sync(); }
+    void push_back(const T& value) { materialize(); owned.push_back(value); sync(); }
+    void erase(size_t i) { materialize(); owned.erase(owned.begin() + i); sync(); }
+    void assign(size_t size, const T& value) { mapped = false; owned.assign(size, value); sync(); }
+};
+
+// Book ID -> catalog slot hash table (open addressing, linear probing)
+// Entries are slot + 1 (0 = empty) and keys are compared through the
+// catalog's ID column, so the table is one flat array of integers: a snapshot
+// stores it as it is and a load maps it back without rebuilding anything.
+class SlotIndex {
+private:
+    Column<uint32_t> table; // Power-of-two size, at most half full
+    size_t used;
+
+    static size_t home(int id, size_t mask) {
+        return static_cast<size_t>((static_cast<uint32_t>(id) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    }
+
+    void place(int id, size_t slot) {
+        size_t mask = table.size() - 1;
+        size_t i = home(id, mask);
+        while (table[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        table[i] = static_cast<uint32_t>(slot + 1);
+    }
+
+    // Position of the entry holding `slot`, found by probing from id's home
+    size_t positionOf(int id, size_t slot) const {
+        size_t mask = table.size() - 1;
+        size_t i = home(id, mask);
+        while (table[i] != slot + 1) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+public:
+    // Slots must fit an entry, with 0 kept for empty
+    static const size_t MAX_SLOTS = numeric_limits<uint32_t>::max() - 1;
+
+    SlotIndex() : used(0) {}
+
+    static size_t capacityFor(size_t count) {
+        size_t capacity = 16;
+        while (capacity < count * 2) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+
+    const uint32_t* entries() const { return table.data(); }
+    size_t capacity() const { return table.size(); }
+
+    bool find(int id, const int* ids, size_t count, size_t& slot) const {
+        size_t capacity = table.size();
+        if (capacity == 0) return false;
+        size_t mask = capacity - 1;
+        // Bounded, so a damaged mapped table cannot loop forever
+        for (size_t i = home(id, mask), probes = 0; probes < capacity; i = (i + 1) & mask, probes++) {
+            uint32_t entry = table[i];
+            if (entry == 0) return false;
+            if (entry <= count && ids[entry - 1] == id) {
+                slot = entry - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Indexes slots [0, count) in a table with room for `room` slots
+    void rebuild(const int* ids, size_t count, size_t room = 0) {
+        table.assign(capacityFor(max(count, room)), 0);
+        for (size_t slot = 0; slot < count; slot++) {
+            place(ids[slot], slot);
+        }
+        used = count;
+    }
+
+    void reserve(size_t room, const int* ids, size_t count) {
+        if (capacityFor(room) > table.size()) rebuild(ids, count, room);
+    }
+
+    // Indexes the slot just appended; ids[slot] is its ID
+    void insert(const int* ids, size_t slot) {
+        if ((used + 1) * 2 > table.size()) {
+            rebuild(ids, slot + 1);
+            return;
+        }
+        place(ids[slot], slot);
+        used++;
+    }
+
+    // Call before the slot leaves the ID column; later entries are shifted
+    // back so no probe sequence is cut short
+    void erase(const int* ids, size_t slot) {
+        size_t mask = table.size() - 1;
+        size_t hole = positionOf(ids[slot], slot);
+        for (size_t i = (hole + 1) & mask; table[i] != 0; i = (i + 1) & mask) {
+            size_t wanted = home(ids[table[i] - 1], mask);
+            // Move the entry into the hole unless its home lies after the hole
+            if (((i - wanted) & mask) >= ((i - hole) & mask)) {
+                table[hole] = table[i];
+                hole = i;
+            }
+        }
+        table[hole] = 0;
+        used--;
+    }
+
+    // Records that the book `id` moved from slot `from` to slot `to`
+    void move(int id, size_t from, size_t to) {
+        table[positionOf(id, from)] = static_cast<uint32_t>(to + 1);
+    }
+
+    void map(uint32_t* entries, size_t capacity, size_t count) {
+        table.map(entries, capacity);
+        used = count;
+    }
+};
+
+// Pool of title/author bytes
+// Catalog rows refer to their text by offset and length, so all strings live
+// in one contiguous buffer instead of one heap block each. Removed rows leave
+// dead bytes behind until the owner compacts the pool. A pool may start from
+// a mapped snapshot heap; text added later goes after it in owned memory.
+class StringPool {
+public:
+    struct Ref {
+        size_t offset;
+        size_t length;
+    };
+private:
+    const char* base; // Mapped bytes before the owned ones; may be null
+    size_t baseSize;
+    string bytes;
+    size_t releasedBytes;
+public:
+    StringPool() : base(nullptr), baseSize(0), releasedBytes(0) {}
+
+    // The caller keeps the mapping alive for as long as the pool uses it
+    void map(const char* heap, size_t size) {
+        base = heap;
+        baseSize = size;
+        bytes.clear();
+        releasedBytes = 0;
+    }
+
+    Ref add(string_view text) {
+        Ref ref = { baseSize + bytes.size(), text.size() };
+        bytes.append(text.data(), text.size());
+        return ref;
+    }
+
+    // Refs are clipped to the bytes behind them, so a damaged snapshot ref
+    // cannot reach past the mapped heap or the owned bytes
+    string_view view(Ref ref) const {
+        if (ref.offset >= baseSize) {
+            size_t start = ref.offset - baseSize;
+            if (start >= bytes.size()) return string_view();
+            return string_view(bytes.data() + start, min(ref.length, bytes.size() - start));
+        }
+        return string_view(base + ref.offset, min(ref.length, baseSize - ref.offset));
+    }
+
+    void release(Ref ref) { releasedBytes += ref.length; }
+    bool needsCompaction() const { return releasedBytes > 4096 && releasedBytes * 2 > size(); }
+    size_t size() const { return baseSize + bytes.size(); }
+    void reserve(size_t count) { bytes.reserve(count); }
+};
+
+// Class for the book catalog
+// Books are stored column-wise: the hot numeric fields live in contiguous
+// arrays (one entry per slot) so whole-catalog scans such as price/stock
+// totals and filters only touch the bytes they need, while titles and authors
+// live in a string pool. An ID -> slot index makes lookups by book ID O(1).
+// All mutations go through the catalog so the index stays consistent.
+// Stock is kept twice: the copies physically on hand (what gets saved) and
+// the copies still available, i.e. on hand minus those held by reservations.
+// A snapshot load (loadCatalogSnapshot) points the columns, the index and the
+// pool at a mapping of the snapshot instead of copying it.
+class MappedFile;
+
+class Catalog {
+private:
+    Column<int> ids;
+    Column<double> prices;
+    Column<int> stocks; // Available; changed lock-free by reservations
+    Column<int> onHand;
+    Column<uint64_t> ratings; // RatingTally words, updated lock-free
+    Column<StringPool::Ref> titles;
+    Column<StringPool::Ref> authors;
+    StringPool text;
+    SlotIndex slotByID;
+    vector<shared_ptr<MappedFile>> mappings; // Snapshot mappings the columns use
+
+    // The trigram index is rebuilt lazily after bulk loads: they only mark it
+    // stale, and the first search afterwards indexes every row at once
+    mutable SearchIndex searchIndex;
+    mutable bool searchIndexStale;
+    mutable mutex searchIndexMutex;
+
+    friend class BookView;
+    friend bool loadCatalogSnapshot(Catalog& catalog, const string& path);
+
+    void ensureSearchIndex() const {
+        lock_guard<mutex> lock(searchIndexMutex);
+        if (!searchIndexStale) return;
+        searchIndex.clear();
+        for (size_t i = 0; i < ids.size(); i++) {
+            searchIndex.addBook(ids[i], text.view(titles[i]), text.view(authors[i]));
+        }
+        searchIndexStale = false;
+    }
+
+    // Slots from `slot` on have moved down by one
+    void reindexFrom(size_t slot) {
+        for (size_t i = slot; i < ids.size(); i++) {
+            slotByID.move(ids[i], i + 1, i);
+        }
+    }
+
+    void compactText() {
+        StringPool fresh;
+        fresh.reserve(text.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            titles[i] = fresh.add(text.view(titles[i]));
+            authors[i] = fresh.add(text.view(authors[i]));
+        }
+        text = move(fresh);
+    }
+
+    // Reads a stock count that other threads may be updating
+    static int loadCount(const int& count) {
+        return atomicLoad(count);
+    }
+
+    bool findSlot(int id, size_t& slot) const {
+        return slotByID.find(id, ids.data(), ids.size(), slot);
+    }
+
+    // Relevance of a keyword match in one field: 4 = whole field,
+    // 3 = field prefix, 2 = start of a word, 1 = inside a word, 0 = no match.
+    // A match inside a word keeps looking for a later one at a word start.
+    static int matchRank(string_view field, const string& keyword) {
+        size_t pos = findIgnoreCase(field, keyword);
+        if (pos == string::npos) return 0;
+        if (pos == 0) return keyword.size() == field.size() ? 4 : 3;
+        while (isalnum(static_cast<unsigned char>(field[pos - 1]))) {
+            size_t next = findIgnoreCase(field.substr(pos + 1), keyword);
+            if (next == string::npos) return 1;
+            pos += 1 + next;
+        }
+        return 2;
+    }
+public:
+    // Iterates the catalog in listing order, yielding BookViews
+    class const_iterator {
+    private:
+        const Catalog* catalog;
+        size_t slot;
+    public:
+        const_iterator(const Catalog* c, size_t s) : catalog(c), slot(s) {}
+        BookView operator*() const { return BookView(catalog, slot); }
+        const_iterator& operator++() { slot++; return *this; }
+        bool operator==(const const_iterator& other) const { return slot == other.slot; }
+        bool operator!=(const const_iterator& other) const { return slot != other.slot; }
+    };
+
+    Catalog() : searchIndexStale(false) {}
+
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+
+    // Call before adding many books at once; indexing them for search is
+    // then deferred to the first search
+    void deferSearchIndex() {
+        lock_guard<mutex> lock(searchIndexMutex);
+        searchIndexStale = true;
+    }
+
+    void reserve(size_t count) {
+        ids.reserve(count);
+        prices.reserve(count);
+        stocks.reserve(count);
+        onHand.reserve(count);
+        ratings.reserve(count);
+        titles.reserve(count);
+        authors.reserve(count);
+        slotByID.reserve(count, ids.data(), ids.size());
+    }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, ids.size()); }
+    BookView at(size_t slot) const { return BookView(this, slot); }
+
+    // Column access for whole-catalog scans; index i is slot i
+    const Column<int>& idColumn() const { return ids; }
+    const Column<double>& priceColumn() const { return prices; }
+    const Column<int>& stockColumn() const { return stocks; }
+    const Column<uint64_t>& ratingColumn() const { return ratings; }
+
+    // Returns a view that tests false if no book has this ID
+    BookView findBook(int id) const {
+        size_t slot;
+        return findSlot(id, slot) ? BookView(this, slot) : BookView(nullptr, 0);
+    }
+
+    // Returns false if a book with the same ID already exists
+    bool addBook(int id, string_view title, string_view author, double price, int stock,
+                 uint64_t ratingTally = 0) {
+        size_t existing;
+        if (findSlot(id, existing) || ids.size() >= SlotIndex::MAX_SLOTS) {
+            return false;
+        }
+        ids.push_back(id);
+        prices.push_back(price);
+        stocks.push_back(stock);
+        onHand.push_back(stock);
+        ratings.push_back(ratingTally);
+        titles.push_back(text.add(title));
+        authors.push_back(text.add(author));
+        slotByID.insert(ids.data(), ids.size() - 1);
+        if (!searchIndexStale) {
+            searchIndex.addBook(id, title, author);
+        }
+        return true;
+    }
+
+    bool addBook(const Book& book) {
+        return addBook(book.getBookID(), book.getTitle(), book.getAuthor(), book.getPrice(),
+                       book.getStockQuantity(), book.getRatingTally());
+    }
+
+    bool removeBook(int id) {
+        size_t slot;
+        if (!findSlot(id, slot)) {
+            return false;
+        }
+        slotByID.erase(ids.data(), slot);
+        if (!searchIndexStale) {
+            searchIndex.removeBook(id, text.view(titles[slot]), text.view(authors[slot]));
+        }
+        text.release(titles[slot]);
+        text.release(authors[slot]);
+        ids.erase(slot);
+        prices.erase(slot);
+        stocks.erase(slot);
+        onHand.erase(slot);
+        ratings.erase(slot);
+        titles.erase(slot);
+        authors.erase(slot);
+        reindexFrom(slot); // Keep listing order; only later slots shift
+        if (text.needsCompaction()) {
+            compactText();
+        }
+        return true;
+    }
+
+    // Sets the copies on hand; copies held by reservations stay held
+    // Sets the copies on hand; the available count moves by the same amount,
+    // so copies held by reservations stay held. The swap is a compare-and-swap
+    // on the value it replaces, so a concurrent commit or restock is never
+    // lost.
+    bool setStockQuantity(int id, int quantity) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        int current = loadCount(onHand[slot]);
+        while (!atomicCompareExchange(onHand[slot], current, quantity)) {}
+        atomicFetchAdd(stocks[slot], quantity - current);
+        return true;
+    }
+
+    bool adjustStockQuantity(int id, int delta) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        atomicFetchAdd(onHand[slot], delta);
+        atomicFetchAdd(stocks[slot], delta);
+        return true;
+    }
+
+    // Takes copies out of the available stock with a compare-and-swap loop.
+    // Fails rather than going below zero, so concurrent shoppers cannot
+    // oversell and never wait on each other.
+    bool reserveStock(int id, int quantity) {
+        size_t slot;
+        if (!findSlot(id, slot) || quantity <= 0) return false;
+        int current = atomicLoad(stocks[slot]);
+        do {
+            if (current < quantity) return false;
+        } while (!atomicCompareExchange(stocks[slot], current, current - quantity));
+        return true;
+    }
+
+    // Returns reserved copies to the available stock
+    bool releaseStock(int id, int quantity) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        atomicFetchAdd(stocks[slot], quantity);
+        return true;
+    }
+
+    // Turns reserved copies into a sale; stores the new on-hand count in `updated`
+    bool commitStock(int id, int quantity, int& updated) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        updated = atomicFetchAdd(onHand[slot], -quantity) - quantity;
+        return true;
+    }
+
+    bool setPrice(int id, double price) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        atomicStore(prices[slot], price);
+        return true;
+    }
+
+    // Lock-free, so concurrent raters do not serialize; the new tally is
+    // stored in `updated` for the journal. Returns false if the book is
+    // unknown or its tally is full.
+    bool addRating(int id, double rating, uint64_t& updated) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        return RatingTally::add(ratings[slot], rating, updated);
+    }
+
+    // Replaces the tally unless it already holds more ratings; tallies only
+    // grow, so this keeps the newest value even if journal records of
+    // concurrent raters were appended out of order
+    bool raiseRating(int id, uint64_t ratingTally) {
+        size_t slot;
+        if (!findSlot(id, slot)) return false;
+        uint64_t current = atomicLoad(ratings[slot]);
+        while (RatingTally::count(ratingTally) >= RatingTally::count(current)
+               && !atomicCompareExchange(ratings[slot], current, ratingTally)) {}
+        return true;
+    }
+
+    // Sum of price x stock over the whole catalog
+    double totalInventoryValue() const {
+        double total = 0.0;
+        for (size_t i = 0; i < prices.size(); i++) {
+            total += prices[i] * loadCount(onHand[i]);
+        }
+        return total;
+    }
+
+    // Books passing every predicate of the filter, ordered by its sort key and
+    // cut to its limit. Numeric predicates run over the columns first; the
+    // author match only looks at rows that survived them. With a limit only
+    // the top rows are sorted.
+    vector<BookView> filter(const BookFilter& filter) const {
+        size_t count = ids.size();
+        vector<size_t> slots;
+        evaluateNumericPredicates(prices.data(), stocks.data(), ratings.data(), count, filter, slots);
+        if (!filter.author.empty()) {
+            slots.erase(remove_if(slots.begin(), slots.end(), [&](size_t slot) {
+                return findIgnoreCase(text.view(authors[slot]), filter.author) == string::npos;
+            }), slots.end());
+        }
+
+        // Sort keys are read once per survivor so the comparisons touch one
+        // contiguous array; a negated key gives descending order and ties
+        // stay in slot order
+        size_t keep = (filter.limit == 0 || filter.limit > slots.size()) ? slots.size() : filter.limit;
+        if (filter.sortKey != BookFilter::SORT_NONE) {
+            vector<pair<double, size_t>> keyed;
+            keyed.reserve(slots.size());
+            for (size_t slot : slots) {
+                double key;
+                switch (filter.sortKey) {
+                    case BookFilter::SORT_RATING:
+                        key = -RatingTally::average(RatingTally::load(ratings[slot]));
+                        break;
+                    case BookFilter::SORT_PRICE_DESC:
+                        key = -atomicLoad(prices[slot]);
+                        break;
+                    default:
+                        key = atomicLoad(prices[slot]);
+                        break;
+                }
+                keyed.push_back(make_pair(key, slot));
+            }
+            if (keep == keyed.size()) {
+                sort(keyed.begin(), keyed.end());
+            } else {
+                partial_sort(keyed.begin(), keyed.begin() + keep, keyed.end());
+            }
+            for (size_t i = 0; i < keep; i++) {
+                slots[i] = keyed[i].second;
+            }
+        }
+        slots.resize(keep);
+
+        vector<BookView> results;
+        results.reserve(keep);
+        for (size_t slot : slots) {
+            results.push_back(BookView(this, slot));
+        }
+        return results;
+    }
+
+    // Books whose title or author contains the lowercase keyword, best matches
+    // first (title matches before author-only matches) and equal matches in
+    // listing order. Short keywords cannot use the trigram index and fall
+    // back to a scan.
+    vector<BookView> search(const string& keyword) const {
+        ScopedTimer timer(TIME_SEARCH);
+        Metrics::count(COUNT_SEARCHES);
+        vector<pair<int, size_t>> scored;
+        auto consider = [&](size_t slot) {
+            int score = matchRank(text.view(titles[slot]), keyword) * 5
+                      + matchRank(text.view(authors[slot]), keyword);
+            if (score > 0) {
+                scored.push_back(make_pair(score, slot));
+            }
+        };
+        if (keyword.size() < SearchIndex::MIN_KEYWORD_LENGTH) {
+            for (size_t slot = 0; slot < ids.size(); slot++) {
+                consider(slot);
+            }
+        } else {
+            ensureSearchIndex();
+            Metrics::count(COUNT_SEARCH_INDEX_HITS);
+            for (int id : searchIndex.candidates(keyword)) {
+                size_t slot;
+                if (findSlot(id, slot)) consider(slot);
+            }
+        }
+        // Ties keep listing order whichever path found them; index
+        // candidates arrive in book ID order, not slot order
+        sort(scored.begin(), scored.end(), [](const pair<int, size_t>& a, const pair<int, size_t>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        vector<BookView> results;
+        results.reserve(scored.size());
+        for (const auto& entry : scored) {
+            results.push_back(BookView(this, entry.second));
+        }
+        return results;
+    }
+};
+
+inline int BookView::getBookID() const { return catalog->ids[slot]; }
+inline string_view BookView::getTitle() const { return catalog->text.view(catalog->titles[slot]); }
+inline string_view BookView::getAuthor() const { return catalog->text.view(catalog->authors[slot]); }
+inline double BookView::getPrice() const { return atomicLoad(catalog->prices[slot]); }
+inline Money BookView::getUnitPrice() const { return Money::fromDouble(getPrice()); }
+inline int BookView::getStockQuantity() const { return Catalog::loadCount(catalog->stocks[slot]); }
+inline int BookView::getOnHandQuantity() const { return Catalog::loadCount(catalog->onHand[slot]); }
+inline uint64_t BookView::getRatingTally() const { return RatingTally::load(catalog->ratings[slot]); }
+inline double BookView::getRatingSum() const { return RatingTally::sum(getRatingTally()); }
+inline int BookView::getRatingCount() const { return RatingTally::count(getRatingTally()); }
+inline double BookView::getAverageRating() const { return RatingTally::average(getRatingTally()); }
+
+inline Book BookView::toBook() const {
+    return Book(getBookID(), string(getTitle()), string(getAuthor()), getPrice(),
+                getStockQuantity(), getRatingTally());
+}
+
+inline void BookView::displayBook() const {
+    displayBookRow(getBookID(), getTitle(), getAuthor(), getPrice(), getStockQuantity(), getAverageRating());
+}
+
+// View of a whole file
+// The file is memory-mapped where the platform supports it and read into
+// memory otherwise. A writable view is private: writes change this process's
+// copy of the pages, never the file.
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+    bool mapped;
+    string buffer;
+public:
+    MappedFile() : bytes(nullptr), length(0), mapped(false) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Returns false if the file cannot be opened
+    bool open(const string& path, bool writable = false) {
+        close();
+#if defined(BOOKSTORE_POSIX)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0) {
+            void* address = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            madvise(address, length, MADV_WILLNEED);
+            bytes = static_cast<const char*>(address);
+            mapped = true;
+        }
+        ::close(fd);
+        return true;
+#else
+        (void)writable;
+        ifstream in(path, ios::binary);
+        if (!in) return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#if defined(BOOKSTORE_POSIX)
+        if (mapped) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+        buffer.clear();
+        bytes = nullptr;
+        length = 0;
+        mapped = false;
+    }
+
+    const char* data() const { return bytes; }
+    char* writableData() { return const_cast<char*>(bytes); } // Opened writable only
+    size_t size() const { return length; }
+};
+
+// Number parsing for book_data.txt fields
+// Mirrors stoi/stod (leading whitespace and a '+' sign are accepted, trailing
+// characters are ignored) but works on string_views without allocating.
+inline bool prepareNumberField(string_view& field) {
+    size_t pos = 0;
+    while (pos < field.size() && isspace(static_cast<unsigned char>(field[pos]))) {
+        pos++;
+    }
+    if (pos < field.size() && field[pos] == '+') {
+        pos++;
+        if (pos < field.size() && field[pos] == '-') return false;
+    }
+    field.remove_prefix(pos);
+    return !field.empty();
+}
+
+inline bool parseIntField(string_view field, int& value) {
+    if (!prepareNumberField(field)) return false;
+    return from_chars(field.data(), field.data() + field.size(), value).ec == errc();
+}
+
+inline bool parseDoubleField(string_view field, double& value) {
+    if (!prepareNumberField(field)) return false;
+    return from_chars(field.data(), field.data() + field.size(), value).ec == errc();
+}
+
+// One parsed line of book_data.txt; the text fields point into the file buffer
+struct BookRecord {
+    int id;
+    string_view title;
+    string_view author;
+    double price;
+    int stock;
+    uint64_t ratingTally;
+};
+
+// Parses the lines in [begin, end) with the same rules as the original
+// getline/stringstream loader: fields are split on '|' (a trailing '|' does not
+// start an empty field) and lines with fewer than five fields are skipped.
+// Lines whose numeric fields do not parse are skipped as well.
+// Line format: id|title|author|price|stock|average|ratingSum|ratingCount
+// The average is informational; older files without the last two fields
+// load with no ratings.
+inline void parseBookLines(const char* begin, const char* end, vector<BookRecord>& out) {
+    const size_t REQUIRED_FIELDS = 5;
+    const size_t FIELD_COUNT = 8;
+    const char* line = begin;
+    while (line < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!lineEnd) lineEnd = end;
+
+        string_view fields[FIELD_COUNT];
+        size_t fieldCount = 0;
+        const char* field = line;
+        while (fieldCount < FIELD_COUNT && field < lineEnd) {
+            const char* separator = static_cast<const char*>(memchr(field, '|', lineEnd - field));
+            if (!separator) separator = lineEnd;
+            fields[fieldCount++] = string_view(field, separator - field);
+            field = separator + 1;
+        }
+
+        BookRecord record;
+        if (fieldCount >= REQUIRED_FIELDS
+            && parseIntField(fields[0], record.id)
+            && parseDoubleField(fields[3], record.price)
+            && parseIntField(fields[4], record.stock)) {
+            record.title = fields[1];
+            record.author = fields[2];
+            double ratingSum;
+            int ratingCount;
+            if (fieldCount < FIELD_COUNT
+                || !parseDoubleField(fields[6], ratingSum) || !parseIntField(fields[7], ratingCount)
+                || !RatingTally::fromSumAndCount(ratingSum, ratingCount, record.ratingTally)) {
+                record.ratingTally = 0;
+            }
+            out.push_back(record);
+        }
+        line = lineEnd + 1;
+    }
+}
+
+// Parses a whole book_data.txt buffer in parallel: the buffer is split into
+// newline-aligned chunks, one per worker, and the per-chunk results are
+// returned in file order
+inline vector<vector<BookRecord>> parseBookData(const char* data, size_t size) {
+    const size_t MIN_CHUNK_BYTES = 1 << 20;
+    size_t workers = max<size_t>(1, thread::hardware_concurrency());
+    workers = max<size_t>(1, min(workers, size / MIN_CHUNK_BYTES));
+
+    const char* end = data + size;
+    vector<const char*> bounds(1, data);
+    for (size_t k = 1; k < workers; k++) {
+        const char* cut = max(data + size * k / workers, bounds.back());
+        const char* newline = static_cast<const char*>(memchr(cut, '\n', end - cut));
+        bounds.push_back(newline ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+
+    vector<vector<BookRecord>> chunks(workers);
+    vector<thread> threads;
+    for (size_t k = 1; k < workers; k++) {
+        threads.emplace_back(parseBookLines, bounds[k], bounds[k + 1], ref(chunks[k]));
+    }
+    parseBookLines(bounds[0], bounds[1], chunks[0]);
+    for (auto& worker : threads) {
+        worker.join();
+    }
+    return chunks;
+}
+
+// Binary catalog snapshot (book_data.bin)
+// Layout: SnapshotHeader, then the catalog's columns exactly as Catalog keeps
+// them in memory (IDs, stock, prices, rating tallies, title refs, author
+// refs), its SlotIndex table, and a heap holding all titles and authors back
+// to back. Each section starts on a 64-byte boundary and values are in native
+// byte order, so a load maps the file and uses it in place: startup does not
+// grow with the catalog. The checksum covers the header only; snapshots are
+// renamed into place after an fsync, so a torn file cannot appear, and a
+// foreign or mismatched one fails the header checks. Damaged contents cannot
+// reach outside the mapping: string refs are clipped to the heap and index
+// probes are bounded.
+const char SNAPSHOT_MAGIC[8] = { 'B', 'O', 'O', 'K', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 3;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t heapSize;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(SnapshotHeader) == 40, "snapshot header layout changed");
+static_assert(sizeof(int) == 4 && sizeof(StringPool::Ref) == 16, "catalog snapshot columns changed");
+
+// Bytes per book across the catalog snapshot's columns; stored as the
+// header's recordSize
+const uint32_t CATALOG_SNAPSHOT_BOOK_BYTES = 2 * sizeof(int) + sizeof(double) + sizeof(uint64_t) + 2 * sizeof(StringPool::Ref);
+
+// File offsets of the catalog snapshot's sections
+struct CatalogSnapshotLayout {
+    uint64_t ids, stocks, prices, ratings, titles, authors, index, heap, end;
+
+    CatalogSnapshotLayout(uint64_t count, uint64_t heapSize) {
+        auto aligned = [](uint64_t offset) { return (offset + 63) & ~static_cast<uint64_t>(63); };
+        ids = aligned(sizeof(SnapshotHeader));
+        stocks = aligned(ids + count * sizeof(int));
+        prices = aligned(stocks + count * sizeof(int));
+        ratings = aligned(prices + count * sizeof(double));
+        titles = aligned(ratings + count * sizeof(uint64_t));
+        authors = aligned(titles + count * sizeof(StringPool::Ref));
+        index = aligned(authors + count * sizeof(StringPool::Ref));
+        heap = aligned(index + SlotIndex::capacityFor(count) * sizeof(uint32_t));
+        end = heap + heapSize;
+    }
+};
+
+// 64-bit checksum of a byte range, folded eight bytes at a time; pass the
+// previous result as seed to continue over several ranges
+inline uint64_t snapshotChecksum(const char* data, size_t size, uint64_t seed = 0x9E3779B97F4A7C15ULL) {
+    const uint64_t MULTIPLIER = 0xFF51AFD7ED558CCDULL;
+    uint64_t hash = seed;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * MULTIPLIER;
+    }
+    return hash ^ (hash >> 32);
+}
+
+// Flushes a file's contents to stable storage; used before a base file
+// replaces log records
+inline bool syncFileToDisk(const string& path) {
+#if defined(BOOKSTORE_POSIX)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    Metrics::count(COUNT_FSYNCS);
+    return synced;
+#else
+    (void)path;
+    return true;
+#endif
+}
+
+// Append-only log file with group commit
+// append() only copies the record into a pending buffer and returns its
+// sequence number. A writer thread takes everything appended since its last
+// pass and writes it with one write and one fsync, then wakes every caller
+// waiting in waitDurable() for those records. While one batch is being synced
+// the next one accumulates, so concurrent commits share a single disk flush.
+// A failed write is sticky: that batch and everything after it are dropped and
+// reported as not durable, since the file may now end in a torn record.
+class GroupCommitLog {
+private:
+    string path;
+    FILE* file;
+    mutex logMutex;
+    condition_variable workReady;
+    condition_variable flushed;
+    string pending;
+    uint64_t appendedSequence;
+    uint64_t durableSequence;
+    uint64_t failedSequence; // First sequence lost to a write error
+    uint64_t fileBytes;
+    bool stopping;
+    thread writer;
+
+    // Callers hold logMutex
+    bool failed() const { return failedSequence != numeric_limits<uint64_t>::max(); }
+
+    void writerLoop() {
+        unique_lock<mutex> lock(logMutex);
+        while (true) {
+            workReady.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) break; // Stopping and fully drained
+            string batch;
+            batch.swap(pending);
+            uint64_t batchStart = durableSequence + 1;
+            uint64_t batchEnd = appendedSequence;
+            bool healthy = !failed();
+            lock.unlock();
+            bool written = false;
+            if (healthy) {
+                written = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && fflush(file) == 0;
+#if defined(BOOKSTORE_POSIX)
+                written = written && fsync(fileno(file)) == 0;
+                Metrics::count(COUNT_FSYNCS);
+#endif
+                Metrics::count(COUNT_BYTES_WRITTEN, batch.size());
+                if (!written) {
+                    cout << "Error writing " << path << ". Later records are not saved.\n";
+                }
+            }
+            lock.lock();
+            if (!written && !failed()) {
+                failedSequence = batchStart;
+            }
+            durableSequence = batchEnd;
+            flushed.notify_all();
+        }
+    }
+public:
+    GroupCommitLog()
+        : file(nullptr), appendedSequence(0), durableSequence(0), failedSequence(numeric_limits<uint64_t>::max()),
+          fileBytes(0), stopping(false) {}
+    GroupCommitLog(const GroupCommitLog&) = delete;
+    GroupCommitLog& operator=(const GroupCommitLog&) = delete;
+    ~GroupCommitLog() { close(); }
+
+    bool open(const string& logPath) {
+        close();
+        path = logPath;
+        file = fopen(path.c_str(), "ab");
+        if (!file) return false;
+        fseek(file, 0, SEEK_END);
+        fileBytes = static_cast<uint64_t>(ftell(file));
+        failedSequence = numeric_limits<uint64_t>::max();
+        stopping = false;
+        writer = thread(&GroupCommitLog::writerLoop, this);
+        return true;
+    }
+
+    // Queues one record and returns its sequence number; the record's file
+    // offset is stored in `offset` if given
+    uint64_t append(const char* data, size_t size, uint64_t* offset = nullptr) {
+        lock_guard<mutex> lock(logMutex);
+        if (offset) *offset = fileBytes;
+        pending.append(data, size);
+        fileBytes += size;
+        uint64_t sequence = ++appendedSequence;
+        workReady.notify_one();
+        return sequence;
+    }
+
+    // Waits until the record with this sequence number has been written;
+    // returns false if it was lost to a write error
+    bool waitDurable(uint64_t sequence) {
+        ScopedTimer timer(TIME_LOG_SYNC);
+        unique_lock<mutex> lock(logMutex);
+        flushed.wait(lock, [this, sequence] { return durableSequence >= sequence; });
+        return sequence < failedSequence;
+    }
+
+    // Waits until everything appended so far is on disk; returns false if
+    // any of it was lost to a write error
+    bool sync() {
+        uint64_t sequence;
+        {
+            lock_guard<mutex> lock(logMutex);
+            sequence = appendedSequence;
+        }
+        return waitDurable(sequence);
+    }
+
+    // Replaces the log with `keep` (usually nothing) through a temporary
+    // file, so a crash leaves either the old log or the new one. Callers must
+    // have persisted the old contents elsewhere. Returns false, leaving the
+    // log as it was, if records were appended after the sync (the caller's
+    // copy may not hold them), a write has failed, or the new file could not
+    // be written. The new file is opened for appending before it replaces the
+    // old one, so the writer always has a handle.
+    bool truncate(const string& keep = string()) {
+        if (!sync()) return false;
+        lock_guard<mutex> lock(logMutex);
+        if (!pending.empty()) return false;
+        string tempPath = path + ".tmp";
+        FILE* replacement = fopen(tempPath.c_str(), "wb");
+        if (!replacement) return false;
+        bool written = fwrite(keep.data(), 1, keep.size(), replacement) == keep.size();
+        written = fclose(replacement) == 0 && written && syncFileToDisk(tempPath);
+        FILE* reopened = written ? fopen(tempPath.c_str(), "ab") : nullptr;
+        if (!reopened || rename(tempPath.c_str(), path.c_str()) != 0) {
+            if (reopened) fclose(reopened);
+            remove(tempPath.c_str());
+            return false;
+        }
+        fclose(file);
+        file = reopened;
+        fileBytes = keep.size();
+        return true;
+    }
+
+    uint64_t size() {
+        lock_guard<mutex> lock(logMutex);
+        return fileBytes;
+    }
+
+    bool isOpen() const { return writer.joinable(); }
+
+    // Drains pending records, then stops the writer
+    void close() {
+        if (!writer.joinable()) return;
+        {
+            lock_guard<mutex> lock(logMutex);
+            stopping = true;
+        }
+        workReady.notify_one();
+        writer.join();
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+};
+
+// Write-ahead log of catalog mutations (catalog_journal.log)
+// Stock, price and rating changes are appended as fixed-size records holding
+// the book's new value rather than a difference, so replaying the log over the
+// base catalog is idempotent: records already reflected in book_data.txt /
+// book_data.bin just set the same value again. A torn record at the tail (from
+// a crash mid-write) fails its checksum and ends the replay.
+class CatalogJournal {
+public:
+    enum RecordType : uint32_t {
+        STOCK = 1,  // count = new stock quantity
+        PRICE = 2,  // value = new price
+        RATING = 3, // count = RatingTally word
+        RETURNS = 4 // count = ReturnLedger sequence through which restocks are applied
+    };
+
+    struct Record {
+        uint32_t type;
+        int32_t bookID;
+        int64_t count;
+        double value;
+        uint64_t checksum;
+    };
+
+    // Base files are rewritten once the log passes this size
+    static const uint64_t COMPACT_AFTER_BYTES = 4 << 20;
+private:
+    GroupCommitLog log;
+    uint64_t returnsRestocked;
+
+    static uint64_t checksumOf(const Record& record) {
+        return snapshotChecksum(reinterpret_cast<const char*>(&record), offsetof(Record, checksum));
+    }
+
+    static Record makeRecord(uint32_t type, int bookID, int64_t count, double value) {
+        Record record = {};
+        record.type = type;
+        record.bookID = bookID;
+        record.count = count;
+        record.value = value;
+        record.checksum = checksumOf(record);
+        return record;
+    }
+
+    void append(uint32_t type, int bookID, int64_t count, double value) {
+        Record record = makeRecord(type, bookID, count, value);
+        log.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+public:
+    CatalogJournal() : returnsRestocked(0) {}
+
+    // Replays the log into the catalog, drops any torn tail, then opens the
+    // log for appending. Returns false if the log cannot be opened.
+    bool open(const string& path, Catalog& catalog) {
+        returnsRestocked = 0;
+        size_t validBytes = 0;
+        {
+            MappedFile existing;
+            if (existing.open(path)) {
+                const char* data = existing.data();
+                while (validBytes + sizeof(Record) <= existing.size()) {
+                    Record record;
+                    memcpy(&record, data + validBytes, sizeof(record));
+                    if (record.checksum != checksumOf(record)) break;
+                    switch (record.type) {
+                        case STOCK:
+                            catalog.setStockQuantity(record.bookID, static_cast<int>(record.count));
+                            break;
+                        case PRICE:
+                            catalog.setPrice(record.bookID, record.value);
+                            break;
+                        case RATING:
+                            catalog.raiseRating(record.bookID, static_cast<uint64_t>(record.count));
+                            break;
+                        case RETURNS:
+                            returnsRestocked = max(returnsRestocked, static_cast<uint64_t>(record.count));
+                            break;
+                    }
+                    validBytes += sizeof(Record);
+                }
+                if (validBytes != existing.size()) {
+                    existing.close();
+                    error_code error;
+                    filesystem::resize_file(path, validBytes, error);
+                }
+            }
+        }
+        return log.open(path);
+    }
+
+    void recordStock(int bookID, int stock) { append(STOCK, bookID, stock, 0.0); }
+    void recordPrice(int bookID, double price) { append(PRICE, bookID, 0, price); }
+    void recordRating(int bookID, uint64_t ratingTally) { append(RATING, bookID, static_cast<int64_t>(ratingTally), 0.0); }
+
+    // Marks every return up to this ReturnLedger sequence as restocked; must
+    // follow their STOCK records
+    void recordReturnsRestocked(uint64_t sequence) {
+        returnsRestocked = sequence;
+        append(RETURNS, 0, static_cast<int64_t>(sequence), 0.0);
+    }
+
+    uint64_t restockedReturns() const { return returnsRestocked; }
+
+    // Waits until every record so far is durable (one fsync per batch); false
+    // if a write failed
+    bool commit() { return log.sync(); }
+
+    bool needsCompaction() { return log.size() >= COMPACT_AFTER_BYTES; }
+
+    // Empties the log once the base files hold everything in it. The return
+    // mark is carried over, since the base files do not record it. Returns
+    // false if the log was kept (see GroupCommitLog::truncate).
+    bool reset() {
+        string keep;
+        if (returnsRestocked > 0) {
+            Record mark = makeRecord(RETURNS, 0, static_cast<int64_t>(returnsRestocked), 0.0);
+            keep.assign(reinterpret_cast<const char*>(&mark), sizeof(mark));
+        }
+        return log.truncate(keep);
+    }
+};
+
+static_assert(sizeof(CatalogJournal::Record) == 32, "journal record layout changed");
+
+// One purchased line of an order
+struct OrderItem {
+    int bookID;
+    int quantity;
+    int64_t priceCents; // Unit price
+    string title;
+    string author;
+};
+
+// One placed order as stored in the order journal
+struct OrderRecord {
+    uint64_t orderID;
+    int64_t placedAt;  // time_t
+    int accountID;     // User::getId() of the account that ordered
+    int buyerNumber;   // Buyer ID entered at checkout
+    string name;
+    string address;
+    int64_t totalCents; // Amount paid after discounts
+    vector<OrderItem> items;
+};
+
+// Criteria for an order history query
+// Orders placed within [from, to] (time_t, inclusive) are listed newest
+// first; the first `skip` of them are passed over and at most `limit` are
+// returned, so page p of size n is skip = p * n, limit = n.
+struct OrderQuery {
+    int64_t from;
+    int64_t to;
+    size_t skip;
+    size_t limit;
+
+    OrderQuery()
+        : from(numeric_limits<int64_t>::min()), to(numeric_limits<int64_t>::max()), skip(0), limit(10) {}
+};
+
+// Time-ordered index of each account's orders
+// Every account keeps a vector of (time placed, journal offset) sorted by
+// time. Orders arrive in time order, so adding is an append; a query finds
+// the ends of its date range by binary search and then walks only the rows
+// it returns: O(log n + k) for an account with n orders and a page of k.
+class OrderHistoryIndex {
+public:
+    struct Entry {
+        int64_t placedAt;
+        uint64_t offset;
+    };
+private:
+    unordered_map<int, vector<Entry>> entriesByAccount;
+
+    static bool placedBefore(const Entry& entry, int64_t time) { return entry.placedAt < time; }
+    static bool placedAfter(int64_t time, const Entry& entry) { return time < entry.placedAt; }
+public:
+    void clear() { entriesByAccount.clear(); }
+
+    void reserve(int accountID, size_t count) { entriesByAccount[accountID].reserve(count); }
+
+    void add(int accountID, int64_t placedAt, uint64_t offset) {
+        vector<Entry>& entries = entriesByAccount[accountID];
+        Entry entry = { placedAt, offset };
+        if (entries.empty() || entries.back().placedAt <= placedAt) {
+            entries.push_back(entry);
+        } else {
+            // Clock stepped back; keep the vector sorted
+            entries.insert(upper_bound(entries.begin(), entries.end(), placedAt, placedAfter), entry);
+        }
+    }
+
+    size_t count(int accountID) const {
+        auto it = entriesByAccount.find(accountID);
+        return it == entriesByAccount.end() ? 0 : it->second.size();
+    }
+
+    // Journal offsets of the orders the query selects, newest first. The
+    // number of orders in the date range is stored in `matching` if given.
+    vector<uint64_t> query(int accountID, const OrderQuery& query, size_t* matching = nullptr) const {
+        vector<uint64_t> offsets;
+        if (matching) *matching = 0;
+        auto it = entriesByAccount.find(accountID);
+        if (it == entriesByAccount.end() || query.from > query.to) return offsets;
+        const vector<Entry>& entries = it->second;
+        auto first = lower_bound(entries.begin(), entries.end(), query.from, placedBefore);
+        auto last = upper_bound(first, entries.end(), query.to, placedAfter);
+        size_t inRange = static_cast<size_t>(last - first);
+        if (matching) *matching = inRange;
+        if (query.skip >= inRange) return offsets;
+        size_t take = min(query.limit, inRange - query.skip);
+        offsets.reserve(take);
+        for (auto entry = last - static_cast<ptrdiff_t>(query.skip); take > 0; take--) {
+            --entry;
+            offsets.push_back(entry->offset);
+        }
+        return offsets;
+    }
+};
+
+// Append-only journal of every order (orders.log)
+// Records are length-prefixed binary with a checksum, written through a
+// GroupCommitLog so concurrent checkouts share one fsync. An in-memory
+// OrderHistoryIndex maps each account to the file offsets of its orders, so
+// a page of history costs one seek per order returned instead of a scan.
+// open() rebuilds the index from the file and drops a torn tail.
+class OrderJournal {
+private:
+    // Fixed part of a record; followed by name, address, the items and a
+    // trailing checksum of everything before it
+    struct Header {
+        uint32_t length; // Whole record in bytes, checksum included
+        uint32_t itemCount;
+        uint64_t orderID;
+        int64_t placedAt;
+        int32_t accountID;
+        int32_t buyerNumber;
+        int64_t totalCents;
+        uint16_t nameLength;
+        uint16_t addressLength;
+        uint32_t reserved;
+    };
+
+    struct ItemHeader {
+        int32_t bookID;
+        int32_t quantity;
+        int64_t priceCents;
+        uint16_t titleLength;
+        uint16_t authorLength;
+        uint32_t reserved;
+    };
+
+    string path;
+    GroupCommitLog log;
+    mutex indexMutex;
+    OrderHistoryIndex index;
+    vector<uint64_t> offsetByID; // Entry orderID - 1; NO_OFFSET for IDs not in the journal
+    uint64_t nextOrderID;
+    uint64_t orderCount;
+
+    static constexpr uint64_t NO_OFFSET = UINT64_MAX;
+
+    void indexOrderID(uint64_t orderID, uint64_t offset) {
+        if (orderID == 0) return;
+        if (offsetByID.size() < orderID) offsetByID.resize(orderID, NO_OFFSET);
+        offsetByID[orderID - 1] = offset;
+    }
+
+    // Reads and decodes the record at `offset`; false if it is missing or corrupt
+    static bool readAt(ifstream& in, uint64_t offset, string& buffer, OrderRecord& order) {
+        Header header;
+        in.clear();
+        in.seekg(static_cast<streamoff>(offset));
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || header.length < sizeof(header) + sizeof(uint64_t)) return false;
+        buffer.resize(header.length);
+        memcpy(&buffer[0], &header, sizeof(header));
+        if (!in.read(&buffer[sizeof(header)], header.length - sizeof(header))) return false;
+        return decode(buffer.data(), buffer.size(), &order) > 0;
+    }
+
+    static void put(string& out, const void* data, size_t size) {
+        out.append(static_cast<const char*>(data), size);
+    }
+
+    static void putText(string& out, const string& text, uint16_t length) {
+        out.append(text.data(), length);
+    }
+
+    static string encode(const OrderRecord& order) {
+        string out;
+        Header header = {};
+        header.itemCount = static_cast<uint32_t>(order.items.size());
+        header.orderID = order.orderID;
+        header.placedAt = order.placedAt;
+        header.accountID = order.accountID;
+        header.buyerNumber = order.buyerNumber;
+        header.totalCents = order.totalCents;
+        header.nameLength = static_cast<uint16_t>(min<size_t>(order.name.size(), UINT16_MAX));
+        header.addressLength = static_cast<uint16_t>(min<size_t>(order.address.size(), UINT16_MAX));
+        put(out, &header, sizeof(header));
+        putText(out, order.name, header.nameLength);
+        putText(out, order.address, header.addressLength);
+        for (const auto& item : order.items) {
+            ItemHeader itemHeader = {};
+            itemHeader.bookID = item.bookID;
+            itemHeader.quantity = item.quantity;
+            itemHeader.priceCents = item.priceCents;
+            itemHeader.titleLength = static_cast<uint16_t>(min<size_t>(item.title.size(), UINT16_MAX));
+            itemHeader.authorLength = static_cast<uint16_t>(min<size_t>(item.author.size(), UINT16_MAX));
+            put(out, &itemHeader, sizeof(itemHeader));
+            putText(out, item.title, itemHeader.titleLength);
+            putText(out, item.author, itemHeader.authorLength);
+        }
+        uint32_t length = static_cast<uint32_t>(out.size() + sizeof(uint64_t));
+        memcpy(&out[0], &length, sizeof(length));
+        uint64_t checksum = snapshotChecksum(out.data(), out.size());
+        put(out, &checksum, sizeof(checksum));
+        return out;
+    }
+
+    // Parses the record at data[0..available); returns its length, or 0 if
+    // it is incomplete or corrupt
+    static size_t decode(const char* data, size_t available, OrderRecord* order) {
+        Header header;
+        if (available < sizeof(header) + sizeof(uint64_t)) return 0;
+        memcpy(&header, data, sizeof(header));
+        if (header.length < sizeof(header) + sizeof(uint64_t) || header.length > available) return 0;
+        uint64_t checksum;
+        memcpy(&checksum, data + header.length - sizeof(checksum), sizeof(checksum));
+        if (checksum != snapshotChecksum(data, header.length - sizeof(checksum))) return 0;
+        if (!order) return header.length;
+
+        const char* end = data + header.length - sizeof(checksum);
+        const char* cursor = data + sizeof(header);
+        auto takeText = [&](uint16_t length, string& text) {
+            if (static_cast<size_t>(end - cursor) < length) return false;
+            text.assign(cursor, length);
+            cursor += length;
+            return true;
+        };
+        order->orderID = header.orderID;
+        order->placedAt = header.placedAt;
+        order->accountID = header.accountID;
+        order->buyerNumber = header.buyerNumber;
+        order->totalCents = header.totalCents;
+        order->items.clear();
+        if (!takeText(header.nameLength, order->name) || !takeText(header.addressLength, order->address)) return 0;
+        for (uint32_t i = 0; i < header.itemCount; i++) {
+            ItemHeader itemHeader;
+            if (static_cast<size_t>(end - cursor) < sizeof(itemHeader)) return 0;
+            memcpy(&itemHeader, cursor, sizeof(itemHeader));
+            cursor += sizeof(itemHeader);
+            OrderItem item = { itemHeader.bookID, itemHeader.quantity, itemHeader.priceCents, "", "" };
+            if (!takeText(itemHeader.titleLength, item.title) || !takeText(itemHeader.authorLength, item.author)) return 0;
+            order->items.push_back(move(item));
+        }
+        return header.length;
+    }
+
+    // Like decode() but only collects the book IDs of the record's items
+    static size_t decodeBooks(const char* data, size_t available, vector<int>& bookIDs) {
+        Header header;
+        if (available < sizeof(header) + sizeof(uint64_t)) return 0;
+        memcpy(&header, data, sizeof(header));
+        if (header.length < sizeof(header) + sizeof(uint64_t) || header.length > available) return 0;
+        uint64_t checksum;
+        memcpy(&checksum, data + header.length - sizeof(checksum), sizeof(checksum));
+        if (checksum != snapshotChecksum(data, header.length - sizeof(checksum))) return 0;
+
+        const char* end = data + header.length - sizeof(checksum);
+        const char* cursor = data + sizeof(header) + header.nameLength + header.addressLength;
+        bookIDs.clear();
+        for (uint32_t i = 0; i < header.itemCount; i++) {
+            ItemHeader itemHeader;
+            if (cursor > end || static_cast<size_t>(end - cursor) < sizeof(itemHeader)) return 0;
+            memcpy(&itemHeader, cursor, sizeof(itemHeader));
+            cursor += sizeof(itemHeader) + itemHeader.titleLength + itemHeader.authorLength;
+            bookIDs.push_back(itemHeader.bookID);
+        }
+        return cursor <= end ? header.length : 0;
+    }
+public:
+    OrderJournal() : nextOrderID(1), orderCount(0) {}
+
+    // Indexes the existing journal, drops any torn tail, then opens it for
+    // appending. Returns false if the journal cannot be opened.
+    bool open(const string& journalPath) {
+        path = journalPath;
+        index.clear();
+        offsetByID.clear();
+        nextOrderID = 1;
+        orderCount = 0;
+        size_t validBytes = 0;
+        {
+            MappedFile existing;
+            if (existing.open(path)) {
+                OrderRecord order;
+                size_t length;
+                while ((length = decode(existing.data() + validBytes, existing.size() - validBytes, &order)) > 0) {
+                    index.add(order.accountID, order.placedAt, validBytes);
+                    indexOrderID(order.orderID, validBytes);
+                    nextOrderID = max(nextOrderID, order.orderID + 1);
+                    orderCount++;
+                    validBytes += length;
+                }
+                if (validBytes != existing.size()) {
+                    existing.close();
+                    error_code error;
+                    filesystem::resize_file(path, validBytes, error);
+                }
+            }
+        }
+        return log.open(path);
+    }
+
+    // Assigns the order its ID, appends it and indexes it. The order is on
+    // disk once commit() returns.
+    uint64_t append(OrderRecord& order) {
+        lock_guard<mutex> lock(indexMutex);
+        order.orderID = nextOrderID++;
+        string bytes = encode(order);
+        uint64_t offset;
+        log.append(bytes.data(), bytes.size(), &offset);
+        index.add(order.accountID, order.placedAt, offset);
+        indexOrderID(order.orderID, offset);
+        orderCount++;
+        return order.orderID;
+    }
+
+    // Waits until every order appended so far is durable (one fsync per batch);
+    // false if a write failed
+    bool commit() { return log.sync(); }
+
+    // Orders of one account selected by the query, newest first; the number
+    // in the query's date range is stored in `matching` if given
+    vector<OrderRecord> history(int accountID, const OrderQuery& query, size_t* matching = nullptr) {
+        vector<uint64_t> offsets;
+        {
+            lock_guard<mutex> lock(indexMutex);
+            offsets = index.query(accountID, query, matching);
+        }
+        vector<OrderRecord> orders;
+        if (offsets.empty()) return orders;
+        log.sync(); // Records still queued for the writer are not in the file yet
+        ifstream in(path, ios::binary);
+        string buffer;
+        for (uint64_t offset : offsets) {
+            OrderRecord order;
+            if (readAt(in, offset, buffer, order)) {
+                orders.push_back(move(order));
+            }
+        }
+        return orders;
+    }
+
+    // Looks up orders by ID, reading them in file order; IDs with no order
+    // are left out of `found`
+    void findAll(const vector<uint64_t>& orderIDs, unordered_map<uint64_t, OrderRecord>& found) {
+        vector<pair<uint64_t, uint64_t>> offsets; // offset, orderID
+        {
+            lock_guard<mutex> lock(indexMutex);
+            for (uint64_t orderID : orderIDs) {
+                if (orderID > 0 && orderID <= offsetByID.size() && offsetByID[orderID - 1] != NO_OFFSET) {
+                    offsets.push_back(make_pair(offsetByID[orderID - 1], orderID));
+                }
+            }
+        }
+        if (offsets.empty()) return;
+        sort(offsets.begin(), offsets.end());
+        log.sync();
+        ifstream in(path, ios::binary);
+        string buffer;
+        OrderRecord order;
+        for (const auto& entry : offsets) {
+            if (readAt(in, entry.first, buffer, order)) {
+                found[entry.second] = order;
+            }
+        }
+    }
+
+    // Looks up one order by its ID; false if there is no such order
+    bool find(uint64_t orderID, OrderRecord& order) {
+        unordered_map<uint64_t, OrderRecord> found;
+        findAll({ orderID }, found);
+        if (found.empty()) return false;
+        order = move(found.begin()->second);
+        return true;
+    }
+
+    // Calls visit(bookIDs) with the books of every order, oldest first; only
+    // the item headers are decoded
+    template<class Visit>
+    void forEachBasket(Visit visit) {
+        log.sync();
+        MappedFile file;
+        if (!file.open(path)) return;
+        vector<int> bookIDs;
+        size_t offset = 0, length;
+        while ((length = decodeBooks(file.data() + offset, file.size() - offset, bookIDs)) > 0) {
+            visit(static_cast<const vector<int>&>(bookIDs));
+            offset += length;
+        }
+    }
+
+    size_t countFor(int accountID) {
+        lock_guard<mutex> lock(indexMutex);
+        return index.count(accountID);
+    }
+
+    uint64_t size() {
+        lock_guard<mutex> lock(indexMutex);
+        return orderCount;
+    }
+};
+
+// Time-limited holds on catalog stock
+// reserve() takes copies out of the available stock lock-free (see
+// Catalog::reserveStock) and returns a handle to the hold. The hold is then
+// committed at checkout, released when the shopper drops it, or expired by
+// the reaper thread once its deadline passes, so abandoned carts give their
+// copies back. Each hold's state changes with one compare-and-swap, so
+// exactly one of commit, release and expiry wins. A commit of several holds
+// first moves each to CLAIMING, which release and expiry leave alone and the
+// reaper keeps tracking, so a commit that backs out hands back holds the
+// reaper can still expire. Commits journal the new on-hand count; the commit
+// mutex keeps those records in the same order as the counts they carry.
+class StockReservations {
+public:
+    enum State { HELD, CLAIMING, COMMITTED, RELEASED, EXPIRED };
+
+    struct Hold {
+        int bookID;
+        int quantity;
+        chrono::steady_clock::time_point expiresAt;
+        atomic<int> state;
+
+        Hold(int id, int q, chrono::steady_clock::time_point deadline)
+            : bookID(id), quantity(q), expiresAt(deadline), state(HELD) {}
+    };
+
+    typedef shared_ptr<Hold> Handle;
+private:
+    static const size_t SHARD_COUNT = 16;
+
+    // Live holds for the reaper, spread over shards so reservers rarely meet
+    struct Shard {
+        mutex lock;
+        vector<Handle> holds;
+    };
+
+    Catalog& catalog;
+    CatalogJournal* journal;
+    chrono::milliseconds timeout;
+    Shard shards[SHARD_COUNT];
+    mutex commitMutex;
+    atomic<size_t> nextShard;
+    atomic<uint64_t> expiredCount;
+
+    thread reaper;
+    mutex reaperMutex;
+    condition_variable reaperWake;
+    bool reaperStopping;
+
+    void reaperLoop() {
+        unique_lock<mutex> lock(reaperMutex);
+        while (!reaperStopping) {
+            reaperWake.wait_for(lock, chrono::milliseconds(250));
+            lock.unlock();
+            expireOverdue(chrono::steady_clock::now());
+            lock.lock();
+        }
+    }
+public:
+    // journal may be null (nothing is recorded, e.g. for a scratch catalog)
+    StockReservations(Catalog& c, CatalogJournal* j, chrono::milliseconds holdTimeout)
+        : catalog(c), journal(j), timeout(holdTimeout), nextShard(0), expiredCount(0), reaperStopping(false) {}
+
+    ~StockReservations() { stopReaper(); }
+
+    // Returns a null handle if fewer than `quantity` copies are available
+    Handle reserve(int bookID, int quantity) {
+        if (!catalog.reserveStock(bookID, quantity)) {
+            return nullptr;
+        }
+        Handle hold = make_shared<Hold>(bookID, quantity, chrono::steady_clock::now() + timeout);
+        Shard& shard = shards[nextShard.fetch_add(1, memory_order_relaxed) % SHARD_COUNT];
+        lock_guard<mutex> lock(shard.lock);
+        shard.holds.push_back(hold);
+        return hold;
+    }
+
+    // Gives the copies back unless the hold was already committed or expired
+    void release(const Handle& hold) {
+        int held = HELD;
+        if (hold && hold->state.compare_exchange_strong(held, RELEASED)) {
+            catalog.releaseStock(hold->bookID, hold->quantity);
+        }
+    }
+
+    // Sells every hold or none of them. Returns false, leaving all holds as
+    // they were, if any of them has already expired or been released.
+    bool commit(const vector<Handle>& holds) {
+        size_t claimed = 0;
+        for (; claimed < holds.size(); claimed++) {
+            int held = HELD;
+            if (!holds[claimed]->state.compare_exchange_strong(held, CLAIMING)) break;
+        }
+        if (claimed < holds.size()) {
+            for (size_t i = 0; i < claimed; i++) {
+                holds[i]->state.store(HELD);
+            }
+            return false;
+        }
+        lock_guard<mutex> lock(commitMutex);
+        for (const auto& hold : holds) {
+            int updated;
+            if (catalog.commitStock(hold->bookID, hold->quantity, updated) && journal) {
+                journal->recordStock(hold->bookID, updated);
+            }
+            hold->state.store(COMMITTED);
+        }
+        return true;
+    }
+
+    // Releases every hold whose deadline has passed and forgets finished
+    // holds; returns how many expired
+    size_t expireOverdue(chrono::steady_clock::time_point now) {
+        size_t expired = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.lock);
+            auto keep = remove_if(shard.holds.begin(), shard.holds.end(), [&](const Handle& hold) {
+                int held = HELD;
+                if (hold->expiresAt <= now && hold->state.compare_exchange_strong(held, EXPIRED)) {
+                    catalog.releaseStock(hold->bookID, hold->quantity);
+                    expired++;
+                }
+                int state = hold->state.load();
+                return state != HELD && state != CLAIMING; // Claimed holds may still be handed back
+            });
+            shard.holds.erase(keep, shard.holds.end());
+        }
+        expiredCount += expired;
+        return expired;
+    }
+
+    size_t activeHolds() {
+        size_t count = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.lock);
+            for (const auto& hold : shard.holds) {
+                int state = hold->state.load();
+                count += state == HELD || state == CLAIMING;
+            }
+        }
+        return count;
+    }
+
+    uint64_t expiredHolds() const { return expiredCount; }
+
+    void startReaper() {
+        if (!reaper.joinable()) {
+            reaperStopping = false;
+            reaper = thread(&StockReservations::reaperLoop, this);
+        }
+    }
+
+    void stopReaper() {
+        if (reaper.joinable()) {
+            {
+                lock_guard<mutex> lock(reaperMutex);
+                reaperStopping = true;
+            }
+            reaperWake.notify_all();
+            reaper.join();
+        }
+    }
+};
+
+// One outgoing customer message
+struct Notification {
+    string recipient;
+    string message;
+};
+
+// Destination for batches of notifications; deliver() may be called from
+// several dispatcher threads at once
+class NotificationSink {
+public:
+    virtual ~NotificationSink() {}
+    virtual void deliver(const vector<Notification>& batch) = 0;
+};
+
+// Appends each notification to a local outbox file. A non-zero sendDelay
+// stands in for the round trip to a mail server (paid once per batch) when
+// measuring the dispatcher; the store itself writes at once.
+class FileNotificationSink : public NotificationSink {
+private:
+    string path;
+    chrono::milliseconds sendDelay;
+    mutex fileMutex;
+public:
+    explicit FileNotificationSink(const string& outboxPath, chrono::milliseconds delay = chrono::milliseconds(0))
+        : path(outboxPath), sendDelay(delay) {}
+
+    void deliver(const vector<Notification>& batch) override {
+        if (sendDelay.count() > 0) {
+            this_thread::sleep_for(sendDelay);
+        }
+        string lines;
+        time_t now = time(nullptr);
+        for (const auto& notification : batch) {
+            lines += to_string(now) + "\t" + notification.recipient + "\t" + notification.message + "\n";
+        }
+        lock_guard<mutex> lock(fileMutex);
+        ofstream outbox(path, ios::app);
+        outbox << lines;
+    }
+};
+
+// Bounded multi-producer, single-consumer ring of notifications
+// Each cell carries a sequence number that tells producers when it is free and
+// the consumer when it is filled, so producers claim cells with one
+// compare-and-swap on the tail and never take a lock.
+class NotificationRing {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        Notification notification;
+    };
+
+    vector<Cell> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail; // Next cell for producers
+    alignas(64) atomic<size_t> head; // Next cell for the consumer, which alone writes it
+public:
+    // capacity is rounded up to a power of two
+    explicit NotificationRing(size_t capacity) : head(0) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells = vector<Cell>(size);
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+        mask = size - 1;
+        tail.store(0, memory_order_relaxed);
+    }
+
+    // Returns false if the ring is full
+    bool tryPush(Notification& notification) {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.notification = move(notification);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false;
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only; returns false if the ring is empty
+    bool tryPop(Notification& notification) {
+        size_t position = head.load(memory_order_relaxed);
+        Cell& cell = cells[position & mask];
+        if (cell.sequence.load(memory_order_acquire) != position + 1) {
+            return false;
+        }
+        notification = move(cell.notification);
+        cell.sequence.store(position + mask + 1, memory_order_release);
+        head.store(position + 1, memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate number of queued notifications
+    size_t depth() const {
+        size_t produced = tail.load(memory_order_relaxed);
+        size_t consumed = head.load(memory_order_relaxed);
+        return produced > consumed ? produced - consumed : 0;
+    }
+};
+
+// Sends notifications off the caller's thread
+// send() drops the message into one of several rings, each drained by its own
+// dispatcher thread that hands whole batches to the sink. A caller only waits
+// when every ring is full (backpressure), which is counted in the stats. An
+// idle dispatcher sleeps on its lane's condition variable; senders only take
+// the lane mutex to wake one that is asleep. stop() (also run by the
+// destructor) turns later send() calls into direct deliveries, waits for
+// sends already under way to land in a ring, and delivers everything queued
+// before the dispatchers exit, so no message is dropped.
+class NotificationDispatcher {
+public:
+    struct Stats {
+        uint64_t queued;
+        uint64_t delivered;
+        uint64_t batches;
+        uint64_t fullWaits; // Times a sender found every ring full
+        size_t maxDepth;
+    };
+
+    static const size_t BATCH_SIZE = 64;
+private:
+    struct Lane {
+        NotificationRing ring;
+        mutex wakeMutex;
+        condition_variable wake;
+        atomic<bool> sleeping; // Set by the dispatcher before it waits
+        thread dispatcher;
+
+        explicit Lane(size_t capacity) : ring(capacity), sleeping(false) {}
+    };
+
+    unique_ptr<NotificationSink> sink;
+    vector<unique_ptr<Lane>> lanes;
+    atomic<size_t> nextLane;
+    atomic<bool> stopping;      // No new sends go into the rings
+    atomic<bool> closed;        // No send is still pushing; dispatchers exit once drained
+    atomic<size_t> activeSends; // send() calls between their stopping check and their push
+    atomic<uint64_t> queuedCount;
+    atomic<uint64_t> deliveredCount;
+    atomic<uint64_t> batchCount;
+    atomic<uint64_t> fullWaitCount;
+    atomic<size_t> maxDepth;
+
+    void deliver(vector<Notification>& batch) {
+        sink->deliver(batch);
+        deliveredCount += batch.size();
+        batchCount++;
+        batch.clear();
+    }
+
+    void dispatch(Lane& lane) {
+        vector<Notification> batch;
+        batch.reserve(BATCH_SIZE);
+        Notification notification;
+        while (true) {
+            while (batch.size() < BATCH_SIZE && lane.ring.tryPop(notification)) {
+                batch.push_back(move(notification));
+            }
+            if (!batch.empty()) {
+                deliver(batch);
+                continue;
+            }
+            if (closed.load()) {
+                return; // Ring drained after stop(): nothing is left behind
+            }
+            unique_lock<mutex> lock(lane.wakeMutex);
+            lane.sleeping.store(true);
+            // Pairs with the fence in send(): either the sender sees
+            // `sleeping` or this pop sees its message
+            atomic_thread_fence(memory_order_seq_cst);
+            if (lane.ring.tryPop(notification)) {
+                lane.sleeping.store(false);
+                batch.push_back(move(notification));
+                continue;
+            }
+            lane.wake.wait(lock, [this, &lane] { return !lane.sleeping.load() || closed.load(); });
+            lane.sleeping.store(false);
+        }
+    }
+
+    void wakeUp(Lane& lane) {
+        lock_guard<mutex> lock(lane.wakeMutex);
+        lane.sleeping.store(false);
+        lane.wake.notify_one();
+    }
+public:
+    NotificationDispatcher(unique_ptr<NotificationSink> s, size_t dispatchers, size_t capacityPerLane = 1024)
+        : sink(move(s)), nextLane(0), stopping(false), closed(false), activeSends(0), queuedCount(0), deliveredCount(0),
+          batchCount(0), fullWaitCount(0), maxDepth(0) {
+        for (size_t i = 0; i < max<size_t>(1, dispatchers); i++) {
+            lanes.push_back(make_unique<Lane>(capacityPerLane));
+        }
+        for (auto& lane : lanes) {
+            Lane* raw = lane.get();
+            lane->dispatcher = thread([this, raw] { dispatch(*raw); });
+        }
+    }
+
+    ~NotificationDispatcher() { stop(); }
+
+    // Queues a message and returns; safe to call from any thread. After
+    // stop() the message is delivered on the caller's thread instead.
+    void send(const string& recipient, const string& message) {
+        Notification notification = { recipient, message };
+        activeSends++;
+        if (stopping.load()) {
+            activeSends--;
+            vector<Notification> batch(1, move(notification));
+            queuedCount++;
+            deliver(batch);
+            return;
+        }
+        size_t start = nextLane.fetch_add(1, memory_order_relaxed);
+        for (size_t attempt = 0;; attempt++) {
+            Lane& lane = *lanes[(start + attempt) % lanes.size()];
+            if (lane.ring.tryPush(notification)) {
+                activeSends--;
+                queuedCount++;
+                size_t depth = lane.ring.depth();
+                size_t seen = maxDepth.load(memory_order_relaxed);
+                while (depth > seen && !maxDepth.compare_exchange_weak(seen, depth, memory_order_relaxed)) {}
+                atomic_thread_fence(memory_order_seq_cst);
+                if (lane.sleeping.load()) {
+                    wakeUp(lane);
+                }
+                return;
+            }
+            if ((attempt + 1) % lanes.size() == 0) {
+                fullWaitCount++;
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        }
+    }
+
+    // Delivers everything queued so far, then stops the dispatchers
+    void stop() {
+        if (stopping.exchange(true)) return;
+        // Sends that passed the stopping check finish pushing first; the
+        // dispatchers keep draining meanwhile, so full rings still empty
+        while (activeSends.load() != 0) {
+            this_thread::yield();
+        }
+        closed = true;
+        for (auto& lane : lanes) {
+            wakeUp(*lane);
+        }
+        for (auto& lane : lanes) {
+            lane->dispatcher.join();
+        }
+    }
+
+    Stats stats() const {
+        Stats result = { queuedCount.load(), deliveredCount.load(), batchCount.load(),
+                         fullWaitCount.load(), maxDepth.load() };
+        return result;
+    }
+};
+
+// Per-session memory for carts and wishlists
+// A bump allocator: the first few hundred bytes come from a buffer inside the
+// arena itself, later blocks from the upstream resource, and nothing is freed
+// until the arena is destroyed or reset() returns everything in one shot.
+class SessionArena {
+private:
+    alignas(max_align_t) char inlineBuffer[256];
+    pmr::monotonic_buffer_resource pool;
+public:
+    explicit SessionArena(pmr::memory_resource* upstream = pmr::new_delete_resource())
+        : pool(inlineBuffer, sizeof(inlineBuffer), upstream) {}
+    SessionArena(const SessionArena&) = delete;
+    SessionArena& operator=(const SessionArena&) = delete;
+
+    pmr::memory_resource* resource() { return &pool; }
+
+    // Frees everything at once; containers using the arena must be gone or empty
+    void reset() { pool.release(); }
+};
+
+// One line of a cart
+struct CartLine {
+    int bookID;
+    int quantity;
+};
+
+// Shopping cart holding book IDs and quantities
+// Adding a book that is already in the cart raises its quantity instead of
+// adding a second line. Titles and prices are looked up in the catalog when
+// the cart is shown or checked out.
+class Cart {
+private:
+    pmr::vector<CartLine> lines;
+
+    pmr::vector<CartLine>::iterator find(int bookID) {
+        return find_if(lines.begin(), lines.end(), [bookID](const CartLine& line) { return line.bookID == bookID; });
+    }
+public:
+    explicit Cart(pmr::memory_resource* arena) : lines(arena) {
+        lines.reserve(8);
+    }
+
+    void add(int bookID, int quantity) {
+        if (quantity <= 0) return;
+        auto it = find(bookID);
+        if (it != lines.end()) {
+            it->quantity += quantity;
+        } else {
+            lines.push_back({ bookID, quantity });
+        }
+    }
+
+    bool remove(int bookID) {
+        auto it = find(bookID);
+        if (it == lines.end()) return false;
+        lines.erase(it);
+        return true;
+    }
+
+    // A quantity of zero or less removes the line
+    bool setQuantity(int bookID, int quantity) {
+        auto it = find(bookID);
+        if (it == lines.end()) return false;
+        if (quantity <= 0) {
+            lines.erase(it);
+        } else {
+            it->quantity = quantity;
+        }
+        return true;
+    }
+
+    int quantityOf(int bookID) const {
+        for (const auto& line : lines) {
+            if (line.bookID == bookID) return line.quantity;
+        }
+        return 0;
+    }
+
+    pmr::vector<CartLine>::const_iterator begin() const { return lines.begin(); }
+    pmr::vector<CartLine>::const_iterator end() const { return lines.end(); }
+    size_t size() const { return lines.size(); }
+    bool empty() const { return lines.empty(); }
+    void clear() { lines.clear(); }
+};
+
+// Wishlist holding book IDs, each at most once
+class Wishlist {
+private:
+    pmr::vector<int> bookIDs;
+public:
+    explicit Wishlist(pmr::memory_resource* arena) : bookIDs(arena) {}
+
+    // Returns false if the book is already on the list
+    bool add(int bookID) {
+        if (contains(bookID)) return false;
+        bookIDs.push_back(bookID);
+        return true;
+    }
+
+    bool remove(int bookID) {
+        auto it = std::find(bookIDs.begin(), bookIDs.end(), bookID);
+        if (it == bookIDs.end()) return false;
+        bookIDs.erase(it);
+        return true;
+    }
+
+    bool contains(int bookID) const {
+        return std::find(bookIDs.begin(), bookIDs.end(), bookID) != bookIDs.end();
+    }
+
+    pmr::vector<int>::const_iterator begin() const { return bookIDs.begin(); }
+    pmr::vector<int>::const_iterator end() const { return bookIDs.end(); }
+    size_t size() const { return bookIDs.size(); }
+    bool empty() const { return bookIDs.empty(); }
+};
+
+// Everything a promotion rule may test, gathered once per checkout
+struct CheckoutContext {
+    int64_t subtotalCents;
+    int buyerType;  // As from buyerTypeForId: 1 = Gold, 2 = Diamond, 3 = Ordinary
+    int starLevel;  // Gold members only; 0 otherwise
+    int64_t now;    // time_t
+    vector<int> bookIDs;   // Sorted
+    vector<int> authorIDs; // Sorted; PromotionEngine's interned author IDs
+    vector<pair<int, int64_t>> lineCents; // (book ID, line subtotal)
+    vector<int> lineAuthorIDs;            // Parallel to lineCents
+};
+
+// Coupon and promotion rules (promotions.txt)
+// One rule per line: code|percent or fixed|amount|condition|condition...
+// A code of * makes an automatic promotion that needs no coupon. Conditions:
+//   minspend=30.00  book=12  author=J.R.R. Tolkien  tier=gold|diamond|ordinary
+//   minstars=3  expires=2027-12-31  cap=1000  scope=lines
+// With scope=lines a book/author rule discounts only the matching lines.
+// load() compiles the file: coupon codes go into a hash table, conditions into
+// one flat predicate program, and authors are interned so conditions compare
+// integers. Usage caps are atomic counters, so concurrent checkouts can never
+// redeem a capped rule more often than allowed. A scope=lines percentage
+// comes off the matching lines at the same point a whole-cart percentage
+// comes off the cart, so 10% off every line prices the same as 10% off.
+class PromotionEngine {
+public:
+    enum Opcode : uint8_t { MIN_SPEND, HAS_BOOK, HAS_AUTHOR, BUYER_TIER, MIN_STARS, NOT_AFTER };
+
+    struct Instruction {
+        Opcode op;
+        int64_t operand;
+    };
+
+    struct Rule {
+        string code;       // Empty for automatic promotions
+        bool percent;      // Otherwise a fixed amount
+        int64_t amount;    // Basis points or cents
+        bool linesOnly;    // Discount only lines matching the book/author conditions
+        uint32_t programBegin;
+        uint32_t programEnd;
+        int64_t cap;       // Maximum redemptions; -1 = unlimited
+        string source;     // The rule's line, which keys its usage count
+    };
+private:
+    vector<Rule> rules;
+    vector<Instruction> program;
+    unordered_map<string, vector<uint32_t>> rulesByCode;
+    vector<uint32_t> automaticRules;
+    unordered_map<string, int> authorIDs;
+    unique_ptr<atomic<int64_t>[]> uses;
+    GroupCommitLog usageLog; // Open once openUsage() has been called
+
+    void logUse(uint32_t index, int delta) {
+        if (!usageLog.isOpen()) return;
+        string record = to_string(delta) + '\t' + rules[index].source + '\n';
+        usageLog.append(record.data(), record.size());
+    }
+
+    static string upper(string text) {
+        transform(text.begin(), text.end(), text.begin(), [](char c) { return static_cast<char>(toupper(static_cast<unsigned char>(c))); });
+        return text;
+    }
+
+    static string lower(string text) {
+        transform(text.begin(), text.end(), text.begin(), foldCase);
+        return text;
+    }
+
+    // Returns false (and leaves the rule half-built) if a field is malformed
+    bool compile(const string& line, Rule& rule) {
+        vector<string> fields;
+        string field;
+        istringstream in(line);
+        while (getline(in, field, '|')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 3 || (fields[1] != "percent" && fields[1] != "fixed")) return false;
+        rule.code = fields[0] == "*" ? "" : upper(fields[0]);
+        rule.percent = fields[1] == "percent";
+        double amount = atof(fields[2].c_str());
+        if (amount <= 0.0) return false;
+        rule.amount = rule.percent ? llround(amount * 100.0) : Money::fromDouble(amount).getCents();
+        rule.linesOnly = false;
+        rule.cap = -1;
+        rule.source = line;
+        rule.programBegin = static_cast<uint32_t>(program.size());
+        for (size_t i = 3; i < fields.size(); i++) {
+            size_t equals = fields[i].find('=');
+            if (equals == string::npos) return false;
+            string key = fields[i].substr(0, equals);
+            string value = fields[i].substr(equals + 1);
+            if (key == "minspend") {
+                program.push_back({ MIN_SPEND, Money::fromDouble(atof(value.c_str())).getCents() });
+            } else if (key == "book") {
+                program.push_back({ HAS_BOOK, atoll(value.c_str()) });
+            } else if (key == "author") {
+                auto interned = authorIDs.emplace(lower(value), static_cast<int>(authorIDs.size()));
+                program.push_back({ HAS_AUTHOR, interned.first->second });
+            } else if (key == "tier") {
+                int tier = value == "gold" ? GoldTier::TYPE : value == "diamond" ? DiamondTier::TYPE
+                         : value == "ordinary" ? OrdinaryTier::TYPE : 0;
+                if (tier == 0) return false;
+                program.push_back({ BUYER_TIER, tier });
+            } else if (key == "minstars") {
+                program.push_back({ MIN_STARS, atoll(value.c_str()) });
+            } else if (key == "expires") {
+                tm date = {};
+                istringstream dateIn(value);
+                dateIn >> get_time(&date, "%Y-%m-%d");
+                if (dateIn.fail()) return false;
+                date.tm_isdst = -1;
+                program.push_back({ NOT_AFTER, static_cast<int64_t>(mktime(&date)) + 24 * 60 * 60 - 1 });
+            } else if (key == "cap") {
+                rule.cap = atoll(value.c_str());
+            } else if (key == "scope") {
+                rule.linesOnly = value == "lines";
+            } else {
+                return false;
+            }
+        }
+        rule.programEnd = static_cast<uint32_t>(program.size());
+        return true;
+    }
+
+    bool passes(const Rule& rule, const CheckoutContext& context) const {
+        for (uint32_t pc = rule.programBegin; pc < rule.programEnd; pc++) {
+            const Instruction& instruction = program[pc];
+            bool ok;
+            switch (instruction.op) {
+                case MIN_SPEND: ok = context.subtotalCents >= instruction.operand; break;
+                case HAS_BOOK: ok = binary_search(context.bookIDs.begin(), context.bookIDs.end(), static_cast<int>(instruction.operand)); break;
+                case HAS_AUTHOR: ok = binary_search(context.authorIDs.begin(), context.authorIDs.end(), static_cast<int>(instruction.operand)); break;
+                case BUYER_TIER: ok = context.buyerType == instruction.operand; break;
+                case MIN_STARS: ok = context.starLevel >= instruction.operand; break;
+                case NOT_AFTER: ok = context.now <= instruction.operand; break;
+                default: ok = false;
+            }
+            if (!ok) return false;
+        }
+        return true;
+    }
+public:
+    // Replaces all rules with those in the file; returns the number loaded
+    // (0 if the file is missing). Malformed lines are reported and skipped.
+    size_t load(const string& path) {
+        ifstream in(path);
+        vector<string> lines;
+        string line;
+        while (getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty() && line[0] != '#') lines.push_back(line);
+        }
+        return compileAll(lines);
+    }
+
+    size_t compileAll(const vector<string>& lines) {
+        rules.clear();
+        program.clear();
+        rulesByCode.clear();
+        automaticRules.clear();
+        authorIDs.clear();
+        for (const auto& line : lines) {
+            Rule rule;
+            if (!compile(line, rule)) {
+                program.resize(rules.empty() ? 0 : rules.back().programEnd);
+                cout << "Skipping malformed promotion rule: " << line << "\n";
+                continue;
+            }
+            uint32_t index = static_cast<uint32_t>(rules.size());
+            if (rule.code.empty()) {
+                automaticRules.push_back(index);
+            } else {
+                rulesByCode[rule.code].push_back(index);
+            }
+            rules.push_back(move(rule));
+        }
+        uses.reset(new atomic<int64_t>[rules.size()]);
+        for (size_t i = 0; i < rules.size(); i++) {
+            uses[i].store(0, memory_order_relaxed);
+        }
+        return rules.size();
+    }
+
+    size_t size() const { return rules.size(); }
+    const Rule& rule(uint32_t index) const { return rules[index]; }
+
+    // Interned ID of a lowercase author name, or -1 if no rule mentions it
+    int authorID(const string& lowercaseAuthor) const {
+        auto it = authorIDs.find(lowercaseAuthor);
+        return it == authorIDs.end() ? -1 : it->second;
+    }
+
+    // Every rule that applies: all automatic promotions whose conditions hold,
+    // plus the rules behind each entered code whose conditions hold
+    vector<uint32_t> evaluate(const CheckoutContext& context, const vector<string>& codes) const {
+        vector<uint32_t> matched;
+        for (uint32_t index : automaticRules) {
+            if (passes(rules[index], context)) matched.push_back(index);
+        }
+        for (const auto& code : codes) {
+            auto it = rulesByCode.find(upper(code));
+            if (it == rulesByCode.end()) continue;
+            for (uint32_t index : it->second) {
+                if (passes(rules[index], context) && find(matched.begin(), matched.end(), index) == matched.end()) {
+                    matched.push_back(index);
+                }
+            }
+        }
+        return matched;
+    }
+
+    // Counts one use; returns false if the rule's cap is already reached
+    bool redeem(uint32_t index) {
+        int64_t cap = rules[index].cap;
+        int64_t current = uses[index].load(memory_order_relaxed);
+        do {
+            if (cap >= 0 && current >= cap) return false;
+        } while (!uses[index].compare_exchange_weak(current, current + 1, memory_order_acq_rel));
+        logUse(index, 1);
+        return true;
+    }
+
+    // Gives back uses redeemed by a checkout that then failed
+    void unredeem(const vector<uint32_t>& applied) {
+        for (uint32_t index : applied) {
+            uses[index].fetch_sub(1, memory_order_acq_rel);
+            logUse(index, -1);
+        }
+    }
+
+    int64_t usesOf(uint32_t index) const { return uses[index].load(memory_order_relaxed); }
+
+    // Adds the redeemed rules' discounts to the last cart of the batch
+    void addDiscounts(uint32_t index, const CheckoutContext& context, PricingBatch& batch) const {
+        const Rule& rule = rules[index];
+        if (!rule.linesOnly) {
+            if (rule.percent) {
+                batch.addPercentCoupon(rule.amount);
+            } else {
+                batch.addFixedCoupon(Money::fromCents(rule.amount));
+            }
+            return;
+        }
+        // Only lines whose book/author the rule names
+        Money matching;
+        for (size_t i = 0; i < context.lineCents.size(); i++) {
+            bool named = false;
+            for (uint32_t pc = rule.programBegin; pc < rule.programEnd; pc++) {
+                const Instruction& instruction = program[pc];
+                named = named || (instruction.op == HAS_BOOK && instruction.operand == context.lineCents[i].first)
+                              || (instruction.op == HAS_AUTHOR && instruction.operand == context.lineAuthorIDs[i]);
+            }
+            if (named) matching += Money::fromCents(context.lineCents[i].second);
+        }
+        if (rule.percent) {
+            batch.addLinePercentCoupon(matching, rule.amount);
+        } else {
+            batch.addFixedCoupon(min(matching, Money::fromCents(rule.amount)));
+        }
+    }
+
+    // Usage counts survive restarts in a journal keyed by each rule's line:
+    // "count<TAB>rule" records whose counts are summed, so each redemption
+    // appends "1" (and each unredeem "-1") instead of rewriting the file.
+    // Opening folds the journal into one total per rule; returns false if
+    // the journal could not be opened, leaving counts in memory only.
+    bool openUsage(const string& path) {
+        ifstream in(path);
+        string line;
+        unordered_map<string, int64_t> counts;
+        while (getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab != string::npos) counts[line.substr(tab + 1)] += atoll(line.c_str());
+        }
+        in.close();
+        string totals;
+        for (size_t i = 0; i < rules.size(); i++) {
+            auto it = counts.find(rules[i].source);
+            int64_t count = it == counts.end() ? 0 : max<int64_t>(it->second, 0);
+            uses[i].store(count, memory_order_relaxed);
+            if (count > 0) totals += to_string(count) + '\t' + rules[i].source + '\n';
+        }
+        if (!usageLog.open(path)) return false;
+        if (!usageLog.truncate(totals)) {
+            cout << "Could not compact " << path << ". It is kept as it is.\n";
+        }
+        return true;
+    }
+};
+
+// One customer review; the rating is kept in hundredths of a star
+struct Review {
+    int64_t postedAt; // time_t
+    int bookID;
+    int ratingHundredths;
+    string username;
+    string text;
+
+    double getRating() const { return ratingHundredths / 100.0; }
+};
+
+// Aggregates of one book's reviews, maintained as reviews are written
+struct ReviewSummary {
+    uint64_t histogram[5];       // Reviews per star, ratings rounded to the nearest star
+    uint64_t count;
+    uint64_t sumHundredths;
+    uint64_t recentCount;        // Within the last ReviewStore::RECENT_DAYS days
+    uint64_t recentSumHundredths;
+
+    double average() const { return count == 0 ? 0.0 : sumHundredths / 100.0 / count; }
+    double recentAverage() const { return recentCount == 0 ? 0.0 : recentSumHundredths / 100.0 / recentCount; }
+};
+
+// Review log (reviews.txt.0, reviews.txt.1, ...)
+// Reviews are appended as "time|bookID|rating|username|text" lines to the
+// newest segment; a new segment starts once it passes segmentBytes, so no
+// file grows without bound. For every book the store keeps the file location
+// of each review, bucketed by star and oldest first, plus a star histogram,
+// an exact rating sum and a ring of per-day sums for the recent-window
+// average. All of these are updated on write, so a book's summary is O(1) to
+// read and its top k reviews (most stars first, newest first within a star)
+// are k direct reads, never a scan. open() rebuilds the index from the
+// segments and drops a torn last line.
+class ReviewStore {
+public:
+    static const int RECENT_DAYS = 30;
+    static const uint64_t DEFAULT_SEGMENT_BYTES = uint64_t(64) << 20;
+private:
+    static const int OFFSET_BITS = 40; // Location = segment << OFFSET_BITS | byte offset
+
+    // Ratings posted on one day; a write touches a single slot
+    struct DaySlot {
+        int32_t day; // Day number the slot holds, -1 if none
+        uint32_t sumHundredths;
+        uint32_t count;
+    };
+
+    struct BookReviews {
+        vector<uint64_t> byStars[5];
+        uint64_t sumHundredths;
+        DaySlot days[RECENT_DAYS];
+
+        BookReviews() : sumHundredths(0) {
+            fill(begin(days), end(days), DaySlot{ -1, 0, 0 });
+        }
+    };
+
+    unordered_map<int, BookReviews> books;
+    mutable shared_mutex indexLock;
+    mutable mutex fileMutex;
+    string basePath;
+    uint64_t segmentBytes;
+    uint32_t activeSegment;
+    uint64_t activeSize;
+    FILE* active;
+    mutable bool unflushed;
+    mutable vector<int> readers; // Read descriptors by segment, opened on first use
+    uint64_t reviewCount;
+
+    string segmentPath(uint32_t segment) const { return basePath + "." + to_string(segment); }
+
+    static int starBucket(int ratingHundredths) { return max(1, min(5, (ratingHundredths + 50) / 100)) - 1; }
+
+    void index(const Review& review, uint64_t location) {
+        reviewCount++;
+        BookReviews& book = books[review.bookID];
+        book.byStars[starBucket(review.ratingHundredths)].push_back(location);
+        book.sumHundredths += static_cast<uint64_t>(review.ratingHundredths);
+        int32_t day = static_cast<int32_t>(review.postedAt / 86400);
+        DaySlot& slot = book.days[day % RECENT_DAYS];
+        if (day < slot.day) return; // Older than the window already
+        if (day > slot.day) {
+            slot = DaySlot{ day, 0, 0 };
+        }
+        slot.sumHundredths += static_cast<uint32_t>(review.ratingHundredths);
+        slot.count++;
+    }
+
+    // Parses one line without its newline; false if it is malformed. With
+    // withText false only the numeric fields are filled in.
+    static bool parse(string_view line, Review& review, bool withText = true) {
+        size_t fields[4];
+        size_t start = 0;
+        for (int i = 0; i < 4; i++) {
+            fields[i] = line.find('|', start);
+            if (fields[i] == string_view::npos) return false;
+            start = fields[i] + 1;
+        }
+        const char* text = line.data();
+        auto posted = from_chars(text, text + fields[0], review.postedAt);
+        auto book = from_chars(text + fields[0] + 1, text + fields[1], review.bookID);
+        auto rating = from_chars(text + fields[1] + 1, text + fields[2], review.ratingHundredths);
+        if (posted.ec != errc() || book.ec != errc() || rating.ec != errc()
+            || review.ratingHundredths < 100 || review.ratingHundredths > 500) {
+            return false;
+        }
+        if (withText) {
+            review.username.assign(text + fields[2] + 1, fields[3] - fields[2] - 1);
+            review.text.assign(text + fields[3] + 1, line.size() - fields[3] - 1);
+        }
+        return true;
+    }
+
+    bool startSegment(uint32_t segment) {
+        if (active) fclose(active);
+        activeSegment = segment;
+        active = fopen(segmentPath(segment).c_str(), "ab");
+        if (!active) return false;
+        fseek(active, 0, SEEK_END);
+        activeSize = static_cast<uint64_t>(ftell(active));
+        return true;
+    }
+
+    bool readAt(uint64_t location, Review& review) const {
+        uint32_t segment = static_cast<uint32_t>(location >> OFFSET_BITS);
+        uint64_t offset = location & ((uint64_t(1) << OFFSET_BITS) - 1);
+        string line;
+#if defined(BOOKSTORE_POSIX)
+        int fd;
+        {
+            lock_guard<mutex> lock(fileMutex);
+            if (unflushed && active) {
+                fflush(active);
+                unflushed = false;
+            }
+            if (readers.size() <= segment) readers.resize(segment + 1, -1);
+            if (readers[segment] < 0) {
+                readers[segment] = ::open(segmentPath(segment).c_str(), O_RDONLY);
+                Metrics::count(COUNT_READER_CACHE_MISSES);
+            } else {
+                Metrics::count(COUNT_READER_CACHE_HITS);
+            }
+            fd = readers[segment];
+        }
+        if (fd < 0) return false;
+        char buffer[512];
+        while (true) {
+            ssize_t got = pread(fd, buffer, sizeof(buffer), static_cast<off_t>(offset + line.size()));
+            if (got <= 0) break;
+            const char* newline = static_cast<const char*>(memchr(buffer, '\n', static_cast<size_t>(got)));
+            line.append(buffer, newline ? static_cast<size_t>(newline - buffer) : static_cast<size_t>(got));
+            if (newline) break;
+        }
+#else
+        {
+            lock_guard<mutex> lock(fileMutex);
+            if (unflushed && active) {
+                fflush(active);
+                unflushed = false;
+            }
+        }
+        ifstream in(segmentPath(segment), ios::binary);
+        in.seekg(static_cast<streamoff>(offset));
+        getline(in, line);
+#endif
+        return parse(line, review);
+    }
+public:
+    ReviewStore()
+        : segmentBytes(DEFAULT_SEGMENT_BYTES), activeSegment(0), activeSize(0), active(nullptr),
+          unflushed(false), reviewCount(0) {}
+    ReviewStore(const ReviewStore&) = delete;
+    ReviewStore& operator=(const ReviewStore&) = delete;
+    ~ReviewStore() { close(); }
+
+    // Indexes every segment of the log at `path` and opens the newest for
+    // appends. Returns false if it cannot be opened.
+    bool open(const string& path, uint64_t maxSegmentBytes = DEFAULT_SEGMENT_BYTES) {
+        close();
+        unique_lock<shared_mutex> lock(indexLock);
+        basePath = path;
+        segmentBytes = maxSegmentBytes;
+        books.clear();
+        reviewCount = 0;
+        uint32_t segment = 0;
+        while (filesystem::exists(segmentPath(segment + 1))) {
+            segment++;
+        }
+        for (uint32_t s = 0; s <= segment; s++) {
+            MappedFile file;
+            if (!file.open(segmentPath(s))) continue;
+            const char* data = file.data();
+            size_t size = file.size();
+            size_t start = 0;
+            Review review;
+            while (start < size) {
+                const char* newline = static_cast<const char*>(memchr(data + start, '\n', size - start));
+                if (!newline) break; // Torn last line
+                size_t end = static_cast<size_t>(newline - data);
+                if (parse(string_view(data + start, end - start), review, false)) {
+                    index(review, (uint64_t(s) << OFFSET_BITS) | start);
+                }
+                start = end + 1;
+            }
+            if (s == segment && start < size) {
+                file.close();
+                error_code error;
+                filesystem::resize_file(segmentPath(s), start, error);
+            }
+        }
+        return startSegment(segment);
+    }
+
+    // Appends a review; call commit() to make it durable. Returns false for a
+    // rating outside 1-5 or a write error.
+    bool add(Review review) {
+        if (review.ratingHundredths < 100 || review.ratingHundredths > 500) return false;
+        for (char& c : review.username) {
+            if (c == '|' || c == '\n') c = ' ';
+        }
+        for (char& c : review.text) {
+            if (c == '|' || c == '\n' || c == '\r') c = ' ';
+        }
+        char head[64];
+        char* end = head;
+        auto field = [&](int64_t value) {
+            end = to_chars(end, head + sizeof(head) - 1, value).ptr; // Leaves room for the '|'
+            *end++ = '|';
+        };
+        field(review.postedAt);
+        field(review.bookID);
+        field(review.ratingHundredths);
+
+        unique_lock<shared_mutex> indexGuard(indexLock);
+        lock_guard<mutex> fileGuard(fileMutex);
+        if (!active) return false;
+        if (activeSize >= segmentBytes) {
+            fflush(active);
+#if defined(BOOKSTORE_POSIX)
+            fsync(fileno(active));
+#endif
+            if (!startSegment(activeSegment + 1)) return false;
+        }
+        uint64_t location = (uint64_t(activeSegment) << OFFSET_BITS) | activeSize;
+        size_t headLength = static_cast<size_t>(end - head);
+        bool written = fwrite(head, 1, headLength, active) == headLength
+                    && fwrite(review.username.data(), 1, review.username.size(), active) == review.username.size()
+                    && fputc('|', active) != EOF
+                    && fwrite(review.text.data(), 1, review.text.size(), active) == review.text.size()
+                    && fputc('\n', active) != EOF;
+        if (!written) return false;
+        activeSize += headLength + review.username.size() + review.text.size() + 2;
+        unflushed = true;
+        index(review, location);
+        return true;
+    }
+
+    // Flushes appended reviews to disk
+    bool commit() {
+        lock_guard<mutex> lock(fileMutex);
+        if (!active) return false;
+        bool flushed = fflush(active) == 0;
+#if defined(BOOKSTORE_POSIX)
+        flushed = flushed && fsync(fileno(active)) == 0;
+#endif
+        unflushed = false;
+        return flushed;
+    }
+
+    ReviewSummary summary(int bookID, int64_t now = static_cast<int64_t>(time(nullptr))) const {
+        ReviewSummary result = {};
+        shared_lock<shared_mutex> lock(indexLock);
+        auto it = books.find(bookID);
+        if (it == books.end()) return result;
+        const BookReviews& book = it->second;
+        for (int star = 0; star < 5; star++) {
+            result.histogram[star] = book.byStars[star].size();
+            result.count += book.byStars[star].size();
+        }
+        result.sumHundredths = book.sumHundredths;
+        int32_t today = static_cast<int32_t>(now / 86400);
+        for (const DaySlot& slot : book.days) {
+            if (slot.day <= today && today - slot.day < RECENT_DAYS) {
+                result.recentCount += slot.count;
+                result.recentSumHundredths += slot.sumHundredths;
+            }
+        }
+        return result;
+    }
+
+    // Up to k reviews: most stars first, newest first within a star
+    vector<Review> top(int bookID, size_t k) const {
+        vector<uint64_t> locations;
+        {
+            shared_lock<shared_mutex> lock(indexLock);
+            auto it = books.find(bookID);
+            if (it == books.end()) return {};
+            for (int star = 4; star >= 0 && locations.size() < k; star--) {
+                const vector<uint64_t>& bucket = it->second.byStars[star];
+                for (size_t i = bucket.size(); i-- > 0 && locations.size() < k;) {
+                    locations.push_back(bucket[i]);
+                }
+            }
+        }
+        vector<Review> reviews;
+        reviews.reserve(locations.size());
+        for (uint64_t location : locations) {
+            Review review;
+            if (readAt(location, review)) reviews.push_back(move(review));
+        }
+        return reviews;
+    }
+
+    uint64_t size() const {
+        shared_lock<shared_mutex> lock(indexLock);
+        return reviewCount;
+    }
+
+    uint32_t segments() const {
+        lock_guard<mutex> lock(fileMutex);
+        return activeSegment + 1;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(fileMutex);
+        if (active) {
+            fflush(active);
+            fclose(active);
+            active = nullptr;
+        }
+        unflushed = false;
+#if defined(BOOKSTORE_POSIX)
+        for (int fd : readers) {
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+        readers.clear();
+    }
+};
+
+// "Customers also bought" from co-purchase counts
+// Each order adds one to the count of every pair of distinct books in it. A
+// book keeps at most SLOTS partner counts: once they are full, a new partner
+// takes over the smallest count plus one (the Space-Saving scheme), so books
+// often bought together cannot be pushed out and memory stays bounded however
+// many pairs appear. rebuild() recounts exactly from the order journal with
+// the books spread over worker threads. Books are sharded so checkouts of
+// different books record without contending.
+class CoPurchaseRecommender {
+public:
+    static constexpr size_t SLOTS = 32;
+    static constexpr size_t MAX_BASKET_BOOKS = 64; // Larger orders count their 64 lowest book IDs
+
+    struct Suggestion {
+        int bookID;
+        uint32_t count; // Orders containing both books (an upper bound once slots were reused)
+    };
+private:
+    struct Partners {
+        int32_t bookIDs[SLOTS];
+        uint32_t counts[SLOTS];
+        uint32_t used = 0;
+
+        void add(int32_t partner) {
+            uint32_t smallest = 0;
+            for (uint32_t i = 0; i < used; i++) {
+                if (bookIDs[i] == partner) {
+                    counts[i]++;
+                    return;
+                }
+                if (counts[i] < counts[smallest]) smallest = i;
+            }
+            if (used < SLOTS) {
+                bookIDs[used] = partner;
+                counts[used++] = 1;
+            } else {
+                bookIDs[smallest] = partner;
+                counts[smallest]++;
+            }
+        }
+    };
+
+    struct Shard {
+        mutex lock;
+        unordered_map<int, Partners> books;
+    };
+
+    static constexpr size_t SHARD_COUNT = 64;
+    unique_ptr<Shard[]> shards;
+    atomic<uint64_t> orderCount;
+
+    Shard& shardFor(int bookID) const { return shards[static_cast<uint32_t>(bookID) % SHARD_COUNT]; }
+
+    // The distinct books of an order, capped at MAX_BASKET_BOOKS
+    static const vector<int>& basketOf(const int* bookIDs, size_t count) {
+        static thread_local vector<int> basket;
+        basket.assign(bookIDs, bookIDs + count);
+        sort(basket.begin(), basket.end());
+        basket.erase(unique(basket.begin(), basket.end()), basket.end());
+        if (basket.size() > MAX_BASKET_BOOKS) basket.resize(MAX_BASKET_BOOKS);
+        return basket;
+    }
+
+    // Exact counts for every book from baskets stored as dense book numbers
+    // (basket b is members[starts[b]..starts[b+1]); ids maps them back).
+    // Each worker takes a run of books, walks the baskets containing each one
+    // and tallies the partners in its own array, so no counts are shared.
+    void recount(const vector<int>& ids, const vector<uint64_t>& starts, const vector<uint32_t>& members,
+                 size_t threads) {
+        size_t bookCount = ids.size();
+        size_t basketCount = starts.size() - 1;
+        vector<uint64_t> firstBasket(bookCount + 1, 0);
+        for (uint32_t book : members) {
+            firstBasket[book + 1]++;
+        }
+        for (size_t b = 0; b < bookCount; b++) {
+            firstBasket[b + 1] += firstBasket[b];
+        }
+        vector<uint32_t> basketsOf(members.size());
+        {
+            vector<uint64_t> fill(firstBasket.begin(), firstBasket.end() - 1);
+            for (size_t basket = 0; basket < basketCount; basket++) {
+                for (uint64_t m = starts[basket]; m < starts[basket + 1]; m++) {
+                    basketsOf[fill[members[m]]++] = static_cast<uint32_t>(basket);
+                }
+            }
+        }
+
+        vector<Partners> fresh(bookCount);
+        atomic<size_t> nextBook(0);
+        auto worker = [&] {
+            const size_t RUN = 256;
+            vector<uint32_t> tally(bookCount, 0);
+            vector<uint32_t> touched;
+            for (size_t begin; (begin = nextBook.fetch_add(RUN)) < bookCount;) {
+                for (size_t book = begin; book < min(begin + RUN, bookCount); book++) {
+                    for (uint64_t i = firstBasket[book]; i < firstBasket[book + 1]; i++) {
+                        uint32_t basket = basketsOf[i];
+                        for (uint64_t m = starts[basket]; m < starts[basket + 1]; m++) {
+                            uint32_t partner = members[m];
+                            if (partner != book && tally[partner]++ == 0) touched.push_back(partner);
+                        }
+                    }
+                    auto better = [&](uint32_t a, uint32_t b) {
+                        return tally[a] != tally[b] ? tally[a] > tally[b] : ids[a] < ids[b];
+                    };
+                    size_t kept = min(touched.size(), SLOTS);
+                    nth_element(touched.begin(), touched.begin() + (kept > 0 ? kept - 1 : 0), touched.end(), better);
+                    Partners& partners = fresh[book];
+                    for (size_t i = 0; i < kept; i++) {
+                        partners.bookIDs[i] = ids[touched[i]];
+                        partners.counts[i] = tally[touched[i]];
+                    }
+                    partners.used = static_cast<uint32_t>(kept);
+                    for (uint32_t partner : touched) {
+                        tally[partner] = 0;
+                    }
+                    touched.clear();
+                }
+            }
+        };
+        vector<thread> pool;
+        for (size_t t = 1; t < threads; t++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : pool) {
+            t.join();
+        }
+
+        vector<unordered_map<int, Partners>> replacement(SHARD_COUNT);
+        for (size_t book = 0; book < bookCount; book++) {
+            replacement[static_cast<uint32_t>(ids[book]) % SHARD_COUNT].emplace(ids[book], fresh[book]);
+        }
+        for (size_t s = 0; s < SHARD_COUNT; s++) {
+            lock_guard<mutex> lock(shards[s].lock);
+            shards[s].books.swap(replacement[s]);
+        }
+    }
+public:
+    CoPurchaseRecommender() : shards(new Shard[SHARD_COUNT]), orderCount(0) {}
+
+    void recordOrder(const int* bookIDs, size_t count) {
+        const vector<int>& basket = basketOf(bookIDs, count);
+        if (basket.size() > 1) {
+            for (int book : basket) {
+                Shard& shard = shardFor(book);
+                lock_guard<mutex> lock(shard.lock);
+                Partners& partners = shard.books[book];
+                for (int other : basket) {
+                    if (other != book) partners.add(other);
+                }
+            }
+        }
+        orderCount++;
+    }
+
+    void recordOrder(const Cart& cart) {
+        vector<int> bookIDs;
+        bookIDs.reserve(cart.size());
+        for (const auto& line : cart) {
+            bookIDs.push_back(line.bookID);
+        }
+        recordOrder(bookIDs.data(), bookIDs.size());
+    }
+
+    // Replaces the counts with ones recomputed from every order in the
+    // journal. Orders recorded while it runs may be lost, so rebuild before
+    // checkouts start. Returns the number of orders read.
+    uint64_t rebuild(OrderJournal& orders, size_t threads = thread::hardware_concurrency()) {
+        vector<int> ids;
+        unordered_map<int, uint32_t> denseIDs;
+        vector<uint64_t> starts(1, 0);
+        vector<uint32_t> members;
+        uint64_t count = 0;
+        orders.forEachBasket([&](const vector<int>& bookIDs) {
+            count++;
+            const vector<int>& basket = basketOf(bookIDs.data(), bookIDs.size());
+            if (basket.size() < 2) return;
+            for (int book : basket) {
+                auto inserted = denseIDs.emplace(book, static_cast<uint32_t>(ids.size()));
+                if (inserted.second) ids.push_back(book);
+                members.push_back(inserted.first->second);
+            }
+            starts.push_back(members.size());
+        });
+        recount(ids, starts, members, max<size_t>(1, threads));
+        orderCount = count;
+        return count;
+    }
+
+    // The k books most often bought together with bookID, most frequent first
+    vector<Suggestion> alsoBought(int bookID, size_t k) const {
+        Partners partners;
+        {
+            Shard& shard = shardFor(bookID);
+            lock_guard<mutex> lock(shard.lock);
+            auto it = shard.books.find(bookID);
+            if (it == shard.books.end()) return {};
+            partners = it->second;
+        }
+        vector<Suggestion> suggestions(partners.used);
+        for (uint32_t i = 0; i < partners.used; i++) {
+            suggestions[i] = { partners.bookIDs[i], partners.counts[i] };
+        }
+        k = min(k, suggestions.size());
+        partial_sort(suggestions.begin(), suggestions.begin() + k, suggestions.end(),
+                     [](const Suggestion& a, const Suggestion& b) {
+                         return a.count != b.count ? a.count > b.count : a.bookID < b.bookID;
+                     });
+        suggestions.resize(k);
+        return suggestions;
+    }
+
+    uint64_t orders() const { return orderCount; }
+
+    // Books with at least one partner
+    size_t books() const {
+        size_t count = 0;
+        for (size_t s = 0; s < SHARD_COUNT; s++) {
+            lock_guard<mutex> lock(shards[s].lock);
+            count += shards[s].books.size();
+        }
+        return count;
+    }
+};
+
+// One return or refund asked for against a placed order
+struct ReturnRequest {
+    string key;        // Idempotency key chosen by the client; a retry reuses it
+    uint64_t orderID;
+    int accountID;     // Account that placed the order
+    int bookID;
+    int quantity;
+    bool restock;      // false: refund only, the copies are not coming back
+};
+
+enum ReturnStatus {
+    RETURN_APPLIED,
+    RETURN_DUPLICATE,     // Key seen before; the first outcome is repeated
+    RETURN_UNKNOWN_ORDER, // No such order for this account
+    RETURN_NOT_IN_ORDER,
+    RETURN_BAD_QUANTITY,  // Zero, negative or more than is left to return
+    RETURN_NOT_SAVED      // The ledger could not be written; nothing was refunded
+};
+
+struct ReturnOutcome {
+    ReturnStatus status;
+    uint64_t sequence;   // Ledger entry; for a duplicate, the original one
+    int64_t refundCents;
+};
+
+// Ledger of returns and refunds (returns.log)
+// Each accepted request is a compensating transaction against its original
+// order, stored as a fixed-size record: the hashed idempotency key, order,
+// book, copies, whether they go back into stock, and the refund. The refund
+// is the copies' share of what the order actually paid, so discounts carry
+// over and an order never refunds more than its total. applyBatch() checks a
+// batch against the order journal, appends its records with one fsync, then
+// restocks through the catalog journal (STOCK records and a RETURNS mark)
+// rather than rewriting the catalog. A key already in the ledger repeats its
+// first outcome and changes nothing. open() restocks the entries past the
+// RETURNS mark, which covers a crash between the two logs.
+class ReturnLedger {
+public:
+    enum Kind : uint32_t {
+        RESTOCK = 1,
+        REFUND_ONLY = 2
+    };
+
+    struct Record {
+        uint64_t sequence; // 1, 2, ... in log order
+        uint64_t keyHigh;
+        uint64_t keyLow;
+        uint64_t orderID;
+        int64_t processedAt;
+        int64_t refundCents;
+        int32_t accountID;
+        int32_t bookID;
+        int32_t quantity;
+        uint32_t kind;
+        uint64_t checksum;
+    };
+private:
+    struct Key {
+        uint64_t high;
+        uint64_t low;
+        bool operator==(const Key& other) const { return high == other.high && low == other.low; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return static_cast<size_t>(key.low); }
+    };
+
+    struct OrderReturns {
+        int64_t refundedCents = 0;
+        vector<pair<int, int>> copies; // bookID, copies returned or refunded so far
+    };
+
+    GroupCommitLog log;
+    mutex ledgerMutex;
+    unordered_map<Key, ReturnOutcome, KeyHash> byKey;
+    unordered_map<uint64_t, OrderReturns> byOrder;
+    uint64_t lastSequence;
+    int64_t refundedTotal;
+
+    static uint64_t checksumOf(const Record& record) {
+        return snapshotChecksum(reinterpret_cast<const char*>(&record), offsetof(Record, checksum));
+    }
+
+    static Key keyOf(const string& text) {
+        return Key{ snapshotChecksum(text.data(), text.size(), 0x243F6A8885A308D3ULL),
+                    snapshotChecksum(text.data(), text.size()) };
+    }
+
+    static int& copiesOf(OrderReturns& returns, int bookID) {
+        for (auto& entry : returns.copies) {
+            if (entry.first == bookID) return entry.second;
+        }
+        returns.copies.push_back(make_pair(bookID, 0));
+        return returns.copies.back().second;
+    }
+
+    void index(const Record& record) {
+        byKey[Key{ record.keyHigh, record.keyLow }] = ReturnOutcome{ RETURN_APPLIED, record.sequence, record.refundCents };
+        OrderReturns& returns = byOrder[record.orderID];
+        returns.refundedCents += record.refundCents;
+        copiesOf(returns, record.bookID) += record.quantity;
+        lastSequence = max(lastSequence, record.sequence);
+        refundedTotal += record.refundCents;
+    }
+
+    // Reverses index() for a record that never reached the disk
+    void unindex(const Record& record) {
+        byKey.erase(Key{ record.keyHigh, record.keyLow });
+        OrderReturns& returns = byOrder[record.orderID];
+        returns.refundedCents -= record.refundCents;
+        copiesOf(returns, record.bookID) -= record.quantity;
+        lastSequence = min(lastSequence, record.sequence - 1);
+        refundedTotal -= record.refundCents;
+    }
+
+    // Checks a request against its order and prices the refund
+    ReturnStatus assess(const ReturnRequest& request, const OrderRecord& order, int64_t& refundCents) {
+        if (order.orderID == 0 || order.accountID != request.accountID) return RETURN_UNKNOWN_ORDER;
+        int64_t subtotalCents = 0, priceCents = 0;
+        int bought = 0;
+        for (const auto& item : order.items) {
+            subtotalCents += item.priceCents * item.quantity;
+            if (item.bookID == request.bookID) {
+                priceCents = item.priceCents;
+                bought += item.quantity;
+            }
+        }
+        if (bought == 0) return RETURN_NOT_IN_ORDER;
+        auto returns = byOrder.find(order.orderID);
+        int returned = 0;
+        int64_t refunded = 0;
+        if (returns != byOrder.end()) {
+            returned = copiesOf(returns->second, request.bookID);
+            refunded = returns->second.refundedCents;
+        }
+        if (request.quantity <= 0 || request.quantity > bought - returned) return RETURN_BAD_QUANTITY;
+        refundCents = subtotalCents > 0
+            ? Money::divideRounded(priceCents * request.quantity * order.totalCents, subtotalCents) : 0;
+        refundCents = max<int64_t>(0, min(refundCents, order.totalCents - refunded));
+        return RETURN_APPLIED;
+    }
+
+    // Puts the copies back and appends their STOCK records, then marks every
+    // entry so far as restocked. The caller commits the catalog journal; if
+    // that fails, open() restocks the same entries again.
+    void recordRestock(const map<int, int>& copies, Catalog& catalog, CatalogJournal& journal) {
+        for (const auto& entry : copies) {
+            if (catalog.adjustStockQuantity(entry.first, entry.second)) {
+                journal.recordStock(entry.first, catalog.findBook(entry.first).getOnHandQuantity());
+            }
+        }
+        journal.recordReturnsRestocked(lastSequence);
+    }
+public:
+    ReturnLedger() : lastSequence(0), refundedTotal(0) {}
+
+    // Indexes the ledger, drops any torn tail, restocks entries the catalog
+    // journal has not marked, then opens the ledger for appending. Returns
+    // false if it cannot be opened.
+    bool open(const string& path, Catalog& catalog, CatalogJournal& journal) {
+        lock_guard<mutex> lock(ledgerMutex);
+        byKey.clear();
+        byOrder.clear();
+        lastSequence = 0;
+        refundedTotal = 0;
+        map<int, int> unrestocked;
+        size_t validBytes = 0;
+        {
+            MappedFile existing;
+            if (existing.open(path)) {
+                while (validBytes + sizeof(Record) <= existing.size()) {
+                    Record record;
+                    memcpy(&record, existing.data() + validBytes, sizeof(record));
+                    if (record.checksum != checksumOf(record)) break;
+                    index(record);
+                    if (record.kind == RESTOCK && record.sequence > journal.restockedReturns()) {
+                        unrestocked[record.bookID] += record.quantity;
+                    }
+                    validBytes += sizeof(Record);
+                }
+                if (validBytes != existing.size()) {
+                    existing.close();
+                    error_code error;
+                    filesystem::resize_file(path, validBytes, error);
+                }
+            }
+        }
+        if (!log.open(path)) return false;
+        if (!unrestocked.empty()) {
+            recordRestock(unrestocked, catalog, journal);
+            journal.commit();
+        }
+        return true;
+    }
+
+    // Applies a batch of requests in order; one outcome per request. The
+    // STOCK records must not interleave with other stock writers' records, so
+    // a shared catalog passes its lock: it is held exclusively only while
+    // those records are appended, never across the order lookup or a sync.
+    vector<ReturnOutcome> applyBatch(const vector<ReturnRequest>& requests, OrderJournal& orders, Catalog& catalog,
+                                     CatalogJournal& journal, shared_mutex* catalogLock = nullptr) {
+        lock_guard<mutex> lock(ledgerMutex);
+        vector<ReturnOutcome> outcomes;
+        outcomes.reserve(requests.size());
+        vector<uint64_t> orderIDs;
+        orderIDs.reserve(requests.size());
+        for (const auto& request : requests) {
+            orderIDs.push_back(request.orderID);
+        }
+        sort(orderIDs.begin(), orderIDs.end());
+        orderIDs.erase(unique(orderIDs.begin(), orderIDs.end()), orderIDs.end());
+        unordered_map<uint64_t, OrderRecord> placed; // The batch's orders, read in one pass
+        orders.findAll(orderIDs, placed);
+        const OrderRecord missing = {};
+        map<int, int> copiesBack;
+        vector<Record> appended;
+        int64_t now = static_cast<int64_t>(time(nullptr));
+        for (const auto& request : requests) {
+            Key key = keyOf(request.key);
+            auto seen = byKey.find(key);
+            if (seen != byKey.end()) {
+                outcomes.push_back(ReturnOutcome{ RETURN_DUPLICATE, seen->second.sequence, seen->second.refundCents });
+                continue;
+            }
+            auto order = placed.find(request.orderID);
+            int64_t refundCents = 0;
+            ReturnStatus status = assess(request, order != placed.end() ? order->second : missing, refundCents);
+            if (status != RETURN_APPLIED) {
+                outcomes.push_back(ReturnOutcome{ status, 0, 0 });
+                continue;
+            }
+            Record record = {};
+            record.sequence = lastSequence + 1;
+            record.keyHigh = key.high;
+            record.keyLow = key.low;
+            record.orderID = request.orderID;
+            record.processedAt = now;
+            record.refundCents = refundCents;
+            record.accountID = request.accountID;
+            record.bookID = request.bookID;
+            record.quantity = request.quantity;
+            record.kind = request.restock ? RESTOCK : REFUND_ONLY;
+            record.checksum = checksumOf(record);
+            log.append(reinterpret_cast<const char*>(&record), sizeof(record));
+            index(record);
+            appended.push_back(record);
+            if (request.restock) copiesBack[request.bookID] += request.quantity;
+            outcomes.push_back(ReturnOutcome{ RETURN_APPLIED, record.sequence, refundCents });
+            Metrics::count(COUNT_RETURNS);
+        }
+        // The refunds are recorded before any copy goes back on sale. If the
+        // ledger cannot be written the batch is forgotten and reported unsaved,
+        // including duplicates of its own entries.
+        if (!appended.empty() && !log.sync()) {
+            for (auto record = appended.rbegin(); record != appended.rend(); ++record) {
+                unindex(*record);
+            }
+            for (auto& outcome : outcomes) {
+                if ((outcome.status == RETURN_APPLIED || outcome.status == RETURN_DUPLICATE)
+                    && outcome.sequence >= appended.front().sequence) {
+                    outcome = ReturnOutcome{ RETURN_NOT_SAVED, 0, 0 };
+                }
+            }
+            return outcomes;
+        }
+        if (!copiesBack.empty()) {
+            {
+                unique_lock<shared_mutex> exclusive;
+                if (catalogLock) exclusive = unique_lock<shared_mutex>(*catalogLock);
+                recordRestock(copiesBack, catalog, journal);
+            }
+            journal.commit();
+        }
+        return outcomes;
+    }
+
+    int64_t refundedCents(uint64_t orderID) {
+        lock_guard<mutex> lock(ledgerMutex);
+        auto returns = byOrder.find(orderID);
+        return returns == byOrder.end() ? 0 : returns->second.refundedCents;
+    }
+
+    int64_t totalRefundedCents() {
+        lock_guard<mutex> lock(ledgerMutex);
+        return refundedTotal;
+    }
+
+    uint64_t size() {
+        lock_guard<mutex> lock(ledgerMutex);
+        return lastSequence;
+    }
+
+    void close() { log.close(); }
+};
+
+static_assert(sizeof(ReturnLedger::Record) == 72, "return record layout changed");
+
+// Message for a return that was not applied
+inline const char* describeReturnStatus(ReturnStatus status) {
+    switch (status) {
+        case RETURN_APPLIED: return "applied";
+        case RETURN_DUPLICATE: return "already applied";
+        case RETURN_UNKNOWN_ORDER: return "order not found";
+        case RETURN_NOT_IN_ORDER: return "book not in that order";
+        case RETURN_BAD_QUANTITY: return "quantity exceeds the copies left to return";
+        case RETURN_NOT_SAVED: return "the return could not be saved, nothing was refunded";
+    }
+    return "unknown";
+}
+
+// SHA-256 (FIPS 180-4), used for password hashing
+class Sha256 {
+private:
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockLength;
+    uint64_t totalLength;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t(chunk[4 * i]) << 24) | (uint32_t(chunk[4 * i + 1]) << 16)
+                 | (uint32_t(chunk[4 * i + 2]) << 8) | uint32_t(chunk[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t INITIAL[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, INITIAL, sizeof(state));
+        blockLength = 0;
+        totalLength = 0;
+    }
+
+    void update(const uint8_t* data, size_t length) {
+        totalLength += length;
+        while (length > 0) {
+            size_t take = min(length, sizeof(block) - blockLength);
+            memcpy(block + blockLength, data, take);
+            blockLength += take;
+            data += take;
+            length -= take;
+            if (blockLength == sizeof(block)) {
+                compress(block);
+                blockLength = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t digest[DIGEST_SIZE]) {
+        uint64_t bits = totalLength * 8;
+        uint8_t padding = 0x80;
+        update(&padding, 1);
+        padding = 0;
+        while (blockLength != 56) {
+            update(&padding, 1);
+        }
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+            digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+            digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+            digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+        }
+    }
+};
+
+// Password cost used for new hashes: 2^cost PBKDF2 iterations. Each step up
+// doubles the work of a login and of every guess against a stolen file.
+const int DEFAULT_PASSWORD_COST = 12;
+
+// Salted password hash: PBKDF2-HMAC-SHA256 over the password with a random
+// 16-byte salt and 2^cost iterations. Only this is stored, never the password.
+struct PasswordHash {
+    static const size_t SALT_SIZE = 16;
+
+    uint8_t salt[SALT_SIZE];
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    uint8_t cost;
+
+    // One 32-byte block of PBKDF2-HMAC-SHA256. The keyed inner and outer
+    // states are computed once, so each iteration costs two compressions.
+    static void derive(const string& password, const uint8_t* salt, int cost, uint8_t out[Sha256::DIGEST_SIZE]) {
+        uint8_t key[64] = {};
+        if (password.size() > sizeof(key)) {
+            Sha256 keyHash;
+            keyHash.update(reinterpret_cast<const uint8_t*>(password.data()), password.size());
+            keyHash.finish(key);
+        } else {
+            memcpy(key, password.data(), password.size());
+        }
+        uint8_t pad[64];
+        Sha256 innerKeyed, outerKeyed;
+        for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+        innerKeyed.update(pad, 64);
+        for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+        outerKeyed.update(pad, 64);
+
+        auto hmac = [&](const uint8_t* message, size_t length, uint8_t result[Sha256::DIGEST_SIZE]) {
+            uint8_t innerDigest[Sha256::DIGEST_SIZE];
+            Sha256 inner = innerKeyed;
+            inner.update(message, length);
+            inner.finish(innerDigest);
+            Sha256 outer = outerKeyed;
+            outer.update(innerDigest, sizeof(innerDigest));
+            outer.finish(result);
+        };
+        uint8_t first[SALT_SIZE + 4];
+        memcpy(first, salt, SALT_SIZE);
+        first[SALT_SIZE] = 0; first[SALT_SIZE + 1] = 0; first[SALT_SIZE + 2] = 0; first[SALT_SIZE + 3] = 1; // Block 1
+        uint8_t u[Sha256::DIGEST_SIZE];
+        hmac(first, sizeof(first), u);
+        memcpy(out, u, sizeof(u));
+        for (uint64_t i = 1; i < (uint64_t(1) << cost); i++) {
+            hmac(u, sizeof(u), u);
+            for (size_t b = 0; b < sizeof(u); b++) out[b] ^= u[b];
+        }
+    }
+
+    static PasswordHash create(const string& password, int cost = DEFAULT_PASSWORD_COST) {
+        thread_local mt19937_64 saltSource(random_device{}() ^ hash<thread::id>()(this_thread::get_id()));
+        PasswordHash hashed;
+        for (size_t i = 0; i < SALT_SIZE; i += 8) {
+            uint64_t bits = saltSource();
+            memcpy(hashed.salt + i, &bits, 8);
+        }
+        hashed.cost = static_cast<uint8_t>(max(0, min(cost, 30)));
+        derive(password, hashed.salt, hashed.cost, hashed.digest);
+        return hashed;
+    }
+
+    // Compares in constant time so the reply time leaks nothing about the hash
+    bool matches(const string& password) const {
+        uint8_t candidate[Sha256::DIGEST_SIZE];
+        derive(password, salt, cost, candidate);
+        uint8_t difference = 0;
+        for (size_t i = 0; i < sizeof(candidate); i++) difference |= candidate[i] ^ digest[i];
+        return difference == 0;
+    }
+
+    // "cost salthex digesthex"
+    string toText() const {
+        static const char HEX[] = "0123456789abcdef";
+        string text = to_string(cost) + ' ';
+        for (uint8_t byte : salt) { text += HEX[byte >> 4]; text += HEX[byte & 15]; }
+        text += ' ';
+        for (uint8_t byte : digest) { text += HEX[byte >> 4]; text += HEX[byte & 15]; }
+        return text;
+    }
+
+    static bool fromText(int costValue, const string& saltHex, const string& digestHex, PasswordHash& hashed) {
+        auto decode = [](const string& hex, uint8_t* out, size_t size) {
+            if (hex.size() != size * 2) return false;
+            for (size_t i = 0; i < size; i++) {
+                auto result = from_chars(hex.data() + 2 * i, hex.data() + 2 * i + 2, out[i], 16);
+                if (result.ec != errc() || result.ptr != hex.data() + 2 * i + 2) return false;
+            }
+            return true;
+        };
+        if (costValue < 0 || costValue > 30) return false;
+        hashed.cost = static_cast<uint8_t>(costValue);
+        return decode(saltHex, hashed.salt, SALT_SIZE) && decode(digestHex, hashed.digest, Sha256::DIGEST_SIZE);
+    }
+};
+
+// Class for User (for authentication)
+class User {
+private:
+    string username;
+    PasswordHash credential;
+    int id;
+    bool isLoggedIn;
+public:
+    User() : credential(), id(-1), isLoggedIn(false) {}
+    User(string uname, const PasswordHash& hashed, int uid) : username(uname), credential(hashed), id(uid), isLoggedIn(false) {}
+
+    string getUsername() const { return username; }
+    const PasswordHash& getCredential() const { return credential; }
+    bool checkPassword(const string& password) const { return credential.matches(password); }
+    int getId() const { return id; }
+    void setLoggedIn(bool status) { isLoggedIn = status; }
+    bool getLoggedIn() const { return isLoggedIn; }
+};
+
+// Accounts, sharded by username hash (user_data.txt)
+// Each shard has its own reader-writer lock, so logins and registrations on
+// different shards never contend, and the password hash is checked outside
+// any lock. The file is an append-only log of "username id cost salt digest"
+// lines: a registration appends one line through a group-commit log instead
+// of rewriting every account. Old "username password id" lines are hashed on
+// load and the file is rewritten once in the new format. Users are never
+// removed, so pointers returned by find() and authenticate() stay valid.
+class UserStore {
+public:
+    static const size_t SHARDS = 64;
+private:
+    struct Shard {
+        mutable shared_mutex lock;
+        unordered_map<string, User> users;
+    };
+
+    unique_ptr<Shard[]> shards;
+    GroupCommitLog log;
+    string path;
+    int cost;
+
+    Shard& shardFor(const string& username) const {
+        return shards[hash<string>()(username) % SHARDS];
+    }
+
+    static string record(const User& user) {
+        return user.getUsername() + ' ' + to_string(user.getId()) + ' ' + user.getCredential().toText() + '\n';
+    }
+public:
+    explicit UserStore(int passwordCost = DEFAULT_PASSWORD_COST) : shards(new Shard[SHARDS]), cost(passwordCost) {}
+
+    void setCost(int passwordCost) { cost = passwordCost; }
+    int getCost() const { return cost; }
+
+    void reserve(size_t count) {
+        for (size_t i = 0; i < SHARDS; i++) {
+            shards[i].users.reserve(count / SHARDS + 1);
+        }
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < SHARDS; i++) {
+            shared_lock<shared_mutex> lock(shards[i].lock);
+            total += shards[i].users.size();
+        }
+        return total;
+    }
+
+    // Reads the account file (later lines win), then keeps it open for
+    // appends. Returns false if the file cannot be opened for writing.
+    bool open(const string& filePath) {
+        log.close();
+        path = filePath;
+        ifstream in(path);
+        string line;
+        bool legacy = false;
+        while (getline(in, line)) {
+            istringstream fields(line);
+            vector<string> parts;
+            string part;
+            while (fields >> part) {
+                parts.push_back(part);
+            }
+            PasswordHash hashed;
+            if (parts.size() == 5 && PasswordHash::fromText(atoi(parts[2].c_str()), parts[3], parts[4], hashed)) {
+                User user(parts[0], hashed, atoi(parts[1].c_str()));
+                shardFor(parts[0]).users.insert_or_assign(parts[0], user);
+            } else if (parts.size() == 3) {
+                User user(parts[0], PasswordHash::create(parts[1], cost), atoi(parts[2].c_str()));
+                shardFor(parts[0]).users.insert_or_assign(parts[0], user);
+                legacy = true;
+            }
+            // Anything else is a torn last line from an interrupted append
+        }
+        in.close();
+        if (legacy && !rewrite()) return false;
+        return log.open(path);
+    }
+
+    // Writes every account to a fresh file in one go
+    bool rewrite() {
+        string tmpPath = path + ".tmp";
+        {
+            ofstream out(tmpPath, ios::trunc);
+            if (!out) return false;
+            for (size_t i = 0; i < SHARDS; i++) {
+                shared_lock<shared_mutex> lock(shards[i].lock);
+                for (const auto& entry : shards[i].users) {
+                    out << record(entry.second);
+                }
+            }
+            if (!out.flush()) return false;
+        }
+        error_code error;
+        filesystem::rename(tmpPath, path, error);
+        return !error;
+    }
+
+    // Adds an account without persisting it (loading, benchmarks)
+    bool add(const User& user) {
+        Shard& shard = shardFor(user.getUsername());
+        unique_lock<shared_mutex> lock(shard.lock);
+        return shard.users.emplace(user.getUsername(), user).second;
+    }
+
+    // Hashes the password, adds the account and waits until its record is on
+    // disk. Returns false if the username is taken.
+    bool registerUser(const string& username, const string& password, int id) {
+        User user(username, PasswordHash::create(password, cost), id);
+        if (!add(user)) return false;
+        string line = record(user);
+        log.waitDurable(log.append(line.data(), line.size()));
+        return true;
+    }
+
+    const User* find(const string& username) const {
+        Shard& shard = shardFor(username);
+        shared_lock<shared_mutex> lock(shard.lock);
+        auto it = shard.users.find(username);
+        return it == shard.users.end() ? nullptr : &it->second;
+    }
+
+    // The account if the password is right, otherwise nullptr
+    const User* authenticate(const string& username, const string& password) const {
+        const User* user = find(username);
+        if (!user || !user->checkPassword(password)) return nullptr;
+        return user;
+    }
+
+    void close() { log.close(); }
+};
+
+// Random 128-bit session identifier
+struct SessionToken {
+    uint64_t high;
+    uint64_t low;
+
+    bool operator==(const SessionToken& other) const { return high == other.high && low == other.low; }
+
+    // 32 hex digits
+    string toString() const {
+        char text[33];
+        snprintf(text, sizeof(text), "%016llx%016llx", static_cast<unsigned long long>(high), static_cast<unsigned long long>(low));
+        return text;
+    }
+
+    static bool parse(const string& text, SessionToken& token) {
+        if (text.size() != 32) return false;
+        auto high = from_chars(text.data(), text.data() + 16, token.high, 16);
+        auto low = from_chars(text.data() + 16, text.data() + 32, token.low, 16);
+        return high.ec == errc() && high.ptr == text.data() + 16 && low.ec == errc() && low.ptr == text.data() + 32;
+    }
+};
+
+struct SessionTokenHash {
+    size_t operator()(const SessionToken& token) const { return static_cast<size_t>(token.low ^ (token.high >> 7)); }
+};
+
+// Hierarchical timing wheel of session tokens, one tick per second
+// Three levels of 256 slots cover 256 seconds, 18 hours and 194 days. A token
+// is filed by how far away its due time is and moves down a level each time
+// the level below wraps, so scheduling and expiring cost O(1) per token no
+// matter how many sessions are live. Not thread-safe; each SessionManager
+// shard owns one under its lock.
+class TimingWheel {
+public:
+    static const int SLOT_BITS = 8;
+    static const int LEVELS = 3;
+    static const uint64_t SLOTS = uint64_t(1) << SLOT_BITS;
+    static const uint64_t HORIZON = uint64_t(1) << (SLOT_BITS * LEVELS);
+private:
+    vector<SessionToken> slots[LEVELS][SLOTS];
+    uint64_t current; // Last tick processed
+
+    // Files a token with due >= current; due == current only while cascading
+    void place(const SessionToken& token, uint64_t due) {
+        uint64_t delta = min(due - current, HORIZON - 1);
+        due = current + delta;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        slots[level][(due >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(token);
+    }
+public:
+    explicit TimingWheel(uint64_t now = 0) : current(now) {}
+
+    uint64_t now() const { return current; }
+
+    // A due time already passed fires on the next tick
+    void schedule(const SessionToken& token, uint64_t due) {
+        place(token, max(due, current + 1));
+    }
+
+    // Processes every tick up to and including `now`, passing each token due
+    // to fire(token, tick). fire() may schedule the token again.
+    template <class Fire>
+    void advance(uint64_t now, Fire fire) {
+        if (now > current + HORIZON) {
+            current = now - HORIZON; // Asleep for months; every token is long due
+        }
+        vector<SessionToken> due;
+        while (current < now) {
+            current++;
+            for (int level = 1; level < LEVELS; level++) {
+                if ((current & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) break;
+                vector<SessionToken> moving;
+                moving.swap(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+                for (const auto& token : moving) {
+                    place(token, current); // Lands in level 0 or fires below
+                }
+            }
+            due.clear();
+            due.swap(slots[0][current & (SLOTS - 1)]);
+            for (const auto& token : due) {
+                fire(token, current);
+            }
+        }
+    }
+};
+
+const char SESSION_SNAPSHOT_MAGIC[8] = { 'S', 'E', 'S', 'S', 'N', 'A', 'P', '1' };
+
+struct SessionSnapshotRecord {
+    uint64_t tokenHigh;
+    uint64_t tokenLow;
+    int64_t lastActive; // time_t
+    int32_t userID;
+    uint32_t nameLength;
+    uint64_t nameOffset;
+};
+
+static_assert(sizeof(SessionSnapshotRecord) == 40, "session snapshot record layout changed");
+
+// Logged-in sessions (session_data.bin)
+// Tokens map to their user in a table split into shards with one mutex each,
+// and each shard keeps a TimingWheel for idle expiry. touch() only records
+// the time of the activity; when a token's wheel slot comes up it is expired
+// if it has been idle for idleTimeout, or refiled for its new deadline. One
+// background thread advances the wheels every second and, when sessions have
+// changed, writes a compact binary snapshot (SnapshotHeader, fixed records,
+// then the usernames) so sessions survive a restart.
+class SessionManager {
+public:
+    static const size_t SHARDS = 64;
+
+    struct Session {
+        string username;
+        int userID;
+        int64_t lastActive; // time_t of the last request
+    };
+private:
+    struct Shard {
+        mutex lock;
+        unordered_map<SessionToken, Session, SessionTokenHash> sessions;
+        TimingWheel wheel;
+    };
+
+    unique_ptr<Shard[]> shards;
+    int64_t idleTimeout;
+    atomic<bool> changed;
+    atomic<uint64_t> expiredCount;
+    mutex reaperMutex;
+    condition_variable reaperWake;
+    bool stopping;
+    thread reaper;
+
+    Shard& shardFor(const SessionToken& token) const { return shards[token.high % SHARDS]; }
+
+    // Tokens come from the system's entropy source, drawn 16 at a time
+    static SessionToken newToken() {
+        thread_local uint64_t pool[32];
+        thread_local size_t used = 32;
+        if (used == 32) {
+            bool filled = false;
+#if defined(BOOKSTORE_POSIX)
+            filled = getentropy(pool, sizeof(pool)) == 0;
+#endif
+            if (!filled) {
+                random_device entropy;
+                for (auto& word : pool) word = (uint64_t(entropy()) << 32) | entropy();
+            }
+            used = 0;
+        }
+        SessionToken token = { pool[used], pool[used + 1] };
+        used += 2;
+        return token;
+    }
+
+    void insert(const SessionToken& token, Session session) {
+        Shard& shard = shardFor(token);
+        lock_guard<mutex> lock(shard.lock);
+        shard.wheel.schedule(token, static_cast<uint64_t>(session.lastActive + idleTimeout));
+        shard.sessions[token] = move(session);
+    }
+public:
+    static int64_t currentTime() { return static_cast<int64_t>(time(nullptr)); }
+
+    explicit SessionManager(chrono::seconds idle = chrono::minutes(30), int64_t now = currentTime())
+        : shards(new Shard[SHARDS]), idleTimeout(idle.count()), changed(false), expiredCount(0), stopping(false) {
+        for (size_t i = 0; i < SHARDS; i++) {
+            shards[i].wheel = TimingWheel(static_cast<uint64_t>(now));
+        }
+    }
+
+    ~SessionManager() { stop(); }
+
+    void reserve(size_t count) {
+        for (size_t i = 0; i < SHARDS; i++) {
+            shards[i].sessions.reserve(count / SHARDS + 1);
+        }
+    }
+
+    SessionToken create(const User& user, int64_t now = currentTime()) {
+        SessionToken token = newToken();
+        insert(token, Session{ user.getUsername(), user.getId(), now });
+        changed = true;
+        return token;
+    }
+
+    // Marks activity; returns false if the session has ended or expired
+    bool touch(const SessionToken& token, int64_t now = currentTime()) {
+        Shard& shard = shardFor(token);
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.sessions.find(token);
+        if (it == shard.sessions.end() || now - it->second.lastActive >= idleTimeout) return false;
+        it->second.lastActive = now;
+        return true;
+    }
+
+    // Copies the session out; returns false if there is none
+    bool find(const SessionToken& token, Session& session) {
+        Shard& shard = shardFor(token);
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.sessions.find(token);
+        if (it == shard.sessions.end()) return false;
+        session = it->second;
+        return true;
+    }
+
+    // Logout. Its wheel entry finds nothing when it comes up and is dropped.
+    bool end(const SessionToken& token) {
+        Shard& shard = shardFor(token);
+        lock_guard<mutex> lock(shard.lock);
+        bool ended = shard.sessions.erase(token) > 0;
+        changed = changed || ended;
+        return ended;
+    }
+
+    // Advances every wheel to `now`; returns the number of sessions expired
+    size_t expire(int64_t now = currentTime()) {
+        size_t expired = 0;
+        for (size_t i = 0; i < SHARDS; i++) {
+            Shard& shard = shards[i];
+            lock_guard<mutex> lock(shard.lock);
+            shard.wheel.advance(static_cast<uint64_t>(now), [&](const SessionToken& token, uint64_t tick) {
+                auto it = shard.sessions.find(token);
+                if (it == shard.sessions.end()) return;
+                int64_t deadline = it->second.lastActive + idleTimeout;
+                if (deadline <= static_cast<int64_t>(tick)) {
+                    shard.sessions.erase(it);
+                    expired++;
+                } else {
+                    shard.wheel.schedule(token, static_cast<uint64_t>(deadline));
+                }
+            });
+        }
+        if (expired > 0) {
+            expiredCount += expired;
+            changed = true;
+        }
+        return expired;
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (size_t i = 0; i < SHARDS; i++) {
+            lock_guard<mutex> lock(shards[i].lock);
+            total += shards[i].sessions.size();
+        }
+        return total;
+    }
+
+    uint64_t expiredSessions() const { return expiredCount.load(); }
+
+    bool saveSnapshot(const string& path) {
+        changed = false;
+        vector<SessionSnapshotRecord> records;
+        string names;
+        for (size_t i = 0; i < SHARDS; i++) {
+            lock_guard<mutex> lock(shards[i].lock);
+            for (const auto& entry : shards[i].sessions) {
+                SessionSnapshotRecord record = {};
+                record.tokenHigh = entry.first.high;
+                record.tokenLow = entry.first.low;
+                record.lastActive = entry.second.lastActive;
+                record.userID = entry.second.userID;
+                record.nameLength = static_cast<uint32_t>(entry.second.username.size());
+                record.nameOffset = names.size();
+                names += entry.second.username;
+                records.push_back(record);
+            }
+        }
+        SnapshotHeader header = {};
+        memcpy(header.magic, SESSION_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.recordSize = sizeof(SessionSnapshotRecord);
+        header.count = records.size();
+        header.heapSize = names.size();
+        const char* recordBytes = reinterpret_cast<const char*>(records.data());
+        size_t recordByteCount = records.size() * sizeof(SessionSnapshotRecord);
+        header.checksum = snapshotChecksum(names.data(), names.size(), snapshotChecksum(recordBytes, recordByteCount));
+
+        string tempPath = path + ".tmp";
+        ofstream out(tempPath, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(recordBytes, recordByteCount);
+        out.write(names.data(), names.size());
+        out.close();
+        error_code error;
+        if (out) {
+            filesystem::rename(tempPath, path, error);
+        }
+        if (!out || error) {
+            changed = true; // Try again next time
+            return false;
+        }
+        return true;
+    }
+
+    // Restores the sessions of a snapshot that are still within the idle
+    // timeout; returns how many. A damaged snapshot is ignored as a whole.
+    size_t loadSnapshot(const string& path, int64_t now = currentTime()) {
+        MappedFile snapshot;
+        if (!snapshot.open(path) || snapshot.size() < sizeof(SnapshotHeader)) return 0;
+        SnapshotHeader header;
+        memcpy(&header, snapshot.data(), sizeof(header));
+        if (memcmp(header.magic, SESSION_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+            || header.recordSize != sizeof(SessionSnapshotRecord)
+            || header.count > (snapshot.size() - sizeof(header)) / sizeof(SessionSnapshotRecord)) {
+            return 0;
+        }
+        const char* recordBytes = snapshot.data() + sizeof(header);
+        size_t recordByteCount = header.count * sizeof(SessionSnapshotRecord);
+        const char* names = recordBytes + recordByteCount;
+        if (header.heapSize != snapshot.size() - sizeof(header) - recordByteCount
+            || snapshotChecksum(names, header.heapSize, snapshotChecksum(recordBytes, recordByteCount)) != header.checksum) {
+            return 0;
+        }
+        size_t restored = 0;
+        for (uint64_t i = 0; i < header.count; i++) {
+            SessionSnapshotRecord record;
+            memcpy(&record, recordBytes + i * sizeof(record), sizeof(record));
+            if (record.nameOffset + record.nameLength > header.heapSize || now - record.lastActive >= idleTimeout) {
+                continue;
+            }
+            insert(SessionToken{ record.tokenHigh, record.tokenLow },
+                   Session{ string(names + record.nameOffset, record.nameLength), record.userID, record.lastActive });
+            restored++;
+        }
+        return restored;
+    }
+
+    // Expires sessions every second and snapshots them to `path` at most
+    // every snapshotInterval when something changed
+    void start(const string& path, chrono::seconds snapshotInterval = chrono::seconds(60)) {
+        stop();
+        stopping = false;
+        reaper = thread([this, path, snapshotInterval] {
+            auto lastSnapshot = chrono::steady_clock::now();
+            unique_lock<mutex> lock(reaperMutex);
+            while (!stopping) {
+                reaperWake.wait_for(lock, chrono::seconds(1));
+                lock.unlock();
+                expire();
+                if (changed && chrono::steady_clock::now() - lastSnapshot >= snapshotInterval) {
+                    saveSnapshot(path);
+                    lastSnapshot = chrono::steady_clock::now();
+                }
+                lock.lock();
+            }
+            lock.unlock();
+            if (changed) saveSnapshot(path);
+        });
+    }
+
+    // Stops the background thread after a final snapshot
+    void stop() {
+        if (!reaper.joinable()) return;
+        {
+            lock_guard<mutex> lock(reaperMutex);
+            stopping = true;
+        }
+        reaperWake.notify_all();
+        reaper.join();
+    }
+};
+
+// Class for Admin (inherits User)
+class Admin : public User {
+public:
+    explicit Admin(const User& user) : User(user) {}
+
+    // Administrative functions
+    void addBook(Catalog& catalog) {
+        int id, stock;
+        string title, author;
+        double price;
+        cout << "Enter new book ID: ";
+        cin >> id;
+        cin.ignore();
+        cout << "Enter book title: ";
+        getline(cin, title);
+        cout << "Enter author name: ";
+        getline(cin, author);
+        cout << "Enter price: ";
+        cin >> price;
+        cout << "Enter stock quantity: ";
+        cin >> stock;
+        cin.ignore();
+        if (catalog.addBook(Book(id, title, author, price, stock))) {
+            cout << "Book added successfully.\n";
+        } else {
+            cout << "A book with ID " << id << " already exists.\n";
+        }
+    }
+
+    void removeBook(Catalog& catalog) {
+        int id;
+        cout << "Enter the ID of the book to remove: ";
+        cin >> id;
+        cin.ignore();
+        if (catalog.removeBook(id)) {
+            cout << "Book removed successfully.\n";
+        } else {
+            cout << "Book not found.\n";
+        }
+    }
+
+    void updateBookStock(Catalog& catalog, CatalogJournal& journal) {
+        int id, newStock;
+        cout << "Enter the ID of the book to update stock: ";
+        cin >> id;
+        cout << "Enter new stock quantity: ";
+        cin >> newStock;
+        cin.ignore();
+        if (catalog.setStockQuantity(id, newStock)) {
+            journal.recordStock(id, newStock);
+            cout << (journal.commit() ? "Stock updated successfully.\n" : "Stock updated, but the change could not be saved.\n");
+        } else {
+            cout << "Book not found.\n";
+        }
+    }
+
+    void updateBookPrice(Catalog& catalog, CatalogJournal& journal) {
+        int id;
+        double newPrice;
+        cout << "Enter the ID of the book to update price: ";
+        cin >> id;
+        cout << "Enter new price: ";
+        cin >> newPrice;
+        cin.ignore();
+        if (catalog.setPrice(id, newPrice)) {
+            journal.recordPrice(id, newPrice);
+            cout << (journal.commit() ? "Price updated successfully.\n" : "Price updated, but the change could not be saved.\n");
+        } else {
+            cout << "Book not found.\n";
+        }
+    }
+};
+
+// Function prototypes
+void showWelcomeMessage();
+void displayBookList(const Catalog& catalog);
+template<class RowAt>
+void showPaged(size_t total, RowAt rowAt, bool withHeader = false);
+void addBooksToCart(Cart& cart, const Catalog& catalog, const CoPurchaseRecommender& recommendations);
+void showAlsoBought(const CoPurchaseRecommender& recommendations, const Catalog& catalog, BookView book);
+Money calculateTotal(const Cart& cart, const Catalog& catalog);
+bool reserveCart(StockReservations& reservations, const Cart& cart, const Catalog& catalog,
+                 vector<StockReservations::Handle>& holds);
+Money cartTotal(const Cart& cart, const Catalog& catalog);
+Buyer* createBuyer(int buyerType);
+void runLoadGenerator(int port, int clients, int requestsPerClient, const string& username, const string& password);
+bool runStockStressTest(int maxThreads, int operationsPerThread);
+void runCartBenchmark(int cartCount);
+void runPricingBenchmark(int cartCount);
+void runPromotionBenchmark(int ruleCount);
+void runTierBenchmark(int buyerCount);
+void runUserStoreBenchmark(size_t userCount, int passwordCost);
+void runSessionBenchmark(size_t sessionCount);
+void runReviewBenchmark(uint64_t reviewCount, int bookCount);
+void runRecommendationBenchmark(size_t orderCount, int bookCount);
+void runReturnBenchmark(size_t returnCount, size_t batchSize);
+void runListingBenchmark(size_t bookCount);
+void runSnapshotBenchmark(size_t bookCount);
+void runLookupBenchmark(const vector<size_t>& bookCounts);
+void runSearchBenchmark(size_t bookCount, size_t queryCount);
+void runMatcherBenchmark(size_t megabytes);
+void runColumnScanBenchmark(size_t bookCount);
+void runFilterBenchmark(size_t bookCount);
+void runLoadBenchmark(size_t bookCount);
+void runMetricsBenchmark(size_t events);
+void runOrderJournalBenchmark(int threads, int ordersPerThread);
+void runStockJournalBenchmark(size_t bookCount, int threads, int ordersPerThread);
+void runOrderHistoryBenchmark(size_t orderCount, int accounts);
+uint64_t saveOrder(OrderJournal& orders, const User& user, Buyer* buyer, const Cart& cart, const Catalog& catalog);
+void viewCart(const Cart& cart, const Catalog& catalog);
+void removeBookFromCart(Cart& cart);
+void updateBookQuantity(Cart& cart);
+void userRegistration(UserStore& users);
+User userLogin(const UserStore& users);
+void viewOrderHistory(OrderJournal& orders, ReturnLedger& returns, const User& user);
+void adminMenu(Admin& admin, Catalog& catalog, CatalogJournal& journal);
+vector<uint32_t> applyPromotions(PromotionEngine& promotions, Buyer* buyer, int buyerType, const vector<string>& codes,
+                                 const Cart& cart, const Catalog& catalog);
+vector<uint32_t> applyCoupon(PromotionEngine& promotions, Buyer* buyer, int buyerType, const Cart& cart, const Catalog& catalog);
+void processPayment(Buyer* buyer);
+void saveBooksToFile(const Catalog& catalog);
+void compactCatalogJournal(const Catalog& catalog, CatalogJournal& journal);
+void loadBooksFromFile(Catalog& catalog);
+bool saveBooksToText(const Catalog& catalog, const string& path);
+bool loadBooksFromText(Catalog& catalog, const string& path);
+bool saveCatalogSnapshot(const Catalog& catalog, const string& path);
+bool loadCatalogSnapshot(Catalog& catalog, const string& path);
+void searchBooks(const Catalog& catalog, const CoPurchaseRecommender& recommendations);
+void filterBooks(const Catalog& catalog);
+void rateBook(Catalog& catalog, CatalogJournal& journal, ReviewStore& reviews, const User& user);
+void showReviews(const Catalog& catalog, const ReviewStore& reviews);
+void addToWishlist(Wishlist& wishlist, const Catalog& catalog);
+void viewWishlist(const Wishlist& wishlist, const Catalog& catalog);
+void sendEmailNotification(NotificationDispatcher& notifications, const User& user, const string& message);
+void handleGiftOption(Cart& cart);
+void returnOrRefund(ReturnLedger& returns, OrderJournal& orders, Catalog& catalog, CatalogJournal& journal,
+                    const User& user);
+string encryptData(const string& data);
+string decryptData(const string& data);
+
+// Exception classes
+class AuthenticationError : public exception {
+public:
+    const char* what() const noexcept override {
+        return "Authentication failed.";
+    }
+};
+
+class BookNotFoundError : public exception {
+public:
+    const char* what() const noexcept override {
+        return "Book not found.";
+    }
+};
+
+class OutOfStockError : public exception {
+public:
+    const char* what() const noexcept override {
+        return "Requested quantity not available.";
+    }
+};
+
+// Line-based TCP server for concurrent shopper sessions (--server)
+// One poll loop (run) accepts connections and watches every idle one. When a
+// complete request line has arrived, the connection is queued for a fixed
+// pool of worker threads; a worker serves that one request and hands the
+// connection back. No connection holds a worker between requests, so a few
+// threads serve any number of connected shoppers and an idle or slow client
+// never holds up the others. Requests mirror the main menu:
+//   LOGIN <username> <password>    RESUME <token>              SEARCH <keyword>
+//   BROWSE [offset] [limit]        ADD <bookID> <quantity>     REMOVE <bookID>
+//   CART                           CHECKOUT [coupon codes...]  HISTORY [page] [pageSize]
+//   RECOMMEND <bookID> [count]     RETURN <key> <orderID> <bookID> <quantity> [refund-only]
+//   STATS                          QUIT
+// Every reply is "OK <n>" followed by n data lines, or a single "ERR <reason>".
+// LOGIN replies with a session token that RESUME accepts on a later
+// connection until the session has been idle for SESSION_IDLE_TIMEOUT; QUIT
+// logs out.
+// ADD reserves the copies for the session (StockReservations), so stock cannot
+// be oversold between adding and checking out; holds are released by REMOVE,
+// by closing the connection, or after CART_HOLD_TIMEOUT. Sessions share the
+// catalog through a reader-writer lock that only journal compaction and a
+// RETURN's restock records take exclusively; log syncs are awaited after
+// releasing it.
+#if defined(BOOKSTORE_POSIX)
+class BookstoreServer {
+private:
+    // Buffered line reader/writer over one client socket
+    class Connection {
+    private:
+        int fd;
+        string input;
+    public:
+        explicit Connection(int socket) : fd(socket) {}
+
+        int socket() const { return fd; }
+
+        // Reads what has arrived without waiting; false once the client has
+        // closed the connection or it failed
+        bool fill() {
+            char chunk[4096];
+            ssize_t received = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (received < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            if (received == 0) return false;
+            input.append(chunk, static_cast<size_t>(received));
+            return true;
+        }
+
+        bool hasLine() const { return input.find('\n') != string::npos; }
+
+        // Takes the next complete line already received, if any
+        bool takeLine(string& line) {
+            size_t newline = input.find('\n');
+            if (newline == string::npos) return false;
+            line.assign(input, 0, newline);
+            input.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            return true;
+        }
+
+        bool send(const string& reply) {
+            size_t sent = 0;
+            while (sent < reply.size()) {
+                ssize_t written = ::send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                if (written <= 0) return false;
+                sent += static_cast<size_t>(written);
+            }
+            return true;
+        }
+    };
+
+    // Cart memory comes from the session's arena and is freed with it
+    struct Session {
+        const User* user;
+        SessionToken token;
+        Cart cart;
+        vector<StockReservations::Handle> holds; // One per ADD; the cart merges them per book
+
+        explicit Session(SessionArena& arena) : user(nullptr), token(), cart(arena.resource()) {}
+    };
+
+    // One connected shopper. While idle it belongs to the poll loop; while
+    // busy (queued or being served) it belongs to the workers.
+    struct Client {
+        Connection connection;
+        SessionArena arena;
+        Session session;
+        bool busy;    // Poll loop only
+        bool closing; // Set by the worker after QUIT or a failed send
+
+        explicit Client(int fd) : connection(fd), arena(), session(arena), busy(false), closing(false) {}
+    };
+
+    const UserStore& users;
+    SessionManager& sessions;
+    Catalog& catalog;
+    CatalogJournal& journal;
+    OrderJournal& orders;
+    ReturnLedger& returns;
+    NotificationDispatcher& notifications;
+    PromotionEngine& promotions;
+    CoPurchaseRecommender& recommendations;
+    shared_mutex catalogLock;
+    StockReservations reservations;
+
+    int listener;
+    int wakePipe[2]; // Workers write a byte here when they hand a client back
+    atomic<bool> stopping;
+    size_t workerCount;
+    vector<thread> workers;
+    unordered_map<int, unique_ptr<Client>> clients; // By socket; changed by the poll loop only
+    mutex queueMutex;
+    condition_variable queueReady;
+    deque<Client*> readyClients;     // A complete request line is buffered
+    vector<Client*> returnedClients; // Served; back to the poll loop
+
+    static string ok(size_t lineCount, const string& lines = "") {
+        return "OK " + to_string(lineCount) + "\n" + lines;
+    }
+
+    static string error(const string& reason) {
+        return "ERR " + reason + "\n";
+    }
+
+    string browse(istringstream& args) {
+        size_t offset = 0, limit = 20;
+        args >> offset >> limit;
+        ListingRenderer lines;
+        size_t count = 0;
+        shared_lock<shared_mutex> lock(catalogLock);
+        for (size_t slot = offset; slot < catalog.size() && count < limit; slot++, count++) {
+            lines.record(catalog.at(slot));
+        }
+        return ok(count, lines.take());
+    }
+
+    string search(istringstream& args) {
+        string keyword;
+        getline(args >> ws, keyword);
+        transform(keyword.begin(), keyword.end(), keyword.begin(), foldCase);
+        ListingRenderer lines;
+        shared_lock<shared_mutex> lock(catalogLock);
+        vector<BookView> results = catalog.search(keyword);
+        for (const auto& book : results) {
+            lines.record(book);
+        }
+        return ok(results.size(), lines.take());
+    }
+
+    // Books most often bought with one book: bookID|title|author|orders together
+    string recommend(istringstream& args) {
+        int bookID = 0;
+        size_t count = 5;
+        if (!(args >> bookID)) return error("usage: RECOMMEND <bookID> [count]");
+        args >> count;
+        ostringstream lines;
+        size_t found = 0;
+        shared_lock<shared_mutex> lock(catalogLock);
+        for (const auto& suggestion : recommendations.alsoBought(bookID, min<size_t>(count, CoPurchaseRecommender::SLOTS))) {
+            BookView book = catalog.findBook(suggestion.bookID);
+            if (!book) continue;
+            lines << suggestion.bookID << '|' << book.getTitle() << '|' << book.getAuthor() << '|' << suggestion.count << '\n';
+            found++;
+        }
+        return ok(found, lines.str());
+    }
+
+    // The timer and counter report (see Metrics::report), one line each
+    string stats() {
+        string report = Metrics::report();
+        return ok(static_cast<size_t>(count(report.begin(), report.end(), '\n')), report);
+    }
+
+    string add(Session& session, istringstream& args) {
+        ScopedTimer timer(TIME_ADD_TO_CART);
+        int bookID = 0, quantity = 0;
+        if (!(args >> bookID >> quantity) || quantity <= 0) return error("usage: ADD <bookID> <quantity>");
+        shared_lock<shared_mutex> lock(catalogLock);
+        BookView book = catalog.findBook(bookID);
+        if (!book) return error("book not found");
+        StockReservations::Handle hold = reservations.reserve(bookID, quantity);
+        if (!hold) return error("only " + to_string(book.getStockQuantity()) + " available");
+        session.cart.add(bookID, quantity);
+        session.holds.push_back(hold);
+        return ok(0);
+    }
+
+    string remove(Session& session, istringstream& args) {
+        int bookID = 0;
+        args >> bookID;
+        if (!session.cart.remove(bookID)) return error("book not in cart");
+        auto released = remove_if(session.holds.begin(), session.holds.end(), [&](const StockReservations::Handle& hold) {
+            if (hold->bookID != bookID) return false;
+            reservations.release(hold);
+            return true;
+        });
+        session.holds.erase(released, session.holds.end());
+        return ok(0);
+    }
+
+    void releaseCart(Session& session) {
+        for (const auto& hold : session.holds) {
+            reservations.release(hold);
+        }
+        session.cart.clear();
+        session.holds.clear();
+    }
+
+    string showCart(const Session& session) {
+        ostringstream lines;
+        shared_lock<shared_mutex> lock(catalogLock);
+        for (const auto& line : session.cart) {
+            BookView book = catalog.findBook(line.bookID);
+            lines << line.bookID << '|' << (book ? book.getTitle() : "(unavailable)") << '|' << line.quantity << '|'
+                  << fixed << setprecision(2) << (book ? book.getPrice() : 0.0) << '\n';
+        }
+        return ok(session.cart.size(), lines.str());
+    }
+
+    string checkout(Session& session, istringstream& args) {
+        if (session.cart.empty()) return error("cart is empty");
+        ScopedTimer timer(TIME_CHECKOUT);
+        vector<string> codes;
+        string code;
+        while (args >> code) {
+            codes.push_back(code);
+        }
+        int buyerType = buyerTypeForId(session.user->getId());
+        unique_ptr<Buyer> buyer(createBuyer(buyerType));
+        if (!buyer) return error("invalid buyer ID");
+        {
+            shared_lock<shared_mutex> lock(catalogLock);
+            if (!reservations.commit(session.holds)) {
+                // Drop the lapsed items so the shopper can re-add them
+                string lapsed;
+                for (size_t i = session.holds.size(); i-- > 0;) {
+                    const StockReservations::Handle& hold = session.holds[i];
+                    if (hold->state.load() != StockReservations::HELD) {
+                        lapsed += " " + to_string(hold->bookID);
+                        session.cart.setQuantity(hold->bookID, session.cart.quantityOf(hold->bookID) - hold->quantity);
+                        session.holds.erase(session.holds.begin() + i);
+                    }
+                }
+                return error("reservation expired for book(s)" + lapsed + "; removed from cart");
+            }
+            buyer->setDetails(session.user->getUsername(), session.user->getId(), "");
+            buyer->setPay(cartTotal(session.cart, catalog));
+            applyPromotions(promotions, buyer.get(), buyerType, codes, session.cart, catalog);
+            saveOrder(orders, *session.user, buyer.get(), session.cart, catalog);
+        }
+        recommendations.recordOrder(session.cart);
+        // Both share one fsync with other sessions checking out
+        bool saved = journal.commit();
+        saved = orders.commit() && saved;
+        session.cart.clear();
+        session.holds.clear();
+        if (!saved) {
+            return error("the order was placed but could not be saved; please contact the store");
+        }
+        sendEmailNotification(notifications, *session.user, "Your order has been placed successfully!");
+        if (journal.needsCompaction()) {
+            unique_lock<shared_mutex> lock(catalogLock, try_to_lock);
+            if (lock && journal.needsCompaction()) {
+                compactCatalogJournal(catalog, journal);
+            }
+        }
+        ostringstream total;
+        total << "total " << buyer->getPay() << '\n';
+        return ok(1, total.str());
+    }
+
+    // One line per order, newest first: orderID|placed at|total|items
+    string history(const Session& session, istringstream& args) {
+        size_t page = 0, pageSize = 10;
+        args >> page >> pageSize;
+        OrderQuery query;
+        query.limit = min<size_t>(max<size_t>(pageSize, 1), 100);
+        query.skip = page * query.limit;
+        ostringstream lines;
+        vector<OrderRecord> found = orders.history(session.user->getId(), query);
+        for (const auto& order : found) {
+            lines << order.orderID << '|' << order.placedAt << '|' << fixed << setprecision(2)
+                  << order.totalCents / 100.0 << '|' << order.items.size() << '\n';
+        }
+        return ok(found.size(), lines.str());
+    }
+
+    // Returns copies from one of the user's orders (or refunds them without
+    // taking them back with "refund-only"). The client's key makes a retry
+    // safe: it repeats the first outcome.
+    string returnCopies(const Session& session, istringstream& args) {
+        ReturnRequest request;
+        string option;
+        if (!(args >> request.key >> request.orderID >> request.bookID >> request.quantity)) {
+            return error("usage: RETURN <key> <orderID> <bookID> <quantity> [refund-only]");
+        }
+        args >> option;
+        request.accountID = session.user->getId();
+        request.restock = option != "refund-only";
+        ReturnOutcome outcome = returns.applyBatch({ request }, orders, catalog, journal, &catalogLock).front();
+        if (outcome.status != RETURN_APPLIED && outcome.status != RETURN_DUPLICATE) {
+            return error(describeReturnStatus(outcome.status));
+        }
+        return ok(1, "refund " + Money::fromCents(outcome.refundCents).toString() + " return " + to_string(outcome.sequence)
+                         + (outcome.status == RETURN_DUPLICATE ? " (already applied)" : "") + "\n");
+    }
+
+    // Continues a session started on an earlier connection (the cart is not
+    // kept across connections)
+    string resume(Session& session, istringstream& args) {
+        string text;
+        args >> text;
+        SessionToken token;
+        SessionManager::Session found;
+        if (!SessionToken::parse(text, token) || !sessions.touch(token) || !sessions.find(token, found)) {
+            return error("unknown or expired session");
+        }
+        const User* user = users.find(found.username);
+        if (!user) return error("unknown or expired session");
+        session.user = user;
+        session.token = token;
+        return ok(0);
+    }
+
+    // Serves one request line; returns false if the connection should close
+    bool handle(Client& client, const string& line) {
+        Session& session = client.session;
+        istringstream args(line);
+        string command;
+        args >> command;
+        string reply;
+        if (command == "QUIT") {
+            if (session.user) sessions.end(session.token); // Logout
+            client.connection.send(ok(0));
+            return false;
+        } else if (command == "LOGIN") {
+            string username, password;
+            args >> username >> password;
+            const User* user = users.authenticate(username, password);
+            if (user) {
+                Metrics::count(COUNT_LOGINS);
+                if (session.user) sessions.end(session.token);
+                session.user = user;
+                session.token = sessions.create(*user);
+                reply = ok(1, session.token.toString() + "\n");
+            } else {
+                reply = error(AuthenticationError().what());
+            }
+        } else if (command == "RESUME") {
+            reply = resume(session, args);
+        } else if (!session.user) {
+            reply = error("login required");
+        } else if (!sessions.touch(session.token)) {
+            session.user = nullptr;
+            releaseCart(session);
+            reply = error("session expired; log in again");
+        } else if (command == "BROWSE") {
+            reply = browse(args);
+        } else if (command == "SEARCH") {
+            reply = search(args);
+        } else if (command == "RECOMMEND") {
+            reply = recommend(args);
+        } else if (command == "ADD") {
+            reply = add(session, args);
+        } else if (command == "REMOVE") {
+            reply = remove(session, args);
+        } else if (command == "CART") {
+            reply = showCart(session);
+        } else if (command == "CHECKOUT") {
+            reply = checkout(session, args);
+        } else if (command == "STATS") {
+            reply = stats();
+        } else if (command == "HISTORY") {
+            reply = history(session, args);
+        } else if (command == "RETURN") {
+            reply = returnCopies(session, args);
+        } else {
+            reply = error("unknown command");
+        }
+        return client.connection.send(reply);
+    }
+
+    // Takes one queued request at a time, from whichever client it came
+    void workerLoop() {
+        while (true) {
+            Client* client;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return stopping || !readyClients.empty(); });
+                if (stopping) return;
+                client = readyClients.front();
+                readyClients.pop_front();
+            }
+            string line;
+            client->connection.takeLine(line);
+            client->closing = !handle(*client, line);
+            lock_guard<mutex> lock(queueMutex);
+            if (!client->closing && client->connection.hasLine()) {
+                readyClients.push_back(client); // Pipelined requests wait their turn behind others
+                queueReady.notify_one();
+            } else {
+                returnedClients.push_back(client);
+                char wake = 0;
+                (void)!write(wakePipe[1], &wake, 1); // A full pipe already wakes the poll loop
+            }
+        }
+    }
+
+    void queue(Client* client) {
+        client->busy = true;
+        lock_guard<mutex> lock(queueMutex);
+        readyClients.push_back(client);
+        queueReady.notify_one();
+    }
+
+    void closeClient(Client* client) {
+        releaseCart(client->session);
+        int fd = client->connection.socket();
+        clients.erase(fd);
+        ::close(fd);
+    }
+
+    // Clients handed back by the workers are polled again, or closed
+    void takeReturnedClients() {
+        vector<Client*> returned;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            returned.swap(returnedClients);
+        }
+        for (Client* client : returned) {
+            client->busy = false;
+            if (client->closing) closeClient(client);
+        }
+    }
+public:
+    BookstoreServer(const UserStore& u, SessionManager& s, Catalog& c, CatalogJournal& j, OrderJournal& o,
+                    ReturnLedger& l, NotificationDispatcher& n, PromotionEngine& p, CoPurchaseRecommender& r,
+                    size_t threads)
+        : users(u), sessions(s), catalog(c), journal(j), orders(o), returns(l), notifications(n), promotions(p),
+          recommendations(r),
+          reservations(c, &j, CART_HOLD_TIMEOUT),
+          listener(-1), wakePipe{ -1, -1 }, stopping(false), workerCount(max<size_t>(1, threads)) {}
+
+    ~BookstoreServer() { stop(); }
+
+    // Binds to 127.0.0.1:port and starts the worker pool
+    bool start(int port) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0) return false;
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0
+            || pipe(wakePipe) != 0) {
+            ::close(listener);
+            listener = -1;
+            return false;
+        }
+        fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+        stopping = false;
+        for (size_t i = 0; i < workerCount; i++) {
+            workers.emplace_back(&BookstoreServer::workerLoop, this);
+        }
+        reservations.startReaper();
+        return true;
+    }
+
+    // Accepts connections and reads requests until stopRequested becomes
+    // true. Each pass polls the listener, the wake pipe and every idle
+    // client; clients with a complete line are queued for the workers.
+    void run(const atomic<bool>& stopRequested) {
+        vector<pollfd> waiting;
+        vector<Client*> polled;
+        while (!stopRequested) {
+            takeReturnedClients();
+            waiting.assign({ { listener, POLLIN, 0 }, { wakePipe[0], POLLIN, 0 } });
+            polled.clear();
+            for (const auto& entry : clients) {
+                if (entry.second->busy) continue;
+                waiting.push_back({ entry.first, POLLIN, 0 });
+                polled.push_back(entry.second.get());
+            }
+            if (poll(waiting.data(), waiting.size(), 200) <= 0) continue;
+            if (waiting[1].revents) {
+                char drained[256];
+                while (read(wakePipe[0], drained, sizeof(drained)) > 0) {}
+            }
+            for (size_t i = 0; i < polled.size(); i++) {
+                if (!waiting[i + 2].revents) continue;
+                Client* client = polled[i];
+                if (!client->connection.fill()) {
+                    closeClient(client);
+                } else if (client->connection.hasLine()) {
+                    queue(client);
+                }
+            }
+            if (waiting[0].revents) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd < 0) continue;
+                int noDelay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                clients.emplace(fd, unique_ptr<Client>(new Client(fd)));
+            }
+        }
+    }
+
+    // Lets the workers finish the requests they are serving, then closes
+    // every connection (releasing its holds) and the listener. Call after
+    // run() has returned.
+    void stop() {
+        if (listener < 0) return;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+            for (const auto& entry : clients) {
+                shutdown(entry.first, SHUT_RDWR); // Unblocks a reply stuck on a full socket
+            }
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        readyClients.clear();
+        returnedClients.clear();
+        for (const auto& entry : clients) {
+            releaseCart(entry.second->session);
+            ::close(entry.first);
+        }
+        clients.clear();
+        reservations.stopReaper();
+        ::close(listener);
+        ::close(wakePipe[0]);
+        ::close(wakePipe[1]);
+        listener = -1;
+    }
+};
+#endif
+
+// Set from SIGINT/SIGTERM to shut the server down cleanly
+atomic<bool> serverStopRequested(false);
+
+// Set from SIGUSR1 to write the stats file now
+atomic<bool> statsDumpRequested(false);
+
+// Entry point of the program
+int main(int argc, char* argv[]) {
+    srand(static_cast<unsigned int>(time(0))); // Seed for random numbers
+
+    // Offline conversion between book_data.txt and the binary snapshot
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "--to-snapshot" || mode == "--to-text") {
+        Catalog converted;
+        if (mode == "--to-snapshot") {
+            if (!loadBooksFromText(converted, BOOK_DATA_FILE) || !saveCatalogSnapshot(converted, BOOK_SNAPSHOT_FILE)) {
+                cout << "Conversion failed.\n";
+                return 1;
+            }
+            cout << "Wrote " << converted.size() << " books to " << BOOK_SNAPSHOT_FILE << ".\n";
+            return 0;
+        } else if (mode == "--to-text") {
+            if (!loadCatalogSnapshot(converted, BOOK_SNAPSHOT_FILE) || !saveBooksToText(converted, BOOK_DATA_FILE)) {
+                cout << "Conversion failed.\n";
+                return 1;
+            }
+            cout << "Wrote " << converted.size() << " books to " << BOOK_DATA_FILE << ".\n";
+            return 0;
+        }
+    }
+
+    // Load generator for a running server:
+    // --loadgen <username> <password> [clients] [requests per client] [port]
+    if (mode == "--loadgen" && argc >= 4) {
+        int clients = argc > 4 ? atoi(argv[4]) : 8;
+        int requests = argc > 5 ? atoi(argv[5]) : 1000;
+        int port = argc > 6 ? atoi(argv[6]) : DEFAULT_SERVER_PORT;
+        runLoadGenerator(port, clients, requests, argv[2], argv[3]);
+        return 0;
+    }
+
+    // Checkout stock persistence, full rewrite against the catalog journal:
+    // --bench-stock [books] [threads] [orders per thread]
+    if (mode == "--bench-stock") {
+        runStockJournalBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 100000,
+                                 argc > 3 ? atoi(argv[3]) : 8, argc > 4 ? atoi(argv[4]) : 2000);
+        return 0;
+    }
+
+    // Order journal throughput on a scratch file: --bench-orders [threads] [orders per thread]
+    if (mode == "--bench-orders") {
+        int threads = argc > 2 ? atoi(argv[2]) : static_cast<int>(max(1u, thread::hardware_concurrency()));
+        int count = argc > 3 ? atoi(argv[3]) : 50000;
+        runOrderJournalBenchmark(threads, count);
+        return 0;
+    }
+
+    // History index queries over a synthetic history: --bench-history [orders] [accounts]
+    if (mode == "--bench-history") {
+        size_t count = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 100000000;
+        int accounts = argc > 3 ? atoi(argv[3]) : 1000;
+        runOrderHistoryBenchmark(count, accounts);
+        return 0;
+    }
+
+    // Memory and allocations of many live carts: --bench-carts [carts]
+    if (mode == "--bench-carts") {
+        runCartBenchmark(argc > 2 ? atoi(argv[2]) : 100000);
+        return 0;
+    }
+
+    // Batch pricing against per-buyer setPay: --bench-pricing [carts]
+    if (mode == "--bench-pricing") {
+        runPricingBenchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+    // Promotion rule evaluation at scale: --bench-promotions [rules]
+    if (mode == "--bench-promotions") {
+        runPromotionBenchmark(argc > 2 ? atoi(argv[2]) : 10000);
+        return 0;
+    }
+
+    // Virtual against compile-time tier dispatch: --bench-tiers [buyers]
+    if (mode == "--bench-tiers") {
+        runTierBenchmark(argc > 2 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+
+    // Sharded user store and password hashing: --bench-logins [users] [cost]
+    if (mode == "--bench-logins") {
+        size_t count = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 10000000;
+        runUserStoreBenchmark(count, argc > 3 ? atoi(argv[3]) : DEFAULT_PASSWORD_COST);
+        return 0;
+    }
+
+    // Session table and idle expiry: --bench-sessions [sessions]
+    if (mode == "--bench-sessions") {
+        runSessionBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000);
+        return 0;
+    }
+
+    // Review log ingest and per-book queries: --bench-reviews [reviews] [books]
+    if (mode == "--bench-reviews") {
+        uint64_t count = argc > 2 ? static_cast<uint64_t>(atoll(argv[2])) : 100000000;
+        runReviewBenchmark(count, argc > 3 ? atoi(argv[3]) : 100000);
+        return 0;
+    }
+
+    // Co-purchase counting and lookups: --bench-recommendations [orders] [books]
+    if (mode == "--bench-recommendations") {
+        size_t count = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 10000000;
+        runRecommendationBenchmark(count, argc > 3 ? atoi(argv[3]) : 100000);
+        return 0;
+    }
+
+    // Bulk return processing: --bench-returns [returns] [batch size]
+    if (mode == "--bench-returns") {
+        size_t count = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000;
+        runReturnBenchmark(count, argc > 3 ? static_cast<size_t>(atoll(argv[3])) : 1000);
+        return 0;
+    }
+
+    // Book listing rendering to /dev/null: --bench-listing [books]
+    if (mode == "--bench-listing") {
+        runListingBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000);
+        return 0;
+    }
+
+    // Lookups by ID and checkout stock updates: --bench-lookups [books...]
+    if (mode == "--bench-lookups") {
+        vector<size_t> bookCounts;
+        for (int i = 2; i < argc; i++) {
+            bookCounts.push_back(static_cast<size_t>(atoll(argv[i])));
+        }
+        if (bookCounts.empty()) bookCounts = { 10000, 1000000 };
+        runLookupBenchmark(bookCounts);
+        return 0;
+    }
+
+    // Keyword search throughput: --bench-search [books] [queries]
+    if (mode == "--bench-search") {
+        runSearchBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000,
+                           argc > 3 ? static_cast<size_t>(atoll(argv[3])) : 2000);
+        return 0;
+    }
+
+    // book_data.txt parsing, old getline loader against the parallel one: --bench-load [books]
+    if (mode == "--bench-load") {
+        runLoadBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 5000000);
+        return 0;
+    }
+
+    // Filtered browsing at several selectivities: --bench-filter [books]
+    if (mode == "--bench-filter") {
+        runFilterBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 5000000);
+        return 0;
+    }
+
+    // Whole-catalog scans, columns against a vector<Book>: --bench-columns [books]
+    if (mode == "--bench-columns") {
+        runColumnScanBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 5000000);
+        return 0;
+    }
+
+    // Case-insensitive substring kernels: --bench-matcher [megabytes of text]
+    if (mode == "--bench-matcher") {
+        runMatcherBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 256);
+        return 0;
+    }
+
+    // Catalog snapshot save and load on a scratch file: --bench-snapshot [books]
+    if (mode == "--bench-snapshot") {
+        runSnapshotBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 1000000);
+        return 0;
+    }
+
+    // Timer and counter overhead and histogram accuracy: --bench-metrics [events]
+    if (mode == "--bench-metrics") {
+        runMetricsBenchmark(argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 10000000);
+        return 0;
+    }
+
+    // Reservation stress run on a scratch catalog: --stress-stock [threads] [operations per thread]
+    if (mode == "--stress-stock") {
+        int threads = argc > 2 ? atoi(argv[2]) : static_cast<int>(max(1u, thread::hardware_concurrency()));
+        int operations = argc > 3 ? atoi(argv[3]) : 200000;
+        return runStockStressTest(threads, operations) ? 0 : 1;
+    }
+
+    if (!mode.empty() && mode != "--server") {
+        cout << "Usage: " << argv[0] << " [--to-snapshot | --to-text | --server [port] [threads]"
+             << " | --loadgen <username> <password> [clients] [requests] [port]"
+             << " | --stress-stock [threads] [operations] | --bench-orders [threads] [orders]"
+             << " | --bench-stock [books] [threads] [orders]"
+             << " | --bench-history [orders] [accounts] | --bench-carts [carts] | --bench-pricing [carts]"
+             << " | --bench-promotions [rules] | --bench-tiers [buyers] | --bench-logins [users] [cost]"
+             << " | --bench-sessions [sessions] | --bench-reviews [reviews] [books]"
+             << " | --bench-recommendations [orders] [books] | --bench-returns [returns] [batch size]"
+             << " | --bench-listing [books] | --bench-snapshot [books] | --bench-lookups [books...]"
+             << " | --bench-search [books] [queries] | --bench-matcher [megabytes] | --bench-columns [books]"
+             << " | --bench-filter [books] | --bench-load [books] | --bench-metrics [events]]\n";
+        return 1;
+    }
+
+    // Load users and books from files
+    UserStore users;
+    if (!users.open(USER_DATA_FILE)) {
+        cout << "Error opening user data.\n";
+        return 1;
+    }
+    Catalog catalog;
+    loadBooksFromFile(catalog);
+    // Apply stock/price/rating changes logged since the base files were written
+    CatalogJournal journal;
+    if (!journal.open(CATALOG_JOURNAL_FILE, catalog)) {
+        cout << "Error opening catalog journal.\n";
+        return 1;
+    }
+    OrderJournal orders;
+    if (!orders.open(ORDER_JOURNAL_FILE)) {
+        cout << "Error opening order journal.\n";
+        return 1;
+    }
+    ReviewStore reviews;
+    if (!reviews.open(REVIEWS_FILE)) {
+        cout << "Error opening reviews.\n";
+        return 1;
+    }
+    // Returns and refunds; restocks any the catalog journal missed
+    ReturnLedger returns;
+    if (!returns.open(RETURNS_FILE, catalog, journal)) {
+        cout << "Error opening the returns ledger.\n";
+        return 1;
+    }
+    // "Customers also bought", recounted from the orders placed so far
+    CoPurchaseRecommender recommendations;
+    recommendations.rebuild(orders);
+
+    // Coupon and promotion rules, with the redemptions counted so far
+    PromotionEngine promotions;
+    promotions.load(PROMOTIONS_FILE);
+    if (!promotions.openUsage(PROMOTION_USAGE_FILE)) {
+        cout << "Could not open " << PROMOTION_USAGE_FILE << "; coupon usage is not saved this run.\n";
+    }
+
+    // Ensure admin user exists
+    if (!users.find("admin")) {
+        users.registerUser("admin", "admin123", 0); // Admin user
+    }
+
+    // Order emails go out in the background; whatever is still queued is
+    // delivered when this goes out of scope
+    NotificationDispatcher notifications(make_unique<FileNotificationSink>(NOTIFICATION_OUTBOX_FILE), 2);
+
+    // Logged-in sessions, restored from the last snapshot; idle ones expire
+    SessionManager sessions(SESSION_IDLE_TIMEOUT);
+    sessions.loadSnapshot(SESSION_DATA_FILE);
+    sessions.start(SESSION_DATA_FILE);
+
+    // Timer and counter report, rewritten every STATS_DUMP_INTERVAL; on POSIX
+    // `kill -USR1 <pid>` writes it at once
+    MetricsReporter statsReporter;
+    statsReporter.start(STATS_FILE, STATS_DUMP_INTERVAL, &statsDumpRequested);
+#if defined(BOOKSTORE_POSIX)
+    signal(SIGUSR1, [](int) { statsDumpRequested = true; });
+#endif
+
+    // Serve many shoppers over a local socket instead of this terminal
+    if (mode == "--server") {
+#if defined(BOOKSTORE_POSIX)
+        int port = argc > 2 ? atoi(argv[2]) : DEFAULT_SERVER_PORT;
+        size_t threads = argc > 3 ? static_cast<size_t>(atoi(argv[3])) : max(4u, 2 * thread::hardware_concurrency());
+        BookstoreServer server(users, sessions, catalog, journal, orders, returns, notifications, promotions,
+                               recommendations, threads);
+        if (!server.start(port)) {
+            cout << "Could not listen on port " << port << ".\n";
+            return 1;
+        }
+        signal(SIGINT, [](int) { serverStopRequested = true; });
+        signal(SIGTERM, [](int) { serverStopRequested = true; });
+        cout << "Serving on 127.0.0.1:" << port << " with " << threads << " worker threads. Press Ctrl+C to stop.\n";
+        server.run(serverStopRequested);
+        server.stop();
+        journal.commit();
+        cout << "Server stopped. Delivering queued notifications...\n";
+        notifications.stop();
+        NotificationDispatcher::Stats sent = notifications.stats();
+        cout << sent.delivered << " notifications in " << sent.batches << " batches (peak queue depth "
+             << sent.maxDepth << ", " << sent.fullWaits << " waits on a full queue).\n";
+        return 0;
+#else
+        cout << "Server mode is not supported on this platform.\n";
+        return 1;
+#endif
+    }
+
+    // Checkout takes its copies through the same holds as the server
+    StockReservations reservations(catalog, &journal, CART_HOLD_TIMEOUT);
+
+    SessionArena sessionArena;
+    Cart shoppingCart(sessionArena.resource());
+    Wishlist wishlist(sessionArena.resource());
+    Buyer* buyer = nullptr;
+
+    showWelcomeMessage();
+
+    // User authentication
+    int choice;
+    cout << "1. Register\n2. Login\nChoose an option: ";
+    cin >> choice;
+    cin.ignore();
+
+    User currentUser;
+
+    try {
+        if (choice == 1) {
+            userRegistration(users);
+            currentUser = userLogin(users);
+        } else if (choice == 2) {
+            currentUser = userLogin(users);
+        } else {
+            cout << "Invalid choice. Exiting.\n";
+            return 0;
+        }
+    } catch (AuthenticationError& e) {
+        cout << e.what() << endl;
+        return 0;
+    }
+
+    // Start user session
+    SessionToken sessionToken = sessions.create(currentUser);
+    cout << "User session started for " << currentUser.getUsername() << endl;
+
+    // Check if the user is an admin
+    if (currentUser.getUsername() == "admin") {
+        Admin admin(currentUser);
+        adminMenu(admin, catalog, journal);
+        compactCatalogJournal(catalog, journal);
+        sessions.end(sessionToken);
+        return 0;
+    }
+
+    // Proceed with shopping
+    int buyerType = 0;
+    int id = currentUser.getId();
+
+    // Determine buyer type based on ID
+    buyerType = buyerTypeForId(id);
+    if (buyerType == 0) {
+        cout << "Invalid buyer ID. Exiting the system.\n";
+        sessions.end(sessionToken);
+        return 0;
+    }
+
+    // Create appropriate buyer object
+    buyer = createBuyer(buyerType);
+    if (!buyer) {
+        cout << "Error determining buyer type.\n";
+        sessions.end(sessionToken);
+        return 0;
+    }
+
+    buyer->getId();
+    buyer->getBuyName();
+    buyer->getAddress();
+
+    // Additional details based on buyer type
+    if (buyerType == GoldTier::TYPE) {
+        static_cast<Member*>(buyer)->getStarLevel();
+    } else if (buyerType == DiamondTier::TYPE) {
+        static_cast<HonoredGuest*>(buyer)->getDiscountRate();
+    }
+
+    // Main menu loop
+    bool exitProgram = false;
+    while (!exitProgram) {
+        if (!sessions.touch(sessionToken)) {
+            cout << "Your session has expired after " << SESSION_IDLE_TIMEOUT.count()
+                 << " minutes without activity. Please log in again.\n";
+            break;
+        }
+        cout << "\n--- Main Menu ---\n";
+        cout << "1. Browse Books\n2. Search Books\n3. View Cart\n4. View Wishlist\n5. View Order History\n6. Checkout\n7. Filter Books\n8. Rate a Book\n9. Read Reviews\n10. Return or Refund\n11. Logout\nChoose an option: ";
+        int mainChoice;
+        cin >> mainChoice;
+        cin.ignore();
+
+        switch (mainChoice) {
+            case 1:
+                displayBookList(catalog);
+                addBooksToCart(shoppingCart, catalog, recommendations);
+                break;
+            case 2:
+                searchBooks(catalog, recommendations);
+                break;
+            case 3:
+                viewCart(shoppingCart, catalog);
+                break;
+            case 4:
+                viewWishlist(wishlist, catalog);
+                break;
+            case 5:
+                viewOrderHistory(orders, returns, currentUser);
+                break;
+            case 6: {
+                if (shoppingCart.empty()) {
+                    cout << "Your cart is empty.\n";
+                    break;
+                }
+                // Hold every copy first, so a cart that no longer fits the
+                // stock is turned away before payment and stock never goes
+                // below zero
+                vector<StockReservations::Handle> holds;
+                if (!reserveCart(reservations, shoppingCart, catalog, holds)) {
+                    break;
+                }
+                // Gift Option
+                handleGiftOption(shoppingCart);
+                // Calculate total amount, then price in coupons and promotions
+                buyer->setPay(calculateTotal(shoppingCart, catalog));
+                vector<uint32_t> redeemed = applyCoupon(promotions, buyer, buyerType, shoppingCart, catalog);
+                // Display order details
+                buyer->display();
+                // Process payment
+                processPayment(buyer);
+                // Record the order, update stock and persist both; timed
+                // apart from the prompts above
+                {
+                    ScopedTimer timer(TIME_CHECKOUT);
+                    // Sell the held copies; this journals the new stock
+                    if (!reservations.commit(holds)) {
+                        for (const auto& hold : holds) {
+                            reservations.release(hold);
+                        }
+                        promotions.unredeem(redeemed);
+                        cout << "Your reserved copies were released. Please check out again.\n";
+                        break;
+                    }
+                    saveOrder(orders, currentUser, buyer, shoppingCart, catalog);
+                    recommendations.recordOrder(shoppingCart);
+                    // Persist the order and stock changes: log appends and group
+                    // commits instead of rewriting files on every order
+                    bool saved = orders.commit();
+                    saved = journal.commit() && saved;
+                    if (!saved) {
+                        shoppingCart.clear();
+                        cout << "Your order was placed but could not be saved. Please contact the store.\n";
+                        break;
+                    }
+                    if (journal.needsCompaction()) {
+                        compactCatalogJournal(catalog, journal);
+                    }
+                }
+                // Clear cart
+                shoppingCart.clear();
+                // Send email notification
+                sendEmailNotification(notifications, currentUser, "Your order has been placed successfully!");
+                cout << "A confirmation email to " << currentUser.getUsername() << " is on its way.\n";
+                break;
+            }
+            case 7:
+                filterBooks(catalog);
+                break;
+            case 8:
+                rateBook(catalog, journal, reviews, currentUser);
+                break;
+            case 9:
+                showReviews(catalog, reviews);
+                break;
+            case 10:
+                returnOrRefund(returns, orders, catalog, journal, currentUser);
+                break;
+            case 11:
+                sessions.end(sessionToken);
+                exitProgram = true;
+                break;
+            default:
+                cout << "Invalid choice. Try again.\n";
+                break;
+        }
+    }
+
+    // Clean up
+    delete buyer;
+
+    cout << "\nThank you for visiting the Online Bookstore!\n";
+
+    return 0;
+}
+
+// Function Definitions
+
+void showWelcomeMessage() {
+    cout << "**********************************\n";
+    cout << "* Welcome to the Online Bookstore *\n";
+    cout << "**********************************\n\n";
+}
+
+// Renders a listing a page at a time (rowAt(i) gives row i), asking before
+// each further page, so a large catalog only formats what is looked at
+template<class RowAt>
+void showPaged(size_t total, RowAt rowAt, bool withHeader) {
+    ListingRenderer renderer(cout);
+    ListingCursor cursor;
+    if (withHeader) renderer.header();
+    while (true) {
+        cursor.renderPage(renderer, total, rowAt);
+        renderer.flush();
+        if (cursor.atEnd(total)) return;
+        cout << "Showing " << cursor.offset << " of " << total << " books. Show the next page? (y/n): ";
+        char more;
+        cin >> more;
+        cin.ignore();
+        if (tolower(more) != 'y') return;
+    }
+}
+
+void displayBookList(const Catalog& catalog) {
+    cout << "\nAvailable Books:\n";
+    showPaged(catalog.size(), [&catalog](size_t slot) { return catalog.at(slot); }, true);
+}
+
+void addBooksToCart(Cart& cart, const Catalog& catalog, const CoPurchaseRecommender& recommendations) {
+    char choice = 'y';
+    while (tolower(choice) == 'y') {
+        int bookID = 0;
+        int quantity = 0;
+        cout << "Enter the ID of the book you want to add to your cart: ";
+        cin >> bookID;
+        cin.ignore(); // Clear the input buffer
+
+        BookView book = catalog.findBook(bookID);
+
+        if (book) {
+            cout << "Enter quantity: ";
+            cin >> quantity;
+            cin.ignore();
+            int available = book.getStockQuantity() - cart.quantityOf(bookID);
+            if (quantity > available) {
+                cout << "Only " << max(available, 0) << " more copies available.\n";
+                quantity = available;
+            }
+            if (quantity > 0) {
+                ScopedTimer timer(TIME_ADD_TO_CART);
+                cart.add(bookID, quantity);
+                cout << "\"" << book.getTitle() << "\" has been added to your cart.\n";
+                showAlsoBought(recommendations, catalog, book);
+            }
+        } else {
+            cout << "Book with ID " << bookID << " not found.\n";
+        }
+        cout << "Do you want to add another book to your cart? (y/n): ";
+        cin >> choice;
+        cin.ignore();
+    }
+}
+
+void showAlsoBought(const CoPurchaseRecommender& recommendations, const Catalog& catalog, BookView book) {
+    const size_t SHOWN = 3;
+    size_t shown = 0;
+    // Ask for extra in case some were removed from the catalog since
+    for (const auto& suggestion : recommendations.alsoBought(book.getBookID(), CoPurchaseRecommender::SLOTS)) {
+        BookView partner = catalog.findBook(suggestion.bookID);
+        if (!partner) continue;
+        if (shown == 0) {
+            cout << "Customers who bought \"" << book.getTitle() << "\" also bought:\n";
+        }
+        cout << "  - " << partner.getTitle() << " by " << partner.getAuthor() << " (ID " << partner.getBookID() << ")\n";
+        if (++shown == SHOWN) break;
+    }
+}
+
+Money calculateTotal(const Cart& cart, const Catalog& catalog) {
+    cout << "\nBooks in your cart:\n";
+    for (const auto& line : cart) {
+        BookView book = catalog.findBook(line.bookID);
+        if (book) {
+            cout << "- " << book.getTitle() << " x" << line.quantity << " ($" << book.getUnitPrice() << " each)\n";
+        }
+    }
+    Money total = cartTotal(cart, catalog);
+    cout << "Total amount before discount: $" << total << endl;
+    return total;
+}
+
+// Holds every line of the cart; if one line no longer fits the stock, says
+// so, gives back the holds already taken and returns false
+bool reserveCart(StockReservations& reservations, const Cart& cart, const Catalog& catalog,
+                 vector<StockReservations::Handle>& holds) {
+    for (const auto& line : cart) {
+        StockReservations::Handle hold = reservations.reserve(line.bookID, line.quantity);
+        if (!hold) {
+            BookView book = catalog.findBook(line.bookID);
+            if (book) {
+                cout << "Only " << max(book.getStockQuantity(), 0) << " copies of \"" << book.getTitle()
+                     << "\" are left. Please update your cart.\n";
+            } else {
+                cout << "Book " << line.bookID << " is no longer available. Please update your cart.\n";
+            }
+            for (const auto& taken : holds) {
+                reservations.release(taken);
+            }
+            holds.clear();
+            return false;
+        }
+        holds.push_back(hold);
+    }
+    return true;
+}
+
+// Books no longer in the catalog are skipped
+Money cartTotal(const Cart& cart, const Catalog& catalog) {
+    Money total;
+    for (const auto& line : cart) {
+        BookView book = catalog.findBook(line.bookID);
+        if (book) {
+            total += book.getUnitPrice() * line.quantity;
+        }
+    }
+    return total;
+}
+
+// Returns nullptr for an invalid buyer type; the caller owns the result
+Buyer* createBuyer(int buyerType) {
+    switch (buyerType) {
+        case GoldTier::TYPE:
+            return new Member();
+        case DiamondTier::TYPE:
+            return new HonoredGuest();
+        case OrdinaryTier::TYPE:
+            return new Layfolk();
+        default:
+            return nullptr;
+    }
+}
+
+uint64_t saveOrder(OrderJournal& orders, const User& user, Buyer* buyer, const Cart& cart, const Catalog& catalog) {
+    ScopedTimer timer(TIME_SAVE_ORDER);
+    Metrics::count(COUNT_ORDERS);
+    OrderRecord order;
+    order.placedAt = static_cast<int64_t>(time(nullptr));
+    order.accountID = user.getId();
+    order.buyerNumber = buyer->getBuyerID();
+    order.name = buyer->getBuyerName();
+    order.address = buyer->getBuyerAddress();
+    order.totalCents = buyer->getPay().getCents();
+    order.items.reserve(cart.size());
+    for (const auto& line : cart) {
+        BookView book = catalog.findBook(line.bookID);
+        if (book) {
+            order.items.push_back({ line.bookID, line.quantity, book.getUnitPrice().getCents(),
+                                    string(book.getTitle()), string(book.getAuthor()) });
+        }
+    }
+    return orders.append(order);
+}
+
+void viewCart(const Cart& cart, const Catalog& catalog) {
+    if (cart.empty()) {
+        cout << "Your cart is empty.\n";
+        return;
+    }
+    cout << "\nYour Shopping Cart:\n";
+    for (const auto& line : cart) {
+        BookView book = catalog.findBook(line.bookID);
+        if (book) {
+            cout << "- " << book.getTitle() << " x" << line.quantity << " ($" << book.getUnitPrice() << " each)\n";
+        } else {
+            cout << "- Book " << line.bookID << " x" << line.quantity << " (no longer available)\n";
+        }
+    }
+}
+
+void removeBookFromCart(Cart& cart) {
+    if (cart.empty()) {
+        cout << "Your cart is empty.\n";
+        return;
+    }
+    int bookID;
+    cout << "Enter the ID of the book to remove from your cart: ";
+    cin >> bookID;
+    cin.ignore();
+
+    if (cart.remove(bookID)) {
+        cout << "Book removed from your cart.\n";
+    } else {
+        cout << "Book not found in your cart.\n";
+    }
+}
+
+void updateBookQuantity(Cart& cart) {
+    if (cart.empty()) {
+        cout << "Your cart is empty.\n";
+        return;
+    }
+    int bookID, newQuantity;
+    cout << "Enter the ID of the book to update quantity: ";
+    cin >> bookID;
+    cin.ignore();
+
+    if (cart.quantityOf(bookID) > 0) {
+        cout << "Enter new quantity: ";
+        cin >> newQuantity;
+        cin.ignore();
+        cart.setQuantity(bookID, newQuantity);
+        cout << "Quantity updated.\n";
+    } else {
+        cout << "Book not found in your cart.\n";
+    }
+}
+
+void userRegistration(UserStore& users) {
+    string username, password;
+    int id;
+    cout << "Enter a username: ";
+    getline(cin, username);
+    if (username.empty() || any_of(username.begin(), username.end(), [](char c) { return isspace(static_cast<unsigned char>(c)); })) {
+        cout << "Usernames cannot be empty or contain spaces.\n";
+        return;
+    }
+    if (users.find(username)) {
+        cout << "Username already exists. Try logging in.\n";
+        return;
+    }
+    cout << "Enter a password: ";
+    getline(cin, password);
+    cout << "Enter your buyer ID: ";
+    cin >> id;
+    cin.ignore();
+
+    // Saved as soon as it is added; no full rewrite of the user file
+    if (!users.registerUser(username, password, id)) {
+        cout << "Username already exists. Try logging in.\n";
+        return;
+    }
+    cout << "Registration successful.\n";
+}
+
+User userLogin(const UserStore& users) {
+    string username, password;
+    cout << "Enter your username: ";
+    getline(cin, username);
+    cout << "Enter your password: ";
+    getline(cin, password);
+
+    const User* user = users.authenticate(username, password);
+    if (user) {
+        Metrics::count(COUNT_LOGINS);
+        cout << "Login successful.\n";
+        User loggedIn = *user;
+        loggedIn.setLoggedIn(true);
+        return loggedIn;
+    } else {
+        throw AuthenticationError();
+    }
+}
+
+// Prints one journaled order in the same layout as the old order files
+void displayOrder(const OrderRecord& order, int64_t refundedCents) {
+    char placed[32];
+    time_t placedAt = static_cast<time_t>(order.placedAt);
+    tm local = localTime(placedAt);
+    strftime(placed, sizeof(placed), "%Y-%m-%d %H:%M", &local);
+    cout << "----- Order #" << order.orderID << " (" << placed << ") -----\n";
+    cout << "Name: " << order.name << endl;
+    cout << "Buyer ID: " << order.buyerNumber << endl;
+    cout << "Address: " << order.address << endl;
+    cout << "Books Purchased:\n";
+    for (const auto& item : order.items) {
+        cout << "- " << item.title << " by " << item.author << " x" << item.quantity
+             << " ($" << fixed << setprecision(2) << item.priceCents / 100.0 << " each)\n";
+    }
+    cout << "Total Amount Paid: $" << fixed << setprecision(2) << order.totalCents / 100.0 << "\n";
+    if (refundedCents > 0) {
+        cout << "Refunded: $" << fixed << setprecision(2) << refundedCents / 100.0 << "\n";
+    }
+    cout << "\n";
+}
+
+// Reads a YYYY-MM-DD date as local midnight; returns false if malformed
+bool parseDate(const string& text, int64_t& time) {
+    tm date = {};
+    istringstream in(text);
+    in >> get_time(&date, "%Y-%m-%d");
+    if (in.fail()) return false;
+    date.tm_isdst = -1;
+    time = static_cast<int64_t>(mktime(&date));
+    return true;
+}
+
+// Shows the most recent orders, or pages through a date range
+void viewOrderHistory(OrderJournal& orders, ReturnLedger& returns, const User& user) {
+    const size_t PAGE_SIZE = 10;
+    size_t total = orders.countFor(user.getId());
+    if (total == 0) {
+        cout << "No order history found.\n";
+        return;
+    }
+    cout << "\nYou have placed " << total << " order(s).\n";
+    cout << "1. Most recent orders\n2. Orders between two dates\nChoose an option: ";
+    int choice;
+    cin >> choice;
+    cin.ignore();
+
+    OrderQuery query;
+    if (choice == 1) {
+        cout << "How many orders (default " << PAGE_SIZE << "): ";
+        string count;
+        getline(cin, count);
+        query.limit = count.empty() ? PAGE_SIZE : static_cast<size_t>(max(1, atoi(count.c_str())));
+        cout << "\nYour Order History:\n";
+        for (const auto& order : orders.history(user.getId(), query)) {
+            displayOrder(order, returns.refundedCents(order.orderID));
+        }
+        return;
+    }
+    if (choice != 2) {
+        cout << "Invalid choice.\n";
+        return;
+    }
+
+    string from, to;
+    cout << "From date (YYYY-MM-DD): ";
+    getline(cin, from);
+    cout << "To date (YYYY-MM-DD): ";
+    getline(cin, to);
+    if (!parseDate(from, query.from) || !parseDate(to, query.to)) {
+        cout << "Invalid date.\n";
+        return;
+    }
+    query.to += 24 * 60 * 60 - 1; // Through the end of the last day
+    query.limit = PAGE_SIZE;
+    size_t matching = 0;
+    while (true) {
+        vector<OrderRecord> page = orders.history(user.getId(), query, &matching);
+        if (matching == 0) {
+            cout << "No orders in that period.\n";
+            return;
+        }
+        size_t pages = (matching + PAGE_SIZE - 1) / PAGE_SIZE;
+        cout << "\nOrders " << from << " to " << to << " (page " << query.skip / PAGE_SIZE + 1
+             << " of " << pages << ", newest first):\n";
+        for (const auto& order : page) {
+            displayOrder(order, returns.refundedCents(order.orderID));
+        }
+        if (query.skip + PAGE_SIZE >= matching) return;
+        cout << "Show the next page? (y/n): ";
+        char more;
+        cin >> more;
+        cin.ignore();
+        if (tolower(more) != 'y') return;
+        query.skip += PAGE_SIZE;
+    }
+}
+
+void adminMenu(Admin& admin, Catalog& catalog, CatalogJournal& journal) {
+    int choice;
+    do {
+        cout << "\n--- Admin Menu ---\n";
+        cout << "1. Add Book\n2. Remove Book\n3. Update Book Stock\n4. Update Book Price\n5. View Books\n6. View Statistics\n7. Exit\nChoose an option: ";
+        cin >> choice;
+        cin.ignore();
+        switch (choice) {
+            case 1:
+                admin.addBook(catalog);
+                break;
+            case 2:
+                admin.removeBook(catalog);
+                break;
+            case 3:
+                admin.updateBookStock(catalog, journal);
+                break;
+            case 4:
+                admin.updateBookPrice(catalog, journal);
+                break;
+            case 5:
+                displayBookList(catalog);
+                cout << "Total inventory value: $" << fixed << setprecision(2) << catalog.totalInventoryValue() << endl;
+                break;
+            case 6:
+                cout << Metrics::report();
+                break;
+            case 7:
+                cout << "Exiting Admin Menu.\n";
+                break;
+            default:
+                cout << "Invalid choice. Try again.\n";
+                break;
+        }
+    } while (choice != 7);
+}
+
+// Builds the checkout context, redeems every promotion that applies and
+// prices the cart with the buyer's tier and those promotions. Rules whose
+// usage cap is used up are skipped. Returns the rules applied.
+vector<uint32_t> applyPromotions(PromotionEngine& promotions, Buyer* buyer, int buyerType, const vector<string>& codes,
+                                 const Cart& cart, const Catalog& catalog) {
+    CheckoutContext context;
+    context.buyerType = buyerType;
+    context.starLevel = buyerType == GoldTier::TYPE ? static_cast<Member*>(buyer)->getStars() : 0;
+    context.now = static_cast<int64_t>(time(nullptr));
+    PricingBatch batch;
+    batch.addCart(buyer->getTierBasisPoints());
+    Money subtotal;
+    for (const auto& line : cart) {
+        BookView book = catalog.findBook(line.bookID);
+        if (!book) continue;
+        string author(book.getAuthor());
+        transform(author.begin(), author.end(), author.begin(), foldCase);
+        int authorID = promotions.authorID(author);
+        Money lineTotal = book.getUnitPrice() * line.quantity;
+        subtotal += lineTotal;
+        batch.addLine(book.getUnitPrice(), line.quantity);
+        context.bookIDs.push_back(line.bookID);
+        if (authorID >= 0) context.authorIDs.push_back(authorID);
+        context.lineCents.push_back(make_pair(line.bookID, lineTotal.getCents()));
+        context.lineAuthorIDs.push_back(authorID);
+    }
+    context.subtotalCents = subtotal.getCents();
+    sort(context.bookIDs.begin(), context.bookIDs.end());
+    sort(context.authorIDs.begin(), context.authorIDs.end());
+
+    vector<uint32_t> applied;
+    for (uint32_t index : promotions.evaluate(context, codes)) {
+        if (promotions.redeem(index)) {
+            promotions.addDiscounts(index, context, batch);
+            applied.push_back(index);
+        }
+    }
+    if (!applied.empty()) {
+        PricingResult result;
+        PricingEngine(0).price(batch, result);
+        buyer->setPayable(Money::fromCents(result.totalCents[0]));
+    }
+    return applied;
+}
+
+// Call after setPay: asks for coupon codes and applies them together with
+// any automatic promotions. Returns the rules redeemed, which the caller
+// gives back with PromotionEngine::unredeem if the checkout fails.
+vector<uint32_t> applyCoupon(PromotionEngine& promotions, Buyer* buyer, int buyerType, const Cart& cart, const Catalog& catalog) {
+    vector<string> codes;
+    char choice;
+    cout << "Do you have a discount coupon? (y/n): ";
+    cin >> choice;
+    cin.ignore();
+    if (tolower(choice) == 'y') {
+        string line, code;
+        cout << "Enter coupon code(s), separated by spaces: ";
+        getline(cin, line);
+        istringstream in(line);
+        while (in >> code) {
+            codes.push_back(code);
+        }
+    }
+    vector<uint32_t> applied = applyPromotions(promotions, buyer, buyerType, codes, cart, catalog);
+    size_t couponsApplied = 0;
+    for (uint32_t index : applied) {
+        const PromotionEngine::Rule& rule = promotions.rule(index);
+        cout << (rule.code.empty() ? "Promotion" : "Coupon " + rule.code) << " applied: "
+             << (rule.percent ? to_string(rule.amount / 100) + "% off" : "$" + Money::fromCents(rule.amount).toString() + " off")
+             << (rule.linesOnly ? " eligible books" : "") << ".\n";
+        couponsApplied += rule.code.empty() ? 0 : 1;
+    }
+    if (!codes.empty() && couponsApplied == 0) {
+        cout << "Invalid coupon code, or this order does not qualify.\n";
+    }
+    return applied;
+}
+
+void processPayment(Buyer* buyer) {
+    cout << "\nProcessing payment...\n";
+    cout << "Payment of $" << buyer->getPay() << " successful.\n";
+}
+
+void saveBooksToFile(const Catalog& catalog) {
+    ScopedTimer timer(TIME_SAVE_BOOKS);
+    if (!saveBooksToText(catalog, BOOK_DATA_FILE)) {
+        cout << "Error saving book data.\n";
+        return;
+    }
+    // Keep the snapshot in step with the text file so the next start can use it
+    if (!saveCatalogSnapshot(catalog, BOOK_SNAPSHOT_FILE)) {
+        cout << "Error saving book snapshot.\n";
+    }
+}
+
+// Writes the whole catalog to the base files and empties the journal
+void compactCatalogJournal(const Catalog& catalog, CatalogJournal& journal) {
+    ScopedTimer timer(TIME_SAVE_BOOKS);
+    if (!saveBooksToText(catalog, BOOK_DATA_FILE) || !saveCatalogSnapshot(catalog, BOOK_SNAPSHOT_FILE)) {
+        cout << "Error saving book data. Keeping the catalog journal.\n";
+        return;
+    }
+    if (!journal.reset()) {
+        // Harmless: replaying the kept records over the new base files
+        // gives the same catalog
+        cout << "Could not empty the catalog journal. It is kept and replayed on the next start.\n";
+    }
+}
+
+bool saveBooksToText(const Catalog& catalog, const string& path) {
+    // Write to a temporary file and rename, so a crash never leaves a half-written catalog
+    string tempPath = path + ".tmp";
+    ofstream bookFile(tempPath);
+    if (!bookFile) {
+        return false;
+    }
+    for (const auto& book : catalog) {
+        bookFile << book.getBookID() << "|"
+                 << book.getTitle() << "|"
+                 << book.getAuthor() << "|"
+                 << book.getPrice() << "|"
+                 << book.getOnHandQuantity() << "|"
+                 << book.getAverageRating() << "|"
+                 << RatingTally::formatSum(book.getRatingTally()) << "|"
+                 << book.getRatingCount() << endl;
+    }
+    bookFile.close();
+    if (!bookFile || !syncFileToDisk(tempPath)) {
+        return false;
+    }
+    error_code error;
+    Metrics::count(COUNT_BYTES_WRITTEN, filesystem::file_size(tempPath, error));
+    filesystem::rename(tempPath, path, error);
+    return !error;
+}
+
+// Header checksum of a catalog snapshot: every field before `checksum`
+inline uint64_t catalogSnapshotHeaderChecksum(const SnapshotHeader& header) {
+    return snapshotChecksum(reinterpret_cast<const char*>(&header), offsetof(SnapshotHeader, checksum));
+}
+
+bool saveCatalogSnapshot(const Catalog& catalog, const string& path) {
+    size_t count = catalog.size();
+    vector<int> ids, stocks;
+    vector<double> prices;
+    vector<uint64_t> ratings;
+    vector<StringPool::Ref> titles, authors;
+    ids.reserve(count);
+    stocks.reserve(count);
+    prices.reserve(count);
+    ratings.reserve(count);
+    titles.reserve(count);
+    authors.reserve(count);
+    string heap;
+    for (const auto& book : catalog) {
+        ids.push_back(book.getBookID());
+        stocks.push_back(book.getOnHandQuantity());
+        prices.push_back(book.getPrice());
+        ratings.push_back(book.getRatingTally());
+        titles.push_back({ heap.size(), book.getTitle().size() });
+        heap.append(book.getTitle().data(), book.getTitle().size());
+        authors.push_back({ heap.size(), book.getAuthor().size() });
+        heap.append(book.getAuthor().data(), book.getAuthor().size());
+    }
+    // Index the slots as they are written; a load maps this table directly
+    SlotIndex index;
+    index.rebuild(ids.data(), count);
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.recordSize = CATALOG_SNAPSHOT_BOOK_BYTES;
+    header.count = count;
+    header.heapSize = heap.size();
+    header.checksum = catalogSnapshotHeaderChecksum(header);
+    CatalogSnapshotLayout layout(count, heap.size());
+
+    // Write to a temporary file and rename, so a crash never leaves a half-written snapshot
+    string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    if (!out) {
+        return false;
+    }
+    uint64_t written = 0;
+    auto section = [&](uint64_t offset, const void* data, size_t size) {
+        static const char padding[64] = {};
+        out.write(padding, static_cast<streamsize>(offset - written));
+        out.write(static_cast<const char*>(data), static_cast<streamsize>(size));
+        written = offset + size;
+    };
+    section(0, &header, sizeof(header));
+    section(layout.ids, ids.data(), count * sizeof(int));
+    section(layout.stocks, stocks.data(), count * sizeof(int));
+    section(layout.prices, prices.data(), count * sizeof(double));
+    section(layout.ratings, ratings.data(), count * sizeof(uint64_t));
+    section(layout.titles, titles.data(), count * sizeof(StringPool::Ref));
+    section(layout.authors, authors.data(), count * sizeof(StringPool::Ref));
+    section(layout.index, index.entries(), index.capacity() * sizeof(uint32_t));
+    section(layout.heap, heap.data(), heap.size());
+    out.close();
+    if (!out || !syncFileToDisk(tempPath)) {
+        return false;
+    }
+    Metrics::count(COUNT_BYTES_WRITTEN, layout.end);
+    error_code error;
+    filesystem::rename(tempPath, path, error);
+    return !error;
+}
+
+// Points an empty catalog's columns, index and string pool into private
+// mappings of the snapshot, so only the header is read now and pages are
+// faulted in as books are used. Writes (stock, prices, ratings) copy just the
+// pages they touch; adding or removing a book first copies the affected
+// columns into memory. Available stock gets a second mapping of the stock
+// section, since it drifts from the copies on hand. A catalog that already
+// holds books gets copies of the snapshot's rows instead.
+bool loadCatalogSnapshot(Catalog& catalog, const string& path) {
+    shared_ptr<MappedFile> snapshot = make_shared<MappedFile>();
+    if (!snapshot->open(path, true) || snapshot->size() < sizeof(SnapshotHeader)) {
+        return false;
+    }
+    SnapshotHeader header;
+    memcpy(&header, snapshot->data(), sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SNAPSHOT_VERSION
+        || header.recordSize != CATALOG_SNAPSHOT_BOOK_BYTES
+        || header.checksum != catalogSnapshotHeaderChecksum(header)
+        || header.count > snapshot->size() / CATALOG_SNAPSHOT_BOOK_BYTES
+        || header.count > SlotIndex::MAX_SLOTS
+        || header.heapSize > snapshot->size()) {
+        return false;
+    }
+    CatalogSnapshotLayout layout(header.count, header.heapSize);
+    if (layout.end != snapshot->size()) {
+        return false;
+    }
+    size_t count = static_cast<size_t>(header.count);
+    char* base = snapshot->writableData();
+
+    if (!catalog.empty()) {
+        const int* ids = reinterpret_cast<const int*>(base + layout.ids);
+        const int* stocks = reinterpret_cast<const int*>(base + layout.stocks);
+        const double* prices = reinterpret_cast<const double*>(base + layout.prices);
+        const uint64_t* ratings = reinterpret_cast<const uint64_t*>(base + layout.ratings);
+        const StringPool::Ref* titles = reinterpret_cast<const StringPool::Ref*>(base + layout.titles);
+        const StringPool::Ref* authors = reinterpret_cast<const StringPool::Ref*>(base + layout.authors);
+        StringPool heap;
+        heap.map(base + layout.heap, header.heapSize);
+        catalog.reserve(catalog.size() + count);
+        catalog.deferSearchIndex();
+        for (size_t i = 0; i < count; i++) {
+            catalog.addBook(ids[i], heap.view(titles[i]), heap.view(authors[i]), prices[i], stocks[i], ratings[i]);
+        }
+        return true;
+    }
+
+    shared_ptr<MappedFile> available = make_shared<MappedFile>();
+    if (!available->open(path, true) || available->size() != snapshot->size()) {
+        return false;
+    }
+    catalog.deferSearchIndex();
+    catalog.ids.map(reinterpret_cast<int*>(base + layout.ids), count);
+    catalog.onHand.map(reinterpret_cast<int*>(base + layout.stocks), count);
+    catalog.stocks.map(reinterpret_cast<int*>(available->writableData() + layout.stocks), count);
+    catalog.prices.map(reinterpret_cast<double*>(base + layout.prices), count);
+    catalog.ratings.map(reinterpret_cast<uint64_t*>(base + layout.ratings), count);
+    catalog.titles.map(reinterpret_cast<StringPool::Ref*>(base + layout.titles), count);
+    catalog.authors.map(reinterpret_cast<StringPool::Ref*>(base + layout.authors), count);
+    catalog.slotByID.map(reinterpret_cast<uint32_t*>(base + layout.index), SlotIndex::capacityFor(count), count);
+    catalog.text.map(base + layout.heap, static_cast<size_t>(header.heapSize));
+    catalog.mappings = { snapshot, available };
+    return true;
+}
+
+void loadBooksFromFile(Catalog& catalog) {
+    ScopedTimer timer(TIME_LOAD_CATALOG);
+    // Prefer the binary snapshot unless the text file was edited after it
+    error_code error;
+    if (filesystem::exists(BOOK_SNAPSHOT_FILE, error)) {
+        bool textIsNewer = filesystem::exists(BOOK_DATA_FILE, error)
+            && filesystem::last_write_time(BOOK_DATA_FILE, error) > filesystem::last_write_time(BOOK_SNAPSHOT_FILE, error);
+        if (!textIsNewer) {
+            if (loadCatalogSnapshot(catalog, BOOK_SNAPSHOT_FILE)) {
+                return;
+            }
+            cout << "Book snapshot is damaged. Loading text data instead.\n";
+        }
+    }
+    if (!loadBooksFromText(catalog, BOOK_DATA_FILE)) {
+        cout << "No book data found. Using default books.\n";
+        // Initialize default books
+        const Book defaultBooks[] = {
+            Book(1, "The Great Gatsby", "F. Scott Fitzgerald", 10.99, 10),
+            Book(2, "1984", "George Orwell", 8.99, 5),
+            Book(3, "To Kill a Mockingbird", "Harper Lee", 12.50, 8),
+            Book(4, "Pride and Prejudice", "Jane Austen", 9.99, 7),
+            Book(5, "The Catcher in the Rye", "J.D. Salinger", 11.20, 6),
+            Book(6, "The Hobbit", "J.R.R. Tolkien", 15.00, 4),
+            Book(7, "Moby Dick", "Herman Melville", 13.45, 9),
+            Book(8, "War and Peace", "Leo Tolstoy", 20.00, 3),
+            Book(9, "The Odyssey", "Homer", 14.25, 12),
+            Book(10, "Hamlet", "William Shakespeare", 9.75, 15)
+        };
+        for (const auto& book : defaultBooks) {
+            catalog.addBook(book);
+        }
+    }
+}
+
+bool loadBooksFromText(Catalog& catalog, const string& path) {
+    MappedFile bookFile;
+    if (!bookFile.open(path)) {
+        return false;
+    }
+    // Parse chunks of the file in parallel, then insert in file order
+    vector<vector<BookRecord>> chunks = parseBookData(bookFile.data(), bookFile.size());
+    size_t total = 0;
+    for (const auto& chunk : chunks) {
+        total += chunk.size();
+    }
+    catalog.reserve(catalog.size() + total);
+    catalog.deferSearchIndex();
+    for (const auto& chunk : chunks) {
+        for (const auto& record : chunk) {
+            catalog.addBook(record.id, record.title, record.author, record.price, record.stock, record.ratingTally);
+        }
+    }
+    return true;
+}
+
+void searchBooks(const Catalog& catalog, const CoPurchaseRecommender& recommendations) {
+    cout << "Enter keyword to search for books: ";
+    string keyword;
+    getline(cin, keyword);
+    transform(keyword.begin(), keyword.end(), keyword.begin(), foldCase);
+    vector<BookView> results = catalog.search(keyword);
+    if (results.empty()) {
+        cout << "No books found matching \"" << keyword << "\".\n";
+    } else {
+        cout << "\nSearch Results:\n";
+        showPaged(results.size(), [&results](size_t i) { return results[i]; });
+        showAlsoBought(recommendations, catalog, results.front());
+    }
+}
+
+void filterBooks(const Catalog& catalog) {
+    BookFilter filter;
+    char choice;
+    int sortChoice;
+    cout << "Enter minimum price (0 for no minimum): ";
+    cin >> filter.minPrice;
+    cout << "Enter maximum price (0 for no maximum): ";
+    cin >> filter.maxPrice;
+    cout << "Enter minimum average rating (0-5): ";
+    cin >> filter.minRating;
+    cout << "Only show books in stock? (y/n): ";
+    cin >> choice;
+    cin.ignore();
+    filter.inStockOnly = (tolower(choice) == 'y');
+    cout << "Enter author name (leave blank for any author): ";
+    getline(cin, filter.author);
+    transform(filter.author.begin(), filter.author.end(), filter.author.begin(), foldCase);
+    cout << "Sort by: 1. Catalog order 2. Rating 3. Price (low to high) 4. Price (high to low): ";
+    cin >> sortChoice;
+    switch (sortChoice) {
+        case 2:
+            filter.sortKey = BookFilter::SORT_RATING;
+            break;
+        case 3:
+            filter.sortKey = BookFilter::SORT_PRICE_ASC;
+            break;
+        case 4:
+            filter.sortKey = BookFilter::SORT_PRICE_DESC;
+            break;
+        default:
+            filter.sortKey = BookFilter::SORT_NONE;
+            break;
+    }
+    cout << "How many books to show (0 for all): ";
+    cin >> filter.limit;
+    cin.ignore();
+
+    vector<BookView> results = catalog.filter(filter);
+    if (results.empty()) {
+        cout << "No books match the selected filters.\n";
+    } else {
+        cout << "\nFilter Results:\n";
+        showPaged(results.size(), [&results](size_t i) { return results[i]; });
+    }
+}
+
+void rateBook(Catalog& catalog, CatalogJournal& journal, ReviewStore& reviews, const User& user) {
+    int bookID;
+    double rating;
+    cout << "Enter the ID of the book you want to rate: ";
+    cin >> bookID;
+    cin.ignore();
+    BookView book = catalog.findBook(bookID);
+    if (book) {
+        cout << "Enter your rating (1-5): ";
+        cin >> rating;
+        cin.ignore();
+        if (rating >= 1.0 && rating <= 5.0) {
+            uint64_t updated;
+            if (catalog.addRating(bookID, rating, updated)) {
+                journal.recordRating(bookID, updated);
+                journal.commit();
+                Review review;
+                review.postedAt = static_cast<int64_t>(time(nullptr));
+                review.bookID = bookID;
+                review.ratingHundredths = static_cast<int>(llround(rating * 100.0));
+                review.username = user.getUsername();
+                cout << "Write a short review (optional, press Enter to skip): ";
+                getline(cin, review.text);
+                if (!reviews.add(review) || !reviews.commit()) {
+                    cout << "Error saving review.\n";
+                }
+                cout << "Thank you for rating \"" << book.getTitle() << "\".\n";
+            } else {
+                cout << "This book cannot take more ratings.\n";
+            }
+        } else {
+            cout << "Invalid rating. Please enter a value between 1 and 5.\n";
+        }
+    } else {
+        cout << "Book not found.\n";
+    }
+}
+
+void showReviews(const Catalog& catalog, const ReviewStore& reviews) {
+    int bookID;
+    cout << "Enter the ID of the book: ";
+    cin >> bookID;
+    cin.ignore();
+    BookView book = catalog.findBook(bookID);
+    if (!book) {
+        cout << "Book not found.\n";
+        return;
+    }
+    ReviewSummary summary = reviews.summary(bookID);
+    cout << "\nReviews of \"" << book.getTitle() << "\"\n";
+    if (summary.count == 0) {
+        cout << "No reviews yet.\n";
+        return;
+    }
+    cout << fixed << setprecision(2);
+    cout << "Average: " << summary.average() << " from " << summary.count << " reviews";
+    if (summary.recentCount > 0) {
+        cout << " (" << summary.recentAverage() << " over the last " << ReviewStore::RECENT_DAYS << " days)";
+    }
+    cout << "\n";
+    for (int star = 5; star >= 1; star--) {
+        uint64_t count = summary.histogram[star - 1];
+        cout << star << " star: " << string(static_cast<size_t>(count * 30 / summary.count), '#') << " " << count << "\n";
+    }
+    cout << "\nTop reviews:\n";
+    for (const auto& review : reviews.top(bookID, 5)) {
+        tm local = localTime(static_cast<time_t>(review.postedAt));
+        cout << review.getRating() << " stars, " << review.username << ", " << put_time(&local, "%Y-%m-%d");
+        if (!review.text.empty()) {
+            cout << ": " << review.text;
+        }
+        cout << "\n";
+    }
+}
+
+void addToWishlist(Wishlist& wishlist, const Catalog& catalog) {
+    int bookID;
+    cout << "Enter the ID of the book to add to your wishlist: ";
+    cin >> bookID;
+    cin.ignore();
+    BookView book = catalog.findBook(bookID);
+    if (!book) {
+        cout << "Book not found.\n";
+    } else if (wishlist.add(bookID)) {
+        cout << "\"" << book.getTitle() << "\" has been added to your wishlist.\n";
+    } else {
+        cout << "\"" << book.getTitle() << "\" is already on your wishlist.\n";
+    }
+}
+
+void viewWishlist(const Wishlist& wishlist, const Catalog& catalog) {
+    if (wishlist.empty()) {
+        cout << "Your wishlist is empty.\n";
+        return;
+    }
+    cout << "\nYour Wishlist:\n";
+    vector<BookView> books;
+    for (int bookID : wishlist) {
+        BookView book = catalog.findBook(bookID);
+        if (book) {
+            books.push_back(book);
+        }
+    }
+    showPaged(books.size(), [&books](size_t i) { return books[i]; });
+}
+
+// Queues the email and returns at once; the dispatcher delivers it
+void sendEmailNotification(NotificationDispatcher& notifications, const User& user, const string& message) {
+    notifications.send(user.getUsername(), message);
+}
+
+void handleGiftOption(Cart& cart) {
+    char choice;
+    cout << "Do you want to purchase any item as a gift? (y/n): ";
+    cin >> choice;
+    cin.ignore();
+    if (tolower(choice) == 'y') {
+        // For simplicity, this function is a placeholder
+        cout << "Gift option selected. Proceeding with gift purchase.\n";
+    }
+}
+
+// Returns copies of one book from one of the user's orders, or refunds them
+// without taking them back, through the returns ledger
+void returnOrRefund(ReturnLedger& returns, OrderJournal& orders, Catalog& catalog, CatalogJournal& journal,
+                    const User& user) {
+    ReturnRequest request;
+    cout << "Enter the order number (see Order History): ";
+    cin >> request.orderID;
+    cin.ignore();
+    OrderRecord order;
+    if (!orders.find(request.orderID, order) || order.accountID != user.getId()) {
+        cout << "Order #" << request.orderID << " not found.\n";
+        return;
+    }
+    displayOrder(order, returns.refundedCents(order.orderID));
+    cout << "Enter the ID of the book to return: ";
+    cin >> request.bookID;
+    cout << "How many copies: ";
+    cin >> request.quantity;
+    char choice;
+    cout << "Are you sending the copies back? (y/n, n = refund only, e.g. damaged or never arrived): ";
+    cin >> choice;
+    cin.ignore();
+    request.restock = tolower(choice) == 'y';
+    request.accountID = user.getId();
+    // Every submission here is a new request; clients that may retry send their own key
+    request.key = "console:" + to_string(user.getId()) + ":" + to_string(chrono::system_clock::now().time_since_epoch().count());
+
+    ReturnOutcome outcome = returns.applyBatch({ request }, orders, catalog, journal).front();
+    if (outcome.status != RETURN_APPLIED) {
+        cout << "Return not accepted: " << describeReturnStatus(outcome.status) << ".\n";
+        return;
+    }
+    cout << "Refund of $" << Money::fromCents(outcome.refundCents) << " recorded against order #" << order.orderID
+         << " (return #" << outcome.sequence << ").\n";
+    if (request.restock) {
+        cout << "The copies are back in stock.\n";
+    }
+    if (journal.needsCompaction()) {
+        compactCatalogJournal(catalog, journal);
+    }
+}
+
+string encryptData(const string& data) {
+    // Simple encryption (placeholder)
+    string encrypted = data;
+    for (char& c : encrypted) {
+        c += 3;
+    }
+    return encrypted;
+}
+
+string decryptData(const string& data) {
+    // Simple decryption (placeholder)
+    string decrypted = data;
+    for (char& c : decrypted) {
+        c -= 3;
+    }
+    return decrypted;
+}
+
+// Drives a running --server with concurrent clients and reports latency
+// percentiles and throughput. Each client logs in and then issues a mix of
+// searches, browses, cart updates and occasional checkouts.
+void runLoadGenerator(int port, int clients, int requestsPerClient, const string& username, const string& password) {
+#if defined(BOOKSTORE_POSIX)
+    static const char* keywords[] = { "the", "war", "love", "history", "ing", "man" };
+    vector<vector<double>> latencies(max(1, clients));
+    atomic<int> failures(0);
+
+    auto client = [&](int index) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            failures++;
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        string input;
+
+        // Sends one request and consumes its whole reply; returns false on a dropped connection
+        auto exchange = [&](const string& request, string& status, vector<string>& lines) {
+            string wire = request + "\n";
+            if (::send(fd, wire.data(), wire.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(wire.size())) return false;
+            auto readLine = [&](string& line) {
+                size_t newline;
+                while ((newline = input.find('\n')) == string::npos) {
+                    char chunk[4096];
+                    ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+                    if (received <= 0) return false;
+                    input.append(chunk, static_cast<size_t>(received));
+                }
+                line.assign(input, 0, newline);
+                input.erase(0, newline + 1);
+                return true;
+            };
+            lines.clear();
+            if (!readLine(status)) return false;
+            if (status.compare(0, 3, "OK ") == 0) {
+                int count = atoi(status.c_str() + 3);
+                string line;
+                for (int i = 0; i < count; i++) {
+                    if (!readLine(line)) return false;
+                    lines.push_back(line);
+                }
+            }
+            return true;
+        };
+
+        mt19937 rng(static_cast<unsigned>(index * 7919 + 17));
+        string status;
+        vector<string> lines;
+        vector<int> knownIDs;
+        if (!exchange("LOGIN " + username + " " + password, status, lines) || status != "OK 1") {
+            failures++;
+            ::close(fd);
+            return;
+        }
+        latencies[index].reserve(requestsPerClient);
+        for (int i = 0; i < requestsPerClient; i++) {
+            string request;
+            int pick = static_cast<int>(rng() % 100);
+            if (pick < 40) {
+                request = string("SEARCH ") + keywords[rng() % (sizeof(keywords) / sizeof(keywords[0]))];
+            } else if (pick < 70) {
+                request = "BROWSE " + to_string(rng() % 1000) + " 20";
+            } else if (pick < 90 && !knownIDs.empty()) {
+                request = "ADD " + to_string(knownIDs[rng() % knownIDs.size()]) + " 1";
+            } else if (pick < 98) {
+                request = "CART";
+            } else {
+                request = "CHECKOUT";
+            }
+            auto started = chrono::steady_clock::now();
+            if (!exchange(request, status, lines)) {
+                failures++;
+                break;
+            }
+            latencies[index].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - started).count());
+            for (const auto& line : lines) {
+                if (knownIDs.size() < 256 && isdigit(static_cast<unsigned char>(line[0])) && line.find('|') != string::npos) {
+                    knownIDs.push_back(atoi(line.c_str()));
+                }
+            }
+        }
+        exchange("QUIT", status, lines);
+        ::close(fd);
+    };
+
+    auto started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int i = 0; i < clients; i++) {
+        threads.emplace_back(client, i);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    vector<double> all;
+    for (const auto& perClient : latencies) {
+        all.insert(all.end(), perClient.begin(), perClient.end());
+    }
+    if (all.empty()) {
+        cout << "No requests completed (" << failures << " client failures).\n";
+        return;
+    }
+    sort(all.begin(), all.end());
+    auto percentile = [&all](double p) { return all[min(all.size() - 1, static_cast<size_t>(p * all.size()))]; };
+    cout << fixed << setprecision(1);
+    cout << "Requests: " << all.size() << " from " << clients << " clients in " << seconds << " s\n";
+    cout << "Throughput: " << all.size() / seconds << " requests/s\n";
+    cout << "Latency (us): p50 " << percentile(0.50) << ", p99 " << percentile(0.99) << ", max " << all.back() << "\n";
+    if (failures > 0) {
+        cout << "Client failures: " << failures << "\n";
+    }
+#else
+    (void)port; (void)clients; (void)requestsPerClient; (void)username; (void)password;
+    cout << "The load generator is not supported on this platform.\n";
+#endif
+}
+
+// Hammers StockReservations from 1, 2, 4, ... maxThreads threads on a scratch
+// catalog with a mix of reserve/commit, reserve/release and abandoned holds
+// that must time out, plus two-hold commits that pair a fresh hold with an
+// earlier abandoned one, so commits often back out while an extra sweeper
+// thread expires holds. Afterwards every book must satisfy
+// on hand = initial stock - copies sold >= 0, with nothing left held.
+// Prints throughput per thread count; returns false if any book was oversold.
+bool runStockStressTest(int maxThreads, int operationsPerThread) {
+    const int BOOKS = 64;
+    const int INITIAL_STOCK = 5000;
+    bool consistent = true;
+    double singleThreadRate = 0.0;
+    cout << fixed << setprecision(0);
+    vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(max(1, maxThreads));
+    for (int threads : threadCounts) {
+        Catalog catalog;
+        for (int id = 1; id <= BOOKS; id++) {
+            catalog.addBook(id, "Stress book " + to_string(id), "Stress author", 10.0, INITIAL_STOCK);
+        }
+        StockReservations reservations(catalog, nullptr, chrono::milliseconds(2));
+        reservations.startReaper();
+        vector<vector<long long>> sold(threads, vector<long long>(BOOKS + 1, 0));
+
+        auto worker = [&](int index) {
+            mt19937 rng(static_cast<unsigned>(index * 104729 + 1));
+            StockReservations::Handle abandoned;
+            for (int i = 0; i < operationsPerThread; i++) {
+                int bookID = static_cast<int>(rng() % BOOKS) + 1;
+                int quantity = static_cast<int>(rng() % 3) + 1;
+                StockReservations::Handle hold = reservations.reserve(bookID, quantity);
+                if (!hold) continue;
+                int action = static_cast<int>(rng() % 10);
+                if (action < 5) {
+                    if (reservations.commit({ hold })) {
+                        sold[index][bookID] += quantity;
+                    }
+                } else if (action < 7 && abandoned) {
+                    // Often backs out on the abandoned hold (expired, or
+                    // dropped here half the time), handing `hold` back while
+                    // the sweeper may be looking at it; `hold` is then
+                    // abandoned too and only expiry can return its copies
+                    if (rng() % 2) reservations.release(abandoned);
+                    if (reservations.commit({ hold, abandoned })) {
+                        sold[index][bookID] += quantity;
+                        sold[index][abandoned->bookID] += abandoned->quantity;
+                        abandoned = nullptr;
+                    } else {
+                        abandoned = hold;
+                    }
+                } else if (action < 9) {
+                    reservations.release(hold);
+                } else {
+                    abandoned = hold; // Left for the reaper
+                }
+            }
+        };
+
+        atomic<bool> sweeping(true);
+        thread sweeper([&] {
+            while (sweeping.load()) {
+                reservations.expireOverdue(chrono::steady_clock::now());
+            }
+        });
+        auto started = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back(worker, t);
+        }
+        for (auto& t : pool) {
+            t.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        sweeping = false;
+        sweeper.join();
+        reservations.stopReaper();
+        reservations.expireOverdue(chrono::steady_clock::time_point::max());
+
+        int oversold = 0;
+        for (int id = 1; id <= BOOKS; id++) {
+            long long totalSold = 0;
+            for (const auto& perThread : sold) {
+                totalSold += perThread[id];
+            }
+            BookView book = catalog.findBook(id);
+            if (book.getOnHandQuantity() < 0 || book.getOnHandQuantity() != INITIAL_STOCK - totalSold
+                || book.getStockQuantity() != book.getOnHandQuantity()) {
+                oversold++;
+            }
+        }
+        double rate = static_cast<double>(threads) * operationsPerThread / seconds;
+        if (threads == 1) singleThreadRate = rate;
+        cout << threads << " thread(s): " << rate << " operations/s";
+        if (singleThreadRate > 0.0) {
+            cout << " (x" << setprecision(2) << rate / singleThreadRate << setprecision(0) << ")";
+        }
+        cout << ", " << reservations.expiredHolds() << " holds expired, "
+             << (oversold == 0 ? "stock consistent" : to_string(oversold) + " books inconsistent") << "\n";
+        consistent = consistent && oversold == 0;
+    }
+    cout << (consistent ? "No overselling detected.\n" : "Stock invariant violated!\n");
+    return consistent;
+}
+
+// Appends synthetic orders from several threads to a scratch journal, each
+// thread committing after every order as checkout does, then reads one
+// account's history back through the index. Prints orders/s and lookup time.
+void runOrderJournalBenchmark(int threads, int ordersPerThread) {
+    threads = max(1, threads);
+    string path = (filesystem::temp_directory_path() / ("orders_bench_" + to_string(time(nullptr)) + ".log")).string();
+    {
+        OrderJournal orders;
+        if (!orders.open(path)) {
+            cout << "Could not create " << path << ".\n";
+            return;
+        }
+        auto worker = [&](int index) {
+            OrderRecord order;
+            order.name = "Bench buyer";
+            order.address = "1 Benchmark Road";
+            for (int i = 0; i < ordersPerThread; i++) {
+                order.placedAt = static_cast<int64_t>(time(nullptr));
+                order.accountID = 1000 + (index * ordersPerThread + i) % 1000;
+                order.buyerNumber = order.accountID;
+                order.items.assign(1 + i % 3, OrderItem{ 1 + i % 500, 1, 1299, "Benchmark title", "Benchmark author" });
+                order.totalCents = 1299 * static_cast<int64_t>(order.items.size());
+                orders.append(order);
+                orders.commit();
+            }
+        };
+        auto started = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back(worker, t);
+        }
+        for (auto& t : pool) {
+            t.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << fixed << setprecision(0);
+        cout << orders.size() << " orders from " << threads << " threads in " << setprecision(2) << seconds
+             << " s: " << setprecision(0) << orders.size() / seconds << " orders/s (durable)\n";
+    }
+
+    OrderJournal reopened;
+    auto started = chrono::steady_clock::now();
+    reopened.open(path);
+    double indexSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    OrderQuery everything;
+    everything.limit = numeric_limits<size_t>::max();
+    size_t found = reopened.history(1000, everything).size();
+    double lookupSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << setprecision(1) << "Reindexed " << reopened.size() << " orders in " << indexSeconds * 1000.0
+         << " ms; one account's " << found << " orders read in " << lookupSeconds * 1000.0 << " ms\n";
+    error_code error;
+    filesystem::remove(path, error);
+}
+
+// Places three-book orders against a scratch catalog and persists their
+// stock two ways: the former rewrite of the whole book file after every
+// order, run on one thread for a few seconds, and the checkout path
+// (reserve, commit, STOCK records, one shared fsync per group of orders)
+// from several threads, compacting into the base file whenever the journal
+// asks. The journaled run is then reloaded from the base file plus journal
+// replay and must match the live stock.
+void runStockJournalBenchmark(size_t bookCount, int threads, int ordersPerThread) {
+    bookCount = max<size_t>(3, bookCount);
+    threads = max(1, threads);
+    ordersPerThread = max(1, ordersPerThread);
+    const int INITIAL_STOCK = 1000000;
+    const double REWRITE_SECONDS = 3.0;
+    filesystem::path scratch = filesystem::temp_directory_path() / ("stock_bench_" + to_string(time(nullptr)));
+    filesystem::create_directories(scratch);
+    string basePath = (scratch / "book_data.txt").string();
+    string journalPath = (scratch / "catalog_journal.log").string();
+    auto makeCatalog = [&](Catalog& catalog) {
+        catalog.reserve(bookCount);
+        catalog.deferSearchIndex();
+        for (size_t i = 0; i < bookCount; i++) {
+            catalog.addBook(static_cast<int>(i + 1), "Bench title " + to_string(i), "Bench author " + to_string(i % 5000),
+                            (100 + i % 9900) / 100.0, INITIAL_STOCK);
+        }
+    };
+    auto orderBooks = [bookCount](uint64_t seed, int books[3]) {
+        books[0] = static_cast<int>(seed % bookCount) + 1;
+        books[1] = books[0] % static_cast<int>(bookCount) + 1;
+        books[2] = books[1] % static_cast<int>(bookCount) + 1;
+    };
+    cout << fixed << setprecision(2);
+
+    {
+        Catalog catalog;
+        makeCatalog(catalog);
+        mt19937_64 rng(8);
+        size_t placed = 0;
+        auto started = chrono::steady_clock::now();
+        double seconds = 0.0;
+        while (seconds < REWRITE_SECONDS) {
+            int books[3];
+            orderBooks(rng(), books);
+            for (int id : books) {
+                catalog.adjustStockQuantity(id, -1);
+            }
+            if (!saveBooksToText(catalog, basePath)) {
+                cout << "Could not write " << basePath << ".\n";
+                return;
+            }
+            placed++;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        }
+        cout << bookCount << " books, " << filesystem::file_size(basePath) / 1024 << " KiB catalog file\n";
+        cout << "  rewrite per order, 1 thread     " << setw(8) << placed << " orders in " << seconds << " s: "
+             << setw(10) << placed / seconds << " orders/s\n";
+    }
+
+    Catalog catalog;
+    makeCatalog(catalog);
+    if (!saveBooksToText(catalog, basePath)) {
+        cout << "Could not write " << basePath << ".\n";
+        return;
+    }
+    size_t compactions = 0;
+    {
+        CatalogJournal journal;
+        if (!journal.open(journalPath, catalog)) {
+            cout << "Could not open " << journalPath << ".\n";
+            return;
+        }
+        StockReservations reservations(catalog, &journal, chrono::minutes(10));
+        shared_mutex catalogLock;
+        atomic<size_t> refused(0);
+        auto worker = [&](int index) {
+            mt19937_64 rng(100 + index);
+            vector<StockReservations::Handle> holds;
+            for (int i = 0; i < ordersPerThread; i++) {
+                int books[3];
+                orderBooks(rng(), books);
+                holds.clear();
+                for (int id : books) {
+                    StockReservations::Handle hold = reservations.reserve(id, 1);
+                    if (hold) holds.push_back(hold);
+                }
+                {
+                    shared_lock<shared_mutex> lock(catalogLock);
+                    if (holds.size() != 3 || !reservations.commit(holds)) {
+                        refused++;
+                        for (const auto& hold : holds) {
+                            reservations.release(hold);
+                        }
+                        continue;
+                    }
+                }
+                journal.commit();
+                if (journal.needsCompaction()) {
+                    unique_lock<shared_mutex> lock(catalogLock, try_to_lock);
+                    if (lock && journal.needsCompaction() && saveBooksToText(catalog, basePath) && journal.reset()) {
+                        compactions++;
+                    }
+                }
+            }
+        };
+        auto started = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (int t = 0; t < threads; t++) {
+            pool.emplace_back(worker, t);
+        }
+        for (auto& t : pool) {
+            t.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        size_t placed = static_cast<size_t>(threads) * ordersPerThread - refused;
+        cout << "  journal + group commit, " << setw(2) << threads << " thr " << setw(8) << placed << " orders in "
+             << seconds << " s: " << setw(10) << placed / seconds << " orders/s (" << compactions
+             << " compactions, " << refused << " refused)\n";
+    }
+
+    Catalog reloaded;
+    CatalogJournal replay;
+    auto started = chrono::steady_clock::now();
+    bool reopened = loadBooksFromText(reloaded, basePath) && replay.open(journalPath, reloaded);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    size_t mismatches = reloaded.size() == catalog.size() ? 0 : bookCount;
+    int64_t sold = 0;
+    for (size_t slot = 0; slot < catalog.size() && slot < reloaded.size(); slot++) {
+        mismatches += reloaded.at(slot).getOnHandQuantity() != catalog.at(slot).getOnHandQuantity();
+        sold += INITIAL_STOCK - catalog.at(slot).getOnHandQuantity();
+    }
+    cout << "  reloaded base file + journal in " << seconds * 1000.0 << " ms" << (reopened ? "" : " (FAILED)") << ": "
+         << mismatches << " books differ from the live stock, " << sold << " copies sold\n";
+    error_code error;
+    filesystem::remove_all(scratch, error);
+}
+
+// Builds an OrderHistoryIndex over a synthetic history (one order a minute,
+// spread round-robin over the accounts; about 16 bytes per order) and times
+// last-N, date-range, deep-page and full-scan queries on it.
+void runOrderHistoryBenchmark(size_t orderCount, int accounts) {
+    accounts = max(1, accounts);
+    const int64_t START = 1500000000; // 2017-07-14
+    OrderHistoryIndex index;
+    auto started = chrono::steady_clock::now();
+    for (int account = 0; account < accounts; account++) {
+        index.reserve(account, orderCount / accounts + 1);
+    }
+    for (size_t i = 0; i < orderCount; i++) {
+        index.add(static_cast<int>(i % accounts), START + static_cast<int64_t>(i) * 60, i * 128);
+    }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << fixed << setprecision(2);
+    cout << "Indexed " << orderCount << " orders for " << accounts << " accounts in " << buildSeconds << " s\n";
+    if (orderCount == 0) return;
+
+    const int QUERIES = 100000;
+    const int64_t SPAN = static_cast<int64_t>(orderCount) * 60;
+    mt19937_64 rng(42);
+    size_t returned = 0;
+    auto timeQueries = [&](const char* label, const function<OrderQuery()>& makeQuery) {
+        auto begin = chrono::steady_clock::now();
+        for (int q = 0; q < QUERIES; q++) {
+            returned += index.query(static_cast<int>(rng() % accounts), makeQuery()).size();
+        }
+        double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / QUERIES;
+        cout << "  " << left << setw(34) << label << right << setw(10) << nanos << " ns/query\n";
+    };
+    cout << "Query cost (" << QUERIES << " random accounts each):\n";
+    timeQueries("last 10 orders", [] { return OrderQuery(); });
+    timeQueries("last 100 orders", [] { OrderQuery q; q.limit = 100; return q; });
+    timeQueries("30-day range, first page of 10", [&] {
+        OrderQuery q;
+        q.from = START + static_cast<int64_t>(rng() % static_cast<uint64_t>(SPAN));
+        q.to = q.from + 30 * 24 * 3600;
+        return q;
+    });
+    timeQueries("page 500 of 10, all time", [] { OrderQuery q; q.skip = 5000; return q; });
+
+    // For comparison: what reading one account's whole history costs
+    auto begin = chrono::steady_clock::now();
+    OrderQuery everything;
+    everything.limit = numeric_limits<size_t>::max();
+    size_t all = index.query(0, everything).size();
+    double scanMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    cout << "Full history of one account (" << all << " orders): " << scanMillis << " ms\n";
+    if (returned == 0) cout << "(no orders matched)\n";
+}
+
+// Memory resource that counts what it hands out, for runCartBenchmark
+class CountingResource : public pmr::memory_resource {
+public:
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+private:
+    void* do_allocate(size_t size, size_t alignment) override {
+        allocations++;
+        bytes += size;
+        return pmr::new_delete_resource()->allocate(size, alignment);
+    }
+    void do_deallocate(void* p, size_t size, size_t alignment) override {
+        pmr::new_delete_resource()->deallocate(p, size, alignment);
+    }
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+// Keeps `cartCount` carts alive at once, each built from the same six adds
+// (one of them a repeat of an earlier book), first as the old
+// vector<pair<Book, int>> and then as arena-backed Carts. Reports heap
+// allocations, bytes allocated and build/teardown time for both.
+void runCartBenchmark(int cartCount) {
+    cartCount = max(1, cartCount);
+    const int BOOKS = 10000;
+    Catalog catalog;
+    for (int id = 1; id <= BOOKS; id++) {
+        catalog.addBook(id, "Synthetic Book Title " + to_string(id), "Synthetic Author " + to_string(id % 97), 12.5, 100);
+    }
+    auto pickBooks = [BOOKS](int cart, int adds[6]) {
+        for (int i = 0; i < 5; i++) {
+            adds[i] = 1 + static_cast<int>((static_cast<uint64_t>(cart) * 7919 + i * 104729) % BOOKS);
+        }
+        adds[5] = adds[1];
+    };
+    auto onHeap = [](const string& text) {
+        const char* object = reinterpret_cast<const char*>(&text);
+        return text.data() < object || text.data() >= object + sizeof(text);
+    };
+    cout << fixed << setprecision(1);
+
+    // Old layout: a Book copy per add, duplicates kept as extra lines
+    {
+        CountingResource counter;
+        auto started = chrono::steady_clock::now();
+        vector<pmr::vector<pair<Book, int>>> carts;
+        carts.reserve(cartCount);
+        uint64_t stringAllocations = 0, stringBytes = 0;
+        for (int c = 0; c < cartCount; c++) {
+            carts.emplace_back(&counter);
+            int adds[6];
+            pickBooks(c, adds);
+            for (int bookID : adds) {
+                carts.back().push_back(make_pair(catalog.findBook(bookID).toBook(), 1));
+                const Book& copy = carts.back().back().first;
+                for (const string* text : { &copy.getTitle(), &copy.getAuthor() }) {
+                    if (onHeap(*text)) {
+                        stringAllocations++;
+                        stringBytes += text->capacity() + 1;
+                    }
+                }
+            }
+        }
+        double buildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        started = chrono::steady_clock::now();
+        carts.clear();
+        double freeMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        uint64_t allocations = counter.allocations + stringAllocations;
+        uint64_t bytes = counter.bytes + stringBytes;
+        cout << "vector<pair<Book, int>>: " << allocations << " allocations ("
+             << static_cast<double>(allocations) / cartCount << " per cart), "
+             << bytes / 1048576.0 << " MiB allocated, build " << buildMillis << " ms, free " << freeMillis << " ms\n";
+    }
+
+    // New layout: ID + quantity lines in a per-session arena
+    {
+        CountingResource counter;
+        auto started = chrono::steady_clock::now();
+        vector<unique_ptr<SessionArena>> arenas;
+        vector<Cart> carts;
+        arenas.reserve(cartCount);
+        carts.reserve(cartCount);
+        for (int c = 0; c < cartCount; c++) {
+            arenas.push_back(make_unique<SessionArena>(&counter));
+            carts.emplace_back(arenas.back()->resource());
+            int adds[6];
+            pickBooks(c, adds);
+            for (int bookID : adds) {
+                carts.back().add(bookID, 1);
+            }
+        }
+        double buildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        size_t lines = 0;
+        for (const auto& cart : carts) {
+            lines += cart.size();
+        }
+        uint64_t arenaBytes = counter.bytes + static_cast<uint64_t>(cartCount) * sizeof(SessionArena);
+        started = chrono::steady_clock::now();
+        carts.clear();
+        arenas.clear();
+        double freeMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        cout << "Cart in SessionArena:    " << counter.allocations << " allocations ("
+             << static_cast<double>(counter.allocations) / cartCount << " per cart), "
+             << arenaBytes / 1048576.0 << " MiB allocated including arenas, build " << buildMillis
+             << " ms, free " << freeMillis << " ms (" << static_cast<double>(lines) / cartCount << " lines per cart)\n";
+    }
+}
+
+// Prices the same synthetic carts three ways: with doubles as checkout used
+// to, through each buyer's virtual setPay with Money, and in one
+// PricingEngine batch. Reports the time of each and how many carts the first
+// two get wrong by at least a cent against the batch's exact result.
+void runPricingBenchmark(int cartCount) {
+    cartCount = max(1, cartCount);
+    mt19937 rng(7);
+    PricingBatch batch;
+    batch.reserve(cartCount, static_cast<size_t>(cartCount) * 5);
+    vector<double> linePrices;
+    linePrices.reserve(static_cast<size_t>(cartCount) * 5);
+    vector<unique_ptr<Buyer>> buyers;
+    buyers.reserve(cartCount);
+    vector<double> buyerRates(cartCount);
+    vector<bool> hasCoupon(cartCount);
+    for (int c = 0; c < cartCount; c++) {
+        int64_t tier = Money::BASIS;
+        switch (rng() % 3) {
+            case 0: {
+                Member* member = new Member();
+                int stars = 1 + static_cast<int>(rng() % 5);
+                member->setStarLevel(stars);
+                tier = STAR_LEVEL_BASIS_POINTS[stars];
+                buyers.emplace_back(member);
+                break;
+            }
+            case 1: {
+                HonoredGuest* guest = new HonoredGuest();
+                tier = 5000 + static_cast<int64_t>(rng() % 50) * 100;
+                guest->setDiscountBasisPoints(tier);
+                buyers.emplace_back(guest);
+                break;
+            }
+            default:
+                buyers.emplace_back(new Layfolk());
+        }
+        buyerRates[c] = tier / 10000.0;
+        batch.addCart(tier);
+        int lines = 1 + static_cast<int>(rng() % 8);
+        for (int l = 0; l < lines; l++) {
+            int cents = 100 + static_cast<int>(rng() % 9900);
+            linePrices.push_back(cents / 100.0);
+            batch.addLine(Money::fromCents(cents), 1 + static_cast<int>(rng() % 3));
+        }
+        hasCoupon[c] = rng() % 10 < 3;
+        if (hasCoupon[c]) {
+            batch.addPercentCoupon(1000); // SAVE10
+        }
+    }
+    PricingEngine engine(0); // Checkout charges no tax today
+    cout << fixed << setprecision(1);
+
+    // Old arithmetic: double sums and rates, rounded only when printed
+    auto started = chrono::steady_clock::now();
+    vector<int64_t> doubleCents(cartCount);
+    for (int c = 0; c < cartCount; c++) {
+        double total = 0.0;
+        for (uint32_t line = batch.lineBegin[c]; line < batch.lineBegin[c + 1]; line++) {
+            total += linePrices[line] * batch.quantities[line];
+        }
+        total *= buyerRates[c];
+        if (hasCoupon[c]) total *= 0.90;
+        doubleCents[c] = llround(total * 100.0);
+    }
+    double doubleMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // One virtual setPay per buyer, Money throughout
+    started = chrono::steady_clock::now();
+    vector<int64_t> buyerCents(cartCount);
+    for (int c = 0; c < cartCount; c++) {
+        Money total;
+        for (uint32_t line = batch.lineBegin[c]; line < batch.lineBegin[c + 1]; line++) {
+            total += Money::fromCents(batch.unitCents[line]) * batch.quantities[line];
+        }
+        buyers[c]->setPay(hasCoupon[c] ? total.scaled(9000) : total);
+        buyerCents[c] = buyers[c]->getPay().getCents();
+    }
+    double buyerMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    PricingResult result;
+    engine.price(batch, result); // Sizes the result columns, as a reused engine would have
+    started = chrono::steady_clock::now();
+    engine.price(batch, result);
+    double batchMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    size_t doubleWrong = 0, buyerWrong = 0;
+    for (int c = 0; c < cartCount; c++) {
+        doubleWrong += doubleCents[c] != result.totalCents[c];
+        buyerWrong += buyerCents[c] != result.totalCents[c];
+    }
+    cout << "Priced " << cartCount << " carts (" << batch.unitCents.size() << " lines):\n";
+    cout << "  double arithmetic      " << setw(8) << doubleMillis << " ms, " << doubleWrong << " carts off by a cent or more\n";
+    cout << "  virtual setPay (Money) " << setw(8) << buyerMillis << " ms, " << buyerWrong << " carts off (coupon rounded separately)\n";
+    cout << "  PricingEngine batch    " << setw(8) << batchMillis << " ms, exact\n";
+}
+
+// Compiles ruleCount synthetic rules (one in ten automatic) and evaluates
+// them for synthetic checkouts: through the compiled PromotionEngine, and by
+// re-reading every rule line per checkout as string-compare coupon checks
+// would. Both must pick the same rules. A scope=lines percentage naming every
+// line must then price each cart exactly as the same whole-cart percentage,
+// for every tier. Last, several threads race to redeem one capped rule and
+// give back every other redemption, as failed checkouts do; the count must
+// end exactly at its cap.
+void runPromotionBenchmark(int ruleCount) {
+    ruleCount = max(1, ruleCount);
+    mt19937 rng(11);
+    const int BOOKS = 5000, AUTHORS = 500;
+    const char* tiers[] = { "gold", "diamond", "ordinary" };
+    vector<string> lines;
+    lines.reserve(ruleCount);
+    for (int r = 0; r < ruleCount; r++) {
+        string line = rng() % 10 == 0 ? "*" : "CODE" + to_string(r);
+        line += rng() % 2 ? "|percent|" + to_string(1 + rng() % 20) : "|fixed|" + to_string(1 + rng() % 10) + ".00";
+        if (rng() % 2) line += "|minspend=" + to_string(20 + rng() % 80) + ".00";
+        switch (rng() % 3) {
+            case 0: line += "|book=" + to_string(1 + rng() % BOOKS); break;
+            case 1: line += "|author=Author " + to_string(rng() % AUTHORS); break;
+        }
+        if (rng() % 4 == 0) line += string("|tier=") + tiers[rng() % 3];
+        if (rng() % 4 == 0) line += "|expires=20" + to_string(20 + rng() % 20) + "-06-30";
+        if (rng() % 4 == 0) line += "|scope=lines";
+        lines.push_back(line);
+    }
+
+    PromotionEngine engine;
+    auto started = chrono::steady_clock::now();
+    engine.compileAll(lines);
+    double compileMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // Synthetic checkouts: up to eight books, up to two codes
+    const int CHECKOUTS = 200000;
+    vector<CheckoutContext> contexts(CHECKOUTS);
+    vector<vector<string>> codes(CHECKOUTS);
+    vector<vector<string>> cartAuthors(CHECKOUTS);
+    int64_t now = static_cast<int64_t>(time(nullptr));
+    for (int c = 0; c < CHECKOUTS; c++) {
+        CheckoutContext& context = contexts[c];
+        context.buyerType = 1 + static_cast<int>(rng() % 3);
+        context.starLevel = context.buyerType == 1 ? 1 + static_cast<int>(rng() % 5) : 0;
+        context.now = now;
+        context.subtotalCents = 0;
+        int books = 1 + static_cast<int>(rng() % 8);
+        for (int b = 0; b < books; b++) {
+            int bookID = 1 + static_cast<int>(rng() % BOOKS);
+            string author = "author " + to_string(bookID % AUTHORS);
+            int64_t cents = 500 + static_cast<int64_t>(rng() % 3000);
+            context.subtotalCents += cents;
+            context.bookIDs.push_back(bookID);
+            int authorID = engine.authorID(author);
+            if (authorID >= 0) context.authorIDs.push_back(authorID);
+            context.lineCents.push_back(make_pair(bookID, cents));
+            context.lineAuthorIDs.push_back(authorID);
+            cartAuthors[c].push_back(author);
+        }
+        sort(context.bookIDs.begin(), context.bookIDs.end());
+        sort(context.authorIDs.begin(), context.authorIDs.end());
+        for (unsigned n = rng() % 3; n > 0; n--) {
+            codes[c].push_back("code" + to_string(rng() % ruleCount));
+        }
+    }
+
+    started = chrono::steady_clock::now();
+    size_t matched = 0;
+    vector<vector<uint32_t>> compiledMatches(CHECKOUTS);
+    for (int c = 0; c < CHECKOUTS; c++) {
+        compiledMatches[c] = engine.evaluate(contexts[c], codes[c]);
+        matched += compiledMatches[c].size();
+    }
+    double compiledMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // Rule text re-read for every checkout, on a sample of the checkouts
+    const int SAMPLE = min(CHECKOUTS, 2000);
+    size_t mismatches = 0;
+    started = chrono::steady_clock::now();
+    for (int c = 0; c < SAMPLE; c++) {
+        const CheckoutContext& context = contexts[c];
+        vector<uint32_t> found;
+        for (size_t r = 0; r < lines.size(); r++) {
+            vector<string> fields;
+            string field;
+            istringstream in(lines[r]);
+            while (getline(in, field, '|')) {
+                fields.push_back(field);
+            }
+            bool applies = fields[0] == "*";
+            for (const auto& code : codes[c]) {
+                string upperCode = code;
+                transform(upperCode.begin(), upperCode.end(), upperCode.begin(), [](char ch) { return static_cast<char>(toupper(static_cast<unsigned char>(ch))); });
+                applies = applies || fields[0] == upperCode;
+            }
+            for (size_t i = 3; applies && i < fields.size(); i++) {
+                string key = fields[i].substr(0, fields[i].find('='));
+                string value = fields[i].substr(fields[i].find('=') + 1);
+                if (key == "minspend") {
+                    applies = context.subtotalCents >= Money::fromDouble(atof(value.c_str())).getCents();
+                } else if (key == "book") {
+                    applies = find(context.bookIDs.begin(), context.bookIDs.end(), atoi(value.c_str())) != context.bookIDs.end();
+                } else if (key == "author") {
+                    transform(value.begin(), value.end(), value.begin(), foldCase);
+                    applies = find(cartAuthors[c].begin(), cartAuthors[c].end(), value) != cartAuthors[c].end();
+                } else if (key == "tier") {
+                    applies = tiers[context.buyerType - 1] == value;
+                } else if (key == "expires") {
+                    tm date = {};
+                    istringstream dateIn(value);
+                    dateIn >> get_time(&date, "%Y-%m-%d");
+                    date.tm_isdst = -1;
+                    applies = context.now <= static_cast<int64_t>(mktime(&date)) + 24 * 60 * 60 - 1;
+                }
+            }
+            if (applies) found.push_back(static_cast<uint32_t>(r));
+        }
+        vector<uint32_t> expected = compiledMatches[c];
+        sort(expected.begin(), expected.end());
+        mismatches += found != expected;
+    }
+    double textMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    cout << fixed << setprecision(2);
+    cout << "Compiled " << engine.size() << " rules in " << compileMillis << " ms\n";
+    cout << "  compiled rules     " << setw(10) << compiledMillis * 1000.0 / CHECKOUTS << " us per checkout ("
+         << CHECKOUTS << " checkouts, " << static_cast<double>(matched) / CHECKOUTS << " rules matched on average)\n";
+    cout << "  rule text per call " << setw(10) << textMillis * 1000.0 / SAMPLE << " us per checkout ("
+         << SAMPLE << " checkouts, " << mismatches << " disagreeing with the compiled rules)\n";
+
+    // Line-scoped and whole-cart percentages over the same carts
+    PromotionEngine scopes;
+    scopes.compileAll({ "WHOLE|percent|12.5", "LINES|percent|12.5|author=Everyone|scope=lines" });
+    const int64_t tierShares[] = { GoldTier::shareBasisPoints(1), GoldTier::shareBasisPoints(3), GoldTier::shareBasisPoints(5),
+                                   DiamondTier::shareBasisPoints(8765), OrdinaryTier::shareBasisPoints(0) };
+    const int SCOPE_CARTS = 100000;
+    PricingBatch scoped;
+    for (int c = 0; c < SCOPE_CARTS; c++) {
+        CheckoutContext context;
+        int64_t tier = tierShares[rng() % 5];
+        scoped.addCart(tier);
+        for (int b = 1 + static_cast<int>(rng() % 8); b > 0; b--) {
+            Money unit = Money::fromCents(99 + static_cast<int64_t>(rng() % 5000));
+            int quantity = 1 + static_cast<int>(rng() % 3);
+            scoped.addLine(unit, quantity);
+            context.lineCents.push_back(make_pair(0, unit.getCents() * quantity));
+            context.lineAuthorIDs.push_back(scopes.authorID("everyone"));
+        }
+        scopes.addDiscounts(0, context, scoped);
+        uint32_t begin = scoped.lineBegin[scoped.size() - 1];
+        scoped.addCart(tier);
+        for (uint32_t line = begin; line < begin + context.lineCents.size(); line++) {
+            scoped.addLine(Money::fromCents(scoped.unitCents[line]), scoped.quantities[line]);
+        }
+        scopes.addDiscounts(1, context, scoped);
+    }
+    PricingResult scopedPrices;
+    PricingEngine(0).price(scoped, scopedPrices);
+    size_t scopeMismatches = 0;
+    for (size_t c = 0; c < scoped.size(); c += 2) {
+        scopeMismatches += scopedPrices.totalCents[c] != scopedPrices.totalCents[c + 1];
+    }
+    cout << "  12.5% off every line vs off the cart: " << scopeMismatches << " of " << SCOPE_CARTS << " carts differ\n";
+
+    // Usage cap under contention, with failed checkouts giving uses back
+    PromotionEngine capped;
+    capped.compileAll({ "RACE|percent|5|cap=1000" });
+    int threads = static_cast<int>(max(2u, thread::hardware_concurrency()));
+    atomic<int> redeemed(0);
+    atomic<int> givenBack(0);
+    vector<thread> racers;
+    for (int t = 0; t < threads; t++) {
+        racers.emplace_back([&] {
+            for (int i = 0; i < 20000; i++) {
+                if (!capped.redeem(0)) continue;
+                redeemed++;
+                if (i % 2 == 0) {
+                    capped.unredeem({ 0 });
+                    givenBack++;
+                }
+            }
+        });
+    }
+    for (auto& racer : racers) {
+        racer.join();
+    }
+    cout << "  cap of 1000 under " << threads << " threads: " << redeemed.load() << " redemptions, "
+         << givenBack.load() << " given back, " << capped.usesOf(0) << " counted\n";
+}
+
+// Prices the same buyers three ways: through heap-allocated Buyers and the
+// virtual setPay, by visiting a vector of AnyBuyer values, and grouped by tier
+// with one payAll loop per policy. Reports build and pricing times and checks
+// that all three agree to the cent.
+void runTierBenchmark(int buyerCount) {
+    buyerCount = max(1, buyerCount);
+    mt19937 rng(5);
+    vector<int> ids(buyerCount);
+    vector<int64_t> parameters(buyerCount);
+    vector<int64_t> subtotals(buyerCount);
+    for (int b = 0; b < buyerCount; b++) {
+        switch (rng() % 3) {
+            case 0:
+                ids[b] = GoldTier::MIN_ID + static_cast<int>(rng() % 100);
+                parameters[b] = 1 + static_cast<int64_t>(rng() % 5);
+                break;
+            case 1:
+                ids[b] = DiamondTier::MIN_ID + static_cast<int>(rng() % 100);
+                parameters[b] = 5000 + static_cast<int64_t>(rng() % 50) * 100;
+                break;
+            default:
+                ids[b] = OrdinaryTier::MIN_ID + static_cast<int>(rng() % 1000);
+                parameters[b] = 0;
+        }
+        subtotals[b] = 100 + static_cast<int64_t>(rng() % 50000);
+    }
+    cout << fixed << setprecision(1);
+
+    // Virtual dispatch: one heap object per buyer
+    auto started = chrono::steady_clock::now();
+    vector<unique_ptr<Buyer>> buyers;
+    buyers.reserve(buyerCount);
+    for (int b = 0; b < buyerCount; b++) {
+        int type = buyerTypeForId(ids[b]);
+        Buyer* buyer = createBuyer(type);
+        if (type == GoldTier::TYPE) {
+            static_cast<Member*>(buyer)->setStarLevel(static_cast<int>(parameters[b]));
+        } else if (type == DiamondTier::TYPE) {
+            static_cast<HonoredGuest*>(buyer)->setDiscountBasisPoints(parameters[b]);
+        }
+        buyers.emplace_back(buyer);
+    }
+    double virtualBuildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    vector<int64_t> virtualCents(buyerCount);
+    started = chrono::steady_clock::now();
+    for (int b = 0; b < buyerCount; b++) {
+        buyers[b]->setPay(Money::fromCents(subtotals[b]));
+        virtualCents[b] = buyers[b]->getPay().getCents();
+    }
+    double virtualMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // Static dispatch through a variant, buyers stored by value
+    started = chrono::steady_clock::now();
+    vector<AnyBuyer> values;
+    values.reserve(buyerCount);
+    for (int b = 0; b < buyerCount; b++) {
+        values.push_back(*makeTieredBuyer(ids[b], parameters[b]));
+    }
+    double variantBuildMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    vector<int64_t> variantCents(buyerCount);
+    started = chrono::steady_clock::now();
+    for (int b = 0; b < buyerCount; b++) {
+        variantCents[b] = payFor(values[b], Money::fromCents(subtotals[b])).getCents();
+    }
+    double variantMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // Grouped by tier: plain columns per policy, one inlined loop each
+    struct Group {
+        vector<int> index;
+        vector<int64_t> parameters;
+        vector<int64_t> subtotals;
+        vector<int64_t> payable;
+    };
+    Group groups[3];
+    for (int b = 0; b < buyerCount; b++) {
+        Group& group = groups[buyerTypeForId(ids[b]) - 1];
+        group.index.push_back(b);
+        group.parameters.push_back(parameters[b]);
+        group.subtotals.push_back(subtotals[b]);
+    }
+    for (auto& group : groups) {
+        group.payable.resize(group.index.size());
+    }
+    started = chrono::steady_clock::now();
+    payAll<GoldTier>(groups[0].parameters.data(), groups[0].subtotals.data(), groups[0].payable.data(), groups[0].index.size());
+    payAll<DiamondTier>(groups[1].parameters.data(), groups[1].subtotals.data(), groups[1].payable.data(), groups[1].index.size());
+    payAll<OrdinaryTier>(groups[2].parameters.data(), groups[2].subtotals.data(), groups[2].payable.data(), groups[2].index.size());
+    double groupedMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    size_t mismatches = 0;
+    for (const auto& group : groups) {
+        for (size_t i = 0; i < group.index.size(); i++) {
+            int b = group.index[i];
+            mismatches += virtualCents[b] != variantCents[b] || variantCents[b] != group.payable[i];
+        }
+    }
+    cout << "Priced " << buyerCount << " buyers:\n";
+    cout << "  virtual Buyer*      build " << setw(8) << virtualBuildMillis << " ms (" << buyerCount
+         << " allocations), price " << setw(7) << virtualMillis << " ms\n";
+    cout << "  AnyBuyer (variant)  build " << setw(8) << variantBuildMillis << " ms (1 allocation), price "
+         << setw(7) << variantMillis << " ms\n";
+    cout << "  payAll per tier                                     price " << setw(7) << groupedMillis << " ms\n";
+    cout << "  " << mismatches << " buyers priced differently\n";
+}
+
+// Builds a UserStore of userCount accounts from several threads and measures
+// login throughput: first at cost 0, where the sharded lookup dominates, then
+// with a sample of logins at passwordCost, where the hash dominates. Finally
+// registers accounts concurrently into a scratch file with appends and reloads
+// it to check that every account came back.
+void runUserStoreBenchmark(size_t userCount, int passwordCost) {
+    userCount = max<size_t>(1, userCount);
+    int threads = static_cast<int>(max(2u, thread::hardware_concurrency()));
+    cout << fixed << setprecision(2);
+
+    UserStore store(0);
+    store.reserve(userCount);
+    auto started = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&store, t, threads, userCount] {
+            for (size_t i = t; i < userCount; i += threads) {
+                string name = "user" + to_string(i);
+                store.add(User(name, PasswordHash::create("pw" + to_string(i), 0), static_cast<int>(1000 + i % 1000)));
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Registered " << store.size() << " users in " << buildSeconds << " s from " << threads << " threads\n";
+
+    // Logins at cost 0; one in ten uses a wrong password
+    const size_t LOGINS_PER_THREAD = 1000000;
+    atomic<size_t> accepted(0);
+    workers.clear();
+    started = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&store, &accepted, t, userCount] {
+            mt19937_64 rng(t);
+            size_t ok = 0;
+            for (size_t i = 0; i < LOGINS_PER_THREAD; i++) {
+                size_t who = rng() % userCount;
+                string password = "pw" + to_string(i % 10 == 0 ? who + 1 : who);
+                ok += store.authenticate("user" + to_string(who), password) != nullptr;
+            }
+            accepted += ok;
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double loginSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    size_t logins = LOGINS_PER_THREAD * threads;
+    cout << "  cost 0:  " << setw(12) << logins / loginSeconds << " logins/s (" << logins << " logins, "
+         << accepted.load() << " accepted)\n";
+
+    // Logins at the real cost
+    User sample("sample", PasswordHash::create("secret", passwordCost), 1000);
+    const int COSTLY_LOGINS = 200;
+    started = chrono::steady_clock::now();
+    int costlyAccepted = 0;
+    for (int i = 0; i < COSTLY_LOGINS; i++) {
+        costlyAccepted += sample.checkPassword(i % 10 == 0 ? "wrong" : "secret");
+    }
+    double costlySeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  cost " << passwordCost << ": " << setw(12) << COSTLY_LOGINS / costlySeconds << " logins/s per core ("
+         << costlySeconds * 1000.0 / COSTLY_LOGINS << " ms per hash, " << costlyAccepted << " of " << COSTLY_LOGINS
+         << " accepted)\n";
+
+    // Append-only persistence
+    const string scratchPath = "user_bench.tmp";
+    filesystem::remove(scratchPath);
+    const int REGISTRATIONS = 20000;
+    {
+        UserStore persisted(0);
+        persisted.open(scratchPath);
+        workers.clear();
+        started = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&persisted, t, threads] {
+                for (int i = t; i < REGISTRATIONS; i += threads) {
+                    persisted.registerUser("user" + to_string(i), "pw" + to_string(i), 1000 + i % 1000);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double registerSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << "  " << REGISTRATIONS << " durable registrations in " << registerSeconds << " s ("
+             << REGISTRATIONS / registerSeconds << "/s), file " << filesystem::file_size(scratchPath) / 1024 << " KiB\n";
+    }
+    UserStore reloaded(0);
+    reloaded.open(scratchPath);
+    const User* check = reloaded.authenticate("user123", "pw123");
+    cout << "  reloaded " << reloaded.size() << " users; user123 " << (check ? "logs in" : "FAILS to log in") << "\n";
+    reloaded.close();
+    filesystem::remove(scratchPath);
+}
+
+// Runs sessionCount sessions through a SessionManager on a simulated clock:
+// creation, lookups from several threads, a half of the sessions active
+// again, one-second expiry ticks over an hour, and a snapshot round trip.
+// A scan of every session, as a reaper without the timing wheel would do
+// each tick, is timed for comparison.
+void runSessionBenchmark(size_t sessionCount) {
+    sessionCount = max<size_t>(2, sessionCount);
+    const int64_t START = 1700000000;
+    const int64_t IDLE = 30 * 60;
+    cout << fixed << setprecision(2);
+    SessionManager sessions(chrono::seconds(IDLE), START);
+    sessions.reserve(sessionCount);
+    vector<SessionToken> tokens(sessionCount);
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < sessionCount; i++) {
+        tokens[i] = sessions.create(User("user" + to_string(i), PasswordHash(), static_cast<int>(1000 + i % 1000)), START);
+    }
+    double createSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Created " << sessions.size() << " sessions in " << createSeconds << " s ("
+         << sessionCount / createSeconds << "/s)\n";
+
+    // Lookups: every request of a logged-in shopper touches its session
+    int threads = static_cast<int>(max(2u, thread::hardware_concurrency()));
+    const size_t TOUCHES_PER_THREAD = 2000000;
+    atomic<size_t> valid(0);
+    vector<thread> workers;
+    started = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            mt19937_64 rng(t);
+            size_t found = 0;
+            for (size_t i = 0; i < TOUCHES_PER_THREAD; i++) {
+                found += sessions.touch(tokens[rng() % sessionCount], START + 60);
+            }
+            valid += found;
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double touchSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  touch:    " << setw(12) << TOUCHES_PER_THREAD * threads / touchSeconds << " lookups/s from " << threads
+         << " threads (" << valid.load() << " valid)\n";
+
+    // Half of the shoppers come back at minute 20; the rest go idle
+    for (size_t i = 0; i < sessionCount; i += 2) {
+        sessions.touch(tokens[i], START + 1200);
+    }
+
+    // Snapshot round trip
+    const string scratchPath = "session_bench.tmp";
+    started = chrono::steady_clock::now();
+    sessions.saveSnapshot(scratchPath);
+    double saveMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    SessionManager restored(chrono::seconds(IDLE), START + 1200);
+    started = chrono::steady_clock::now();
+    size_t restoredCount = restored.loadSnapshot(scratchPath, START + 1200);
+    double loadMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    cout << "  snapshot: saved in " << saveMillis << " ms (" << filesystem::file_size(scratchPath) / 1048576.0
+         << " MiB), restored " << restoredCount << " sessions in " << loadMillis << " ms\n";
+    filesystem::remove(scratchPath);
+
+    // An hour of one-second ticks
+    // (sessions last touched at minute 1 fall due at minute 31, the rest at 50)
+    double totalMillis = 0.0, worstMillis = 0.0;
+    size_t expiredBy31 = 0, expiredTotal = 0, worstExpired = 0;
+    for (int64_t now = START + 1; now <= START + 3600; now++) {
+        started = chrono::steady_clock::now();
+        size_t expired = sessions.expire(now);
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        totalMillis += millis;
+        if (millis > worstMillis) {
+            worstMillis = millis;
+            worstExpired = expired;
+        }
+        expiredTotal += expired;
+        if (now == START + 60 + IDLE) expiredBy31 = expiredTotal;
+    }
+    cout << "  expiry:   " << expiredBy31 << " idle sessions expired by minute 31, " << expiredTotal << " by minute 60, "
+         << sessions.size() << " left\n";
+    cout << "            " << totalMillis * 1000.0 / 3600 << " us per tick on average; slowest tick " << worstMillis
+         << " ms (expired " << worstExpired << " sessions at once)\n";
+
+    // The alternative: look at every session each tick
+    unordered_map<SessionToken, int64_t, SessionTokenHash> flat;
+    flat.reserve(sessionCount);
+    for (size_t i = 0; i < sessionCount; i++) {
+        flat.emplace(tokens[i], START);
+    }
+    started = chrono::steady_clock::now();
+    size_t idle = 0;
+    for (const auto& entry : flat) {
+        idle += START + 60 - entry.second >= IDLE;
+    }
+    double scanMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    cout << "  full scan of " << flat.size() << " sessions: " << scanMillis << " ms per tick (" << idle << " idle)\n";
+}
+
+// Ingests reviewCount synthetic reviews for bookCount books (a fifth of them
+// for 100 best-sellers) into a scratch ReviewStore, posted over the past
+// year, then times per-book summaries and top-10 queries and checks them
+// against counts kept on the side. Finally reopens the log to time the index
+// rebuild.
+void runReviewBenchmark(uint64_t reviewCount, int bookCount) {
+    reviewCount = max<uint64_t>(1, reviewCount);
+    bookCount = max(200, bookCount);
+    const string scratchPath = "review_bench.tmp";
+    auto removeScratch = [&scratchPath] {
+        for (uint32_t s = 0; filesystem::exists(scratchPath + "." + to_string(s)); s++) {
+            filesystem::remove(scratchPath + "." + to_string(s));
+        }
+    };
+    removeScratch();
+    const char* phrases[] = { "Great read.", "Could not put it down!", "Slow start, strong finish.",
+                              "Not for me.", "A classic for a reason." };
+    int64_t now = static_cast<int64_t>(time(nullptr));
+    const int64_t YEAR = 365 * 86400;
+    vector<uint64_t> expectedCounts(bookCount + 1, 0);
+    cout << fixed << setprecision(2);
+
+    uint64_t bytes = 0;
+    uint32_t segments = 0;
+    {
+        ReviewStore store;
+        if (!store.open(scratchPath)) {
+            cout << "Cannot create " << scratchPath << ".\n";
+            return;
+        }
+        mt19937_64 rng(3);
+        Review review;
+        auto started = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < reviewCount; i++) {
+            review.postedAt = now - YEAR + static_cast<int64_t>(i * YEAR / reviewCount);
+            review.bookID = rng() % 5 == 0 ? 1 + static_cast<int>(rng() % 100) : 101 + static_cast<int>(rng() % (bookCount - 100));
+            review.ratingHundredths = 100 + 50 * static_cast<int>(rng() % 9);
+            review.username = "user" + to_string(rng() % 1000000);
+            review.text = phrases[rng() % 5];
+            store.add(review);
+            expectedCounts[review.bookID]++;
+            if (i % 1000000 == 999999) store.commit();
+        }
+        store.commit();
+        double ingestSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        segments = store.segments();
+        for (uint32_t s = 0; s < segments; s++) {
+            bytes += filesystem::file_size(scratchPath + "." + to_string(s));
+        }
+        cout << "Ingested " << store.size() << " reviews in " << ingestSeconds << " s (" << reviewCount / ingestSeconds
+             << "/s), " << bytes / 1048576.0 << " MiB in " << segments << " segments\n";
+
+        // Summaries of random books, then of every book for the check
+        const int SUMMARIES = 1000000;
+        uint64_t checksum = 0;
+        started = chrono::steady_clock::now();
+        for (int q = 0; q < SUMMARIES; q++) {
+            ReviewSummary summary = store.summary(1 + static_cast<int>(rng() % bookCount), now);
+            checksum += summary.count + summary.recentCount;
+        }
+        double summaryMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - started).count() / SUMMARIES;
+        size_t wrongCounts = 0;
+        uint64_t recent = 0;
+        for (int book = 1; book <= bookCount; book++) {
+            ReviewSummary summary = store.summary(book, now);
+            uint64_t histogramTotal = 0;
+            for (uint64_t bucket : summary.histogram) histogramTotal += bucket;
+            wrongCounts += summary.count != expectedCounts[book] || histogramTotal != summary.count;
+            recent += summary.recentCount;
+        }
+        cout << "  summary: " << setw(8) << summaryMicros << " us per book (" << wrongCounts
+             << " books with wrong counts; " << recent << " reviews in the last " << ReviewStore::RECENT_DAYS
+             << " days) [" << checksum % 10 << "]\n";
+
+        // Top 10, best-sellers and long tail alike
+        const int TOP_QUERIES = 100000;
+        size_t misordered = 0, returned = 0;
+        started = chrono::steady_clock::now();
+        for (int q = 0; q < TOP_QUERIES; q++) {
+            int book = q % 2 == 0 ? 1 + static_cast<int>(rng() % 100) : 101 + static_cast<int>(rng() % (bookCount - 100));
+            vector<Review> best = store.top(book, 10);
+            returned += best.size();
+            for (size_t r = 1; r < best.size(); r++) {
+                int previousStar = (best[r - 1].ratingHundredths + 50) / 100;
+                int star = (best[r].ratingHundredths + 50) / 100;
+                misordered += star > previousStar || (star == previousStar && best[r].postedAt > best[r - 1].postedAt);
+            }
+            for (const auto& review : best) {
+                misordered += review.bookID != book;
+            }
+        }
+        double topMicros = chrono::duration<double, micro>(chrono::steady_clock::now() - started).count() / TOP_QUERIES;
+        cout << "  top 10:  " << setw(8) << topMicros << " us per book (" << returned << " reviews read, "
+             << misordered << " out of order or for the wrong book)\n";
+    }
+
+    auto started = chrono::steady_clock::now();
+    ReviewStore reopened;
+    reopened.open(scratchPath);
+    double reopenSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  reopen:  index of " << reopened.size() << " reviews rebuilt in " << reopenSeconds << " s ("
+         << bytes / 1048576.0 / reopenSeconds << " MiB/s)\n";
+    reopened.close();
+    removeScratch();
+}
+
+// Synthetic orders of one to four books over series of 20 related books
+// (popular series are bought more; four in five books come from the basket's
+// series), counted incrementally as checkouts would, then written to a
+// scratch journal and recounted with rebuild(). Times both builds and
+// "customers also bought" lookups, and checks how far the bounded
+// incremental top 5 agrees with the exact one.
+void runRecommendationBenchmark(size_t orderCount, int bookCount) {
+    orderCount = max<size_t>(1, orderCount);
+    bookCount = max(100, bookCount);
+    const int SERIES_LENGTH = 20;
+    const int seriesCount = bookCount / SERIES_LENGTH;
+    mt19937_64 rng(11);
+    vector<uint64_t> starts(1, 0);
+    vector<int> members;
+    starts.reserve(orderCount + 1);
+    members.reserve(orderCount * 5 / 2);
+    for (size_t i = 0; i < orderCount; i++) {
+        uint64_t a = rng() % seriesCount, b = rng() % seriesCount;
+        int series = static_cast<int>(a * b / seriesCount);
+        int books = 1 + static_cast<int>(rng() % 4);
+        for (int k = 0; k < books; k++) {
+            members.push_back(rng() % 5 != 0 ? 1 + series * SERIES_LENGTH + static_cast<int>(rng() % SERIES_LENGTH)
+                                             : 1 + static_cast<int>(rng() % bookCount));
+        }
+        starts.push_back(members.size());
+    }
+    cout << fixed << setprecision(2);
+
+    CoPurchaseRecommender incremental;
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < orderCount; i++) {
+        incremental.recordOrder(members.data() + starts[i], starts[i + 1] - starts[i]);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Incremental: " << incremental.orders() << " orders in " << seconds << " s ("
+         << setprecision(0) << orderCount / seconds << " orders/s), " << incremental.books()
+         << " books with partners, " << setprecision(1)
+         << incremental.books() * CoPurchaseRecommender::SLOTS * 8 / 1048576.0 << " MiB of partner slots\n";
+
+    string path = (filesystem::temp_directory_path() / ("recommend_bench_" + to_string(time(nullptr)) + ".log")).string();
+    CoPurchaseRecommender rebuilt;
+    size_t threads = max(1u, thread::hardware_concurrency());
+    {
+        OrderJournal orders;
+        if (!orders.open(path)) {
+            cout << "Could not create " << path << ".\n";
+            return;
+        }
+        started = chrono::steady_clock::now();
+        OrderRecord order;
+        for (size_t i = 0; i < orderCount; i++) {
+            order.accountID = 1000 + static_cast<int>(i % 1000);
+            order.items.clear();
+            for (uint64_t m = starts[i]; m < starts[i + 1]; m++) {
+                order.items.push_back(OrderItem{ members[m], 1, 1299, "", "" });
+            }
+            orders.append(order);
+        }
+        orders.commit();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << setprecision(2) << "Wrote the scratch journal in " << seconds << " s\n";
+
+        started = chrono::steady_clock::now();
+        uint64_t read = rebuilt.rebuild(orders, threads);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << "Rebuild: " << read << " orders from the journal with " << threads << " threads in " << seconds
+             << " s (" << setprecision(0) << read / seconds << " orders/s)\n";
+    }
+    error_code error;
+    filesystem::remove(path, error);
+
+    const size_t QUERIES = 1000000;
+    size_t suggested = 0;
+    started = chrono::steady_clock::now();
+    for (size_t i = 0; i < QUERIES; i++) {
+        suggested += rebuilt.alsoBought(1 + static_cast<int>(rng() % bookCount), 5).size();
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    vector<double> latencies(100000);
+    for (auto& latency : latencies) {
+        int bookID = 1 + static_cast<int>(rng() % bookCount);
+        auto begin = chrono::steady_clock::now();
+        suggested += rebuilt.alsoBought(bookID, 5).size();
+        latency = chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count();
+    }
+    sort(latencies.begin(), latencies.end());
+    cout << setprecision(3) << "Also-bought (top 5): " << seconds * 1e6 / QUERIES << " us per query, p99 "
+         << latencies[latencies.size() * 99 / 100] << " us, max " << latencies.back() << " us ("
+         << suggested << " suggestions)\n";
+
+    // Agreement of the incremental top 5 with the exact counts, and how many
+    // exact suggestions come from the book's own series
+    size_t compared = 0, agreed = 0, sameSeries = 0;
+    for (int bookID = 1; bookID <= bookCount; bookID += 7) {
+        vector<CoPurchaseRecommender::Suggestion> exact = rebuilt.alsoBought(bookID, 5);
+        vector<CoPurchaseRecommender::Suggestion> bounded = incremental.alsoBought(bookID, 5);
+        for (const auto& suggestion : exact) {
+            compared++;
+            for (const auto& other : bounded) {
+                if (other.bookID == suggestion.bookID) {
+                    agreed++;
+                    break;
+                }
+            }
+            if ((suggestion.bookID - 1) / SERIES_LENGTH == (bookID - 1) / SERIES_LENGTH) sameSeries++;
+        }
+    }
+    cout << setprecision(1) << "Incremental top 5 matches the exact top 5 for " << (compared ? 100.0 * agreed / compared : 100.0)
+         << "% of suggestions; " << (compared ? 100.0 * sameSeries / compared : 0.0) << "% are from the same series\n";
+}
+
+// Scratch orders of two books, two copies each (so four one-copy returns
+// each), then returns of single copies in batches: one in five refund-only,
+// one in ten a retry of an earlier key. Checks that stock came back exactly
+// once per restocking return, that no order refunds more than it paid, that
+// replaying a batch changes nothing, and that a reopened ledger agrees. The
+// time of one full catalog rewrite (the old way of recording returns) is
+// shown for comparison.
+void runReturnBenchmark(size_t returnCount, size_t batchSize) {
+    returnCount = max<size_t>(4, returnCount);
+    batchSize = max<size_t>(1, batchSize);
+    const int BOOKS = 100000;
+    const int INITIAL_STOCK = 1000;
+    const size_t orderCount = (returnCount + 3) / 4;
+    filesystem::path scratch = filesystem::temp_directory_path() / ("returns_bench_" + to_string(time(nullptr)));
+    filesystem::create_directories(scratch);
+    string ordersPath = (scratch / "orders.log").string();
+    string catalogJournalPath = (scratch / "catalog_journal.log").string();
+    string returnsPath = (scratch / "returns.log").string();
+    auto makeCatalog = [&](Catalog& catalog) {
+        catalog.reserve(BOOKS);
+        for (int id = 1; id <= BOOKS; id++) {
+            catalog.addBook(Book(id, "Bench title " + to_string(id), "Bench author", 12.99, INITIAL_STOCK));
+        }
+    };
+    cout << fixed << setprecision(2);
+
+    mt19937_64 rng(5);
+    vector<int64_t> paidCents(orderCount + 1, 0);
+    vector<ReturnRequest> requests;
+    requests.reserve(returnCount);
+    int64_t restockedCopies = 0;
+    {
+        OrderJournal orders;
+        if (!orders.open(ordersPath)) {
+            cout << "Could not create " << ordersPath << ".\n";
+            return;
+        }
+        OrderRecord order;
+        for (size_t i = 0; i < orderCount; i++) {
+            int first = 1 + static_cast<int>(rng() % BOOKS);
+            int second = first % BOOKS + 1;
+            order.accountID = 1000 + static_cast<int>(i % 1000);
+            order.items = { OrderItem{ first, 2, 1299, "", "" }, OrderItem{ second, 2, 899, "", "" } };
+            order.totalCents = (1299 + 899) * 2 * 9 / 10; // A 10% promotion
+            uint64_t orderID = orders.append(order);
+            paidCents[orderID] = order.totalCents;
+            for (int copy = 0; copy < 4 && requests.size() < returnCount; copy++) {
+                ReturnRequest request;
+                request.key = "bench:" + to_string(orderID) + ":" + to_string(copy);
+                request.orderID = orderID;
+                request.accountID = order.accountID;
+                request.bookID = copy < 2 ? first : second;
+                request.quantity = 1;
+                request.restock = rng() % 5 != 0;
+                requests.push_back(move(request));
+            }
+        }
+        orders.commit();
+    }
+    shuffle(requests.begin(), requests.end(), rng);
+    // Replace one request in ten with a retry of an earlier one
+    size_t retries = 0;
+    for (size_t i = 1; i < requests.size(); i++) {
+        if (rng() % 10 == 0) {
+            requests[i] = requests[rng() % i];
+            retries++;
+        }
+    }
+
+    uint64_t applied = 0, duplicates = 0, rejected = 0;
+    int64_t refundedCents = 0;
+    {
+        Catalog catalog;
+        makeCatalog(catalog);
+        OrderJournal orders;
+        CatalogJournal journal;
+        ReturnLedger returns;
+        if (!orders.open(ordersPath) || !journal.open(catalogJournalPath, catalog)
+            || !returns.open(returnsPath, catalog, journal)) {
+            cout << "Could not open the scratch logs in " << scratch.string() << ".\n";
+            return;
+        }
+        size_t batches = 0;
+        auto started = chrono::steady_clock::now();
+        for (size_t begin = 0; begin < requests.size(); begin += batchSize) {
+            vector<ReturnRequest> batch(requests.begin() + begin, requests.begin() + min(begin + batchSize, requests.size()));
+            vector<ReturnOutcome> outcomes = returns.applyBatch(batch, orders, catalog, journal);
+            for (size_t i = 0; i < outcomes.size(); i++) {
+                if (outcomes[i].status == RETURN_APPLIED) {
+                    applied++;
+                    refundedCents += outcomes[i].refundCents;
+                    if (batch[i].restock) restockedCopies += batch[i].quantity;
+                } else if (outcomes[i].status == RETURN_DUPLICATE) {
+                    duplicates++;
+                } else {
+                    rejected++;
+                }
+            }
+            batches++;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << requests.size() << " returns in " << batches << " batches of " << batchSize << " in " << seconds << " s ("
+             << setprecision(0) << requests.size() / seconds << " returns/s, durable); " << applied << " applied, "
+             << duplicates << " retries answered from the ledger (" << retries << " sent), " << rejected << " rejected\n";
+
+        int64_t stockBack = 0;
+        for (int stock : catalog.stockColumn()) {
+            stockBack += stock - INITIAL_STOCK;
+        }
+        size_t overRefunded = 0;
+        for (size_t orderID = 1; orderID <= orderCount; orderID++) {
+            if (returns.refundedCents(orderID) > paidCents[orderID]) overRefunded++;
+        }
+        cout << setprecision(2) << "Stock back: " << stockBack << " copies (expected " << restockedCopies << "); refunded $"
+             << refundedCents / 100.0 << " (ledger total $" << returns.totalRefundedCents() / 100.0 << "); "
+             << overRefunded << " orders over-refunded\n";
+
+        vector<ReturnRequest> replay(requests.begin(), requests.begin() + min(batchSize, requests.size()));
+        size_t repeated = 0;
+        for (const auto& outcome : returns.applyBatch(replay, orders, catalog, journal)) {
+            if (outcome.status == RETURN_DUPLICATE) repeated++;
+        }
+        int64_t stockAfterReplay = 0;
+        for (int stock : catalog.stockColumn()) {
+            stockAfterReplay += stock - INITIAL_STOCK;
+        }
+        cout << "Replaying the first batch: " << repeated << " of " << replay.size() << " answered as duplicates, stock "
+             << (stockAfterReplay == stockBack ? "unchanged" : "CHANGED") << "\n";
+
+        string rewritePath = (scratch / "book_data.txt").string();
+        started = chrono::steady_clock::now();
+        saveBooksToText(catalog, rewritePath);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << "One full rewrite of the " << BOOKS << "-book catalog takes " << seconds * 1000.0 << " ms\n";
+    }
+
+    {
+        Catalog catalog;
+        makeCatalog(catalog);
+        CatalogJournal journal;
+        ReturnLedger returns;
+        auto started = chrono::steady_clock::now();
+        bool reopened = journal.open(catalogJournalPath, catalog) && returns.open(returnsPath, catalog, journal);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        int64_t stockBack = 0;
+        for (int stock : catalog.stockColumn()) {
+            stockBack += stock - INITIAL_STOCK;
+        }
+        cout << "Reopened " << (reopened ? "" : "(FAILED) ") << returns.size() << " ledger entries and the catalog journal in "
+             << seconds * 1000.0 << " ms: refunds $" << returns.totalRefundedCents() / 100.0 << ", stock back " << stockBack
+             << " copies\n";
+    }
+    error_code error;
+    filesystem::remove_all(scratch, error);
+}
+
+// Renders a synthetic catalog to /dev/null with the former per-field
+// iostream row (setw/setprecision and endl, so one flush per book) and with
+// ListingRenderer, checks both produce the same bytes, then times one page
+// through a ListingCursor and the server's reply lines.
+void runListingBenchmark(size_t bookCount) {
+    bookCount = max<size_t>(1, bookCount);
+    Catalog catalog;
+    catalog.reserve(bookCount);
+    mt19937_64 rng(8);
+    for (size_t i = 0; i < bookCount; i++) {
+        int id = static_cast<int>(i + 1);
+        string title = "Title " + to_string(rng() % 1000000) + (i % 7 == 0 ? " and a subtitle too long for the column" : "");
+        catalog.addBook(id, title, "Author " + to_string(rng() % 50000), (100 + rng() % 9900) / 100.0,
+                        static_cast<int>(rng() % 200));
+        uint64_t tally;
+        catalog.addRating(id, 1.0 + (rng() % 9) / 2.0, tally);
+    }
+    auto legacyRow = [](ostream& out, const BookView& book) {
+        out << left << setw(5) << book.getBookID()
+            << setw(25) << book.getTitle()
+            << setw(20) << book.getAuthor()
+            << "$" << fixed << setprecision(2) << book.getPrice()
+            << setw(10) << " Stock: " << book.getStockQuantity()
+            << " Rating: " << fixed << setprecision(1) << book.getAverageRating() << "/5"
+            << endl;
+    };
+    cout << fixed << setprecision(2);
+
+    ofstream devNull("/dev/null", ios::binary);
+    if (!devNull) {
+        cout << "Cannot open /dev/null.\n";
         return;
     }
-
-    outFile << "----- Order Details -----\n";
-    outFile << "Name: " << buyer->getPay() << endl;
-    outFile << "Buyer ID: " << buyer->getPay() << endl;
-    outFile << "Address: " << buyer->getPay() << endl;
-
-    outFile << "Books Purchased:\n";
-    for (const auto& item : cart) {
-        outFile << "- " << item.first.getTitle() << " by " << item.first.getAuthor()
-                << " x" << item.second << " ($" << fixed << setprecision(2) << item.first.getPrice() << " each)\n";
+    auto started = chrono::steady_clock::now();
+    for (const auto& book : catalog) {
+        legacyRow(devNull, book);
     }
-    outFile << "Total Amount Paid: $" << fixed << setprecision(2) << buyer->getPay() << "\n\n";
-    outFile.close();
+    double legacySeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-    // Save order history per user
-    string filename = ORDER_HISTORY_PREFIX + to_string(buyer->getPay()) + ".txt";
-    ofstream historyFile(filename, ios::app);
-    if (historyFile) {
-        historyFile << "----- Order Details -----\n";
-        historyFile << "Name: " << buyer->getPay() << endl;
-        historyFile << "Buyer ID: " << buyer->getPay() << endl;
-        historyFile << "Address: " << buyer->getPay() << endl;
-
-        historyFile << "Books Purchased:\n";
-        for (const auto& item : cart) {
-            historyFile << "- " << item.first.getTitle() << " by " << item.first.getAuthor()
-                        << " x" << item.second << " ($" << fixed << setprecision(2) << item.first.getPrice() << " each)\n";
+    started = chrono::steady_clock::now();
+    {
+        ListingRenderer renderer(devNull);
+        for (const auto& book : catalog) {
+            renderer.row(book);
         }
-        historyFile << "Total Amount Paid: $" << fixed << setprecision(2) << buyer->getPay() << "\n\n";
-        historyFile.close();
     }
-}
+    devNull.flush();
+    double renderSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << bookCount << " rows to /dev/null:\n";
+    cout << "  iostream + endl   " << setw(8) << legacySeconds * 1000.0 << " ms (" << setprecision(0)
+         << bookCount / legacySeconds << " rows/s)\n" << setprecision(2);
+    cout << "  ListingRenderer   " << setw(8) << renderSeconds * 1000.0 << " ms (" << setprecision(0)
+         << bookCount / renderSeconds << " rows/s)\n" << setprecision(2);
 
-void viewCart(const vector<pair<Book, int>>& cart) {
-    if (cart.empty()) {
-        cout << "Your cart is empty.\n";
-        return;
+    ostringstream expected;
+    for (const auto& book : catalog) {
+        legacyRow(expected, book);
     }
-    cout << "\nYour Shopping Cart:\n";
-    for (const auto& item : cart) {
-        cout << "- " << item.first.getTitle() << " x" << item.second << " ($" << item.first.getPrice() << " each)\n";
+    ListingRenderer collected;
+    for (const auto& book : catalog) {
+        collected.row(book);
     }
-}
+    string rendered = collected.take();
+    cout << "  output " << (rendered == expected.str() ? "identical" : "DIFFERS") << " (" << rendered.size() << " bytes)\n";
 
-void removeBookFromCart(vector<pair<Book, int>>& cart) {
-    if (cart.empty()) {
-        cout << "Your cart is empty.\n";
-        return;
+    // One page from the middle of the catalog
+    const int PAGES = 1000;
+    started = chrono::steady_clock::now();
+    size_t rows = 0;
+    for (int p = 0; p < PAGES; p++) {
+        ListingRenderer renderer(devNull);
+        ListingCursor cursor;
+        cursor.offset = (bookCount / 2 + static_cast<size_t>(p) * LISTING_PAGE_SIZE) % bookCount;
+        rows += cursor.renderPage(renderer, catalog.size(), [&catalog](size_t slot) { return catalog.at(slot); });
     }
-    int bookID;
-    cout << "Enter the ID of the book to remove from your cart: ";
-    cin >> bookID;
-    cin.ignore();
+    double pageSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  one " << LISTING_PAGE_SIZE << "-row page: " << pageSeconds * 1e6 / PAGES << " us (" << rows << " rows)\n";
 
-    auto it = find_if(cart.begin(), cart.end(), [bookID](const pair<Book, int>& item) {
-        return item.first.getBookID() == bookID;
-    });
-
-    if (it != cart.end()) {
-        cart.erase(it);
-        cout << "Book removed from your cart.\n";
-    } else {
-        cout << "Book not found in your cart.\n";
+    // Server reply lines, formerly an ostringstream per book
+    started = chrono::steady_clock::now();
+    size_t legacyBytes = 0;
+    for (const auto& book : catalog) {
+        ostringstream line;
+        line << book.getBookID() << '|' << book.getTitle() << '|' << book.getAuthor() << '|'
+             << fixed << setprecision(2) << book.getPrice() << '|' << book.getStockQuantity() << '|'
+             << setprecision(1) << book.getAverageRating() << '\n';
+        legacyBytes += line.str().size();
+    }
+    double legacyRecordSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    ListingRenderer records;
+    for (const auto& book : catalog) {
+        records.record(book);
     }
+    size_t recordBytes = records.take().size();
+    double recordSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  server lines: ostringstream " << legacyRecordSeconds * 1000.0 << " ms, ListingRenderer "
+         << recordSeconds * 1000.0 << " ms (" << (legacyBytes == recordBytes ? "same size" : "SIZE DIFFERS") << ")\n";
 }
 
-void updateBookQuantity(vector<pair<Book, int>>& cart) {
-    if (cart.empty()) {
-        cout << "Your cart is empty.\n";
-        return;
-    }
-    int bookID, newQuantity;
-    cout << "Enter the ID of the book to update quantity: ";
-    cin >> bookID;
-    cin.ignore();
+// Times what recording costs (a counter bump, a histogram record, a whole
+// ScopedTimer) on one thread and on several, compares histogram percentiles
+// with the exact ones of a long-tailed sample, and times catalog searches so
+// a BOOKSTORE_METRICS=0 build can be compared with this one.
+void runMetricsBenchmark(size_t events) {
+    events = max<size_t>(1000, events);
+    cout << fixed << setprecision(2);
+    cout << "Metrics " << (METRICS_ENABLED ? "enabled" : "compiled out (BOOKSTORE_METRICS=0)") << ", "
+         << events << " events per run\n";
 
-    auto it = find_if(cart.begin(), cart.end(), [bookID](pair<Book, int>& item) {
-        return item.first.getBookID() == bookID;
-    });
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < events; i++) {
+        Metrics::count(COUNT_SEARCHES);
+    }
+    double countSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    for (size_t i = 0; i < events; i++) {
+        Metrics::record(TIME_SEARCH, (i * 2654435761u) % 1000000);
+    }
+    double recordSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    for (size_t i = 0; i < events; i++) {
+        ScopedTimer timer(TIME_SEARCH);
+    }
+    double timerSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  counter bump      " << setw(8) << countSeconds * 1e9 / events << " ns\n";
+    cout << "  histogram record  " << setw(8) << recordSeconds * 1e9 / events << " ns\n";
+    cout << "  ScopedTimer       " << setw(8) << timerSeconds * 1e9 / events << " ns (two clock reads and a record)\n";
 
-    if (it != cart.end()) {
-        cout << "Enter new quantity: ";
-        cin >> newQuantity;
-        cin.ignore();
-        it->second = newQuantity;
-        cout << "Quantity updated.\n";
-    } else {
-        cout << "Book not found in your cart.\n";
+    unsigned threadCount = max(4u, thread::hardware_concurrency());
+    size_t perThread = events / threadCount;
+    started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (unsigned t = 0; t < threadCount; t++) {
+        threads.emplace_back([perThread] {
+            for (size_t i = 0; i < perThread; i++) {
+                ScopedTimer timer(TIME_SEARCH);
+                Metrics::count(COUNT_SEARCHES);
+            }
+        });
     }
-}
+    for (auto& worker : threads) {
+        worker.join();
+    }
+    double sharedSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  " << threadCount << " threads, timer + counter: " << sharedSeconds * 1e9 / (perThread * threadCount)
+         << " ns per event overall\n";
 
-void userRegistration(map<string, User>& users) {
-    string username, password;
-    int id;
-    cout << "Enter a username: ";
-    getline(cin, username);
-    if (users.find(username) != users.end()) {
-        cout << "Username already exists. Try logging in.\n";
-        return;
+    // Log-normal latencies around 20 us with a tail into the milliseconds
+    mt19937_64 rng(25);
+    lognormal_distribution<double> latency(log(20000.0), 1.2);
+    size_t samples = min<size_t>(events, 2000000);
+    vector<uint64_t> exact(samples);
+    unique_ptr<LatencyHistogram> histogram = make_unique<LatencyHistogram>();
+    for (size_t i = 0; i < samples; i++) {
+        exact[i] = static_cast<uint64_t>(latency(rng));
+        histogram->record(exact[i]);
+    }
+    sort(exact.begin(), exact.end());
+    LatencySummary summary;
+    summary.add(*histogram);
+    cout << "  percentiles of " << samples << " log-normal samples (histogram / exact):\n";
+    for (double fraction : { 0.5, 0.9, 0.99, 0.999 }) {
+        size_t rank = max<size_t>(1, static_cast<size_t>(ceil(fraction * static_cast<double>(samples))));
+        uint64_t truth = exact[rank - 1];
+        uint64_t estimate = summary.percentile(fraction);
+        cout << "    p" << setprecision(fraction < 0.999 ? 0 : 1) << fraction * 100.0
+             << setprecision(2) << "  " << Metrics::formatNanos(static_cast<double>(estimate)) << " / "
+             << Metrics::formatNanos(static_cast<double>(truth)) << " (+"
+             << (static_cast<double>(estimate) - static_cast<double>(truth)) * 100.0 / static_cast<double>(truth)
+             << "%)\n";
     }
-    cout << "Enter a password: ";
-    getline(cin, password);
-    cout << "Enter your buyer ID: ";
-    cin >> id;
-    cin.ignore();
 
-    users[username] = User(username, password, id);
-    cout << "Registration successful.\n";
+    // The same searches in both builds show what the instrumentation costs
+    Catalog catalog;
+    const size_t BOOKS = 20000;
+    catalog.reserve(BOOKS);
+    for (size_t i = 0; i < BOOKS; i++) {
+        catalog.addBook(static_cast<int>(i + 1), "Title " + to_string(rng() % 100000), "Author " + to_string(rng() % 5000),
+                        9.99, 10);
+    }
+    size_t searches = max<size_t>(1000, events / 100);
+    size_t found = 0;
+    catalog.search("title 1"); // Builds the search index
+    started = chrono::steady_clock::now();
+    for (size_t i = 0; i < searches; i++) {
+        found += catalog.search("author " + to_string(i % 5000)).size();
+    }
+    double searchSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "  " << searches << " catalog searches: " << searchSeconds * 1e6 / searches << " us each (" << found
+         << " results)\n";
 }
 
-User userLogin(map<string, User>& users) {
-    string username, password;
-    cout << "Enter your username: ";
-    getline(cin, username);
-    cout << "Enter your password: ";
-    getline(cin, password);
+// Saves a synthetic catalog as a snapshot on a scratch file, then loads it
+// twice: mapped in place (an empty catalog, as at startup) and copied row by
+// row (a catalog already holding a book, the former way every load worked).
+// Times the first lookups and a price change on the mapped catalog, checks
+// every book against the original, and checks that adding and removing a
+// book on the mapped catalog keeps every other lookup working.
+void runSnapshotBenchmark(size_t bookCount) {
+    bookCount = max<size_t>(1, bookCount);
+    const string scratchPath = "snapshot_bench.tmp";
+    auto idOf = [](size_t i) { return static_cast<int>(i * 7 + 3); };
+    double saveMillis;
+    {
+        Catalog original;
+        original.reserve(bookCount);
+        original.deferSearchIndex();
+        for (size_t i = 0; i < bookCount; i++) {
+            original.addBook(idOf(i), "Title " + to_string(i), "Author " + to_string(i % 50000), (100 + i % 9900) / 100.0,
+                             static_cast<int>(i % 200));
+        }
+        auto started = chrono::steady_clock::now();
+        if (!saveCatalogSnapshot(original, scratchPath)) {
+            cout << "Could not write " << scratchPath << ".\n";
+            return;
+        }
+        saveMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    }
+    cout << fixed << setprecision(3);
+    cout << bookCount << " books, snapshot of " << filesystem::file_size(scratchPath) / (1024 * 1024) << " MiB saved in "
+         << saveMillis << " ms\n";
 
-    auto it = users.find(username);
-    if (it != users.end() && it->second.getPassword() == password) {
-        cout << "Login successful.\n";
-        it->second.setLoggedIn(true);
-        return it->second;
-    } else {
-        throw AuthenticationError();
+    Catalog mapped;
+    auto started = chrono::steady_clock::now();
+    bool loaded = loadCatalogSnapshot(mapped, scratchPath);
+    double mapMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    const int LOOKUPS = 1000;
+    started = chrono::steady_clock::now();
+    double priceSum = 0.0;
+    for (int k = 0; k < LOOKUPS; k++) {
+        BookView book = mapped.findBook(idOf((static_cast<size_t>(k) * 7919) % bookCount));
+        if (book) priceSum += book.getPrice();
     }
-}
+    double lookupMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    mapped.setPrice(idOf(bookCount / 2), 1.25);
+    double writeMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    cout << "  mapped load        " << setw(10) << mapMillis << " ms" << (loaded ? "" : " (FAILED)") << "\n";
+    cout << "  first " << LOOKUPS << " lookups " << setw(10) << lookupMillis << " ms (prices sum to " << setprecision(2)
+         << priceSum << setprecision(3) << ")\n";
+    cout << "  first price change " << setw(10) << writeMillis << " ms\n";
 
-void viewOrderHistory(const User& user) {
-    string filename = ORDER_HISTORY_PREFIX + to_string(user.getId()) + ".txt";
-    ifstream historyFile(filename);
-    if (!historyFile) {
-        cout << "No order history found.\n";
-        return;
+    Catalog copied;
+    copied.addBook(-1, "Already here", "Someone", 1.0, 1);
+    started = chrono::steady_clock::now();
+    loaded = loadCatalogSnapshot(copied, scratchPath);
+    double copyMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    cout << "  copied row by row  " << setw(10) << copyMillis << " ms" << (loaded ? "" : " (FAILED)") << "\n";
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < bookCount; i++) {
+        BookView book = mapped.findBook(idOf(i));
+        double price = i == bookCount / 2 ? 1.25 : (100 + i % 9900) / 100.0;
+        mismatches += !book || book.getTitle() != "Title " + to_string(i) || book.getAuthor() != "Author " + to_string(i % 50000)
+                      || book.getPrice() != price || book.getStockQuantity() != static_cast<int>(i % 200);
     }
-    cout << "\nYour Order History:\n";
-    string line;
-    while (getline(historyFile, line)) {
-        cout << line << endl;
+    mapped.addBook(-1, "Added after loading", "Someone", 1.0, 1);
+    mapped.removeBook(idOf(0));
+    size_t lost = 0;
+    for (size_t i = 1; i < bookCount; i++) {
+        lost += !mapped.findBook(idOf(i));
     }
-    historyFile.close();
+    bool changed = mapped.findBook(-1) && !mapped.findBook(idOf(0)) && mapped.size() == bookCount;
+    cout << "  " << mismatches << " books differ from the original; after an add and a remove " << lost
+         << " books are missing" << (changed ? "" : " (ADD/REMOVE FAILED)") << "\n";
+    error_code error;
+    filesystem::remove(scratchPath, error);
 }
 
-void adminMenu(Admin& admin, vector<Book>& books) {
-    int choice;
-    do {
-        cout << "\n--- Admin Menu ---\n";
-        cout << "1. Add Book\n2. Remove Book\n3. Update Book Stock\n4. View Books\n5. Exit\nChoose an option: ";
-        cin >> choice;
-        cin.ignore();
-        switch (choice) {
-            case 1:
-                admin.addBook(books);
-                break;
-            case 2:
-                admin.removeBook(books);
-                break;
-            case 3:
-                admin.updateBookStock(books);
-                break;
-            case 4:
-                displayBookList(books);
-                break;
-            case 5:
-                cout << "Exiting Admin Menu.\n";
-                break;
-            default:
-                cout << "Invalid choice. Try again.\n";
-                break;
+// For each catalog size, looks books up by ID through the Catalog index and
+// with the former find_if scan over a vector<Book>, then times checkouts of
+// five-book carts (one lookup and stock decrement per line) both ways. Scans
+// are sampled less often on large catalogs; both ways must find the same
+// books.
+void runLookupBenchmark(const vector<size_t>& bookCounts) {
+    cout << fixed << setprecision(3);
+    for (size_t bookCount : bookCounts) {
+        bookCount = max<size_t>(1, bookCount);
+        Catalog catalog;
+        vector<Book> books;
+        catalog.reserve(bookCount);
+        books.reserve(bookCount);
+        catalog.deferSearchIndex();
+        auto idOf = [](size_t i) { return static_cast<int>(i * 3 + 1); };
+        for (size_t i = 0; i < bookCount; i++) {
+            string title = "Title " + to_string(i);
+            catalog.addBook(idOf(i), title, "Author", 9.99, 1000000);
+            books.push_back(Book(idOf(i), title, "Author", 9.99, 1000000));
+        }
+        mt19937_64 rng(1);
+        const size_t INDEXED_LOOKUPS = 1000000;
+        size_t scanLookups = min<size_t>(100000, max<size_t>(10, 200000000 / bookCount));
+        vector<int> wanted(INDEXED_LOOKUPS);
+        for (auto& id : wanted) {
+            id = idOf(rng() % bookCount);
         }
-    } while (choice != 5);
-}
 
-void applyCoupon(Buyer* buyer) {
-    char choice;
-    cout << "Do you have a discount coupon? (y/n): ";
-    cin >> choice;
-    cin.ignore();
-    if (tolower(choice) == 'y') {
-        string couponCode;
-        cout << "Enter coupon code: ";
-        getline(cin, couponCode);
-        // For simplicity, let's say "SAVE10" gives a 10% discount
-        if (couponCode == "SAVE10") {
-            double currentPay = buyer->getPay();
-            buyer->setPay(currentPay * 0.90);
-            cout << "Coupon applied! You get a 10% discount.\n";
-        } else {
-            cout << "Invalid coupon code.\n";
+        auto started = chrono::steady_clock::now();
+        size_t found = 0;
+        for (int id : wanted) {
+            found += static_cast<bool>(catalog.findBook(id));
         }
-    }
-}
+        double indexedSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        size_t disagreements = 0;
+        started = chrono::steady_clock::now();
+        for (size_t k = 0; k < scanLookups; k++) {
+            int id = wanted[k];
+            auto it = find_if(books.begin(), books.end(), [id](const Book& book) { return book.getBookID() == id; });
+            disagreements += it == books.end() || it->getTitle() != catalog.findBook(id).getTitle();
+        }
+        double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-void processPayment(Buyer* buyer) {
-    cout << "\nProcessing payment...\n";
-    cout << "Payment of $" << fixed << setprecision(2) << buyer->getPay() << " successful.\n";
-}
+        // Checkouts: look up each of five lines and take one copy off its stock
+        const size_t LINES = 5;
+        size_t indexedCheckouts = INDEXED_LOOKUPS / LINES, scanCheckouts = max<size_t>(1, scanLookups / LINES);
+        started = chrono::steady_clock::now();
+        for (size_t c = 0; c < indexedCheckouts; c++) {
+            for (size_t line = 0; line < LINES; line++) {
+                catalog.adjustStockQuantity(wanted[c * LINES + line], -1);
+            }
+        }
+        double indexedCheckoutSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        started = chrono::steady_clock::now();
+        for (size_t c = 0; c < scanCheckouts; c++) {
+            for (size_t line = 0; line < LINES; line++) {
+                int id = wanted[c * LINES + line];
+                auto it = find_if(books.begin(), books.end(), [id](const Book& book) { return book.getBookID() == id; });
+                it->setStockQuantity(it->getStockQuantity() - 1);
+            }
+        }
+        double scanCheckoutSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-void saveUsersToFile(const map<string, User>& users) {
-    ofstream userFile(USER_DATA_FILE);
-    if (!userFile) {
-        cout << "Error saving user data.\n";
-        return;
-    }
-    for (const auto& pair : users) {
-        userFile << pair.second.getUsername() << " " << pair.second.getPassword() << " " << pair.second.getId() << endl;
+        cout << bookCount << " books" << (disagreements ? " (LOOKUPS DISAGREE)" : "") << ":\n";
+        cout << "  lookup    index " << setw(10) << indexedSeconds * 1e9 / INDEXED_LOOKUPS << " ns, scan "
+             << setw(14) << scanSeconds * 1e9 / scanLookups << " ns (" << found << " of " << INDEXED_LOOKUPS
+             << " found by index, " << scanLookups << " scans)\n";
+        cout << "  checkout  index " << setw(10) << indexedCheckoutSeconds * 1e6 / indexedCheckouts << " us, scan "
+             << setw(14) << scanCheckoutSeconds * 1e6 / scanCheckouts << " us (" << LINES << " lines)\n";
     }
-    userFile.close();
 }
 
-void loadUsersFromFile(map<string, User>& users) {
-    ifstream userFile(USER_DATA_FILE);
-    if (!userFile) {
-        cout << "No user data found. Starting fresh.\n";
-        return;
-    }
-    string username, password;
-    int id;
-    while (userFile >> username >> password >> id) {
-        users[username] = User(username, password, id);
+// Searches a synthetic catalog of random-word titles for whole words, word
+// prefixes and fragments inside words: through Catalog::search (trigram
+// index, built on the first query) and with the former scan that lowercased
+// a copy of every title and author per query. The scan runs on a sample of
+// the queries; both must find the same books. Also times adding and
+// removing books while the index is live.
+void runSearchBenchmark(size_t bookCount, size_t queryCount) {
+    bookCount = max<size_t>(1, bookCount);
+    queryCount = max<size_t>(1, queryCount);
+    mt19937_64 rng(2);
+    vector<string> words(20000);
+    for (auto& word : words) {
+        size_t length = 4 + rng() % 6;
+        for (size_t i = 0; i < length; i++) {
+            word += static_cast<char>('a' + rng() % 26);
+        }
     }
-    userFile.close();
-}
-
-void saveBooksToFile(const vector<Book>& books) {
-    ofstream bookFile(BOOK_DATA_FILE);
-    if (!bookFile) {
-        cout << "Error saving book data.\n";
-        return;
+    auto capitalized = [](string word) {
+        word[0] = static_cast<char>(toupper(static_cast<unsigned char>(word[0])));
+        return word;
+    };
+    Catalog catalog;
+    vector<Book> books;
+    catalog.reserve(bookCount);
+    books.reserve(bookCount);
+    catalog.deferSearchIndex();
+    for (size_t i = 0; i < bookCount; i++) {
+        string title;
+        for (size_t w = 2 + rng() % 3; w > 0; w--) {
+            title += (title.empty() ? "" : " ") + capitalized(words[rng() % words.size()]);
+        }
+        string author = capitalized(words[rng() % 2000]) + " " + capitalized(words[rng() % 2000]);
+        catalog.addBook(static_cast<int>(i + 1), title, author, 9.99, 1);
+        books.push_back(Book(static_cast<int>(i + 1), title, author, 9.99, 1));
     }
-    for (const auto& book : books) {
-        bookFile << book.getBookID() << "|"
-                 << book.getTitle() << "|"
-                 << book.getAuthor() << "|"
-                 << book.getPrice() << "|"
-                 << book.getStockQuantity() << "|"
-                 << book.getAverageRating() << endl;
+    vector<string> queries(queryCount);
+    for (size_t q = 0; q < queryCount; q++) {
+        const string& word = words[rng() % words.size()];
+        switch (q % 3) {
+            case 0: queries[q] = word; break;                           // Whole word
+            case 1: queries[q] = word.substr(0, 3 + rng() % 2); break;  // Prefix
+            default: queries[q] = word.substr(1, 3); break;             // Inside a word
+        }
     }
-    bookFile.close();
-}
 
-void loadBooksFromFile(vector<Book>& books) {
-    ifstream bookFile(BOOK_DATA_FILE);
-    if (!bookFile) {
-        cout << "No book data found. Using default books.\n";
-        // Initialize default books
-        books = {
-            Book(1, "The Great Gatsby", "F. Scott Fitzgerald", 10.99, 10),
-            Book(2, "1984", "George Orwell", 8.99, 5),
-            Book(3, "To Kill a Mockingbird", "Harper Lee", 12.50, 8),
-            Book(4, "Pride and Prejudice", "Jane Austen", 9.99, 7),
-            Book(5, "The Catcher in the Rye", "J.D. Salinger", 11.20, 6),
-            Book(6, "The Hobbit", "J.R.R. Tolkien", 15.00, 4),
-            Book(7, "Moby Dick", "Herman Melville", 13.45, 9),
-            Book(8, "War and Peace", "Leo Tolstoy", 20.00, 3),
-            Book(9, "The Odyssey", "Homer", 14.25, 12),
-            Book(10, "Hamlet", "William Shakespeare", 9.75, 15)
-        };
-        return;
+    cout << fixed << setprecision(2);
+    auto started = chrono::steady_clock::now();
+    catalog.search(queries[0]);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    const char* kinds[] = { "whole words", "prefixes", "inside words" };
+    double kindSeconds[3] = {};
+    size_t kindResults[3] = {}, kindQueries[3] = {};
+    for (size_t q = 0; q < queryCount; q++) {
+        started = chrono::steady_clock::now();
+        kindResults[q % 3] += catalog.search(queries[q]).size();
+        kindSeconds[q % 3] += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        kindQueries[q % 3]++;
     }
-    string line;
-    while (getline(bookFile, line)) {
-        stringstream ss(line);
-        string token;
-        vector<string> tokens;
-        while (getline(ss, token, '|')) {
-            tokens.push_back(token);
+    double indexedSeconds = kindSeconds[0] + kindSeconds[1] + kindSeconds[2];
+
+    size_t scanQueries = min(queryCount, max<size_t>(3, 20000000 / bookCount));
+    size_t disagreements = 0;
+    double scanSeconds = 0.0;
+    for (size_t q = 0; q < scanQueries; q++) {
+        const string& keyword = queries[q];
+        started = chrono::steady_clock::now();
+        vector<int> scanned;
+        for (const auto& book : books) {
+            string title = book.getTitle();
+            string author = book.getAuthor();
+            transform(title.begin(), title.end(), title.begin(), ::tolower);
+            transform(author.begin(), author.end(), author.begin(), ::tolower);
+            if (title.find(keyword) != string::npos || author.find(keyword) != string::npos) {
+                scanned.push_back(book.getBookID());
+            }
         }
-        if (tokens.size() >= 5) {
-            int id = stoi(tokens[0]);
-            string title = tokens[1];
-            string author = tokens[2];
-            double price = stod(tokens[3]);
-            int stock = stoi(tokens[4]);
-            books.push_back(Book(id, title, author, price, stock));
+        scanSeconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        vector<int> indexed;
+        for (const auto& book : catalog.search(keyword)) {
+            indexed.push_back(book.getBookID());
         }
+        sort(indexed.begin(), indexed.end());
+        disagreements += indexed != scanned;
     }
-    bookFile.close();
-}
 
-void searchBooks(const vector<Book>& books) {
-    cout << "Enter keyword to search for books: ";
-    string keyword;
-    getline(cin, keyword);
-    transform(keyword.begin(), keyword.end(), keyword.begin(), ::tolower);
-    vector<Book> results;
-    for (const auto& book : books) {
-        string title = book.getTitle();
-        string author = book.getAuthor();
-        transform(title.begin(), title.end(), title.begin(), ::tolower);
-        transform(author.begin(), author.end(), author.begin(), ::tolower);
-        if (title.find(keyword) != string::npos || author.find(keyword) != string::npos) {
-            results.push_back(book);
-        }
+    const int CHANGES = 10000;
+    started = chrono::steady_clock::now();
+    for (int i = 0; i < CHANGES; i++) {
+        catalog.addBook(-1 - i, "Added " + words[static_cast<size_t>(i) % words.size()], "Someone", 1.0, 1);
     }
-    if (results.empty()) {
-        cout << "No books found matching \"" << keyword << "\".\n";
-    } else {
-        cout << "\nSearch Results:\n";
-        for (const auto& book : results) {
-            book.displayBook();
-        }
+    for (int i = 0; i < CHANGES; i++) {
+        catalog.removeBook(-1 - i);
     }
-}
+    double changeSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-void filterBooks(const vector<Book>& books) {
-    // Implement filtering functionality based on price, rating, etc.
-    // This function is a placeholder for future development.
+    cout << bookCount << " books, index built in " << buildSeconds * 1000.0 << " ms (first query)\n";
+    cout << "  trigram index  " << setw(12) << indexedSeconds * 1e6 / queryCount << " us per query ("
+         << setprecision(0) << queryCount / indexedSeconds << " queries/s)\n" << setprecision(2);
+    for (int kind = 0; kind < 3 && queryCount >= 3; kind++) {
+        cout << "    " << left << setw(13) << kinds[kind] << right << setw(12) << kindSeconds[kind] * 1e6 / kindQueries[kind]
+             << " us, " << static_cast<double>(kindResults[kind]) / kindQueries[kind] << " results on average\n";
+    }
+    cout << "  lowercase scan " << setw(12) << scanSeconds * 1e6 / scanQueries << " us per query (" << scanQueries
+         << " queries, " << disagreements << " with different results)\n";
+    cout << "  add + remove with the index live: " << changeSeconds * 1e6 / (2 * CHANGES) << " us per change\n";
 }
 
-void rateBook(vector<Book>& books) {
-    int bookID;
-    double rating;
-    cout << "Enter the ID of the book you want to rate: ";
-    cin >> bookID;
-    cin.ignore();
-    auto it = find_if(books.begin(), books.end(), [bookID](Book& b) {
-        return b.getBookID() == bookID;
-    });
-    if (it != books.end()) {
-        cout << "Enter your rating (1-5): ";
-        cin >> rating;
-        cin.ignore();
-        if (rating >= 1.0 && rating <= 5.0) {
-            it->addRating(rating);
-            cout << "Thank you for rating \"" << it->getTitle() << "\".\n";
-        } else {
-            cout << "Invalid rating. Please enter a value between 1 and 5.\n";
+// Scans synthetic title/author text for keywords with each case-insensitive
+// kernel the CPU supports and with the former per-field lowercase copy plus
+// string::find, in GB of text scanned per second. The text is scanned twice:
+// as catalog-sized fields (one call per field, as searches do) and as one
+// large buffer (the kernels' peak). Every method must count the same matches.
+void runMatcherBenchmark(size_t megabytes) {
+    size_t targetBytes = max<size_t>(1, megabytes) << 20;
+    mt19937_64 rng(3);
+    string text;
+    vector<string_view> fields;
+    vector<size_t> fieldStarts;
+    text.reserve(targetBytes + 64);
+    while (text.size() < targetBytes) {
+        fieldStarts.push_back(text.size());
+        for (size_t w = 1 + rng() % 4; w > 0; w--) {
+            if (fieldStarts.back() != text.size()) text += ' ';
+            size_t length = 3 + rng() % 7;
+            for (size_t i = 0; i < length; i++) {
+                char c = static_cast<char>('a' + rng() % 26);
+                text += i == 0 ? static_cast<char>(toupper(static_cast<unsigned char>(c))) : c;
+            }
         }
-    } else {
-        cout << "Book not found.\n";
     }
-}
+    fieldStarts.push_back(text.size());
+    for (size_t f = 0; f + 1 < fieldStarts.size(); f++) {
+        fields.push_back(string_view(text.data() + fieldStarts[f], fieldStarts[f + 1] - fieldStarts[f]));
+    }
+    const vector<string> keywords = { "zqxj", "tolkien", "the", "qu" };
 
-void addToWishlist(vector<Book>& wishlist, const vector<Book>& books) {
-    int bookID;
-    cout << "Enter the ID of the book to add to your wishlist: ";
-    cin >> bookID;
-    cin.ignore();
-    auto it = find_if(books.begin(), books.end(), [bookID](const Book& b) {
-        return b.getBookID() == bookID;
-    });
-    if (it != books.end()) {
-        wishlist.push_back(*it);
-        cout << "\"" << it->getTitle() << "\" has been added to your wishlist.\n";
-    } else {
-        cout << "Book not found.\n";
+    struct Method {
+        const char* name;
+        FindIgnoreCaseFn kernel; // Null for the lowercase copy
+    };
+    vector<Method> methods;
+    methods.push_back({ "lowercase copy + find", nullptr });
+    methods.push_back({ "scalar kernel", [](const char* t, size_t n, const char* k, size_t m) {
+        return findIgnoreCaseScalar(t, n, k, m);
+    } });
+#if defined(__SSE2__)
+    methods.push_back({ "SSE2 kernel", findIgnoreCaseSSE2 });
+#endif
+#if defined(BOOKSTORE_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) methods.push_back({ "AVX2 kernel", findIgnoreCaseAVX2 });
+#endif
+
+    cout << fixed << setprecision(2);
+    cout << text.size() / (1024 * 1024) << " MiB of text in " << fields.size() << " fields (" << text.size() / fields.size()
+         << " bytes each on average), keywords";
+    for (const auto& keyword : keywords) {
+        cout << " \"" << keyword << "\"";
     }
-}
+    cout << ":\n";
+    vector<size_t> reference;
+    for (const auto& method : methods) {
+        vector<size_t> counts;
+        auto started = chrono::steady_clock::now();
+        for (const auto& keyword : keywords) {
+            size_t matches = 0;
+            for (string_view field : fields) {
+                if (method.kernel) {
+                    matches += keyword.size() <= field.size()
+                               && method.kernel(field.data(), field.size(), keyword.data(), keyword.size()) != string::npos;
+                } else {
+                    string lower(field);
+                    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+                    matches += lower.find(keyword) != string::npos;
+                }
+            }
+            counts.push_back(matches);
+        }
+        double fieldSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-void viewWishlist(const vector<Book>& wishlist) {
-    if (wishlist.empty()) {
-        cout << "Your wishlist is empty.\n";
-        return;
+        // The whole buffer, counting every occurrence
+        started = chrono::steady_clock::now();
+        for (const auto& keyword : keywords) {
+            size_t matches = 0;
+            if (method.kernel) {
+                for (size_t pos = 0; pos + keyword.size() <= text.size();) {
+                    size_t found = method.kernel(text.data() + pos, text.size() - pos, keyword.data(), keyword.size());
+                    if (found == string::npos) break;
+                    matches++;
+                    pos += found + 1;
+                }
+            } else {
+                string lower(text);
+                transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+                for (size_t found = lower.find(keyword); found != string::npos; found = lower.find(keyword, found + 1)) {
+                    matches++;
+                }
+            }
+            counts.push_back(matches);
+        }
+        double bufferSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (reference.empty()) reference = counts;
+        double scanned = static_cast<double>(text.size()) * keywords.size() / 1e9;
+        cout << "  " << left << setw(22) << method.name << right << " fields " << setw(7) << scanned / fieldSeconds
+             << " GB/s, one buffer " << setw(7) << scanned / bufferSeconds << " GB/s"
+             << (counts == reference ? "" : "  (MATCH COUNTS DIFFER)") << "\n";
     }
-    cout << "\nYour Wishlist:\n";
-    for (const auto& book : wishlist) {
-        book.displayBook();
+    cout << "  field matches per keyword:";
+    for (size_t k = 0; k < keywords.size(); k++) {
+        cout << " " << reference[k];
     }
+    cout << "\n";
 }
 
-void sendEmailNotification(const User& user, const string& message) {
-    cout << "\nSending email to " << user.getUsername() << "...\n";
-    cout << "Email content: " << message << endl;
-    // Simulate email sending delay
-    this_thread::sleep_for(chrono::seconds(1));
-    cout << "Email sent successfully.\n";
+// Runs three whole-catalog scans over the column-wise Catalog and over the
+// former vector<Book> (each Book holding its title and author strings):
+// total inventory value, books in stock, and a price range with a minimum
+// rating. Reports the best of five runs and the bytes each layout strides
+// over per book; both layouts must give the same answers.
+void runColumnScanBenchmark(size_t bookCount) {
+    bookCount = max<size_t>(1, bookCount);
+    mt19937_64 rng(4);
+    Catalog catalog;
+    vector<Book> books;
+    catalog.reserve(bookCount);
+    books.reserve(bookCount);
+    catalog.deferSearchIndex();
+    for (size_t i = 0; i < bookCount; i++) {
+        int id = static_cast<int>(i + 1);
+        string title = "A Synthetic Title Number " + to_string(i);
+        string author = "Author Name " + to_string(rng() % 100000);
+        double price = (100 + rng() % 4900) / 100.0;
+        int stock = static_cast<int>(rng() % 4 == 0 ? 0 : rng() % 50);
+        catalog.addBook(id, title, author, price, stock);
+        books.push_back(Book(id, title, author, price, stock));
+        for (int r = static_cast<int>(rng() % 3); r > 0; r--) {
+            double rating = 1.0 + static_cast<double>(rng() % 5);
+            uint64_t tally;
+            catalog.addRating(id, rating, tally);
+            books.back().addRating(rating);
+        }
+    }
+    BookFilter filter;
+    filter.minPrice = 10.0;
+    filter.maxPrice = 20.0;
+    filter.minRating = 3.5;
+
+    auto best = [](const function<void()>& scan) {
+        double fastest = numeric_limits<double>::infinity();
+        for (int run = 0; run < 5; run++) {
+            auto started = chrono::steady_clock::now();
+            scan();
+            fastest = min(fastest, chrono::duration<double>(chrono::steady_clock::now() - started).count());
+        }
+        return fastest;
+    };
+    double columnValue = 0.0, rowValue = 0.0;
+    size_t columnInStock = 0, rowInStock = 0, columnMatches = 0, rowMatches = 0;
+    double columnValueSeconds = best([&] { columnValue = catalog.totalInventoryValue(); });
+    double rowValueSeconds = best([&] {
+        rowValue = 0.0;
+        for (const auto& book : books) {
+            rowValue += book.getPrice() * book.getStockQuantity();
+        }
+    });
+    double columnStockSeconds = best([&] {
+        columnInStock = 0;
+        for (int stock : catalog.stockColumn()) {
+            columnInStock += stock > 0;
+        }
+    });
+    double rowStockSeconds = best([&] {
+        rowInStock = 0;
+        for (const auto& book : books) {
+            rowInStock += book.getStockQuantity() > 0;
+        }
+    });
+    double columnFilterSeconds = best([&] { columnMatches = catalog.filter(filter).size(); });
+    double rowFilterSeconds = best([&] {
+        rowMatches = 0;
+        for (const auto& book : books) {
+            rowMatches += book.getPrice() >= filter.minPrice && book.getPrice() <= filter.maxPrice
+                          && book.getAverageRating() >= filter.minRating;
+        }
+    });
+
+    cout << fixed << setprecision(2);
+    cout << bookCount << " books; a Book is " << sizeof(Book) << " bytes plus its strings, a catalog row's price and "
+         << "stock columns " << sizeof(double) + sizeof(int) << " bytes:\n";
+    auto line = [bookCount](const char* name, double columnSeconds, double rowSeconds, bool same) {
+        cout << "  " << left << setw(20) << name << right << " columns " << setw(8) << columnSeconds * 1000.0 << " ms ("
+             << setw(6) << bookCount / columnSeconds / 1e6 << " M books/s), vector<Book> " << setw(8) << rowSeconds * 1000.0
+             << " ms (" << setw(6) << bookCount / rowSeconds / 1e6 << " M books/s)" << (same ? "" : "  (RESULTS DIFFER)")
+             << "\n";
+    };
+    line("inventory value", columnValueSeconds, rowValueSeconds, fabs(columnValue - rowValue) < 1e-6 * max(1.0, rowValue));
+    line("books in stock", columnStockSeconds, rowStockSeconds, columnInStock == rowInStock);
+    line("price + rating", columnFilterSeconds, rowFilterSeconds, columnMatches == rowMatches);
+    cout << "  " << rowMatches << " books cost $10-$20 with a rating of 3.5 or more; " << rowInStock << " are in stock\n";
 }
 
-void handleGiftOption(vector<pair<Book, int>>& cart) {
-    char choice;
-    cout << "Do you want to purchase any item as a gift? (y/n): ";
-    cin >> choice;
-    cin.ignore();
-    if (tolower(choice) == 'y') {
-        // For simplicity, this function is a placeholder
-        cout << "Gift option selected. Proceeding with gift purchase.\n";
+// Sweeps price ranges from 0.1% to all of a synthetic catalog, each in stock
+// with a minimum rating, as the top 20 by rating and as the full list by
+// price. Each query runs through Catalog::filter (column predicates, then a
+// partial sort) and through a row-at-a-time baseline (every BookView
+// tested, then a full sort). Both must return the same books in the same
+// order.
+void runFilterBenchmark(size_t bookCount) {
+    bookCount = max<size_t>(1, bookCount);
+    mt19937_64 rng(5);
+    Catalog catalog;
+    catalog.reserve(bookCount);
+    catalog.deferSearchIndex();
+    for (size_t i = 0; i < bookCount; i++) {
+        int id = static_cast<int>(i + 1);
+        catalog.addBook(id, "Title " + to_string(i), "Author " + to_string(rng() % 100000),
+                        (100 + rng() % 5000) / 100.0, static_cast<int>(rng() % 5 == 0 ? 0 : 1 + rng() % 30));
+        for (int r = static_cast<int>(rng() % 4); r > 0; r--) {
+            uint64_t tally;
+            catalog.addRating(id, 1.0 + (rng() % 9) / 2.0, tally);
+        }
     }
-}
 
-void returnOrRefund(vector<Book>& books) {
-    // Implement return or refund functionality
-    // This function is a placeholder for future development.
-}
+    auto baseline = [&catalog](const BookFilter& filter) {
+        double maxPrice = filter.maxPrice > 0.0 ? filter.maxPrice : numeric_limits<double>::infinity();
+        vector<BookView> rows;
+        for (const auto& book : catalog) {
+            if (book.getPrice() >= filter.minPrice && book.getPrice() <= maxPrice
+                && (!filter.inStockOnly || book.getStockQuantity() > 0)
+                && book.getAverageRating() >= filter.minRating) {
+                rows.push_back(book);
+            }
+        }
+        stable_sort(rows.begin(), rows.end(), [&filter](const BookView& a, const BookView& b) {
+            return filter.sortKey == BookFilter::SORT_RATING ? a.getAverageRating() > b.getAverageRating()
+                                                             : a.getPrice() < b.getPrice();
+        });
+        if (filter.limit > 0 && rows.size() > filter.limit) rows.erase(rows.begin() + filter.limit, rows.end());
+        return rows;
+    };
+    auto sameBooks = [](const vector<BookView>& a, const vector<BookView>& b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].getBookID() != b[i].getBookID()) return false;
+        }
+        return true;
+    };
 
-void startUserSession(User& user) {
-    unique_lock<mutex> lock(mtx);
-    user.setLoggedIn(true);
-    saveSessionData(user);
-    cout << "User session started for " << user.getUsername() << endl;
+    cout << fixed << setprecision(2);
+    cout << bookCount << " books; in stock, rated 2.5 or more, price in the range:\n";
+    cout << "  selectivity   results      top 20 by rating (filter / rows)    all by price (filter / rows)\n";
+    for (double selectivity : { 0.001, 0.01, 0.1, 0.5, 1.0 }) {
+        BookFilter filter;
+        filter.minPrice = 1.0;
+        filter.maxPrice = 1.0 + 50.0 * selectivity - 0.005;
+        filter.minRating = 2.5;
+        filter.inStockOnly = true;
+        double seconds[2][2];
+        size_t matched = 0;
+        bool agree = true;
+        for (int sorted = 0; sorted < 2; sorted++) {
+            filter.sortKey = sorted == 0 ? BookFilter::SORT_RATING : BookFilter::SORT_PRICE_ASC;
+            filter.limit = sorted == 0 ? 20 : 0;
+            auto started = chrono::steady_clock::now();
+            vector<BookView> filtered = catalog.filter(filter);
+            seconds[sorted][0] = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            started = chrono::steady_clock::now();
+            vector<BookView> rows = baseline(filter);
+            seconds[sorted][1] = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+            agree = agree && sameBooks(filtered, rows);
+            if (sorted == 1) matched = filtered.size();
+        }
+        cout << "  " << setw(9) << selectivity * 100.0 << "%  " << setw(9) << matched << "   "
+             << setw(10) << seconds[0][0] * 1000.0 << " / " << setw(8) << seconds[0][1] * 1000.0 << " ms        "
+             << setw(10) << seconds[1][0] * 1000.0 << " / " << setw(8) << seconds[1][1] * 1000.0 << " ms"
+             << (agree ? "" : "  (RESULTS DIFFER)") << "\n";
+    }
 }
 
-void saveSessionData(const User& user) {
-    ofstream sessionFile(SESSION_DATA_FILE, ios::app);
-    if (sessionFile) {
-        sessionFile << user.getUsername() << " " << user.getLoggedIn() << endl;
-        sessionFile.close();
+// Writes a book_data.txt of the given size to a scratch file with
+// saveBooksToText, then loads it with the former getline/stringstream/stoi
+// loader into a vector<Book>, with parseBookLines on one thread, and with
+// loadBooksFromText (mapped file, parallel parse, insert into a Catalog).
+// Every book the old loader produced must come back identical from the new
+// one.
+void runLoadBenchmark(size_t bookCount) {
+    bookCount = max<size_t>(1, bookCount);
+    const string scratchPath = "load_bench.tmp";
+    {
+        mt19937_64 rng(6);
+        Catalog original;
+        original.reserve(bookCount);
+        original.deferSearchIndex();
+        for (size_t i = 0; i < bookCount; i++) {
+            int id = static_cast<int>(i + 1);
+            original.addBook(id, "Title " + to_string(rng() % 1000000) + " of the series", "Author " + to_string(rng() % 100000),
+                             (100 + rng() % 9900) / 100.0, static_cast<int>(rng() % 200));
+            for (int r = static_cast<int>(rng() % 3); r > 0; r--) {
+                uint64_t tally;
+                original.addRating(id, 1.0 + (rng() % 9) / 2.0, tally);
+            }
+        }
+        if (!saveBooksToText(original, scratchPath)) {
+            cout << "Could not write " << scratchPath << ".\n";
+            return;
+        }
     }
-}
+    double megabytes = filesystem::file_size(scratchPath) / (1024.0 * 1024.0);
 
-void loadSessionData(map<string, User>& users) {
-    ifstream sessionFile(SESSION_DATA_FILE);
-    if (sessionFile) {
-        string username;
-        bool loggedIn;
-        while (sessionFile >> username >> loggedIn) {
-            auto it = users.find(username);
-            if (it != users.end()) {
-                it->second.setLoggedIn(loggedIn);
+    auto started = chrono::steady_clock::now();
+    vector<Book> books;
+    {
+        ifstream bookFile(scratchPath);
+        string line;
+        while (getline(bookFile, line)) {
+            stringstream ss(line);
+            string token;
+            vector<string> tokens;
+            while (getline(ss, token, '|')) {
+                tokens.push_back(token);
+            }
+            if (tokens.size() >= 5) {
+                uint64_t ratingTally = 0;
+                if (tokens.size() >= 8 && !RatingTally::fromSumAndCount(stod(tokens[6]), stoi(tokens[7]), ratingTally)) {
+                    ratingTally = 0;
+                }
+                books.push_back(Book(stoi(tokens[0]), tokens[1], tokens[2], stod(tokens[3]), stoi(tokens[4]), ratingTally));
             }
         }
-        sessionFile.close();
     }
-}
+    double oldSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
 
-string encryptData(const string& data) {
-    // Simple encryption (placeholder)
-    string encrypted = data;
-    for (char& c : encrypted) {
-        c += 3;
+    double serialSeconds;
+    {
+        MappedFile bookFile;
+        bookFile.open(scratchPath);
+        vector<BookRecord> records;
+        started = chrono::steady_clock::now();
+        parseBookLines(bookFile.data(), bookFile.data() + bookFile.size(), records);
+        serialSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
     }
-    return encrypted;
-}
 
-string decryptData(const string& data) {
-    // Simple decryption (placeholder)
-    string decrypted = data;
-    for (char& c : decrypted) {
-        c -= 3;
+    Catalog catalog;
+    started = chrono::steady_clock::now();
+    bool loaded = loadBooksFromText(catalog, scratchPath);
+    double newSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    size_t mismatches = books.size() == catalog.size() ? 0 : max(books.size(), catalog.size());
+    for (size_t i = 0; i < books.size() && i < catalog.size(); i++) {
+        BookView book = catalog.at(i);
+        mismatches += book.getBookID() != books[i].getBookID() || book.getTitle() != books[i].getTitle()
+                      || book.getAuthor() != books[i].getAuthor() || book.getPrice() != books[i].getPrice()
+                      || book.getStockQuantity() != books[i].getStockQuantity()
+                      || book.getRatingTally() != books[i].getRatingTally();
     }
-    return decrypted;
+
+    cout << fixed << setprecision(2);
+    cout << bookCount << " books, " << megabytes << " MiB of book_data.txt, " << max(1u, thread::hardware_concurrency())
+         << " hardware threads:\n";
+    cout << "  getline loader into vector<Book>   " << setw(10) << oldSeconds * 1000.0 << " ms "
+         << setw(8) << megabytes / oldSeconds << " MiB/s\n";
+    cout << "  parseBookLines on one thread       " << setw(10) << serialSeconds * 1000.0 << " ms "
+         << setw(8) << megabytes / serialSeconds << " MiB/s (parse only)\n";
+    cout << "  loadBooksFromText into a Catalog   " << setw(10) << newSeconds * 1000.0 << " ms "
+         << setw(8) << megabytes / newSeconds << " MiB/s" << (loaded ? "" : " (FAILED)") << "\n";
+    cout << "  " << mismatches << " of " << books.size() << " books differ between the loaders\n";
+    error_code error;
+    filesystem::remove(scratchPath, error);
 }